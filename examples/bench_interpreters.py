@@ -0,0 +1,107 @@
+#!/usr/bin/python
+
+# Sub-interpreter throughput benchmark: each interpreter imports iothpy,
+# creates its own stack and runs a ping-pong over a pair of connected TCP
+# sockets of that stack, and the total number of round trips per second is
+# reported for growing numbers of interpreters. The interpreters are created
+# isolated, with their own GIL, so they scale like processes (Python 3.12+).
+
+import argparse
+import os
+import sys
+import threading
+import time
+
+try:
+    import _interpreters as interpreters
+    def create():
+        return interpreters.create("isolated")
+except ImportError:
+    try:
+        import _xxsubinterpreters as interpreters
+        def create():
+            return interpreters.create(isolated=True)
+    except ImportError:
+        sys.exit("sub-interpreters are not available in python {0}".format(sys.version.split()[0]))
+
+parser = argparse.ArgumentParser(description="Measure socket throughput with multiple interpreters")
+parser.add_argument("stack", nargs="?", default="kernel",
+                    help="ioth plugin to use (default: kernel)")
+parser.add_argument("vdeurl", nargs="?", default=None,
+                    help="vde url of the interface, not needed by kernel")
+parser.add_argument("-i", "--interpreters", type=int, default=8,
+                    help="maximum number of interpreters (default: 8)")
+parser.add_argument("-s", "--size", type=int, default=1024,
+                    help="size of the messages in bytes (default: 1024)")
+parser.add_argument("-d", "--duration", type=float, default=2.0,
+                    help="seconds of each run (default: 2.0)")
+args = parser.parse_args()
+
+# Run in each interpreter, the number of round trips is written to fd
+CHILD = """
+import os, time
+import iothpy
+
+stack = iothpy.Stack({stack!r}, {vdeurl!r})
+stack.linksetupdown(stack.if_nametoindex("lo"), 1)
+
+listener = stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+listener.bind(("127.0.0.1", 0))
+listener.listen(1)
+a = stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+a.connect(listener.getsockname())
+b, _ = listener.accept()
+
+def recv_exactly(sock, buf, size):
+    view = memoryview(buf)
+    got = 0
+    while got < size:
+        got += sock.recv_into(view[got:], size - got)
+
+msg = b"x" * {size}
+buf = bytearray({size})
+n = 0
+while time.time() < {start}:
+    time.sleep(0.001)
+deadline = {start} + {duration}
+while time.time() < deadline:
+    a.sendall(msg)
+    recv_exactly(b, buf, {size})
+    b.sendall(msg)
+    recv_exactly(a, buf, {size})
+    n += 1
+
+for s in (a, b, listener):
+    s.close()
+stack.close()
+os.write({fd}, b"%d\\n" % n)
+"""
+
+print("python {0}, {1}".format(sys.version.split()[0], interpreters.__name__))
+
+base = None
+ninterp = 1
+while ninterp <= args.interpreters:
+    ids = [create() for _ in range(ninterp)]
+    rfd, wfd = os.pipe()
+
+    # Start all the interpreters together once they finished their setup
+    start = time.time() + 0.5 + 0.1 * ninterp
+    code = CHILD.format(stack=args.stack, vdeurl=args.vdeurl, size=args.size,
+                        start=start, duration=args.duration, fd=wfd)
+    threads = [threading.Thread(target=interpreters.run_string, args=(i, code)) for i in ids]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+    for i in ids:
+        interpreters.destroy(i)
+
+    os.close(wfd)
+    with os.fdopen(rfd) as f:
+        counts = [int(line) for line in f]
+
+    rate = sum(counts) / args.duration
+    base = base or rate
+    print("{0:>3} interpreters {1:12.0f} round trips/s   {2:5.2f}x".format(ninterp, rate, rate / base))
+    ninterp *= 2
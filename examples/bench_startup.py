@@ -0,0 +1,46 @@
+#!/usr/bin/python
+
+# Startup benchmark: measure in fresh interpreters the time taken by
+# "import iothpy" and by the creation of the first stack, as paid by
+# short lived command line tools on every invocation.
+
+import argparse
+import statistics
+import subprocess
+import sys
+
+CHILD = """
+import time
+t0 = time.perf_counter()
+import iothpy
+t1 = time.perf_counter()
+stack = iothpy.Stack({stack!r}, {vdeurl!r})
+t2 = time.perf_counter()
+print(t1 - t0, t2 - t1)
+"""
+
+parser = argparse.ArgumentParser(description="Measure import and first stack creation time")
+parser.add_argument("stack", nargs="?", default="vdestack",
+                    help="ioth plugin to use (default: vdestack)")
+parser.add_argument("vdeurl", nargs="?", default="vde://",
+                    help="vde url of the interface (default: vde://)")
+parser.add_argument("-n", "--runs", type=int, default=20,
+                    help="number of interpreters to start (default: 20)")
+args = parser.parse_args()
+
+code = CHILD.format(stack=args.stack, vdeurl=args.vdeurl)
+imports = []
+stacks = []
+for _ in range(args.runs):
+    out = subprocess.run([sys.executable, "-c", code], check=True,
+                         capture_output=True, text=True).stdout
+    t_import, t_stack = map(float, out.split())
+    imports.append(t_import)
+    stacks.append(t_stack)
+
+def report(name, samples):
+    print("{0:<14} median {1:8.2f} ms   min {2:8.2f} ms".format(
+        name, statistics.median(samples) * 1000, min(samples) * 1000))
+
+report("import iothpy", imports)
+report("first stack", stacks)
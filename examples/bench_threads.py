@@ -0,0 +1,90 @@
+#!/usr/bin/python
+
+# Multi-threaded throughput benchmark: each thread runs a ping-pong over
+# its own pair of connected TCP sockets of the same stack, and the total
+# number of round trips per second is reported for growing numbers of
+# threads. Run it with a regular and a free-threaded (3.13t) interpreter
+# to compare the scaling with and without the GIL, "-X gil=1" turns the
+# GIL back on in a free-threaded interpreter.
+
+import argparse
+import sys
+import sysconfig
+import threading
+import time
+
+import iothpy
+
+parser = argparse.ArgumentParser(description="Measure socket throughput with multiple threads")
+parser.add_argument("stack", nargs="?", default="kernel",
+                    help="ioth plugin to use (default: kernel)")
+parser.add_argument("vdeurl", nargs="?", default=None,
+                    help="vde url of the interface, not needed by kernel")
+parser.add_argument("-t", "--threads", type=int, default=8,
+                    help="maximum number of threads (default: 8)")
+parser.add_argument("-s", "--size", type=int, default=1024,
+                    help="size of the messages in bytes (default: 1024)")
+parser.add_argument("-d", "--duration", type=float, default=2.0,
+                    help="seconds of each run (default: 2.0)")
+args = parser.parse_args()
+
+stack = iothpy.Stack(args.stack, args.vdeurl)
+stack.linksetupdown(stack.if_nametoindex("lo"), 1)
+
+listener = stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+listener.bind(("127.0.0.1", 0))
+listener.listen(args.threads)
+address = listener.getsockname()
+
+def connected_pair():
+    a = stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+    a.connect(address)
+    b, _ = listener.accept()
+    return a, b
+
+def recv_exactly(sock, buf, size):
+    view = memoryview(buf)
+    got = 0
+    while got < size:
+        got += sock.recv_into(view[got:], size - got)
+
+def worker(pair, deadline, counts, index):
+    a, b = pair
+    msg = b"x" * args.size
+    buf = bytearray(args.size)
+    n = 0
+    while time.perf_counter() < deadline:
+        a.sendall(msg)
+        recv_exactly(b, buf, args.size)
+        b.sendall(msg)
+        recv_exactly(a, buf, args.size)
+        n += 1
+    counts[index] = n
+
+gil = getattr(sys, "_is_gil_enabled", lambda: True)()
+print("python {0}, free-threaded build: {1}, GIL enabled: {2}".format(
+    sys.version.split()[0], bool(sysconfig.get_config_var("Py_GIL_DISABLED")), gil))
+
+pairs = [connected_pair() for _ in range(args.threads)]
+base = None
+nthreads = 1
+while nthreads <= args.threads:
+    counts = [0] * nthreads
+    deadline = time.perf_counter() + args.duration
+    threads = [threading.Thread(target=worker, args=(pairs[i], deadline, counts, i))
+               for i in range(nthreads)]
+    for t in threads:
+        t.start()
+    for t in threads:
+        t.join()
+
+    rate = sum(counts) / args.duration
+    base = base or rate
+    print("{0:>3} threads {1:12.0f} round trips/s   {2:5.2f}x".format(nthreads, rate, rate / base))
+    nthreads *= 2
+
+for a, b in pairs:
+    a.close()
+    b.close()
+listener.close()
+stack.close()
@@ -0,0 +1,43 @@
+#!/usr/bin/python
+
+import sys
+import socket
+import iothpy
+
+# Check arguments
+if(len(sys.argv) != 4):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl localport remote\ne,g: {1} vxvde://234.0.0.1 8080 10.0.0.2:80\n\n".format(name, name))
+    exit(1)
+
+localport = int(sys.argv[2])
+remote_host, remote_port = sys.argv[3].rsplit(":", 1)
+remote = (remote_host, int(remote_port))
+
+# Create and configure stack
+stack = iothpy.Stack("stack=vdestack,vnl={0},eth,ip=10.0.0.1/24".format(sys.argv[1]))
+
+# Listen on the host network
+host = socket.create_server(("", localport))
+
+# Forward each connection to the remote address through the stack, the
+# bytes are copied by a native relay without going through python
+while True:
+    conn, addr = host.accept()
+    upstream = stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+    try:
+        upstream.connect(remote)
+    except OSError as e:
+        print("Cannot connect to", remote, e)
+        conn.close()
+        upstream.close()
+        continue
+
+    print("Forwarding", addr, "to", remote)
+    relay = iothpy.relay(conn, upstream)
+
+    def finished(relay, conn=conn, upstream=upstream, addr=addr):
+        print("Closed", addr, relay.bytes_ab, "bytes sent,", relay.bytes_ba, "bytes received")
+        conn.close()
+        upstream.close()
+    relay.add_done_callback(finished)
@@ -0,0 +1,42 @@
+#!/usr/bin/python
+
+# Soak test for the stack lifecycle: create and close many stacks, each with
+# a few open sockets, and print the resident set size of the process.
+# With Stack.close() the RSS must stay flat after the first cycles.
+
+import iothpy
+
+import argparse
+import os
+import resource
+
+def rss_kib():
+    with open("/proc/self/statm") as f:
+        pages = int(f.read().split()[1])
+    return pages * resource.getpagesize() // 1024
+
+parser = argparse.ArgumentParser(description="Create and destroy stacks in a loop")
+parser.add_argument("stack", nargs="?", default="vdestack",
+                    help="ioth plugin to use (default: vdestack)")
+parser.add_argument("vdeurl", nargs="?", default="vde://",
+                    help="vde url of the interface (default: vde://)")
+parser.add_argument("-n", "--cycles", type=int, default=10000,
+                    help="number of create/destroy cycles (default: 10000)")
+parser.add_argument("-s", "--sockets", type=int, default=4,
+                    help="sockets left open on each stack (default: 4)")
+parser.add_argument("-r", "--report", type=int, default=1000,
+                    help="print the RSS every REPORT cycles (default: 1000)")
+args = parser.parse_args()
+
+print("{0:>8} {1:>12}".format("cycle", "rss (KiB)"))
+print("{0:>8} {1:>12}".format(0, rss_kib()))
+
+for i in range(1, args.cycles + 1):
+    with iothpy.Stack(args.stack, args.vdeurl) as stack:
+        # Sockets are intentionally left open, close() must reclaim them
+        sockets = [stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM)
+                   for _ in range(args.sockets)]
+    del sockets
+
+    if i % args.report == 0:
+        print("{0:>8} {1:>12}".format(i, rss_kib()))
@@ -0,0 +1,35 @@
+#!/usr/bin/python
+
+import sys
+import threading
+import iothpy
+
+if(len(sys.argv) != 3):
+    name = sys.argv[0]
+    print("Usage: {0} vdeurl workers\ne,g: {1} vxvde://234.0.0.1 4\n\n".format(name, name))
+    exit(1)
+
+workers = int(sys.argv[2])
+
+stack = iothpy.Stack("stack=vdestack,vnl={0},eth,ip=10.0.0.1/24".format(sys.argv[1]))
+
+sock = stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM)
+sock.bind(('', 5000))
+
+# The datagrams of each sensor always reach the same worker, in order
+dispatcher = iothpy.Dispatcher(sock, workers)
+
+def worker(queue):
+    last = {}
+    for data, addr in queue:
+        last[addr] = data.decode()
+        print("Worker", queue.index, "got", last[addr], "from", addr)
+
+for i in range(workers):
+    threading.Thread(target=worker, args=(dispatcher.queue(i),), daemon=True).start()
+
+try:
+    threading.Event().wait()
+except KeyboardInterrupt:
+    print(dispatcher.stats())
+    dispatcher.close()
@@ -65,29 +65,82 @@ For more information on stack configuration see help("iothpy.stack")
 # Import the Stack type
 from iothpy.stack import Stack
 
-# Import constants for ioth_linkadd
-from ._const_linkadd import *
-
 # Import functions from the c module
-from ._iothpy import getdefaulttimeout, setdefaulttimeout, CMSG_LEN, CMSG_SPACE, close, timeout
-
+from ._iothpy import getdefaulttimeout, setdefaulttimeout, CMSG_LEN, CMSG_SPACE, close, timeout, AddrInfo, IfAddr, Route, Link, LinkStats
+from ._iothpy import get_stack, set_default_stack, set_thread_stack, current_stack
+from ._iothpy import NetlinkEvent, RTMGRP_LINK, RTMGRP_IPV4_IFADDR, RTMGRP_IPV6_IFADDR, RTMGRP_IPV4_ROUTE, RTMGRP_IPV6_ROUTE
 
-# Import the function to override the built-in socket module
-from iothpy.override import override_socket_module
+#
+# The remaining symbols are resolved on first access by __getattr__, so that
+# "import iothpy" does not pay for modules and constants it may never use
+#
 
-# Import functions and constants from the builtin socket module 
-from socket import (
+# Symbols of other iothpy modules
+_lazy_modules = {
+    "StackPool": "iothpy.pool",
+    "ShardedServer": "iothpy.sharded",
+    "prefork": "iothpy.fork",
+    "Engine": "iothpy.engine",
+    "relay": "iothpy.proxy",
+    "Relay": "iothpy.proxy",
+    "LoadBalancer": "iothpy.proxy",
+    "Dispatcher": "iothpy.dispatch",
+    "ListenerGroup": "iothpy.listeners",
+    "override_socket_module": "iothpy.override",
+}
+
+# Submodules, reachable as attributes of the package as before
+_submodules = frozenset((
+    "stack", "msocket", "override", "monitor", "engine", "confcache", "pool",
+    "sharded", "fork", "proxy", "dispatch", "listeners",
+))
+
+# Functions and constants from the builtin socket module 
+_socket_names = frozenset((
     # Convertion utils
-    inet_aton, inet_ntoa, inet_ntop, inet_pton, ntohl, ntohs, htonl, htons,
+    "inet_aton", "inet_ntoa", "inet_ntop", "inet_pton", "ntohl", "ntohs", "htonl", "htons",
 
     # Constants
-    AF_INET, AF_INET6, SOCK_STREAM, SOCK_DGRAM, INADDR_ANY,
+    "AF_INET", "AF_INET6", "SOCK_STREAM", "SOCK_DGRAM", "INADDR_ANY",
 
     # Get host functions
-    gethostbyname, gethostbyname_ex, gethostbyaddr, gethostname,
+    "gethostbyname", "gethostbyname_ex", "gethostbyaddr", "gethostname",
 
     # Other functions
-    getfqdn, getaddrinfo, getnameinfo, getprotobyname, getservbyname, getservbyport,
-    sethostname,
-)
-
+    "getfqdn", "getaddrinfo", "getnameinfo", "getprotobyname", "getservbyname", "getservbyport",
+    "sethostname",
+))
+
+# Names bound by the imports above, exported with the lazy ones
+_eager_names = tuple(name for name in globals() if name[0] != "_" and name not in _submodules)
+
+def _linkadd_names():
+    import importlib
+
+    _const_linkadd = importlib.import_module("iothpy._const_linkadd")
+    return {name for name in dir(_const_linkadd) if name[0] != "_"}
+
+def __getattr__(name):
+    import importlib
+
+    if name == "__all__":
+        # Built on first use, "from iothpy import *" loads everything anyway
+        value = sorted(set(_eager_names) | set(_lazy_modules) | _socket_names | _linkadd_names())
+    elif name in _submodules:
+        value = importlib.import_module("iothpy." + name)
+    elif name in _lazy_modules:
+        value = getattr(importlib.import_module(_lazy_modules[name]), name)
+    elif name in _socket_names:
+        value = getattr(importlib.import_module("socket"), name)
+    else:
+        # Constants for ioth_linkadd
+        try:
+            value = getattr(importlib.import_module("iothpy._const_linkadd"), name)
+        except AttributeError:
+            raise AttributeError(f"module 'iothpy' has no attribute {name!r}") from None
+
+    globals()[name] = value
+    return value
+
+def __dir__():
+    return sorted(set(globals()) | _submodules | set(_lazy_modules) | _socket_names | _linkadd_names())
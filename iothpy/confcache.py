@@ -0,0 +1,194 @@
+#
+# This file is part of the iothpy library: python support for ioth.
+#
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""
+Autoconfiguration cache
+
+This module implements the cache mode of Stack.ioth_config for internal use.
+The configuration obtained by ioth_config (MAC address, addresses, default
+gateways and dns servers) is saved to a json file. On the next start it is
+applied statically right away, and ioth_config runs again in a background
+thread to revalidate it, fixing the stack if the lease changed.
+"""
+
+import concurrent.futures
+import json
+import os
+import threading
+
+# Version of the format of the cache file
+_VERSION = 2
+
+# Scope of the addresses and table of the routes saved in the cache
+_RT_SCOPE_UNIVERSE = 0
+_RT_TABLE_MAIN = 254
+
+def _config_ifindex(stack, config):
+    """Return the index of the interface configured by the config string"""
+    iface = "vde0"
+    for item in config.split(","):
+        key, _, value = item.strip().partition("=")
+        if key == "ifindex":
+            return int(value)
+        if key == "iface":
+            iface = value
+    return stack.if_nametoindex(iface)
+
+def _snapshot(stack, config, ifindex):
+    """Read the current configuration of the interface"""
+    addresses = [[a.family, a.address, a.prefixlen]
+                 for a in stack.addresses(ifindex=ifindex)
+                 if a.scope == _RT_SCOPE_UNIVERSE]
+    # The interface is needed to add back IPv6 link local gateways
+    gateways = [[r.family, r.gateway, r.ifindex]
+                for r in stack.routes()
+                if r.table == _RT_TABLE_MAIN and r.dst is None and r.gateway is not None
+                and r.ifindex in (0, ifindex)]
+    try:
+        resolvconf = stack.ioth_resolvconf(config)
+    except Exception:
+        resolvconf = None
+
+    return {
+        "version": _VERSION,
+        "config": config,
+        "mac": stack.linkgetaddr(ifindex).hex(),
+        "addresses": addresses,
+        "gateways": gateways,
+        "resolvconf": resolvconf,
+    }
+
+def _load(path, config):
+    """Return the cached configuration for config, None if missing or invalid"""
+    try:
+        with open(path) as f:
+            snap = json.load(f)
+    except (OSError, ValueError):
+        return None
+
+    if not isinstance(snap, dict) or snap.get("version") != _VERSION or snap.get("config") != config:
+        return None
+    return snap
+
+def _save(path, snap):
+    """Atomically replace the cache file"""
+    tmp = "%s.%d.tmp" % (path, os.getpid())
+    with open(tmp, "w") as f:
+        json.dump(snap, f)
+    os.replace(tmp, path)
+
+def _apply(stack, ifindex, snap):
+    """Apply a cached configuration statically"""
+    if snap["mac"]:
+        stack.linksetaddr(ifindex, snap["mac"])
+    stack.linksetupdown(ifindex, 1)
+    for family, address, prefixlen in snap["addresses"]:
+        stack.ipaddr_add(family, address, prefixlen, ifindex)
+    for family, gateway, oif in snap["gateways"]:
+        stack.iproute_add(family, gateway, None, 0, oif)
+    if snap["resolvconf"]:
+        stack.iothdns_update(snap["resolvconf"])
+
+def _revalidate(stack, config, path, ifindex, cached):
+    """Run ioth_config again and drop the cached entries it did not confirm
+
+    Returns True if the configuration changed. The addresses and gateways
+    applied from the cache are indistinguishable from the ones obtained
+    again by dhcp, so the cached ones of a family are considered stale only
+    when the new configuration has entries of that family not in the cache.
+    """
+    error = None
+    try:
+        stack._ioth_config(config)
+    except Exception as e:
+        error = e
+
+    snap = _snapshot(stack, config, ifindex)
+    changed = False
+
+    cached_addrs = {tuple(a) for a in cached["addresses"]}
+    new_families = {a[0] for a in snap["addresses"] if tuple(a) not in cached_addrs}
+    for family, address, prefixlen in cached["addresses"]:
+        if family in new_families:
+            stack.ipaddr_del(family, address, prefixlen, ifindex)
+            changed = True
+
+    cached_gws = {tuple(g) for g in cached["gateways"]}
+    new_families = {g[0] for g in snap["gateways"] if tuple(g) not in cached_gws}
+    for family, gateway, oif in cached["gateways"]:
+        if family in new_families:
+            stack.iproute_del(family, gateway, None, 0, oif)
+            changed = True
+
+    if snap["resolvconf"] and snap["resolvconf"] != cached["resolvconf"]:
+        stack.iothdns_update(snap["resolvconf"])
+        changed = True
+
+    if changed or snap["mac"] != cached["mac"]:
+        snap = _snapshot(stack, config, ifindex)
+        changed = True
+
+    # Keep the cache when ioth_config failed and confirmed nothing
+    if error is None or changed:
+        _save(path, snap)
+    if error is not None and not changed:
+        raise error
+    return changed
+
+def configure(stack, config, path):
+    """Configure stack with config using the cache file at path
+
+    Returns a concurrent.futures.Future completed when the configuration
+    has been validated, with result True if it differed from the cache.
+    """
+    ifindex = _config_ifindex(stack, config)
+    cached = _load(path, config)
+    future = concurrent.futures.Future()
+
+    if cached is not None:
+        try:
+            _apply(stack, ifindex, cached)
+        except Exception:
+            # The cache does not fit the stack: configure synchronously as
+            # without it, dropping the cached entries not confirmed
+            future.set_result(_revalidate(stack, config, path, ifindex, cached))
+            return future
+
+        def run():
+            if not future.set_running_or_notify_cancel():
+                return
+            try:
+                future.set_result(_revalidate(stack, config, path, ifindex, cached))
+            except BaseException as e:
+                future.set_exception(e)
+
+        # Stack.close() joins the thread, the stack must outlive it
+        thread = threading.Thread(target=run, name="iothpy-confcache", daemon=True)
+        stack._revalidation = thread
+        thread.start()
+        return future
+
+    # No usable cache, configure synchronously and save the result
+    stack._ioth_config(config)
+    _save(path, _snapshot(stack, config, ifindex))
+    future.set_result(False)
+    return future
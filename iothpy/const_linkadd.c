@@ -32,19 +32,24 @@
 
 #define IS_DEBIAN_UNSTABLE_KERNEL LINUX_VERSION_CODE >= KERNEL_VERSION(6,2,0)
 
-#define ADD_INT(name, value) \
-    do { \
-        if (PyModule_AddIntConstant(module, name, value) < 0) { \
-            return NULL; \
-        } \
-    } while (0)
-
-#define ADD_ENUM(names, n) \
-    do { \
-        for (int i = 0; i <= n; i++){ \
-            ADD_INT(names[i],i); \
-        } \
-    } while(0)
+/* 
+   The constants are kept in a static table and converted to python objects
+   only on first access, through the module __getattr__ (PEP 562).
+*/
+struct linkadd_const {
+    const char* name;           /* name of a single constant, NULL for an enum */
+    const char* const* names;   /* names of the values 0, 1, ... of an enum */
+    long value;                 /* value of the constant or number of enum values */
+};
+
+#define ARRAY_SIZE(a) ((long)(sizeof(a) / sizeof((a)[0])))
+
+/* Never read past the names array, even if the kernel headers define more values */
+#define ENUM_COUNT(names, max) ((long)(max) + 1 < ARRAY_SIZE(names) ? (long)(max) + 1 : ARRAY_SIZE(names))
+
+#define ADD_INT(name, value) {name, NULL, value}
+
+#define ADD_ENUM(names, max) {NULL, names, ENUM_COUNT(names, max)}
 
 PyDoc_STRVAR(const_linkadd_doc,
 "This module extends the link_add settings in C to Python.\n\
@@ -850,224 +855,343 @@ static const char* IFLA_DSA[] = {
 };
 
 
-static PyMethodDef link_add_methods[] = {
-    {NULL, NULL, 0, NULL}
-};
-
-static struct PyModuleDef link_add_module = {
-    PyModuleDef_HEAD_INIT,
-    "_const_linkadd",   /* name of module */
-    const_linkadd_doc,  /* module documentation, may be NULL */
-    -1,            /* size of per-interpreter state of the module,
-                      or -1 if the module keeps state in global variables. */
-    link_add_methods
-};
-
-
-PyMODINIT_FUNC PyInit__const_linkadd(void){
-    PyObject* module = PyModule_Create(&link_add_module);
-
-	ADD_ENUM(IFLA, __IFLA_MAX);
-	ADD_INT("IFLA_MAX", IFLA_MAX);
-	ADD_INT("IFLA_TARGET_NETNSID", IFLA_TARGET_NETNSID);
+static const struct linkadd_const linkadd_consts[] = {
+	ADD_ENUM(IFLA, __IFLA_MAX),
+	ADD_INT("IFLA_MAX", IFLA_MAX),
+	ADD_INT("IFLA_TARGET_NETNSID", IFLA_TARGET_NETNSID),
 
-	ADD_ENUM(IFLA_PROTO_DOWNREASON, __IFLA_PROTO_DOWN_REASON_CNT);
-	ADD_INT("IFLA_PROTO_DOWN_REASON_MAX", IFLA_PROTO_DOWN_REASON_MAX);
+	ADD_ENUM(IFLA_PROTO_DOWNREASON, __IFLA_PROTO_DOWN_REASON_CNT),
+	ADD_INT("IFLA_PROTO_DOWN_REASON_MAX", IFLA_PROTO_DOWN_REASON_MAX),
 
-	ADD_ENUM(IFLA_INET, __IFLA_INET_MAX);
-	ADD_INT("IFLA_INET_MAX", IFLA_INET_MAX);
-	ADD_ENUM(IFLA_INET6, __IFLA_INET6_MAX);
-	ADD_INT("IFLA_INET6_MAX", IFLA_INET6_MAX);
-	ADD_ENUM(IFLA_INET6_GEN_MODE,IN6_ADDR_GEN_MODE_RANDOM);
+	ADD_ENUM(IFLA_INET, __IFLA_INET_MAX),
+	ADD_INT("IFLA_INET_MAX", IFLA_INET_MAX),
+	ADD_ENUM(IFLA_INET6, __IFLA_INET6_MAX),
+	ADD_INT("IFLA_INET6_MAX", IFLA_INET6_MAX),
+	ADD_ENUM(IFLA_INET6_GEN_MODE,IN6_ADDR_GEN_MODE_RANDOM),
 
-	ADD_ENUM(IFLA_BR, __IFLA_BR_MAX);
-	ADD_INT("IFLA_BR_MAX", IFLA_BR_MAX);
+	ADD_ENUM(IFLA_BR, __IFLA_BR_MAX),
+	ADD_INT("IFLA_BR_MAX", IFLA_BR_MAX),
 
-	ADD_ENUM(BRIDGE_MODE, BRIDGE_MODE_HAIRPIN);
+	ADD_ENUM(BRIDGE_MODE, BRIDGE_MODE_HAIRPIN),
 
-	ADD_ENUM(IFLA_BRPORT, __IFLA_BRPORT_MAX);
-	ADD_INT("IFLA_BRPORT_MAX", IFLA_BRPORT_MAX);
+	ADD_ENUM(IFLA_BRPORT, __IFLA_BRPORT_MAX),
+	ADD_INT("IFLA_BRPORT_MAX", IFLA_BRPORT_MAX),
 
-	ADD_ENUM(IFLA_INFO, __IFLA_INFO_MAX);
-	ADD_INT("IFLA_INFO_MAX", IFLA_INFO_MAX);
+	ADD_ENUM(IFLA_INFO, __IFLA_INFO_MAX),
+	ADD_INT("IFLA_INFO_MAX", IFLA_INFO_MAX),
 
-	ADD_ENUM(IFLA_VLAN, __IFLA_VLAN_MAX);
-	ADD_INT("IFLA_VLAN_MAX", IFLA_VLAN_MAX);
+	ADD_ENUM(IFLA_VLAN, __IFLA_VLAN_MAX),
+	ADD_INT("IFLA_VLAN_MAX", IFLA_VLAN_MAX),
 
-	ADD_ENUM(IFLA_VLAN_QOS, __IFLA_VLAN_QOS_MAX);
-	ADD_INT("IFLA_VLAN_QOS_MAX",IFLA_VLAN_QOS_MAX);
+	ADD_ENUM(IFLA_VLAN_QOS, __IFLA_VLAN_QOS_MAX),
+	ADD_INT("IFLA_VLAN_QOS_MAX",IFLA_VLAN_QOS_MAX),
 
-	ADD_ENUM(IFLA_MACVLAN,__IFLA_MACVLAN_MAX);
-	ADD_INT("IFLA_MACVLAN_MAX", IFLA_MACVLAN_MAX);
+	ADD_ENUM(IFLA_MACVLAN,__IFLA_MACVLAN_MAX),
+	ADD_INT("IFLA_MACVLAN_MAX", IFLA_MACVLAN_MAX),
 
-	ADD_INT("MACVLAN_MODE_PRIVATE", MACVLAN_MODE_PRIVATE);
-	ADD_INT("MACVLAN_MODE_VEPA", MACVLAN_MODE_VEPA);
-	ADD_INT("MACVLAN_MODE_BRIDGE", MACVLAN_MODE_BRIDGE);
-	ADD_INT("MACVLAN_MODE_PASSTHRU", MACVLAN_MODE_PASSTHRU);
-	ADD_INT("MACVLAN_MODE_SOURCE", MACVLAN_MODE_SOURCE);
+	ADD_INT("MACVLAN_MODE_PRIVATE", MACVLAN_MODE_PRIVATE),
+	ADD_INT("MACVLAN_MODE_VEPA", MACVLAN_MODE_VEPA),
+	ADD_INT("MACVLAN_MODE_BRIDGE", MACVLAN_MODE_BRIDGE),
+	ADD_INT("MACVLAN_MODE_PASSTHRU", MACVLAN_MODE_PASSTHRU),
+	ADD_INT("MACVLAN_MODE_SOURCE", MACVLAN_MODE_SOURCE),
 
-	ADD_ENUM(MACVLAN_MACADDR, MACVLAN_MACADDR_SET);
-	ADD_INT("MACVLAN_FLAG_NOPROMISC", MACVLAN_FLAG_NOPROMISC);
-	ADD_INT("MACVLAN_FLAG_NODST", MACVLAN_FLAG_NODST);
+	ADD_ENUM(MACVLAN_MACADDR, MACVLAN_MACADDR_SET),
+	ADD_INT("MACVLAN_FLAG_NOPROMISC", MACVLAN_FLAG_NOPROMISC),
+	ADD_INT("MACVLAN_FLAG_NODST", MACVLAN_FLAG_NODST),
 
-	ADD_ENUM(IFLA_VRF, __IFLA_VRF_MAX);
-	ADD_INT("IFLA_VRF_MAX", IFLA_VRF_MAX);
+	ADD_ENUM(IFLA_VRF, __IFLA_VRF_MAX),
+	ADD_INT("IFLA_VRF_MAX", IFLA_VRF_MAX),
 
-	ADD_ENUM(IFLA_VRF_PORT, __IFLA_VRF_PORT_MAX);
-	ADD_INT("IFLA_VRF_PORT_MAX", IFLA_VRF_PORT_MAX);
+	ADD_ENUM(IFLA_VRF_PORT, __IFLA_VRF_PORT_MAX),
+	ADD_INT("IFLA_VRF_PORT_MAX", IFLA_VRF_PORT_MAX),
 
-	ADD_ENUM(IFLA_MACSEC, __IFLA_MACSEC_MAX);
-	ADD_INT("IFLA_MACSEC_MAX", IFLA_MACSEC_MAX);
+	ADD_ENUM(IFLA_MACSEC, __IFLA_MACSEC_MAX),
+	ADD_INT("IFLA_MACSEC_MAX", IFLA_MACSEC_MAX),
 
-	ADD_ENUM(IFLA_XFRM,__IFLA_XFRM_MAX);
-	ADD_INT("IFLA_XFRM_MAX", IFLA_XFRM_MAX);
-	ADD_INT("MACSEC_VALIDATE_DISABLED", MACSEC_VALIDATE_DISABLED);
-	ADD_INT("MACSEC_VALIDATE_CHECK", MACSEC_VALIDATE_CHECK);
-	ADD_INT("MACSEC_VALIDATE_STRICT", MACSEC_VALIDATE_STRICT);
-	ADD_INT("__MACSEC_VALIDATE_END", __MACSEC_VALIDATE_END);
-	ADD_INT("MACSEC_VALIDATE_MAX", MACSEC_VALIDATE_MAX);
-	ADD_INT("MACSEC_OFFLOAD_OFF",MACSEC_OFFLOAD_OFF);
-	ADD_INT("MACSEC_OFFLOAD_PHY",MACSEC_OFFLOAD_PHY);
-	ADD_INT("MACSEC_OFFLOAD_MAC",MACSEC_OFFLOAD_MAC);
-	ADD_INT("__MACSEC_OFFLOAD_END",__MACSEC_OFFLOAD_END);
-	ADD_INT("MACSEC_OFFLOAD_MAX",MACSEC_OFFLOAD_MAX);
+	ADD_ENUM(IFLA_XFRM,__IFLA_XFRM_MAX),
+	ADD_INT("IFLA_XFRM_MAX", IFLA_XFRM_MAX),
+	ADD_INT("MACSEC_VALIDATE_DISABLED", MACSEC_VALIDATE_DISABLED),
+	ADD_INT("MACSEC_VALIDATE_CHECK", MACSEC_VALIDATE_CHECK),
+	ADD_INT("MACSEC_VALIDATE_STRICT", MACSEC_VALIDATE_STRICT),
+	ADD_INT("__MACSEC_VALIDATE_END", __MACSEC_VALIDATE_END),
+	ADD_INT("MACSEC_VALIDATE_MAX", MACSEC_VALIDATE_MAX),
+	ADD_INT("MACSEC_OFFLOAD_OFF",MACSEC_OFFLOAD_OFF),
+	ADD_INT("MACSEC_OFFLOAD_PHY",MACSEC_OFFLOAD_PHY),
+	ADD_INT("MACSEC_OFFLOAD_MAC",MACSEC_OFFLOAD_MAC),
+	ADD_INT("__MACSEC_OFFLOAD_END",__MACSEC_OFFLOAD_END),
+	ADD_INT("MACSEC_OFFLOAD_MAX",MACSEC_OFFLOAD_MAX),
 
-	ADD_ENUM(IFLA_IPVLAN,__IFLA_IPVLAN_MAX);
-	ADD_INT("IFLA_IPVLAN_MAX", IFLA_IPVLAN_MAX);
+	ADD_ENUM(IFLA_IPVLAN,__IFLA_IPVLAN_MAX),
+	ADD_INT("IFLA_IPVLAN_MAX", IFLA_IPVLAN_MAX),
 
-	ADD_ENUM(IPVLAN_MODE,IPVLAN_MODE_MAX);
-	ADD_INT("IPVLAN_F_PRIVATE",IPVLAN_F_PRIVATE);
-	ADD_INT("IPVLAN_F_VEPA", IPVLAN_F_VEPA);
+	ADD_ENUM(IPVLAN_MODE,IPVLAN_MODE_MAX),
+	ADD_INT("IPVLAN_F_PRIVATE",IPVLAN_F_PRIVATE),
+	ADD_INT("IPVLAN_F_VEPA", IPVLAN_F_VEPA),
 
-	ADD_INT("NETKIT_NEXT",NETKIT_NEXT);
-	ADD_INT("NETKIT_PASS",NETKIT_PASS);
-	ADD_INT("NETKIT_DROP",NETKIT_DROP);
-	ADD_INT("NETKIT_REDIRECT",NETKIT_REDIRECT);
+	ADD_INT("NETKIT_NEXT",NETKIT_NEXT),
+	ADD_INT("NETKIT_PASS",NETKIT_PASS),
+	ADD_INT("NETKIT_DROP",NETKIT_DROP),
+	ADD_INT("NETKIT_REDIRECT",NETKIT_REDIRECT),
 #if IS_DEBIAN_UNSTABLE_KERNEL
-	ADD_ENUM(NETKIT_MODE, NETKIT_L3);
-	ADD_ENUM(IFLA_NETKIT, __IFLA_NETKIT_MAX);
-	ADD_INT("IFLA_NETKIT_MAX", IFLA_NETKIT_MAX);
+	ADD_ENUM(NETKIT_MODE, NETKIT_L3),
+	ADD_ENUM(IFLA_NETKIT, __IFLA_NETKIT_MAX),
+	ADD_INT("IFLA_NETKIT_MAX", IFLA_NETKIT_MAX),
 #endif
 
-	ADD_INT("TUNNEL_MSG_FLAG_STATS", TUNNEL_MSG_FLAG_STATS);
-	ADD_INT("TUNNEL_MSG_VALID_USER_FLAGS", TUNNEL_MSG_VALID_USER_FLAGS);
-	ADD_ENUM(VNIFILTER_ENTRY, __VNIFILTER_ENTRY_STATS_MAX);
-	ADD_INT("VNIFILTER_ENTRY_STATS_MAX", VNIFILTER_ENTRY_STATS_MAX);
+	ADD_INT("TUNNEL_MSG_FLAG_STATS", TUNNEL_MSG_FLAG_STATS),
+	ADD_INT("TUNNEL_MSG_VALID_USER_FLAGS", TUNNEL_MSG_VALID_USER_FLAGS),
+	ADD_ENUM(VNIFILTER_ENTRY, __VNIFILTER_ENTRY_STATS_MAX),
+	ADD_INT("VNIFILTER_ENTRY_STATS_MAX", VNIFILTER_ENTRY_STATS_MAX),
 
-	ADD_ENUM(VXLAN_VNIFILTERENTRY, __VXLAN_VNIFILTER_ENTRY_MAX);
-	ADD_INT("VXLAN_VNIFILTER_ENTRY_MAX", VXLAN_VNIFILTER_ENTRY_MAX);
-	ADD_ENUM(VXLAN_VNIFILTER, __VXLAN_VNIFILTER_MAX);
-	ADD_INT("VXLAN_VNIFILTER_MAX", VXLAN_VNIFILTER_MAX);
+	ADD_ENUM(VXLAN_VNIFILTERENTRY, __VXLAN_VNIFILTER_ENTRY_MAX),
+	ADD_INT("VXLAN_VNIFILTER_ENTRY_MAX", VXLAN_VNIFILTER_ENTRY_MAX),
+	ADD_ENUM(VXLAN_VNIFILTER, __VXLAN_VNIFILTER_MAX),
+	ADD_INT("VXLAN_VNIFILTER_MAX", VXLAN_VNIFILTER_MAX),
 
-	ADD_ENUM(IFLA_VXLAN, __IFLA_VXLAN_MAX);
-	ADD_INT("IFLA_VXLAN_MAX", IFLA_VXLAN_MAX);
-	ADD_ENUM(IFLA_VXLANDF, __VXLAN_DF_END);
-	ADD_INT("VXLAN_DF_MAX", VXLAN_DF_MAX);
+	ADD_ENUM(IFLA_VXLAN, __IFLA_VXLAN_MAX),
+	ADD_INT("IFLA_VXLAN_MAX", IFLA_VXLAN_MAX),
+	ADD_ENUM(IFLA_VXLANDF, __VXLAN_DF_END),
+	ADD_INT("VXLAN_DF_MAX", VXLAN_DF_MAX),
 
-	ADD_ENUM(IFLA_GENEVE, __IFLA_GENEVE_MAX);
-	ADD_INT("IFLA_GENEVE_MAX",IFLA_GENEVE_MAX);
-	ADD_ENUM(IFLA_GENEVEDF, __GENEVE_DF_END);
-	ADD_INT("GENEVE_DF_MAX", GENEVE_DF_MAX);
+	ADD_ENUM(IFLA_GENEVE, __IFLA_GENEVE_MAX),
+	ADD_INT("IFLA_GENEVE_MAX",IFLA_GENEVE_MAX),
+	ADD_ENUM(IFLA_GENEVEDF, __GENEVE_DF_END),
+	ADD_INT("GENEVE_DF_MAX", GENEVE_DF_MAX),
 
-	ADD_ENUM(IFLA_BAREUDP, __IFLA_BAREUDP_MAX);
-	ADD_INT("IFLA_BAREUDP_MAX", IFLA_BAREUDP_MAX);
+	ADD_ENUM(IFLA_BAREUDP, __IFLA_BAREUDP_MAX),
+	ADD_INT("IFLA_BAREUDP_MAX", IFLA_BAREUDP_MAX),
 
-	ADD_ENUM(IFLA_PPP, __IFLA_PPP_MAX);
-	ADD_INT("IFLA_PPP_MAX", IFLA_PPP_MAX);
+	ADD_ENUM(IFLA_PPP, __IFLA_PPP_MAX),
+	ADD_INT("IFLA_PPP_MAX", IFLA_PPP_MAX),
 	
-	ADD_ENUM(GTP_ROLE, GTP_ROLE_SGSN + 1);
-	ADD_ENUM(IFLA_GTP, __IFLA_GTP_MAX);
-	ADD_INT("IFLA_GTP_MAX", IFLA_GTP_MAX);
-
-	ADD_ENUM(IFLA_BOND, __IFLA_BOND_MAX);
-	ADD_INT("IFLA_BOND_MAX", IFLA_BOND_MAX);
-	ADD_ENUM(IFLA_BOND_ADINFO, __IFLA_BOND_AD_INFO_MAX);
-	ADD_INT("IFLA_BOND_AD_INFO_MAX", IFLA_BOND_AD_INFO_MAX);
-	ADD_ENUM(IFLA_BOND_SLAVE, __IFLA_BOND_SLAVE_MAX);
-	ADD_INT("IFLA_BOND_SLAVE_MAX", IFLA_BOND_SLAVE_MAX);
-
-	ADD_ENUM(IFLA_VFINFO, __IFLA_VF_INFO_MAX);
-	ADD_INT("IFLA_VF_INFO_MAX", IFLA_VF_INFO_MAX);
-	ADD_ENUM(IFLA_VF, __IFLA_VF_MAX);
-	ADD_INT("IFLA_VF_MAX", IFLA_VF_MAX);
-	ADD_ENUM(IFLA_VF_VLANINFO, __IFLA_VF_VLAN_INFO_MAX);
-	ADD_INT("IFLA_VF_VLAN_INFO_MAX", IFLA_VF_VLAN_INFO_MAX);
-	ADD_INT("MAX_VLAN_LIST_LEN", MAX_VLAN_LIST_LEN);
-	ADD_ENUM(IFLA_VF_LINKSTATE, __IFLA_VF_LINK_STATE_MAX);
-	ADD_ENUM(IFLA_VFSTATS, __IFLA_VF_STATS_MAX);
-	ADD_INT("IFLA_VF_STATS_MAX", IFLA_VF_STATS_MAX);
-	ADD_ENUM(IFLA_VFPORT, __IFLA_VF_PORT_MAX);
-	ADD_INT("IFLA_VF_PORT_MAX", IFLA_VF_PORT_MAX);
-
-	ADD_ENUM(IFLA_PORT, __IFLA_PORT_MAX);
-	ADD_INT("IFLA_PORT_MAX", IFLA_PORT_MAX);
-	ADD_INT("PORT_PROFILE_MAX", PORT_PROFILE_MAX);
-	ADD_INT("PORT_UUID_MAX", PORT_UUID_MAX);
-	ADD_INT("PORT_SELF_VF", PORT_SELF_VF);
-	ADD_ENUM(PORT_REQUEST, PORT_REQUEST_DISASSOCIATE);
-
-	ADD_ENUM(PORT_VDP_RESPONSE,PORT_VDP_RESPONSE_OUT_OF_SYNC);
+	ADD_ENUM(GTP_ROLE, GTP_ROLE_SGSN + 1),
+	ADD_ENUM(IFLA_GTP, __IFLA_GTP_MAX),
+	ADD_INT("IFLA_GTP_MAX", IFLA_GTP_MAX),
+
+	ADD_ENUM(IFLA_BOND, __IFLA_BOND_MAX),
+	ADD_INT("IFLA_BOND_MAX", IFLA_BOND_MAX),
+	ADD_ENUM(IFLA_BOND_ADINFO, __IFLA_BOND_AD_INFO_MAX),
+	ADD_INT("IFLA_BOND_AD_INFO_MAX", IFLA_BOND_AD_INFO_MAX),
+	ADD_ENUM(IFLA_BOND_SLAVE, __IFLA_BOND_SLAVE_MAX),
+	ADD_INT("IFLA_BOND_SLAVE_MAX", IFLA_BOND_SLAVE_MAX),
+
+	ADD_ENUM(IFLA_VFINFO, __IFLA_VF_INFO_MAX),
+	ADD_INT("IFLA_VF_INFO_MAX", IFLA_VF_INFO_MAX),
+	ADD_ENUM(IFLA_VF, __IFLA_VF_MAX),
+	ADD_INT("IFLA_VF_MAX", IFLA_VF_MAX),
+	ADD_ENUM(IFLA_VF_VLANINFO, __IFLA_VF_VLAN_INFO_MAX),
+	ADD_INT("IFLA_VF_VLAN_INFO_MAX", IFLA_VF_VLAN_INFO_MAX),
+	ADD_INT("MAX_VLAN_LIST_LEN", MAX_VLAN_LIST_LEN),
+	ADD_ENUM(IFLA_VF_LINKSTATE, __IFLA_VF_LINK_STATE_MAX),
+	ADD_ENUM(IFLA_VFSTATS, __IFLA_VF_STATS_MAX),
+	ADD_INT("IFLA_VF_STATS_MAX", IFLA_VF_STATS_MAX),
+	ADD_ENUM(IFLA_VFPORT, __IFLA_VF_PORT_MAX),
+	ADD_INT("IFLA_VF_PORT_MAX", IFLA_VF_PORT_MAX),
+
+	ADD_ENUM(IFLA_PORT, __IFLA_PORT_MAX),
+	ADD_INT("IFLA_PORT_MAX", IFLA_PORT_MAX),
+	ADD_INT("PORT_PROFILE_MAX", PORT_PROFILE_MAX),
+	ADD_INT("PORT_UUID_MAX", PORT_UUID_MAX),
+	ADD_INT("PORT_SELF_VF", PORT_SELF_VF),
+	ADD_ENUM(PORT_REQUEST, PORT_REQUEST_DISASSOCIATE),
+
+	ADD_ENUM(PORT_VDP_RESPONSE,PORT_VDP_RESPONSE_OUT_OF_SYNC),
 		/* 0x08-0xFF reserved for future VDP use */
-	ADD_INT("PORT_PROFILE_RESPONSE_SUCCESS",PORT_PROFILE_RESPONSE_SUCCESS);
-	ADD_INT("PORT_PROFILE_RESPONSE_INPROGRESS",PORT_PROFILE_RESPONSE_INPROGRESS);
-	ADD_INT("PORT_PROFILE_RESPONSE_INVALID",PORT_PROFILE_RESPONSE_INVALID);
-	ADD_INT("PORT_PROFILE_RESPONSE_BADSTATE",PORT_PROFILE_RESPONSE_BADSTATE);
-	ADD_INT("PORT_PROFILE_RESPONSE_INSUFFICIENT_RESOURCES",PORT_PROFILE_RESPONSE_INSUFFICIENT_RESOURCES);
-	ADD_INT("PORT_PROFILE_RESPONSE_ERROR",PORT_PROFILE_RESPONSE_ERROR);
-
-	ADD_ENUM(IFLA_IPOIB,__IFLA_IPOIB_MAX);
-	ADD_INT("IFLA_IPOIB_MAX", IFLA_IPOIB_MAX);
-	ADD_ENUM(IPOIB_MODE,IPOIB_MODE_CONNECTED);
-
-	ADD_ENUM(HSR_PROTOCOL,HSR_PROTOCOL_MAX);
-	ADD_ENUM(IFLA_HSR, __IFLA_HSR_MAX);
-	ADD_INT("IFLA_HSR_MAX", IFLA_HSR_MAX);
-
-	ADD_ENUM(IFLASTATS, __IFLA_STATS_MAX);
-	ADD_INT("IFLA_STATS_MAX", IFLA_STATS_MAX);
-	ADD_ENUM(IFLA_STATS_GET_SET, __IFLA_STATS_GETSET_MAX);
-	ADD_INT("IFLA_STATS_GETSET_MAX", IFLA_STATS_GETSET_MAX);
-
-	ADD_ENUM(LINK_XSTATS_TYPE, __LINK_XSTATS_TYPE_MAX);
-	ADD_INT("LINK_XSTATS_TYPE_MAX", LINK_XSTATS_TYPE_MAX);
-
-	ADD_ENUM(IFLA_OFFLOAD_XSTATS, __IFLA_OFFLOAD_XSTATS_MAX);
-	ADD_INT("IFLA_OFFLOAD_XSTATS_MAX", IFLA_OFFLOAD_XSTATS_MAX);
-
-	ADD_ENUM(IFLA_OFFLOAD_XSTATS_HW_SINFO, __IFLA_OFFLOAD_XSTATS_HW_S_INFO_MAX);
-	ADD_INT("IFLA_OFFLOAD_XSTATS_HW_S_INFO_MAX", IFLA_OFFLOAD_XSTATS_HW_S_INFO_MAX);
-
-	ADD_INT("XDP_FLAGS_UPDATE_IF_NOEXIST", XDP_FLAGS_UPDATE_IF_NOEXIST);
-	ADD_INT("XDP_FLAGS_SKB_MODE",XDP_FLAGS_SKB_MODE);
-	ADD_INT("XDP_FLAGS_DRV_MODE",XDP_FLAGS_DRV_MODE);
-	ADD_INT("XDP_FLAGS_HW_MODE",XDP_FLAGS_HW_MODE);
-	ADD_INT("XDP_FLAGS_REPLACE",XDP_FLAGS_REPLACE);
-	ADD_INT("XDP_FLAGS_MODES",XDP_FLAGS_MODES);
-	ADD_INT("XDP_FLAGS_MASK",XDP_FLAGS_MASK);
-	ADD_ENUM(XDP_ATTACHED, XDP_ATTACHED_MULTI);
-	ADD_ENUM(IFLAXDP, __IFLA_XDP_MAX);
-	ADD_INT("IFLA_XDP_MAX", IFLA_XDP_MAX);
-	ADD_ENUM(IFLAEVENT, IFLA_EVENT_BONDING_OPTIONS);
-
-	ADD_ENUM(IFLA_TUN, __IFLA_TUN_MAX);
-	ADD_INT("IFLA_TUN_MAX",IFLA_TUN_MAX);
-
-	ADD_INT("RMNET_FLAGS_INGRESS_DEAGGREGATION",RMNET_FLAGS_INGRESS_DEAGGREGATION);
-	ADD_INT("RMNET_FLAGS_INGRESS_MAP_COMMANDS",RMNET_FLAGS_INGRESS_MAP_COMMANDS);
-	ADD_INT("RMNET_FLAGS_INGRESS_MAP_CKSUMV4",RMNET_FLAGS_INGRESS_MAP_CKSUMV4);
-	ADD_INT("RMNET_FLAGS_EGRESS_MAP_CKSUMV4",RMNET_FLAGS_EGRESS_MAP_CKSUMV4);
-	ADD_INT("RMNET_FLAGS_INGRESS_MAP_CKSUMV5",RMNET_FLAGS_INGRESS_MAP_CKSUMV5);
-	ADD_INT("RMNET_FLAGS_EGRESS_MAP_CKSUMV5",RMNET_FLAGS_EGRESS_MAP_CKSUMV5);
-	ADD_ENUM(IFLA_RMNET, __IFLA_RMNET_MAX);
-	ADD_INT("IFLA_RMNET_MAX", IFLA_RMNET_MAX);
-
-	ADD_ENUM(IFLA_MCTP, __IFLA_MCTP_MAX);
-	ADD_INT("IFLA_MCTP_MAX", IFLA_MCTP_MAX);
-
-	ADD_ENUM(IFLA_DSA, __IFLA_DSA_MAX);
-	ADD_INT("IFLA_DSA_MAX", IFLA_DSA_MAX);
-
-	ADD_INT("IFLA_VDE_VNL", IFLA_VDE_VNL);
-
-	return module;
-}
\ No newline at end of file
+	ADD_INT("PORT_PROFILE_RESPONSE_SUCCESS",PORT_PROFILE_RESPONSE_SUCCESS),
+	ADD_INT("PORT_PROFILE_RESPONSE_INPROGRESS",PORT_PROFILE_RESPONSE_INPROGRESS),
+	ADD_INT("PORT_PROFILE_RESPONSE_INVALID",PORT_PROFILE_RESPONSE_INVALID),
+	ADD_INT("PORT_PROFILE_RESPONSE_BADSTATE",PORT_PROFILE_RESPONSE_BADSTATE),
+	ADD_INT("PORT_PROFILE_RESPONSE_INSUFFICIENT_RESOURCES",PORT_PROFILE_RESPONSE_INSUFFICIENT_RESOURCES),
+	ADD_INT("PORT_PROFILE_RESPONSE_ERROR",PORT_PROFILE_RESPONSE_ERROR),
+
+	ADD_ENUM(IFLA_IPOIB,__IFLA_IPOIB_MAX),
+	ADD_INT("IFLA_IPOIB_MAX", IFLA_IPOIB_MAX),
+	ADD_ENUM(IPOIB_MODE,IPOIB_MODE_CONNECTED),
+
+	ADD_ENUM(HSR_PROTOCOL,HSR_PROTOCOL_MAX),
+	ADD_ENUM(IFLA_HSR, __IFLA_HSR_MAX),
+	ADD_INT("IFLA_HSR_MAX", IFLA_HSR_MAX),
+
+	ADD_ENUM(IFLASTATS, __IFLA_STATS_MAX),
+	ADD_INT("IFLA_STATS_MAX", IFLA_STATS_MAX),
+	ADD_ENUM(IFLA_STATS_GET_SET, __IFLA_STATS_GETSET_MAX),
+	ADD_INT("IFLA_STATS_GETSET_MAX", IFLA_STATS_GETSET_MAX),
+
+	ADD_ENUM(LINK_XSTATS_TYPE, __LINK_XSTATS_TYPE_MAX),
+	ADD_INT("LINK_XSTATS_TYPE_MAX", LINK_XSTATS_TYPE_MAX),
+
+	ADD_ENUM(IFLA_OFFLOAD_XSTATS, __IFLA_OFFLOAD_XSTATS_MAX),
+	ADD_INT("IFLA_OFFLOAD_XSTATS_MAX", IFLA_OFFLOAD_XSTATS_MAX),
+
+	ADD_ENUM(IFLA_OFFLOAD_XSTATS_HW_SINFO, __IFLA_OFFLOAD_XSTATS_HW_S_INFO_MAX),
+	ADD_INT("IFLA_OFFLOAD_XSTATS_HW_S_INFO_MAX", IFLA_OFFLOAD_XSTATS_HW_S_INFO_MAX),
+
+	ADD_INT("XDP_FLAGS_UPDATE_IF_NOEXIST", XDP_FLAGS_UPDATE_IF_NOEXIST),
+	ADD_INT("XDP_FLAGS_SKB_MODE",XDP_FLAGS_SKB_MODE),
+	ADD_INT("XDP_FLAGS_DRV_MODE",XDP_FLAGS_DRV_MODE),
+	ADD_INT("XDP_FLAGS_HW_MODE",XDP_FLAGS_HW_MODE),
+	ADD_INT("XDP_FLAGS_REPLACE",XDP_FLAGS_REPLACE),
+	ADD_INT("XDP_FLAGS_MODES",XDP_FLAGS_MODES),
+	ADD_INT("XDP_FLAGS_MASK",XDP_FLAGS_MASK),
+	ADD_ENUM(XDP_ATTACHED, XDP_ATTACHED_MULTI),
+	ADD_ENUM(IFLAXDP, __IFLA_XDP_MAX),
+	ADD_INT("IFLA_XDP_MAX", IFLA_XDP_MAX),
+	ADD_ENUM(IFLAEVENT, IFLA_EVENT_BONDING_OPTIONS),
+
+	ADD_ENUM(IFLA_TUN, __IFLA_TUN_MAX),
+	ADD_INT("IFLA_TUN_MAX",IFLA_TUN_MAX),
+
+	ADD_INT("RMNET_FLAGS_INGRESS_DEAGGREGATION",RMNET_FLAGS_INGRESS_DEAGGREGATION),
+	ADD_INT("RMNET_FLAGS_INGRESS_MAP_COMMANDS",RMNET_FLAGS_INGRESS_MAP_COMMANDS),
+	ADD_INT("RMNET_FLAGS_INGRESS_MAP_CKSUMV4",RMNET_FLAGS_INGRESS_MAP_CKSUMV4),
+	ADD_INT("RMNET_FLAGS_EGRESS_MAP_CKSUMV4",RMNET_FLAGS_EGRESS_MAP_CKSUMV4),
+	ADD_INT("RMNET_FLAGS_INGRESS_MAP_CKSUMV5",RMNET_FLAGS_INGRESS_MAP_CKSUMV5),
+	ADD_INT("RMNET_FLAGS_EGRESS_MAP_CKSUMV5",RMNET_FLAGS_EGRESS_MAP_CKSUMV5),
+	ADD_ENUM(IFLA_RMNET, __IFLA_RMNET_MAX),
+	ADD_INT("IFLA_RMNET_MAX", IFLA_RMNET_MAX),
+
+	ADD_ENUM(IFLA_MCTP, __IFLA_MCTP_MAX),
+	ADD_INT("IFLA_MCTP_MAX", IFLA_MCTP_MAX),
+
+	ADD_ENUM(IFLA_DSA, __IFLA_DSA_MAX),
+	ADD_INT("IFLA_DSA_MAX", IFLA_DSA_MAX),
+
+	ADD_INT("IFLA_VDE_VNL", IFLA_VDE_VNL),
+};
+
+/* Per-interpreter state of the module */
+typedef struct linkadd_state {
+    /* Dictionary of all the constants, built on first access */
+    PyObject* dict;
+} linkadd_state;
+
+static PyObject*
+get_linkadd_dict(PyObject* module)
+{
+    linkadd_state* st = (linkadd_state*)PyModule_GetState(module);
+
+    /* The state is allocated once the module is executed, importlib looks
+       up the attributes of the module before that */
+    if(!st) {
+        PyErr_SetString(PyExc_AttributeError, "module '_const_linkadd' is not initialized");
+        return NULL;
+    }
+
+    PyObject* dict = __atomic_load_n(&st->dict, __ATOMIC_ACQUIRE);
+    if(dict)
+        return dict;
+
+    dict = PyDict_New();
+    if(!dict)
+        return NULL;
+
+    for(size_t i = 0; i < sizeof(linkadd_consts) / sizeof(linkadd_consts[0]); i++) {
+        const struct linkadd_const* c = &linkadd_consts[i];
+        long n = c->name ? 1 : c->value;
+
+        for(long j = 0; j < n; j++) {
+            PyObject* value = PyLong_FromLong(c->name ? c->value : j);
+            if(!value || PyDict_SetItemString(dict, c->name ? c->name : c->names[j], value) < 0) {
+                Py_XDECREF(value);
+                Py_DECREF(dict);
+                return NULL;
+            }
+            Py_DECREF(value);
+        }
+    }
+
+    /* Another thread may have built it meanwhile, keep the first one */
+    PyObject* expected = NULL;
+    if(!__atomic_compare_exchange_n(&st->dict, &expected, dict, 0, __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        Py_DECREF(dict);
+        return expected;
+    }
+    return dict;
+}
+
+static PyObject*
+linkadd_getattr(PyObject* module, PyObject* name)
+{
+    PyObject* dict = get_linkadd_dict(module);
+    if(!dict)
+        return NULL;
+
+    PyObject* value = PyDict_GetItemWithError(dict, name);
+    if(!value) {
+        if(!PyErr_Occurred())
+            PyErr_Format(PyExc_AttributeError, "module '_const_linkadd' has no attribute '%U'", name);
+        return NULL;
+    }
+
+    Py_INCREF(value);
+    return value;
+}
+
+static PyObject*
+linkadd_dir(PyObject* module, PyObject* Py_UNUSED(ignored))
+{
+    PyObject* dict = get_linkadd_dict(module);
+    if(!dict)
+        return NULL;
+
+    return PyDict_Keys(dict);
+}
+
+static PyMethodDef link_add_methods[] = {
+    {"__getattr__", linkadd_getattr, METH_O, NULL},
+    {"__dir__", linkadd_dir, METH_NOARGS, NULL},
+    {NULL, NULL, 0, NULL}
+};
+
+static int
+linkadd_traverse(PyObject* module, visitproc visit, void* arg)
+{
+    linkadd_state* st = (linkadd_state*)PyModule_GetState(module);
+    if(st)
+        Py_VISIT(st->dict);
+    return 0;
+}
+
+static int
+linkadd_clear(PyObject* module)
+{
+    linkadd_state* st = (linkadd_state*)PyModule_GetState(module);
+    if(st)
+        Py_CLEAR(st->dict);
+    return 0;
+}
+
+static void
+linkadd_free(void* module)
+{
+    linkadd_clear((PyObject*)module);
+}
+
+static PyModuleDef_Slot link_add_slots[] = {
+#if PY_VERSION_HEX >= 0x030C0000
+    /* The constants are kept in the module state */
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+    /* The dictionary is published atomically, the rest is read-only */
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+
+static struct PyModuleDef link_add_module = {
+    PyModuleDef_HEAD_INIT,
+    "_const_linkadd",       /* name of module */
+    const_linkadd_doc,      /* module documentation, may be NULL */
+    sizeof(linkadd_state),  /* size of per-interpreter state of the module */
+    link_add_methods,
+    link_add_slots,
+    linkadd_traverse,
+    linkadd_clear,
+    linkadd_free
+};
+
+
+PyMODINIT_FUNC PyInit__const_linkadd(void){
+    return PyModuleDef_Init(&link_add_module);
+}
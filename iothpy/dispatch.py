@@ -0,0 +1,118 @@
+#
+# This file is part of the iothpy library: python support for ioth.
+#
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+"""
+Datagram dispatcher
+
+This module defines Dispatcher, reading the datagrams of a socket in a
+thread of its own with the GIL released and spreading them over a fixed
+number of bounded queues by a hash of the sender address. The datagrams
+of a sender always go to the same queue, in the order they were
+received, so each queue can be consumed by a worker thread of its own
+without any locking of per sender state.
+
+Example:
+
+sock = stack.socket(iothpy.AF_INET, iothpy.SOCK_DGRAM)
+sock.bind(("0.0.0.0", 5000))
+dispatcher = iothpy.Dispatcher(sock, 4)
+
+def worker(queue):
+    for data, addr in queue:
+        handle(addr, data)
+
+for i in range(4):
+    threading.Thread(target=worker, args=(dispatcher.queue(i),)).start()
+"""
+
+from . import _iothpy
+
+class Dispatcher(_iothpy.DispatcherBase):
+    """Dispatcher of the datagrams of a socket to flow hashed queues
+
+    Parameters
+    ----------
+    sock : MSocket
+        Datagram socket of a stack, read only by the dispatcher while it
+        runs. The socket is not closed by the dispatcher and must not be
+        closed while it runs.
+
+    queues : int
+        Number of queues.
+
+    depth : int
+        Maximum number of datagrams waiting in a queue, the datagrams
+        received for a full queue are dropped and counted in stats().
+
+    batch : int
+        Maximum number of datagrams read in a row before they are handed
+        to the queues.
+
+    bufsize : int
+        Maximum size of a datagram, longer datagrams are truncated.
+
+    The datagrams of a queue are taken in batches with recv_batch(i) or
+    with the DispatchQueue returned by queue(i). close() stops the
+    dispatcher, the consumers then get an empty batch.
+    """
+
+    def queue(self, index):
+        """Return the DispatchQueue at index"""
+        if not 0 <= index < self.nqueues:
+            raise IndexError("queue index out of range")
+        return DispatchQueue(self, index)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+class DispatchQueue:
+    """Queue of a Dispatcher, consumed by a single worker
+
+    Iterating a queue yields the (data, address) datagrams until the
+    dispatcher is closed.
+    """
+
+    def __init__(self, dispatcher, index):
+        self.dispatcher = dispatcher
+        self.index = index
+
+    def recv_batch(self, maxcount=0, timeout=None):
+        """Return a list of up to maxcount (data, address) datagrams, see Dispatcher.recv_batch"""
+        return self.dispatcher.recv_batch(self.index, maxcount, timeout)
+
+    def fileno(self):
+        """Return a file descriptor readable while the queue has datagrams"""
+        return self.dispatcher.fileno(self.index)
+
+    def __iter__(self):
+        while True:
+            batch = self.dispatcher.recv_batch(self.index)
+            if not batch:
+                return
+            yield from batch
+
+    def __repr__(self):
+        return "<DispatchQueue {0} of {1!r}>".format(self.index, self.dispatcher)
@@ -0,0 +1,103 @@
+#
+# This file is part of the iothpy library: python support for ioth.
+#
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""
+Engine class
+
+This module defines the Engine class returned by Stack.engine, a
+completion based interface to the sockets of a stack: operations are
+queued with the submit_* methods and their results are collected in
+batches by reap, with a single release of the GIL for the whole batch.
+
+Stacks whose sockets are kernel file descriptors (kernel, vdestack) use
+io_uring, the other stacks (e.g. picox) use a pool of threads.
+
+Example:
+
+with stack.engine() as engine:
+    engine.submit_accept(listener)
+    while True:
+        for c in engine.reap(1):
+            if c.error:
+                continue
+            if c.op == "accept":
+                conn, addr = c.result
+                engine.submit_accept(listener)
+                engine.submit_recv(conn, 4096)
+            elif c.op == "recv" and c.result:
+                engine.submit_send(c.socket, c.result)
+            elif c.op == "send":
+                engine.submit_recv(c.socket, 4096)
+"""
+
+from . import _iothpy
+from ._iothpy import Completion
+
+class Engine(_iothpy.EngineBase):
+    """Completion based I/O engine of a stack
+
+    This class is only used internally, the user should create engines
+    with Stack.engine().
+
+    Parameters
+    ----------
+    stack : Stack
+        Stack of the sockets used with the engine.
+
+    entries : int
+        Maximum number of operations in flight.
+
+    threads : int
+        Number of threads of the thread backend.
+
+    backend : str
+        "io_uring" or "threads", chosen from the stack if None.
+    """
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    async def areap(self):
+        """Wait in the running asyncio loop for completions and return them
+
+        Same as reap(1) without blocking the loop.
+        """
+        import asyncio
+
+        completions = self.reap()
+        if completions or not self.inflight:
+            return completions
+
+        loop = asyncio.get_running_loop()
+        fd = self.fileno()
+        while not completions:
+            ready = loop.create_future()
+            loop.add_reader(fd, ready.set_result, None)
+            try:
+                await ready
+            finally:
+                loop.remove_reader(fd)
+            completions = self.reap()
+        return completions
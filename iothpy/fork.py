@@ -0,0 +1,136 @@
+#
+# This file is part of the iothpy library: python support for ioth.
+#
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""
+Prefork worker model
+
+This module defines the prefork function, a worker model where N child
+processes are forked and each one creates its own stack, with its own
+address on the shared vde network, and runs the same handler on it.
+
+Stacks are not inherited across fork: the plugins keep threads and state
+that do not survive in the child, so in the children the stacks of the
+parent are closed and each child must create a new one.
+
+Example:
+
+def factory(i):
+    stack = iothpy.Stack("vdestack", "vxvde://234.0.0.1")
+    stack.ioth_config("eth,ip=10.0.0.%d/24" % (i + 1))
+    return stack
+
+def serve(stack, i):
+    with stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM) as s:
+        s.bind(("", 5000))
+        s.listen()
+        ...
+
+codes = iothpy.prefork(4, factory, serve)
+"""
+
+import os
+import signal
+import sys
+import traceback
+
+def _child(i, stack_factory, handler):
+    code = 0
+    try:
+        stack = stack_factory(i)
+        with stack:
+            handler(stack, i)
+    except SystemExit as e:
+        code = e.code if isinstance(e.code, int) else 1
+    except BaseException:
+        traceback.print_exc()
+        code = 1
+    finally:
+        try:
+            sys.stdout.flush()
+            sys.stderr.flush()
+        finally:
+            # Never return into the code of the parent
+            os._exit(code)
+
+def _wait(pid):
+    """Wait for pid, return its exit code or -signal if killed by a signal"""
+    _, status = os.waitpid(pid, 0)
+    if os.WIFSIGNALED(status):
+        return -os.WTERMSIG(status)
+    return os.WEXITSTATUS(status)
+
+def prefork(n, stack_factory, handler, wait=True):
+    """Fork n worker processes, each one running handler on its own stack
+
+    Parameters
+    ----------
+    n : int
+        Number of worker processes.
+
+    stack_factory : callable
+        Called in each child with the worker index (0 based), returns the
+        new stack of the worker, already configured.
+
+    handler : callable
+        Called in each child as handler(stack, index), the stack is closed
+        when it returns and the child exits with status 0, or 1 if it
+        raised an exception.
+
+    wait : bool
+        If True (default) wait for all the workers and return the list of
+        their exit codes (negative signal numbers for killed workers), if
+        False return the list of their pids right away.
+
+    If the parent is interrupted while waiting, the workers still running
+    are sent SIGTERM before the exception is propagated.
+    """
+    if n < 1:
+        raise ValueError("n must be at least 1")
+
+    pids = []
+    try:
+        for i in range(n):
+            pid = os.fork()
+            if pid == 0:
+                _child(i, stack_factory, handler)
+            pids.append(pid)
+
+        if not wait:
+            return pids
+
+        codes = []
+        while pids:
+            codes.append(_wait(pids[0]))
+            pids.pop(0)
+        return codes
+    except BaseException:
+        for pid in pids:
+            try:
+                os.kill(pid, signal.SIGTERM)
+            except ProcessLookupError:
+                pass
+        for pid in pids:
+            try:
+                _wait(pid)
+            except ChildProcessError:
+                pass
+        raise
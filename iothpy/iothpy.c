@@ -26,8 +26,14 @@
 #define _GNU_SOURCE
 #endif
 
+#include "iothpy_state.h"
 #include "iothpy_stack.h"
 #include "iothpy_socket.h"
+#include "iothpy_monitor.h"
+#include "iothpy_engine.h"
+#include "iothpy_relay.h"
+#include "iothpy_balancer.h"
+#include "iothpy_dispatch.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -122,11 +128,12 @@ range of values.");
 static PyObject *
 socket_getdefaulttimeout(PyObject *self, PyObject *Py_UNUSED(ignored))
 {
-    if (defaulttimeout < 0) {
+    _PyTime_t timeout = socket_get_defaulttimeout(iothpy_state_from_module(self));
+    if (timeout < 0) {
         Py_RETURN_NONE;
     }
     else {
-        double seconds = _PyTime_AsSecondsDouble(defaulttimeout);
+        double seconds = _PyTime_AsSecondsDouble(timeout);
         return PyFloat_FromDouble(seconds);
     }
 }
@@ -146,7 +153,7 @@ socket_setdefaulttimeout(PyObject *self, PyObject *arg)
     if (socket_parse_timeout(&timeout, arg) < 0)
         return NULL;
 
-    defaulttimeout = timeout;
+    socket_set_defaulttimeout(iothpy_state_from_module(self), timeout);
 
     Py_RETURN_NONE;
 }
@@ -189,6 +196,49 @@ PyDoc_STRVAR(close_doc,
 Close an integer socket file descriptor.  This is like os.close(), but for\n\
 sockets; on some platforms os.close() won't work for socket file descriptors.");
 
+static PyObject *
+iothpy_get_stack(PyObject *self, PyObject *Py_UNUSED(ignored))
+{
+    return stack_get_current(iothpy_state_from_module(self));
+}
+
+PyDoc_STRVAR(get_stack_doc,
+"get_stack() -> Stack\n\
+\n\
+Return the stack used by the sockets created without a stack, such as\n\
+the ones of the socket module after override_socket_module(): the value\n\
+of the current_stack context variable if set, otherwise the stack set\n\
+for the calling thread with set_thread_stack, otherwise the default one\n\
+set with set_default_stack. Raises RuntimeError if there is none.");
+
+static PyObject *
+iothpy_set_default_stack(PyObject *self, PyObject *stack)
+{
+    if (stack_set_default(iothpy_state_from_module(self), stack) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(set_default_stack_doc,
+"set_default_stack(stack)\n\
+\n\
+Set the stack used by the sockets created without a stack when neither\n\
+current_stack nor the stack of the thread are set. None unsets it.");
+
+static PyObject *
+iothpy_set_thread_stack(PyObject *self, PyObject *stack)
+{
+    if (stack_set_thread(iothpy_state_from_module(self), stack) < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(set_thread_stack_doc,
+"set_thread_stack(stack)\n\
+\n\
+Set the stack used by the sockets created without a stack in the calling\n\
+thread, unless current_stack is set. None unsets it.");
+
 static PyMethodDef iothpy_methods[] = {
 #ifdef CMSG_LEN
     {"CMSG_LEN",   socket_CMSG_LEN, METH_VARARGS, CMSG_LEN_doc},
@@ -201,47 +251,218 @@ static PyMethodDef iothpy_methods[] = {
 
     {"close",              socket_close, METH_O, close_doc},
 
+    {"get_stack",          iothpy_get_stack, METH_NOARGS, get_stack_doc},
+    {"set_default_stack",  iothpy_set_default_stack, METH_O, set_default_stack_doc},
+    {"set_thread_stack",   iothpy_set_thread_stack, METH_O, set_thread_stack_doc},
+
     {NULL, NULL, 0, NULL}        /* Sentinel */
 };
 
+static int iothpy_exec(PyObject* module);
+static int iothpy_traverse(PyObject* module, visitproc visit, void* arg);
+static int iothpy_clear(PyObject* module);
+static void iothpy_free(void* module);
+
+static PyModuleDef_Slot iothpy_slots[] = {
+    {Py_mod_exec, iothpy_exec},
+#if PY_VERSION_HEX >= 0x030C0000
+    /* All the state is in the module state and in the objects */
+    {Py_mod_multiple_interpreters, Py_MOD_PER_INTERPRETER_GIL_SUPPORTED},
+#endif
+#if PY_VERSION_HEX >= 0x030D0000
+    /* The state shared by the threads is protected by locks and atomics,
+       the sockets can be used concurrently without the GIL */
+    {Py_mod_gil, Py_MOD_GIL_NOT_USED},
+#endif
+    {0, NULL}
+};
+
 static struct PyModuleDef iothpy_module = {
     PyModuleDef_HEAD_INIT,
-    "_iothpy",   /* name of module */
-    iothpy_doc,  /* module documentation, may be NULL */
-    -1,            /* size of per-interpreter state of the module,
-                      or -1 if the module keeps state in global variables. */
-    iothpy_methods
+    "_iothpy",              /* name of module */
+    iothpy_doc,             /* module documentation, may be NULL */
+    sizeof(iothpy_state),   /* size of per-interpreter state of the module */
+    iothpy_methods,
+    iothpy_slots,
+    iothpy_traverse,
+    iothpy_clear,
+    iothpy_free
 };
 
-PyMODINIT_FUNC
-PyInit__iothpy(void)
-{ 
-#if PY_MINOR_VERSION > 9
-    Py_SET_TYPE(&stack_type, &PyType_Type);
-    Py_SET_TYPE(&socket_type, &PyType_Type);
-#else
-    Py_TYPE(&stack_type) = &PyType_Type;
-    Py_TYPE(&socket_type) = &PyType_Type;
+#if PY_VERSION_HEX < 0x03090000
+/* Before Python 3.9 types do not refer to their module, the state of the
+   last module created is used */
+static iothpy_state* legacy_state = NULL;
 #endif
-    PyObject* module = PyModule_Create(&iothpy_module);
 
-    socket_timeout = PyErr_NewException("_iothpy.timeout",
-                                        PyExc_OSError, NULL);
-    if (socket_timeout == NULL)
-        return NULL;
-    Py_INCREF(socket_timeout);
-    PyModule_AddObject(module, "timeout", socket_timeout);
+iothpy_state*
+iothpy_state_from_module(PyObject* module)
+{
+    return (iothpy_state*)PyModule_GetState(module);
+}
 
-    /* Add a symbol for the stack type */
-    Py_INCREF((PyObject *)&stack_type);
-    if(PyModule_AddObject(module, "StackBase", (PyObject*)&stack_type) != 0) {
+iothpy_state*
+iothpy_state_from_type(PyTypeObject* type)
+{
+#if PY_VERSION_HEX >= 0x030B0000
+    PyObject* module = PyType_GetModuleByDef(type, &iothpy_module);
+    if(!module)
         return NULL;
+    return iothpy_state_from_module(module);
+#elif PY_VERSION_HEX >= 0x03090000
+    PyObject* mro = type->tp_mro;
+    for(Py_ssize_t i = 0; mro && i < PyTuple_GET_SIZE(mro); i++) {
+        PyTypeObject* base = (PyTypeObject*)PyTuple_GET_ITEM(mro, i);
+        if(!(base->tp_flags & Py_TPFLAGS_HEAPTYPE))
+            continue;
+
+        PyObject* module = ((PyHeapTypeObject*)base)->ht_module;
+        if(module && PyModule_GetDef(module) == &iothpy_module)
+            return iothpy_state_from_module(module);
+    }
+    PyErr_Format(PyExc_TypeError, "type '%s' is not defined by the _iothpy module", type->tp_name);
+    return NULL;
+#else
+    return legacy_state;
+#endif
+}
+
+PyTypeObject*
+iothpy_new_type(PyObject* module, PyType_Spec* spec)
+{
+#if PY_VERSION_HEX >= 0x03090000
+    return (PyTypeObject*)PyType_FromModuleAndSpec(module, spec, NULL);
+#else
+    return (PyTypeObject*)PyType_FromSpec(spec);
+#endif
+}
+
+static int
+iothpy_exec(PyObject* module)
+{
+    iothpy_state* st = iothpy_state_from_module(module);
+
+    st->defaulttimeout = _PyTime_FromSeconds(-1);
+    pthread_mutex_init(&st->default_stack_lock, NULL);
+#if PY_VERSION_HEX < 0x03090000
+    legacy_state = st;
+#endif
+
+    st->socket_timeout = PyErr_NewException("_iothpy.timeout",
+                                            PyExc_OSError, NULL);
+    if (st->socket_timeout == NULL)
+        return -1;
+    Py_INCREF(st->socket_timeout);
+    if (PyModule_AddObject(module, "timeout", st->socket_timeout) != 0) {
+        Py_DECREF(st->socket_timeout);
+        return -1;
     }
 
-    /* Add a symbol for the socket type */
-    Py_INCREF((PyObject *)&socket_type);
-    if (PyModule_AddObject(module, "MSocketBase",
-                           (PyObject *)&socket_type) != 0)
-        return NULL;
-    return module;
+    /* Add the stack type and the types used by the stack methods */
+    if(stack_module_init(module) < 0)
+        return -1;
+
+    /* Add the socket type */
+    if(socket_module_init(module) < 0)
+        return -1;
+
+    /* Add the netlink monitor type and its constants */
+    if(monitor_module_init(module) < 0)
+        return -1;
+
+    /* Add the completion engine type */
+    if(engine_module_init(module) < 0)
+        return -1;
+
+    /* Add the relay type */
+    if(relay_module_init(module) < 0)
+        return -1;
+
+    /* Add the load balancer type */
+    if(balancer_module_init(module) < 0)
+        return -1;
+
+    /* Add the datagram dispatcher type */
+    if(dispatch_module_init(module) < 0)
+        return -1;
+
+    return 0;
+}
+
+static int
+iothpy_traverse(PyObject* module, visitproc visit, void* arg)
+{
+    iothpy_state* st = iothpy_state_from_module(module);
+    if(!st)
+        return 0;
+
+    Py_VISIT(st->stack_type);
+    Py_VISIT(st->socket_type);
+    Py_VISIT(st->monitor_type);
+    Py_VISIT(st->engine_type);
+    Py_VISIT(st->relay_type);
+    Py_VISIT(st->balancer_type);
+    Py_VISIT(st->dispatcher_type);
+    Py_VISIT(st->addrinfo_type);
+    Py_VISIT(st->ifaddr_type);
+    Py_VISIT(st->route_type);
+    Py_VISIT(st->link_type);
+    Py_VISIT(st->linkstats_type);
+    Py_VISIT(st->netlink_event_type);
+    Py_VISIT(st->completion_type);
+    Py_VISIT(st->socket_timeout);
+    Py_VISIT(st->current_stack_var);
+    Py_VISIT(st->thread_stack_key);
+    Py_VISIT(st->default_stack);
+    Py_VISIT(st->family_map);
+    Py_VISIT(st->socktype_map);
+    Py_VISIT(st->gaierror);
+    return 0;
+}
+
+static int
+iothpy_clear(PyObject* module)
+{
+    iothpy_state* st = iothpy_state_from_module(module);
+    if(!st)
+        return 0;
+
+    Py_CLEAR(st->stack_type);
+    Py_CLEAR(st->socket_type);
+    Py_CLEAR(st->monitor_type);
+    Py_CLEAR(st->engine_type);
+    Py_CLEAR(st->relay_type);
+    Py_CLEAR(st->balancer_type);
+    Py_CLEAR(st->dispatcher_type);
+    Py_CLEAR(st->addrinfo_type);
+    Py_CLEAR(st->ifaddr_type);
+    Py_CLEAR(st->route_type);
+    Py_CLEAR(st->link_type);
+    Py_CLEAR(st->linkstats_type);
+    Py_CLEAR(st->netlink_event_type);
+    Py_CLEAR(st->completion_type);
+    Py_CLEAR(st->socket_timeout);
+    Py_CLEAR(st->current_stack_var);
+    Py_CLEAR(st->thread_stack_key);
+    Py_CLEAR(st->default_stack);
+    Py_CLEAR(st->family_map);
+    Py_CLEAR(st->socktype_map);
+    Py_CLEAR(st->gaierror);
+    return 0;
+}
+
+static void
+iothpy_free(void* module)
+{
+    iothpy_state* st = iothpy_state_from_module((PyObject*)module);
+
+    iothpy_clear((PyObject*)module);
+    if(st)
+        pthread_mutex_destroy(&st->default_stack_lock);
+}
+
+PyMODINIT_FUNC
+PyInit__iothpy(void)
+{
+    return PyModuleDef_Init(&iothpy_module);
 }
@@ -0,0 +1,1006 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_state.h"
+#include "iothpy_balancer.h"
+#include "iothpy_relay.h"
+#include "iothpy_stack.h"
+#include "iothpy_socket.h"
+#include "utils.h"
+
+#include <structmember.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+
+#include <ioth.h>
+
+#define BALANCER_DEFAULT_BUFSIZE 16384
+
+/* Points of each backend on the hash ring */
+#define BALANCER_VNODES 100
+
+/* Connections accepted in a row before polling again */
+#define BALANCER_ACCEPT_BATCH 64
+
+/* Connections connecting at the same time, the listener is not polled beyond */
+#define BALANCER_MAX_CONNECTING 1024
+
+/* Connection accepted and not yet handed to a relay loop */
+struct balancer_connect {
+    int client;
+    int upstream;                   /* -1 between two backends */
+    int backend;
+    uint64_t tried;                 /* mask of the backends tried */
+    uint64_t key;                   /* hash of the client address */
+    uint64_t deadline;              /* of the connect in progress, milliseconds */
+    struct balancer_connect* next;
+};
+
+static const char* const balancer_policies[] = {"round_robin", "least_conn", "hash"};
+
+static uint64_t
+balancer_now(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* Hash of the host of a client, its port changes at each connection */
+static uint64_t
+balancer_client_key(const struct sockaddr_storage* addr)
+{
+    if(addr->ss_family == AF_INET) {
+        const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+        return hash_bytes(&in->sin_addr, sizeof(in->sin_addr), 0);
+    }
+    if(addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)addr;
+        return hash_bytes(&in6->sin6_addr, sizeof(in6->sin6_addr), 0);
+    }
+    return 0;
+}
+
+static int
+balancer_vnode_cmp(const void* a, const void* b)
+{
+    uint64_t ha = ((const struct balancer_vnode*)a)->hash;
+    uint64_t hb = ((const struct balancer_vnode*)b)->hash;
+    return (ha > hb) - (ha < hb);
+}
+
+/* Place BALANCER_VNODES points of each backend on the ring, returns -1 on error */
+static int
+balancer_build_ring(balancer_object* b)
+{
+    b->nring = b->nbackends * BALANCER_VNODES;
+    b->ring = malloc(b->nring * sizeof(struct balancer_vnode));
+    if(!b->ring)
+        return -1;
+
+    for(unsigned int i = 0; i < b->nbackends; i++) {
+        struct balancer_backend* be = &b->backends[i];
+        for(unsigned int v = 0; v < BALANCER_VNODES; v++) {
+            struct balancer_vnode* node = &b->ring[i * BALANCER_VNODES + v];
+            node->hash = hash_bytes(&be->addr, be->addrlen, ((uint64_t)i << 32) | v);
+            node->backend = i;
+        }
+    }
+
+    qsort(b->ring, b->nring, sizeof(struct balancer_vnode), balancer_vnode_cmp);
+    return 0;
+}
+
+/* Whether the backend can take new connections, with the lock held */
+static int
+balancer_available(balancer_object* b, struct balancer_backend* be, uint64_t now)
+{
+    if(!be->enabled)
+        return 0;
+    return b->max_fails == 0 || be->fails < b->max_fails || now >= be->down_until;
+}
+
+/*
+    Choose the backend of a connection among the ones it did not try yet,
+    with the lock held. Returns its index, -1 if none is available.
+*/
+static int
+balancer_choose(balancer_object* b, struct balancer_connect* c, uint64_t now)
+{
+    int chosen = -1;
+
+#define BALANCER_CANDIDATE(i) (!(c->tried & ((uint64_t)1 << (i))) && \
+                               balancer_available(b, &b->backends[i], now))
+
+    if(b->policy == BALANCER_HASH) {
+        /* First point at or after the key, wrapping around */
+        unsigned int lo = 0, hi = b->nring;
+        while(lo < hi) {
+            unsigned int mid = lo + (hi - lo) / 2;
+            if(b->ring[mid].hash < c->key)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+
+        for(unsigned int k = 0; k < b->nring; k++) {
+            unsigned int i = b->ring[(lo + k) % b->nring].backend;
+            if(BALANCER_CANDIDATE(i)) {
+                chosen = i;
+                break;
+            }
+        }
+    } else {
+        /* Least connections breaks the ties in turn as round robin */
+        for(unsigned int k = 0; k < b->nbackends; k++) {
+            unsigned int i = (b->rr_next + k) % b->nbackends;
+            if(!BALANCER_CANDIDATE(i))
+                continue;
+            if(chosen < 0 || b->backends[i].active < b->backends[chosen].active)
+                chosen = i;
+            if(b->policy == BALANCER_ROUND_ROBIN)
+                break;
+        }
+        if(chosen >= 0)
+            b->rr_next = (chosen + 1) % b->nbackends;
+    }
+
+#undef BALANCER_CANDIDATE
+
+    if(chosen >= 0) {
+        c->tried |= (uint64_t)1 << chosen;
+        b->backends[chosen].active++;
+        b->backends[chosen].connections++;
+    }
+
+    return chosen;
+}
+
+/* Called by a relay loop once a connection finished */
+static void
+balancer_relay_done(struct relay_pair* pair)
+{
+    struct balancer_backend* be = pair->data;
+    balancer_object* b = be->balancer;
+
+    ioth_close(pair->fd[0]);
+    ioth_close(pair->fd[1]);
+
+    pthread_mutex_lock(&b->lock);
+    be->active--;
+    be->bytes_sent += pair->bytes[0];
+    be->bytes_received += pair->bytes[1];
+    pthread_mutex_unlock(&b->lock);
+
+    relay_pair_free(pair);
+}
+
+/* Hand a connected connection to the next relay loop */
+static void
+balancer_relay(balancer_object* b, struct balancer_connect* c)
+{
+    struct balancer_backend* be = &b->backends[c->backend];
+    struct relay_loop* loop = b->loops[b->next_loop++ % b->nloops];
+
+    pthread_mutex_lock(&b->lock);
+    be->fails = 0;
+    pthread_mutex_unlock(&b->lock);
+
+    struct relay_pair* pair = relay_pair_new(c->client, 0, c->upstream, 0, b->bufsize);
+    if(pair) {
+        pair->done = balancer_relay_done;
+        pair->data = be;
+        if(relay_loop_add(loop, pair) == 0)
+            return;
+        relay_pair_free(pair);
+    }
+
+    ioth_close(c->client);
+    ioth_close(c->upstream);
+
+    pthread_mutex_lock(&b->lock);
+    be->active--;
+    pthread_mutex_unlock(&b->lock);
+}
+
+/* Give up the connect to the current backend, counting a failure */
+static void
+balancer_connect_failed(balancer_object* b, struct balancer_connect* c)
+{
+    struct balancer_backend* be = &b->backends[c->backend];
+
+    if(c->upstream != -1) {
+        ioth_close(c->upstream);
+        c->upstream = -1;
+    }
+
+    pthread_mutex_lock(&b->lock);
+    be->active--;
+    be->failures++;
+    be->fails++;
+    if(b->max_fails && be->fails >= b->max_fails)
+        be->down_until = balancer_now() + b->fail_timeout;
+    pthread_mutex_unlock(&b->lock);
+}
+
+static int
+balancer_set_nonblocking(int fd)
+{
+    int flags = ioth_fcntl(fd, F_GETFL, 0);
+    if(flags == -1)
+        return -1;
+    return ioth_fcntl(fd, F_SETFL, flags | O_NONBLOCK);
+}
+
+/*
+    Connect a connection to the next available backend, trying the others
+    while connect fails at once. Returns 1 if the connect is in progress,
+    0 if the connection was handed to a relay loop or closed.
+*/
+static int
+balancer_start_connect(balancer_object* b, struct balancer_connect* c)
+{
+    while(1) {
+        uint64_t now = balancer_now();
+
+        pthread_mutex_lock(&b->lock);
+        c->backend = balancer_choose(b, c, now);
+        if(c->backend < 0)
+            b->rejected++;
+        pthread_mutex_unlock(&b->lock);
+
+        if(c->backend < 0) {
+            ioth_close(c->client);
+            return 0;
+        }
+
+        struct balancer_backend* be = &b->backends[c->backend];
+        int res = -1;
+
+        c->upstream = ioth_msocket(be->stack, be->addr.ss_family, SOCK_STREAM, 0);
+        if(c->upstream != -1 && balancer_set_nonblocking(c->upstream) == 0)
+            res = ioth_connect(c->upstream, (struct sockaddr*)&be->addr, be->addrlen);
+
+        if(res == 0) {
+            balancer_relay(b, c);
+            return 0;
+        }
+        if(c->upstream != -1 && errno == EINPROGRESS) {
+            c->deadline = now + b->connect_timeout;
+            return 1;
+        }
+
+        balancer_connect_failed(b, c);
+    }
+}
+
+/* Result of a connect in progress, 0 or an errno value */
+static int
+balancer_connect_result(struct balancer_connect* c)
+{
+    int err = 0;
+    socklen_t len = sizeof(err);
+
+    if(ioth_getsockopt(c->upstream, SOL_SOCKET, SO_ERROR, &err, &len) < 0)
+        return errno;
+    return err;
+}
+
+static void
+balancer_accept(balancer_object* b)
+{
+    for(int i = 0; i < BALANCER_ACCEPT_BATCH && b->nconnecting < BALANCER_MAX_CONNECTING; i++) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+
+        memset(&addr, 0, sizeof(addr));
+        int fd = ioth_accept(b->listen_fd, (struct sockaddr*)&addr, &addrlen);
+        if(fd < 0)
+            break;
+
+        struct balancer_connect* c = calloc(1, sizeof(struct balancer_connect));
+
+        pthread_mutex_lock(&b->lock);
+        b->accepted++;
+        if(!c)
+            b->rejected++;
+        pthread_mutex_unlock(&b->lock);
+
+        if(!c) {
+            ioth_close(fd);
+            continue;
+        }
+
+        c->client = fd;
+        c->upstream = -1;
+        c->key = balancer_client_key(&addr);
+
+        if(balancer_start_connect(b, c)) {
+            c->next = b->connecting;
+            b->connecting = c;
+            b->nconnecting++;
+        } else {
+            free(c);
+        }
+    }
+}
+
+static void*
+balancer_thread(void* arg)
+{
+    balancer_object* b = arg;
+    struct pollfd* pfds = b->pfds;
+
+    while(1) {
+        pthread_mutex_lock(&b->lock);
+        int stopping = b->stopping;
+        pthread_mutex_unlock(&b->lock);
+        if(stopping)
+            break;
+
+        uint64_t now = balancer_now();
+        int timeout = -1;
+
+        pfds[0].fd = b->wake_fd;
+        pfds[0].events = POLLIN;
+        pfds[0].revents = 0;
+        pfds[1].fd = b->nconnecting < BALANCER_MAX_CONNECTING ? b->listen_fd : -1;
+        pfds[1].events = POLLIN;
+        pfds[1].revents = 0;
+
+        nfds_t n = 2;
+        for(struct balancer_connect* c = b->connecting; c; c = c->next, n++) {
+            pfds[n].fd = c->upstream;
+            pfds[n].events = POLLOUT;
+            pfds[n].revents = 0;
+
+            int left = c->deadline > now ? (int)(c->deadline - now) : 0;
+            if(timeout < 0 || left < timeout)
+                timeout = left;
+        }
+
+        poll(pfds, n, timeout);
+        if(pfds[0].revents)
+            eventfd_drain(b->wake_fd);
+
+        /* The connections connecting follow the listener in pfds */
+        now = balancer_now();
+        n = 2;
+        struct balancer_connect** pc = &b->connecting;
+        while(*pc) {
+            struct balancer_connect* c = *pc;
+            short revents = pfds[n++].revents;
+            int pending = 1;
+
+            if(revents && balancer_connect_result(c) == 0) {
+                balancer_relay(b, c);
+                pending = 0;
+            } else if(revents || now >= c->deadline) {
+                balancer_connect_failed(b, c);
+                pending = balancer_start_connect(b, c);
+            }
+
+            if(pending) {
+                pc = &c->next;
+            } else {
+                *pc = c->next;
+                b->nconnecting--;
+                free(c);
+            }
+        }
+
+        if(pfds[1].revents)
+            balancer_accept(b);
+    }
+
+    /* Drop the connections still connecting */
+    while(b->connecting) {
+        struct balancer_connect* c = b->connecting;
+        b->connecting = c->next;
+
+        ioth_close(c->client);
+        ioth_close(c->upstream);
+
+        pthread_mutex_lock(&b->lock);
+        b->backends[c->backend].active--;
+        pthread_mutex_unlock(&b->lock);
+        free(c);
+    }
+    b->nconnecting = 0;
+
+    return NULL;
+}
+
+/*
+    Python interface
+*/
+
+/* Stop accepting and close the connections, the listener stays open */
+static void
+balancer_close_internal(balancer_object* self)
+{
+    int started = self->started;
+
+    self->started = 0;
+    Py_BEGIN_ALLOW_THREADS
+    /* In a child after fork the thread is gone, its connections are leaked */
+    if(started && self->pid == getpid()) {
+        pthread_mutex_lock(&self->lock);
+        self->stopping = 1;
+        pthread_mutex_unlock(&self->lock);
+        eventfd_signal(self->wake_fd);
+        pthread_join(self->thread, NULL);
+    }
+
+    if(self->loops) {
+        for(unsigned int i = 0; i < self->nloops; i++)
+            if(self->loops[i])
+                relay_loop_stop(self->loops[i]);
+        free(self->loops);
+        self->loops = NULL;
+    }
+    Py_END_ALLOW_THREADS
+
+    /* Let the stacks of the listener and the backends be closed again */
+    if(self->listen_stack) {
+        stack_unpin((stack_object*)self->listen_stack);
+        Py_CLEAR(self->listen_stack);
+    }
+    for(unsigned int i = 0; i < self->nbackends; i++) {
+        struct balancer_backend* be = &self->backends[i];
+        if(be->stack) {
+            stack_unpin((stack_object*)PyTuple_GET_ITEM(self->stacks, i));
+            be->stack = NULL;
+        }
+    }
+
+    /* Give the listener its blocking mode back unless it was closed */
+    if(self->listen_flags != -1 && self->listener &&
+       get_sock_fd((socket_object*)self->listener) == self->listen_fd)
+        ioth_fcntl(self->listen_fd, F_SETFL, self->listen_flags);
+    self->listen_flags = -1;
+}
+
+/* Parse the numeric (host, port[, flowinfo, scope_id]) address of a backend */
+static int
+balancer_parse_address(PyObject* address, struct balancer_backend* be)
+{
+    const char* host;
+    int port;
+    unsigned int flowinfo = 0, scope_id = 0;
+
+    if(!PyTuple_Check(address)) {
+        PyErr_Format(PyExc_TypeError, "backend address must be a tuple, not %.500s",
+                     Py_TYPE(address)->tp_name);
+        return -1;
+    }
+    if(!PyArg_ParseTuple(address, "si|II;backend address must be (host, port)",
+                         &host, &port, &flowinfo, &scope_id))
+        return -1;
+    if(port < 0 || port > 0xffff) {
+        PyErr_SetString(PyExc_OverflowError, "port must be 0-65535.");
+        return -1;
+    }
+
+    memset(&be->addr, 0, sizeof(be->addr));
+    struct sockaddr_in* in = (struct sockaddr_in*)&be->addr;
+    struct sockaddr_in6* in6 = (struct sockaddr_in6*)&be->addr;
+
+    if(inet_pton(AF_INET, host, &in->sin_addr) == 1) {
+        in->sin_family = AF_INET;
+        in->sin_port = htons(port);
+        be->addrlen = sizeof(struct sockaddr_in);
+    } else if(inet_pton(AF_INET6, host, &in6->sin6_addr) == 1) {
+        in6->sin6_family = AF_INET6;
+        in6->sin6_port = htons(port);
+        in6->sin6_flowinfo = htonl(flowinfo);
+        in6->sin6_scope_id = scope_id;
+        be->addrlen = sizeof(struct sockaddr_in6);
+    } else {
+        PyErr_Format(PyExc_ValueError, "backend host must be a numeric address, not '%s'", host);
+        return -1;
+    }
+
+    return 0;
+}
+
+/* Parse the (stack, address) backends, filling the backends and stacks of self */
+static int
+balancer_parse_backends(iothpy_state* st, balancer_object* self, PyObject* backends)
+{
+    PyObject* seq = PySequence_Fast(backends, "backends must be a sequence of (stack, address)");
+    if(!seq)
+        return -1;
+
+    Py_ssize_t n = PySequence_Fast_GET_SIZE(seq);
+    if(n < 1 || n > BALANCER_MAX_BACKENDS) {
+        PyErr_Format(PyExc_ValueError, "the number of backends must be 1-%d", BALANCER_MAX_BACKENDS);
+        goto error;
+    }
+
+    self->backends = calloc(n, sizeof(struct balancer_backend));
+    self->stacks = PyTuple_New(n);
+    if(!self->backends || !self->stacks) {
+        PyErr_NoMemory();
+        goto error;
+    }
+    self->nbackends = n;
+
+    for(Py_ssize_t i = 0; i < n; i++) {
+        PyObject* item = PySequence_Fast_GET_ITEM(seq, i);
+        struct balancer_backend* be = &self->backends[i];
+        PyObject* stack;
+        PyObject* address;
+
+        if(!PyTuple_Check(item) || !PyArg_ParseTuple(item, "OO", &stack, &address)) {
+            PyErr_Clear();
+            PyErr_SetString(PyExc_TypeError, "backends must be a sequence of (stack, address)");
+            goto error;
+        }
+        if(!PyObject_TypeCheck(stack, st->stack_type)) {
+            PyErr_Format(PyExc_TypeError, "backend stack must be a Stack, not %.500s",
+                         Py_TYPE(stack)->tp_name);
+            goto error;
+        }
+        if(balancer_parse_address(address, be) < 0)
+            goto error;
+
+        /* The thread connects on the stack without the GIL, the stack
+           cannot be closed until the balancer is */
+        be->stack = stack_pin((stack_object*)stack);
+        if(!be->stack) {
+            PyErr_SetString(PyExc_ValueError, "backend stack is closed");
+            goto error;
+        }
+        be->balancer = self;
+        be->enabled = 1;
+
+        Py_INCREF(stack);
+        PyTuple_SET_ITEM(self->stacks, i, stack);
+    }
+
+    Py_DECREF(seq);
+    return 0;
+
+error:
+    Py_DECREF(seq);
+    return -1;
+}
+
+static int
+balancer_parse_policy(const char* policy)
+{
+    for(size_t i = 0; i < sizeof(balancer_policies) / sizeof(balancer_policies[0]); i++)
+        if(strcmp(policy, balancer_policies[i]) == 0)
+            return i;
+
+    PyErr_Format(PyExc_ValueError, "unknown policy '%s', expected round_robin, least_conn or hash", policy);
+    return -1;
+}
+
+PyDoc_STRVAR(balancer_close_doc, "close()\n\
+\n\
+Stop accepting connections and close the connections being balanced.\n\
+The listening socket stays open.");
+
+static PyObject*
+balancer_close(balancer_object* self, PyObject* Py_UNUSED(ignored))
+{
+    balancer_close_internal(self);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(balancer_set_backend_doc, "set_backend(index, enabled)\n\
+\n\
+Enable or disable the backend at index, a disabled backend takes no new\n\
+connections and keeps the ones it has. Enabling a backend also clears\n\
+its failures, making it available at once.");
+
+static PyObject*
+balancer_set_backend(balancer_object* self, PyObject* args)
+{
+    Py_ssize_t index;
+    int enabled;
+
+    if(!PyArg_ParseTuple(args, "np:set_backend", &index, &enabled))
+        return NULL;
+    if(index < 0 || index >= (Py_ssize_t)self->nbackends) {
+        PyErr_SetString(PyExc_IndexError, "backend index out of range");
+        return NULL;
+    }
+
+    struct balancer_backend* be = &self->backends[index];
+
+    pthread_mutex_lock(&self->lock);
+    be->enabled = enabled;
+    if(enabled)
+        be->fails = 0;
+    pthread_mutex_unlock(&self->lock);
+
+    Py_RETURN_NONE;
+}
+
+static PyObject*
+balancer_make_backend_stats(balancer_object* self, struct balancer_backend* be, uint64_t now)
+{
+    PyObject* address = make_sockaddr((struct sockaddr*)&be->addr, be->addrlen);
+    if(!address)
+        return NULL;
+
+    PyObject* dict = Py_BuildValue("{s:N,s:O,s:O,s:I,s:K,s:K,s:K,s:K}",
+        "address", address,
+        "up", balancer_available(self, be, now) ? Py_True : Py_False,
+        "enabled", be->enabled ? Py_True : Py_False,
+        "active", be->active,
+        "connections", (unsigned long long)be->connections,
+        "failures", (unsigned long long)be->failures,
+        "bytes_sent", (unsigned long long)be->bytes_sent,
+        "bytes_received", (unsigned long long)be->bytes_received);
+    return dict;
+}
+
+PyDoc_STRVAR(balancer_stats_doc, "stats() -> dict\n\
+\n\
+Return the counters of the balancer: accepted, rejected (closed without\n\
+an available backend), active and backends, a list with a dict for each\n\
+backend: address, up, enabled, active, connections, failures and the\n\
+bytes_sent and bytes_received of its finished connections.");
+
+static PyObject*
+balancer_stats(balancer_object* self, PyObject* Py_UNUSED(ignored))
+{
+    unsigned int n = self->nbackends;
+    struct balancer_backend* copy = NULL;
+    uint64_t accepted, rejected;
+    unsigned long active = 0;
+
+    /* Copy the counters, the lock is not held while building the result */
+    if(n > 0) {
+        copy = PyMem_Malloc(n * sizeof(struct balancer_backend));
+        if(!copy)
+            return PyErr_NoMemory();
+    }
+
+    pthread_mutex_lock(&self->lock);
+    if(n > 0)
+        memcpy(copy, self->backends, n * sizeof(struct balancer_backend));
+    accepted = self->accepted;
+    rejected = self->rejected;
+    pthread_mutex_unlock(&self->lock);
+
+    uint64_t now = balancer_now();
+    PyObject* list = PyList_New(n);
+    if(!list)
+        goto error;
+
+    for(unsigned int i = 0; i < n; i++) {
+        PyObject* item = balancer_make_backend_stats(self, &copy[i], now);
+        if(!item)
+            goto error;
+        PyList_SET_ITEM(list, i, item);
+        active += copy[i].active;
+    }
+
+    PyMem_Free(copy);
+    return Py_BuildValue("{s:K,s:K,s:k,s:N}",
+        "accepted", (unsigned long long)accepted,
+        "rejected", (unsigned long long)rejected,
+        "active", active,
+        "backends", list);
+
+error:
+    Py_XDECREF(list);
+    PyMem_Free(copy);
+    return NULL;
+}
+
+static PyMethodDef balancer_methods[] = {
+    {"close", (PyCFunction)balancer_close, METH_NOARGS, balancer_close_doc},
+    {"set_backend", (PyCFunction)balancer_set_backend, METH_VARARGS, balancer_set_backend_doc},
+    {"stats", (PyCFunction)balancer_stats, METH_NOARGS, balancer_stats_doc},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyObject*
+balancer_get_policy(balancer_object* self, void* Py_UNUSED(closure))
+{
+    return PyUnicode_FromString(balancer_policies[self->policy]);
+}
+
+static PyObject*
+balancer_get_closed(balancer_object* self, void* Py_UNUSED(closure))
+{
+    return PyBool_FromLong(!self->started);
+}
+
+static PyGetSetDef balancer_getsetlist[] = {
+    {"policy", (getter)balancer_get_policy, NULL, "policy choosing the backend of a connection", NULL},
+    {"closed", (getter)balancer_get_closed, NULL, "True if the balancer is not accepting connections", NULL},
+    {NULL} /* sentinel */
+};
+
+static PyMemberDef balancer_memberlist[] = {
+    {"listener", T_OBJECT_EX, offsetof(balancer_object, listener), READONLY, "the listening socket"},
+    {0},
+};
+
+static int
+balancer_initobj(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    balancer_object* b = (balancer_object*)self;
+    static char* kwnames[] = {"listener", "backends", "policy", "bufsize", "connect_timeout",
+                              "max_fails", "fail_timeout", "threads", NULL};
+    PyObject* listener;
+    PyObject* backends;
+    const char* policy = "round_robin";
+    Py_ssize_t bufsize = BALANCER_DEFAULT_BUFSIZE;
+    double connect_timeout = 5.0;
+    int max_fails = 1;
+    double fail_timeout = 10.0;
+    int threads = 1;
+
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return -1;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|sndidi:LoadBalancer", kwnames,
+                                    &listener, &backends, &policy, &bufsize, &connect_timeout,
+                                    &max_fails, &fail_timeout, &threads))
+        return -1;
+
+    if(b->backends) {
+        PyErr_SetString(PyExc_RuntimeError, "LoadBalancer already initialized");
+        return -1;
+    }
+    if(!PyObject_TypeCheck(listener, st->socket_type)) {
+        PyErr_Format(PyExc_TypeError, "listener must be a socket of a stack, not %.500s",
+                     Py_TYPE(listener)->tp_name);
+        return -1;
+    }
+    if(bufsize <= 0) {
+        PyErr_SetString(PyExc_ValueError, "bufsize must be positive");
+        return -1;
+    }
+    if(!(connect_timeout > 0 && connect_timeout <= INT_MAX / 1000)) {
+        PyErr_SetString(PyExc_ValueError, "connect_timeout out of range");
+        return -1;
+    }
+    if(!(fail_timeout >= 0 && fail_timeout <= INT_MAX / 1000)) {
+        PyErr_SetString(PyExc_ValueError, "fail_timeout out of range");
+        return -1;
+    }
+    if(max_fails < 0) {
+        PyErr_SetString(PyExc_ValueError, "max_fails must be non-negative");
+        return -1;
+    }
+    if(threads < 1) {
+        PyErr_SetString(PyExc_ValueError, "threads must be positive");
+        return -1;
+    }
+
+    int policy_id = balancer_parse_policy(policy);
+    if(policy_id < 0)
+        return -1;
+    b->policy = policy_id;
+    b->bufsize = bufsize;
+    b->connect_timeout = (int)(connect_timeout * 1000);
+    b->max_fails = max_fails;
+    b->fail_timeout = (int)(fail_timeout * 1000);
+
+    b->listen_fd = get_sock_fd((socket_object*)listener);
+    if(b->listen_fd < 0) {
+        errno = EBADF;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    /* The stack of the listener cannot be closed under the thread */
+    PyObject* listen_stack = ((socket_object*)listener)->stack;
+    if(!listen_stack || !stack_pin((stack_object*)listen_stack)) {
+        PyErr_SetString(PyExc_ValueError, "listener stack is closed");
+        return -1;
+    }
+    Py_INCREF(listen_stack);
+    b->listen_stack = listen_stack;
+
+    if(balancer_parse_backends(st, b, backends) < 0)
+        return -1;
+    if(b->policy == BALANCER_HASH && balancer_build_ring(b) < 0) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    b->pfds = malloc((2 + BALANCER_MAX_CONNECTING) * sizeof(struct pollfd));
+    b->loops = calloc(threads, sizeof(struct relay_loop*));
+    if(!b->pfds || !b->loops) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    b->nloops = threads;
+
+    b->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(b->wake_fd < 0) {
+        b->wake_fd = -1;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    for(int i = 0; i < threads; i++) {
+        b->loops[i] = relay_loop_start();
+        if(!b->loops[i]) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+    }
+
+    /* The thread polls the listener before accepting */
+    int flags = ioth_fcntl(b->listen_fd, F_GETFL, 0);
+    if(flags == -1 || ioth_fcntl(b->listen_fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    b->listen_flags = flags;
+
+    Py_INCREF(listener);
+    b->listener = listener;
+
+    int err = thread_start_nosignals(&b->thread, balancer_thread, b);
+
+    if(err) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    b->pid = getpid();
+    b->started = 1;
+
+    return 0;
+}
+
+static PyObject*
+balancer_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    PyObject* new = type->tp_alloc(type, 0);
+
+    balancer_object* b = (balancer_object*)new;
+    if(b != NULL) {
+        b->listener = NULL;
+        b->stacks = NULL;
+        b->listen_stack = NULL;
+        b->listen_fd = -1;
+        b->listen_flags = -1;
+        b->policy = BALANCER_ROUND_ROBIN;
+        b->backends = NULL;
+        b->nbackends = 0;
+        b->ring = NULL;
+        b->loops = NULL;
+        b->started = 0;
+        b->wake_fd = -1;
+        b->connecting = NULL;
+        b->pfds = NULL;
+        pthread_mutex_init(&b->lock, NULL);
+    }
+
+    return new;
+}
+
+static void
+balancer_finalize(balancer_object* self)
+{
+    PyObject *error_type, *error_value, *error_traceback;
+    /* Save the current exception, if any. */
+    PyErr_Fetch(&error_type, &error_value, &error_traceback);
+
+    /* The listener and the stacks must outlive the threads using them */
+    balancer_close_internal(self);
+    if(self->wake_fd != -1) {
+        close(self->wake_fd);
+        self->wake_fd = -1;
+    }
+    free(self->pfds);
+    self->pfds = NULL;
+    Py_CLEAR(self->listener);
+    Py_CLEAR(self->stacks);
+
+    /* Restore the saved exception. */
+    PyErr_Restore(error_type, error_value, error_traceback);
+}
+
+static void
+balancer_dealloc(balancer_object* self)
+{
+    if(PyObject_CallFinalizerFromDealloc((PyObject*)self) < 0)
+        return;
+
+    free(self->ring);
+    free(self->backends);
+    pthread_mutex_destroy(&self->lock);
+
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free(self);
+#if PY_VERSION_HEX >= 0x03080000
+    /* Instances of heap types own a reference to their type, released
+       by subtype_dealloc instead before Python 3.8 */
+    Py_DECREF(tp);
+#endif
+}
+
+static PyObject*
+balancer_repr(balancer_object* self)
+{
+    return PyUnicode_FromFormat("<load balancer object, policy=%s, backends=%u%s>",
+                                balancer_policies[self->policy], self->nbackends,
+                                self->started ? "" : ", closed");
+}
+
+PyDoc_STRVAR(balancer_doc, "LoadBalancerBase(listener, backends, policy='round_robin', bufsize=16384,\n\
+                 connect_timeout=5.0, max_fails=1, fail_timeout=10.0, threads=1)\n\
+\n\
+Load balancer of the connections of a listening socket of a stack over\n\
+backends on other stacks, see iothpy.LoadBalancer.");
+
+static PyType_Slot balancer_slots[] = {
+    {Py_tp_dealloc, balancer_dealloc},
+    {Py_tp_repr, balancer_repr},
+    {Py_tp_doc, (void*)balancer_doc},
+    {Py_tp_methods, balancer_methods},
+    {Py_tp_members, balancer_memberlist},
+    {Py_tp_getset, balancer_getsetlist},
+    {Py_tp_init, balancer_initobj},
+    {Py_tp_new, balancer_new},
+    {Py_tp_finalize, balancer_finalize},
+    {0, NULL}
+};
+
+static PyType_Spec balancer_spec = {
+    "_iothpy.LoadBalancerBase",
+    sizeof(balancer_object),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    balancer_slots
+};
+
+/* Add the load balancer type to the module */
+int
+balancer_module_init(PyObject* module)
+{
+    iothpy_state* st = iothpy_state_from_module(module);
+
+    st->balancer_type = iothpy_new_type(module, &balancer_spec);
+    if(!st->balancer_type)
+        return -1;
+
+    Py_INCREF(st->balancer_type);
+    if(PyModule_AddObject(module, "LoadBalancerBase", (PyObject*)st->balancer_type) != 0) {
+        Py_DECREF(st->balancer_type);
+        return -1;
+    }
+
+    return 0;
+}
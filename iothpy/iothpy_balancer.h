@@ -0,0 +1,106 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+#include <poll.h>
+
+/*
+    Load balancer: a thread accepting the connections of a listening
+    socket of a stack, connecting each one to a backend of a pool on the
+    stack of the backend and handing the two sockets to relay loops, see
+    iothpy_relay.h. The connections are never seen by python.
+*/
+
+/* Policies choosing the backend of a connection */
+#define BALANCER_ROUND_ROBIN    0
+#define BALANCER_LEAST_CONN     1   /* fewest active connections */
+#define BALANCER_HASH           2   /* consistent hash of the client address */
+
+/* The backends tried by a connection are kept in a 64 bits mask */
+#define BALANCER_MAX_BACKENDS   64
+
+struct ioth;
+struct relay_loop;
+struct balancer_connect;
+struct balancer_object;
+
+struct balancer_backend {
+    struct balancer_object* balancer;
+    struct ioth* stack;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    /* Fields below protected by the lock of the balancer */
+    int enabled;                    /* see set_backend() */
+
+    /* Passive health check: after max_fails connects failed in a row the
+       backend is skipped until down_until, then tried again */
+    unsigned int fails;
+    uint64_t down_until;            /* monotonic clock, milliseconds */
+
+    /* Statistics */
+    unsigned int active;            /* connections connecting or relayed */
+    uint64_t connections;
+    uint64_t failures;
+    uint64_t bytes_sent;            /* from the clients to the backend */
+    uint64_t bytes_received;        /* from the backend to the clients */
+};
+
+/* Point of a backend on the hash ring */
+struct balancer_vnode {
+    uint64_t hash;
+    unsigned int backend;
+};
+
+typedef struct balancer_object
+{
+    PyObject_HEAD
+    /* Listening socket and stacks of the backends, kept alive while running */
+    PyObject* listener;
+    PyObject* stacks;
+    PyObject* listen_stack;         /* stack of the listener, pinned while running */
+
+    int listen_fd;
+    int listen_flags;               /* restored on close */
+
+    int policy;
+    size_t bufsize;
+    int connect_timeout;            /* milliseconds */
+    unsigned int max_fails;
+    int fail_timeout;               /* milliseconds */
+
+    struct balancer_backend* backends;
+    unsigned int nbackends;
+
+    /* Sorted points of the backends, BALANCER_HASH only */
+    struct balancer_vnode* ring;
+    unsigned int nring;
+
+    /* The connections are spread over the loops in turn */
+    struct relay_loop** loops;
+    unsigned int nloops;
+    unsigned int next_loop;
+
+    /* Accepting thread, owning the connections still connecting */
+    pthread_t thread;
+    pid_t pid;                      /* the thread does not survive fork */
+    int started;
+    int wake_fd;
+    struct balancer_connect* connecting;
+    unsigned int nconnecting;
+    /* Room for the wake_fd, the listener and the connections connecting */
+    struct pollfd* pfds;
+
+    /* Protects the fields below and the backends, never held while
+       waiting for the GIL */
+    pthread_mutex_t lock;
+    int stopping;
+    unsigned int rr_next;
+    uint64_t accepted;
+    uint64_t rejected;              /* closed without an available backend */
+} balancer_object;
+
+int balancer_module_init(PyObject* module);
@@ -0,0 +1,683 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_state.h"
+#include "iothpy_dispatch.h"
+#include "iothpy_stack.h"
+#include "iothpy_socket.h"
+#include "utils.h"
+
+#include <structmember.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <sys/eventfd.h>
+
+#include <ioth.h>
+
+#define DISPATCH_DEFAULT_DEPTH 1024
+#define DISPATCH_DEFAULT_BATCH 64
+#define DISPATCH_DEFAULT_BUFSIZE 65535
+
+/* Hash of the sender of a datagram, its flow */
+static uint64_t
+dispatch_flow_hash(const struct sockaddr_storage* addr, socklen_t addrlen)
+{
+    if(addr->ss_family == AF_INET) {
+        const struct sockaddr_in* in = (const struct sockaddr_in*)addr;
+        return hash_bytes(&in->sin_addr, sizeof(in->sin_addr), in->sin_port);
+    }
+    if(addr->ss_family == AF_INET6) {
+        const struct sockaddr_in6* in6 = (const struct sockaddr_in6*)addr;
+        return hash_bytes(&in6->sin6_addr, sizeof(in6->sin6_addr), in6->sin6_port);
+    }
+    return hash_bytes(addr, addrlen, 0);
+}
+
+/* Move the datagrams read to their queues, locking each queue once */
+static void
+dispatch_deliver(dispatcher_object* d, unsigned int count)
+{
+    for(unsigned int i = 0; i < count; i++) {
+        if(!d->pending[i])
+            continue;
+
+        unsigned int target = d->pending_queue[i];
+        struct dispatch_queue* q = &d->queues[target];
+
+        pthread_mutex_lock(&q->lock);
+        int was_empty = q->count == 0;
+        for(unsigned int j = i; j < count; j++) {
+            if(!d->pending[j] || d->pending_queue[j] != target)
+                continue;
+
+            if(q->count < d->depth) {
+                q->ring[(q->head + q->count) % d->depth] = d->pending[j];
+                q->count++;
+                q->queued++;
+            } else {
+                free(d->pending[j]);
+                q->dropped++;
+            }
+            d->pending[j] = NULL;
+        }
+        if(was_empty && q->count > 0)
+            eventfd_signal(q->ready_fd);
+        pthread_mutex_unlock(&q->lock);
+    }
+}
+
+/*
+    Read up to batch datagrams without blocking. Returns their number,
+    -1 with errno set if the socket cannot be read anymore.
+*/
+static int
+dispatch_read(dispatcher_object* d)
+{
+    unsigned int count = 0;
+
+    while(count < d->batch) {
+        struct sockaddr_storage addr;
+        socklen_t addrlen = sizeof(addr);
+
+        ssize_t len = ioth_recvfrom(d->fd, d->buffer, d->bufsize, MSG_DONTWAIT,
+                                    (struct sockaddr*)&addr, &addrlen);
+        if(len < 0) {
+            if(errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR)
+                break;
+            if(errno == EBADF || errno == ENOTSOCK || errno == EINVAL)
+                return -1;
+            /* e.g. ECONNREFUSED of a previous send, the next read goes on */
+            __atomic_store_n(&d->errors, d->errors + 1, __ATOMIC_RELAXED);
+            break;
+        }
+        if(addrlen > sizeof(addr))
+            addrlen = sizeof(addr);
+
+        struct dispatch_datagram* dg = malloc(sizeof(struct dispatch_datagram) + len);
+        if(!dg) {
+            __atomic_store_n(&d->errors, d->errors + 1, __ATOMIC_RELAXED);
+            continue;
+        }
+        dg->len = len;
+        dg->addrlen = addrlen;
+        memcpy(&dg->addr, &addr, addrlen);
+        memcpy(dg->data, d->buffer, len);
+
+        d->pending[count] = dg;
+        d->pending_queue[count] = dispatch_flow_hash(&addr, addrlen) % d->nqueues;
+        count++;
+
+        __atomic_store_n(&d->received, d->received + 1, __ATOMIC_RELAXED);
+        __atomic_store_n(&d->bytes, d->bytes + len, __ATOMIC_RELAXED);
+    }
+
+    return count;
+}
+
+static void*
+dispatch_thread(void* arg)
+{
+    dispatcher_object* d = arg;
+    struct pollfd pfds[2] = {{d->fd, POLLIN, 0}, {d->wake_fd, POLLIN, 0}};
+    int error = 0;
+
+    while(!__atomic_load_n(&d->stopping, __ATOMIC_ACQUIRE)) {
+        if(poll(pfds, 2, -1) < 0) {
+            if(errno == EINTR)
+                continue;
+            error = errno;
+            break;
+        }
+        if(pfds[1].revents)
+            eventfd_drain(d->wake_fd);
+        if(!pfds[0].revents)
+            continue;
+
+        int count = dispatch_read(d);
+        if(count < 0) {
+            error = errno;
+            break;
+        }
+        dispatch_deliver(d, count);
+    }
+
+    d->error = error;
+    __atomic_store_n(&d->finished, 1, __ATOMIC_RELEASE);
+
+    /* Wake the consumers up, they return once their queue is empty */
+    for(unsigned int i = 0; i < d->nqueues; i++) {
+        pthread_mutex_lock(&d->queues[i].lock);
+        eventfd_signal(d->queues[i].ready_fd);
+        pthread_mutex_unlock(&d->queues[i].lock);
+    }
+
+    return NULL;
+}
+
+/* Take up to max datagrams of a queue, returns their number */
+static unsigned int
+dispatch_take(dispatcher_object* d, struct dispatch_queue* q, struct dispatch_datagram** out, unsigned int max)
+{
+    pthread_mutex_lock(&q->lock);
+    unsigned int count = q->count < max ? q->count : max;
+    for(unsigned int i = 0; i < count; i++) {
+        out[i] = q->ring[q->head];
+        q->head = (q->head + 1) % d->depth;
+    }
+    q->count -= count;
+    q->delivered += count;
+
+    /* The wake up of a finished thread is left for the other consumers */
+    if(count > 0 && q->count == 0 && !__atomic_load_n(&d->finished, __ATOMIC_ACQUIRE))
+        eventfd_drain(q->ready_fd);
+    pthread_mutex_unlock(&q->lock);
+
+    return count;
+}
+
+/*
+    Python interface
+*/
+
+/* Whether no more datagrams are delivered, the thread is gone in a child after fork */
+static int
+dispatch_is_finished(dispatcher_object* self)
+{
+    if(self->started && self->pid != getpid())
+        return 1;
+    return __atomic_load_n(&self->finished, __ATOMIC_ACQUIRE);
+}
+
+/* Stop the thread and drop the datagrams not consumed, the socket stays open */
+static void
+dispatch_close_internal(dispatcher_object* self)
+{
+    int started = self->started;
+
+    self->started = 0;
+    self->closed = 1;
+    Py_BEGIN_ALLOW_THREADS
+    /* In a child after fork the thread is gone */
+    if(started && self->pid == getpid()) {
+        __atomic_store_n(&self->stopping, 1, __ATOMIC_RELEASE);
+        eventfd_signal(self->wake_fd);
+        pthread_join(self->thread, NULL);
+    }
+    __atomic_store_n(&self->finished, 1, __ATOMIC_RELEASE);
+
+    for(unsigned int i = 0; i < self->nqueues; i++) {
+        struct dispatch_queue* q = &self->queues[i];
+
+        pthread_mutex_lock(&q->lock);
+        while(q->count > 0) {
+            free(q->ring[q->head]);
+            q->head = (q->head + 1) % self->depth;
+            q->count--;
+        }
+        if(q->ready_fd != -1)
+            eventfd_signal(q->ready_fd);
+        pthread_mutex_unlock(&q->lock);
+    }
+    Py_END_ALLOW_THREADS
+}
+
+/* Return the queue of index, NULL with IndexError set if out of range */
+static struct dispatch_queue*
+dispatch_get_queue(dispatcher_object* self, int index)
+{
+    if(index < 0 || (unsigned int)index >= self->nqueues) {
+        PyErr_SetString(PyExc_IndexError, "queue index out of range");
+        return NULL;
+    }
+    return &self->queues[index];
+}
+
+PyDoc_STRVAR(dispatch_recv_batch_doc, "recv_batch(queue, maxcount=0, timeout=None) -> list\n\
+\n\
+Return a list of up to maxcount (0 for no limit) (data, address) tuples\n\
+taken from the queue at index queue, in the order they were received.\n\
+Waits up to timeout seconds (None for no limit) for the first one. An\n\
+empty list is returned on timeout and once the dispatcher is closed and\n\
+the queue is empty. Raises the error that stopped the dispatcher, if any,\n\
+once the queue is empty.");
+
+static PyObject*
+dispatch_recv_batch(dispatcher_object* self, PyObject* args, PyObject* kwargs)
+{
+    static char* kwnames[] = {"queue", "maxcount", "timeout", NULL};
+    int index;
+    int maxcount = 0;
+    PyObject* timeout_obj = Py_None;
+    _PyTime_t timeout;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "i|iO:recv_batch", kwnames,
+                                    &index, &maxcount, &timeout_obj))
+        return NULL;
+    if(socket_parse_timeout(&timeout, timeout_obj) < 0)
+        return NULL;
+
+    struct dispatch_queue* q = dispatch_get_queue(self, index);
+    if(!q)
+        return NULL;
+
+    unsigned int max = self->depth;
+    if(maxcount > 0 && (unsigned int)maxcount < max)
+        max = maxcount;
+
+    struct dispatch_datagram** taken = PyMem_Malloc(max * sizeof(struct dispatch_datagram*));
+    if(!taken)
+        return PyErr_NoMemory();
+
+    PyObject* list = NULL;
+    unsigned int count = 0;
+    _PyTime_t deadline = _PyTime_GetMonotonicClock() + timeout;
+
+    while(1) {
+        /* Read finished first, the datagrams delivered before it are taken */
+        int finished = dispatch_is_finished(self);
+        count = dispatch_take(self, q, taken, max);
+        if(count > 0 || finished || timeout == 0)
+            break;
+
+        int ms = -1;
+        if(timeout > 0) {
+            _PyTime_t interval = deadline - _PyTime_GetMonotonicClock();
+            if(interval < 0)
+                break;
+            ms = (int)_PyTime_AsMilliseconds(interval, _PyTime_ROUND_CEILING);
+        }
+
+        struct pollfd pfd = {q->ready_fd, POLLIN, 0};
+        int res;
+
+        Py_BEGIN_ALLOW_THREADS
+        res = poll(&pfd, 1, ms);
+        Py_END_ALLOW_THREADS
+
+        if(res < 0) {
+            if(errno != EINTR) {
+                PyErr_SetFromErrno(PyExc_OSError);
+                goto finally;
+            }
+            if(PyErr_CheckSignals())
+                goto finally;
+        }
+        if(res == 0)
+            break;
+    }
+
+    if(count == 0 && !self->closed && dispatch_is_finished(self) && self->error) {
+        errno = self->error;
+        PyErr_SetFromErrno(PyExc_OSError);
+        goto finally;
+    }
+
+    list = PyList_New(count);
+    if(!list)
+        goto finally;
+
+    for(unsigned int i = 0; i < count; i++) {
+        struct dispatch_datagram* dg = taken[i];
+        PyObject* item = NULL;
+        PyObject* data = PyBytes_FromStringAndSize(dg->data, dg->len);
+        PyObject* addr = data ? make_sockaddr((struct sockaddr*)&dg->addr, dg->addrlen) : NULL;
+
+        if(data && addr)
+            item = PyTuple_Pack(2, data, addr);
+        Py_XDECREF(data);
+        Py_XDECREF(addr);
+        if(!item) {
+            Py_CLEAR(list);
+            goto finally;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+
+finally:
+    for(unsigned int i = 0; i < count; i++)
+        free(taken[i]);
+    PyMem_Free(taken);
+    return list;
+}
+
+PyDoc_STRVAR(dispatch_fileno_doc, "fileno(queue) -> int\n\
+\n\
+Return a file descriptor readable while the queue at index queue has\n\
+datagrams, and once the dispatcher stopped.");
+
+static PyObject*
+dispatch_fileno(dispatcher_object* self, PyObject* args)
+{
+    int index;
+
+    if(!PyArg_ParseTuple(args, "i:fileno", &index))
+        return NULL;
+
+    struct dispatch_queue* q = dispatch_get_queue(self, index);
+    if(!q)
+        return NULL;
+    return PyLong_FromLong(q->ready_fd);
+}
+
+PyDoc_STRVAR(dispatch_stats_doc, "stats() -> dict\n\
+\n\
+Return the counters of the dispatcher: received, bytes, errors (failed\n\
+reads skipped) and queues, a list with a dict for each queue: pending,\n\
+queued, dropped (received while full) and delivered.");
+
+static PyObject*
+dispatch_stats(dispatcher_object* self, PyObject* Py_UNUSED(ignored))
+{
+    PyObject* list = PyList_New(self->nqueues);
+    if(!list)
+        return NULL;
+
+    for(unsigned int i = 0; i < self->nqueues; i++) {
+        struct dispatch_queue* q = &self->queues[i];
+
+        pthread_mutex_lock(&q->lock);
+        unsigned int pending = q->count;
+        unsigned long long queued = q->queued;
+        unsigned long long dropped = q->dropped;
+        unsigned long long delivered = q->delivered;
+        pthread_mutex_unlock(&q->lock);
+
+        PyObject* item = Py_BuildValue("{s:I,s:K,s:K,s:K}",
+            "pending", pending,
+            "queued", queued,
+            "dropped", dropped,
+            "delivered", delivered);
+        if(!item) {
+            Py_DECREF(list);
+            return NULL;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+
+    return Py_BuildValue("{s:K,s:K,s:K,s:N}",
+        "received", (unsigned long long)__atomic_load_n(&self->received, __ATOMIC_RELAXED),
+        "bytes", (unsigned long long)__atomic_load_n(&self->bytes, __ATOMIC_RELAXED),
+        "errors", (unsigned long long)__atomic_load_n(&self->errors, __ATOMIC_RELAXED),
+        "queues", list);
+}
+
+PyDoc_STRVAR(dispatch_close_doc, "close()\n\
+\n\
+Stop reading the socket and drop the datagrams not consumed yet. The\n\
+socket stays open.");
+
+static PyObject*
+dispatch_close(dispatcher_object* self, PyObject* Py_UNUSED(ignored))
+{
+    dispatch_close_internal(self);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef dispatch_methods[] = {
+    {"recv_batch", (PyCFunction)dispatch_recv_batch, METH_VARARGS | METH_KEYWORDS, dispatch_recv_batch_doc},
+    {"fileno", (PyCFunction)dispatch_fileno, METH_VARARGS, dispatch_fileno_doc},
+    {"stats", (PyCFunction)dispatch_stats, METH_NOARGS, dispatch_stats_doc},
+    {"close", (PyCFunction)dispatch_close, METH_NOARGS, dispatch_close_doc},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyObject*
+dispatch_get_nqueues(dispatcher_object* self, void* Py_UNUSED(closure))
+{
+    return PyLong_FromUnsignedLong(self->nqueues);
+}
+
+static PyObject*
+dispatch_get_closed(dispatcher_object* self, void* Py_UNUSED(closure))
+{
+    return PyBool_FromLong(self->closed);
+}
+
+static PyGetSetDef dispatch_getsetlist[] = {
+    {"nqueues", (getter)dispatch_get_nqueues, NULL, "number of queues", NULL},
+    {"closed", (getter)dispatch_get_closed, NULL, "True if the dispatcher was closed", NULL},
+    {NULL} /* sentinel */
+};
+
+static PyMemberDef dispatch_memberlist[] = {
+    {"sock", T_OBJECT_EX, offsetof(dispatcher_object, sock), READONLY, "the socket read by the dispatcher"},
+    {0},
+};
+
+static int
+dispatch_initobj(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    dispatcher_object* d = (dispatcher_object*)self;
+    static char* kwnames[] = {"sock", "queues", "depth", "batch", "bufsize", NULL};
+    PyObject* sock;
+    int nqueues;
+    int depth = DISPATCH_DEFAULT_DEPTH;
+    int batch = DISPATCH_DEFAULT_BATCH;
+    Py_ssize_t bufsize = DISPATCH_DEFAULT_BUFSIZE;
+
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return -1;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "Oi|iin:Dispatcher", kwnames,
+                                    &sock, &nqueues, &depth, &batch, &bufsize))
+        return -1;
+
+    if(d->queues) {
+        PyErr_SetString(PyExc_RuntimeError, "Dispatcher already initialized");
+        return -1;
+    }
+    if(!PyObject_TypeCheck(sock, st->socket_type)) {
+        PyErr_Format(PyExc_TypeError, "sock must be a socket of a stack, not %.500s",
+                     Py_TYPE(sock)->tp_name);
+        return -1;
+    }
+    if(nqueues < 1 || depth < 1 || batch < 1 || bufsize < 1) {
+        PyErr_SetString(PyExc_ValueError, "queues, depth, batch and bufsize must be positive");
+        return -1;
+    }
+
+    d->fd = get_sock_fd((socket_object*)sock);
+    if(d->fd < 0) {
+        errno = EBADF;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    d->queues = calloc(nqueues, sizeof(struct dispatch_queue));
+    if(!d->queues) {
+        PyErr_NoMemory();
+        return -1;
+    }
+    d->depth = depth;
+    for(int i = 0; i < nqueues; i++, d->nqueues++) {
+        struct dispatch_queue* q = &d->queues[i];
+
+        q->ready_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(q->ready_fd < 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            return -1;
+        }
+        q->ring = malloc(depth * sizeof(struct dispatch_datagram*));
+        if(!q->ring) {
+            close(q->ready_fd);
+            PyErr_NoMemory();
+            return -1;
+        }
+        pthread_mutex_init(&q->lock, NULL);
+    }
+
+    d->batch = batch;
+    d->bufsize = bufsize;
+    d->pending = malloc(batch * sizeof(struct dispatch_datagram*));
+    d->pending_queue = malloc(batch * sizeof(unsigned int));
+    d->buffer = malloc(bufsize);
+    if(!d->pending || !d->pending_queue || !d->buffer) {
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    d->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(d->wake_fd < 0) {
+        d->wake_fd = -1;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    Py_INCREF(sock);
+    d->sock = sock;
+
+    int err = thread_start_nosignals(&d->thread, dispatch_thread, d);
+
+    if(err) {
+        errno = err;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    d->pid = getpid();
+    d->started = 1;
+
+    return 0;
+}
+
+static PyObject*
+dispatch_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    PyObject* new = type->tp_alloc(type, 0);
+
+    dispatcher_object* d = (dispatcher_object*)new;
+    if(d != NULL) {
+        d->sock = NULL;
+        d->fd = -1;
+        d->queues = NULL;
+        d->nqueues = 0;
+        d->pending = NULL;
+        d->pending_queue = NULL;
+        d->buffer = NULL;
+        d->started = 0;
+        d->closed = 0;
+        d->wake_fd = -1;
+    }
+
+    return new;
+}
+
+static void
+dispatch_finalize(dispatcher_object* self)
+{
+    PyObject *error_type, *error_value, *error_traceback;
+    /* Save the current exception, if any. */
+    PyErr_Fetch(&error_type, &error_value, &error_traceback);
+
+    /* The socket must outlive the thread reading it */
+    dispatch_close_internal(self);
+    Py_CLEAR(self->sock);
+
+    /* Restore the saved exception. */
+    PyErr_Restore(error_type, error_value, error_traceback);
+}
+
+static void
+dispatch_dealloc(dispatcher_object* self)
+{
+    if(PyObject_CallFinalizerFromDealloc((PyObject*)self) < 0)
+        return;
+
+    for(unsigned int i = 0; i < self->nqueues; i++) {
+        struct dispatch_queue* q = &self->queues[i];
+        pthread_mutex_destroy(&q->lock);
+        close(q->ready_fd);
+        free(q->ring);
+    }
+    free(self->queues);
+    free(self->pending);
+    free(self->pending_queue);
+    free(self->buffer);
+    if(self->wake_fd != -1)
+        close(self->wake_fd);
+
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free(self);
+#if PY_VERSION_HEX >= 0x03080000
+    /* Instances of heap types own a reference to their type, released
+       by subtype_dealloc instead before Python 3.8 */
+    Py_DECREF(tp);
+#endif
+}
+
+static PyObject*
+dispatch_repr(dispatcher_object* self)
+{
+    return PyUnicode_FromFormat("<dispatcher object, queues=%u, received=%llu%s>",
+                                self->nqueues,
+                                (unsigned long long)__atomic_load_n(&self->received, __ATOMIC_RELAXED),
+                                self->closed ? ", closed" : "");
+}
+
+PyDoc_STRVAR(dispatch_doc, "DispatcherBase(sock, queues, depth=1024, batch=64, bufsize=65535)\n\
+\n\
+Dispatcher of the datagrams of a socket of a stack to queues chosen by\n\
+the sender address, see iothpy.Dispatcher.");
+
+static PyType_Slot dispatch_slots[] = {
+    {Py_tp_dealloc, dispatch_dealloc},
+    {Py_tp_repr, dispatch_repr},
+    {Py_tp_doc, (void*)dispatch_doc},
+    {Py_tp_methods, dispatch_methods},
+    {Py_tp_members, dispatch_memberlist},
+    {Py_tp_getset, dispatch_getsetlist},
+    {Py_tp_init, dispatch_initobj},
+    {Py_tp_new, dispatch_new},
+    {Py_tp_finalize, dispatch_finalize},
+    {0, NULL}
+};
+
+static PyType_Spec dispatch_spec = {
+    "_iothpy.DispatcherBase",
+    sizeof(dispatcher_object),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    dispatch_slots
+};
+
+/* Add the dispatcher type to the module */
+int
+dispatch_module_init(PyObject* module)
+{
+    iothpy_state* st = iothpy_state_from_module(module);
+
+    st->dispatcher_type = iothpy_new_type(module, &dispatch_spec);
+    if(!st->dispatcher_type)
+        return -1;
+
+    Py_INCREF(st->dispatcher_type);
+    if(PyModule_AddObject(module, "DispatcherBase", (PyObject*)st->dispatcher_type) != 0) {
+        Py_DECREF(st->dispatcher_type);
+        return -1;
+    }
+
+    return 0;
+}
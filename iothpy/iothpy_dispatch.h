@@ -0,0 +1,84 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+    Dispatcher: a thread reading the datagrams of a socket in batches and
+    spreading them over bounded queues by a hash of the sender address,
+    so that the datagrams of a sender stay in order in the same queue.
+    Each queue is meant to be consumed by a worker of its own.
+*/
+
+/* Datagram read by the thread, handed over to the consumer */
+struct dispatch_datagram {
+    size_t len;
+    socklen_t addrlen;
+    struct sockaddr_storage addr;
+    char data[];
+};
+
+struct dispatch_queue {
+    /* Protects all the fields below */
+    pthread_mutex_t lock;
+
+    /* Ring of depth datagrams, head and count wrap around */
+    struct dispatch_datagram** ring;
+    unsigned int head;
+    unsigned int count;
+
+    /* Eventfd readable while the queue is not empty and once the thread
+       finished, see fileno() */
+    int ready_fd;
+
+    /* Statistics */
+    uint64_t queued;
+    uint64_t dropped;               /* datagrams read while the queue was full */
+    uint64_t delivered;
+};
+
+typedef struct dispatcher_object
+{
+    PyObject_HEAD
+    /* Socket read by the thread, kept alive while running */
+    PyObject* sock;
+    int fd;
+
+    struct dispatch_queue* queues;
+    unsigned int nqueues;
+    unsigned int depth;
+
+    /* Datagrams read in a row before delivering them, and the room for
+       them and their queues, owned by the thread */
+    unsigned int batch;
+    struct dispatch_datagram** pending;
+    unsigned int* pending_queue;
+
+    /* Buffer of the reads, datagrams longer than bufsize are truncated */
+    size_t bufsize;
+    char* buffer;
+
+    pthread_t thread;
+    pid_t pid;                      /* the thread does not survive fork */
+    int started;
+    int closed;
+
+    /* Eventfd waking the thread up from poll on stop */
+    int wake_fd;
+    int stopping;
+
+    /* Set once the thread exited, on error if error is set, then the
+       ready_fd of each queue is signaled */
+    int finished;
+    int error;
+
+    /* Statistics, written by the thread only */
+    uint64_t received;
+    uint64_t bytes;
+    uint64_t errors;                /* failed reads skipped */
+} dispatcher_object;
+
+int dispatch_module_init(PyObject* module);
@@ -0,0 +1,1537 @@
+/* 
+ * This file is part of the iothpy library: python support for ioth.
+ * 
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_state.h"
+#include "iothpy_engine.h"
+#include "iothpy_stack.h"
+#include "iothpy_socket.h"
+#include "utils.h"
+
+#include <structmember.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <linux/io_uring.h>
+
+#include <ioth.h>
+
+/* io_uring needs recv, send and accept (kernel headers 5.7 or later) */
+#if defined(__NR_io_uring_setup) && defined(IORING_FEAT_FAST_POLL)
+#define ENGINE_HAVE_IO_URING 1
+#endif
+
+/* Number of submission entries and threads used when not given */
+#define ENGINE_DEFAULT_ENTRIES 256
+#define ENGINE_DEFAULT_THREADS 4
+#define ENGINE_MAX_ENTRIES 32768
+
+/* Rounds of 10ms waited by close for the kernel to give back the operations */
+#define ENGINE_CLOSE_ROUNDS 100
+
+enum engine_op_type {
+    ENGINE_OP_RECV,
+    ENGINE_OP_SEND,
+    ENGINE_OP_ACCEPT,
+};
+
+static const char* const engine_op_names[] = {"recv", "send", "accept"};
+
+/* State of an operation of the io_uring backend */
+enum engine_op_state {
+    ENGINE_OP_RUNNING,      /* the operation itself is in the ring */
+    ENGINE_OP_POLLING,      /* waiting for the non blocking fd to be ready */
+};
+
+struct engine_op {
+    uint64_t id;
+    enum engine_op_type type;
+    enum engine_op_state state;
+    int fd;
+    int flags;
+
+    /* Socket of the operation, the engine holds a reference until reaped */
+    PyObject* socket;
+    /* recv: the bytes object the data is received into */
+    PyObject* data;
+    /* send: the buffer of the data, released when reaped */
+    Py_buffer view;
+    char* buf;
+    size_t len;
+
+    /* accept: address of the peer */
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+
+    /* Number of bytes, accepted fd or -errno */
+    ssize_t result;
+
+    /* Links in the done, queue or active list */
+    struct engine_op* next;
+    struct engine_op* prev;
+};
+
+static PyStructSequence_Field completion_fields[] = {
+    {"id", "id returned by the submit call"},
+    {"op", "recv, send or accept"},
+    {"socket", "socket of the operation"},
+    {"result", "bytes received, number of bytes sent or (socket, address) accepted, None on error"},
+    {"error", "OSError of the failed operation, None on success"},
+    {NULL}
+};
+
+PyDoc_STRVAR(completion_doc,
+"Completion: result entry of Engine.reap\n\
+\n\
+A 5-tuple (id, op, socket, result, error) with named fields.");
+
+static PyStructSequence_Desc completion_desc = {
+    "iothpy.Completion",
+    completion_doc,
+    completion_fields,
+    5
+};
+
+/* Create an operation on the socket, raises OSError if the socket is closed */
+static struct engine_op*
+engine_op_new(enum engine_op_type type, socket_object* s, int flags)
+{
+    int fd = get_sock_fd(s);
+    if(fd == -1) {
+        errno = EBADF;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+    struct engine_op* op = calloc(1, sizeof(*op));
+    if(!op) {
+        PyErr_NoMemory();
+        return NULL;
+    }
+
+    op->type = type;
+    op->state = ENGINE_OP_RUNNING;
+    op->fd = fd;
+    op->flags = flags;
+    Py_INCREF(s);
+    op->socket = (PyObject*)s;
+    return op;
+}
+
+static void
+engine_op_free(struct engine_op* op)
+{
+    Py_XDECREF(op->socket);
+    Py_XDECREF(op->data);
+    if(op->view.obj)
+        PyBuffer_Release(&op->view);
+    free(op);
+}
+
+/* Free a list of operations linked by next */
+static void
+engine_op_free_list(struct engine_op* op)
+{
+    while(op) {
+        struct engine_op* next = op->next;
+        engine_op_free(op);
+        op = next;
+    }
+}
+
+/* Append a completed operation to the done list, the lock must be held */
+static void
+engine_done_push(engine_object* self, struct engine_op* op)
+{
+    op->next = NULL;
+    op->prev = NULL;
+    if(self->done_tail)
+        self->done_tail->next = op;
+    else
+        self->done_head = op;
+    self->done_tail = op;
+    self->done_count++;
+}
+
+/* Detach the done list, the lock must be held */
+static struct engine_op*
+engine_done_take(engine_object* self, unsigned int* count)
+{
+    struct engine_op* ops = self->done_head;
+
+    *count = self->done_count;
+    self->done_head = self->done_tail = NULL;
+    self->done_count = 0;
+    return ops;
+}
+
+#ifdef ENGINE_HAVE_IO_URING
+
+/*
+    io_uring backend, used through the raw system calls. All the accesses
+    to the rings are done with the engine lock held, so the engine is the
+    only producer of the submission ring and the only consumer of the
+    completion ring.
+*/
+
+static int
+sys_io_uring_setup(unsigned int entries, struct io_uring_params* p)
+{
+    return (int)syscall(__NR_io_uring_setup, entries, p);
+}
+
+static int
+sys_io_uring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags)
+{
+    return (int)syscall(__NR_io_uring_enter, fd, to_submit, min_complete, flags, NULL, 0);
+}
+
+static int
+sys_io_uring_register(int fd, unsigned int opcode, void* arg, unsigned int nr_args)
+{
+    return (int)syscall(__NR_io_uring_register, fd, opcode, arg, nr_args);
+}
+
+/* Check that the kernel supports all the operations used by the engine */
+static int
+ring_probe(int fd)
+{
+    static const int needed[] = {
+        IORING_OP_RECV, IORING_OP_SEND, IORING_OP_ACCEPT,
+        IORING_OP_POLL_ADD, IORING_OP_ASYNC_CANCEL,
+    };
+    size_t size = sizeof(struct io_uring_probe) + 256 * sizeof(struct io_uring_probe_op);
+    struct io_uring_probe* probe = calloc(1, size);
+    if(!probe)
+        return -1;
+
+    int res = sys_io_uring_register(fd, IORING_REGISTER_PROBE, probe, 256);
+    for(size_t i = 0; res == 0 && i < sizeof(needed) / sizeof(needed[0]); i++) {
+        if(needed[i] > probe->last_op || !(probe->ops[needed[i]].flags & IO_URING_OP_SUPPORTED)) {
+            errno = EOPNOTSUPP;
+            res = -1;
+        }
+    }
+
+    free(probe);
+    return res;
+}
+
+static void
+ring_fini(struct engine_ring* ring)
+{
+    if(ring->sqes)
+        munmap(ring->sqes, ring->sqes_size);
+    if(ring->cq_ptr && ring->cq_ptr != ring->sq_ptr)
+        munmap(ring->cq_ptr, ring->cq_size);
+    if(ring->sq_ptr)
+        munmap(ring->sq_ptr, ring->sq_size);
+    if(ring->fd != -1)
+        close(ring->fd);
+
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = -1;
+}
+
+/* Create the ring and map it, returns -1 with errno set on error */
+static int
+ring_init(struct engine_ring* ring, unsigned int entries, int event_fd)
+{
+    struct io_uring_params p;
+    int err;
+
+    memset(&p, 0, sizeof(p));
+    memset(ring, 0, sizeof(*ring));
+    ring->fd = sys_io_uring_setup(entries, &p);
+    if(ring->fd < 0) {
+        ring->fd = -1;
+        return -1;
+    }
+
+    /* Without NODROP completions could be lost when the ring overflows */
+    if(!(p.features & IORING_FEAT_NODROP)) {
+        errno = EOPNOTSUPP;
+        goto error;
+    }
+    if(ring_probe(ring->fd) < 0)
+        goto error;
+
+    ring->entries = p.sq_entries;
+    ring->sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+    ring->cq_size = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        if(ring->cq_size > ring->sq_size)
+            ring->sq_size = ring->cq_size;
+        ring->cq_size = ring->sq_size;
+    }
+
+    ring->sq_ptr = mmap(NULL, ring->sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                        ring->fd, IORING_OFF_SQ_RING);
+    if(ring->sq_ptr == MAP_FAILED) {
+        ring->sq_ptr = NULL;
+        goto error;
+    }
+
+    if(p.features & IORING_FEAT_SINGLE_MMAP) {
+        ring->cq_ptr = ring->sq_ptr;
+    } else {
+        ring->cq_ptr = mmap(NULL, ring->cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                            ring->fd, IORING_OFF_CQ_RING);
+        if(ring->cq_ptr == MAP_FAILED) {
+            ring->cq_ptr = NULL;
+            goto error;
+        }
+    }
+
+    ring->sqes_size = p.sq_entries * sizeof(struct io_uring_sqe);
+    ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                      ring->fd, IORING_OFF_SQES);
+    if(ring->sqes == MAP_FAILED) {
+        ring->sqes = NULL;
+        goto error;
+    }
+
+    char* sq = ring->sq_ptr;
+    ring->sq_head = (unsigned int*)(sq + p.sq_off.head);
+    ring->sq_tail = (unsigned int*)(sq + p.sq_off.tail);
+    ring->sq_array = (unsigned int*)(sq + p.sq_off.array);
+    ring->sq_mask = *(unsigned int*)(sq + p.sq_off.ring_mask);
+
+    char* cq = ring->cq_ptr;
+    ring->cq_head = (unsigned int*)(cq + p.cq_off.head);
+    ring->cq_tail = (unsigned int*)(cq + p.cq_off.tail);
+    ring->cqes = (struct io_uring_cqe*)(cq + p.cq_off.cqes);
+    ring->cq_mask = *(unsigned int*)(cq + p.cq_off.ring_mask);
+
+    /* The eventfd is signaled by the kernel on every completion */
+    if(sys_io_uring_register(ring->fd, IORING_REGISTER_EVENTFD, &event_fd, 1) < 0)
+        goto error;
+
+    return 0;
+
+error:
+    err = errno;
+    ring_fini(ring);
+    errno = err;
+    return -1;
+}
+
+/* Pass the queued entries to the kernel, returns -1 with errno set on error */
+static int
+ring_flush(struct engine_ring* ring)
+{
+    while(ring->sq_pending > 0) {
+        int n = sys_io_uring_enter(ring->fd, ring->sq_pending, 0, 0);
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            return -1;
+        }
+        ring->sq_pending -= n;
+    }
+    return 0;
+}
+
+/*
+    Return a cleared submission entry, flushing the ring if it is full.
+    The entry is passed to the kernel by ring_advance.
+*/
+static struct io_uring_sqe*
+ring_get_sqe(struct engine_ring* ring)
+{
+    unsigned int tail = *ring->sq_tail;
+    unsigned int head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+
+    if(tail - head >= ring->entries) {
+        if(ring_flush(ring) < 0)
+            return NULL;
+        head = __atomic_load_n(ring->sq_head, __ATOMIC_ACQUIRE);
+        if(tail - head >= ring->entries) {
+            errno = EBUSY;
+            return NULL;
+        }
+    }
+
+    struct io_uring_sqe* sqe = &ring->sqes[tail & ring->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+static void
+ring_advance(struct engine_ring* ring)
+{
+    unsigned int tail = *ring->sq_tail;
+
+    ring->sq_array[tail & ring->sq_mask] = tail & ring->sq_mask;
+    __atomic_store_n(ring->sq_tail, tail + 1, __ATOMIC_RELEASE);
+    ring->sq_pending++;
+}
+
+/* Queue the operation itself */
+static int
+ring_queue_op(struct engine_ring* ring, struct engine_op* op)
+{
+    struct io_uring_sqe* sqe = ring_get_sqe(ring);
+    if(!sqe)
+        return -1;
+
+    sqe->fd = op->fd;
+    sqe->user_data = (uintptr_t)op;
+    switch(op->type) {
+        case ENGINE_OP_RECV:
+            sqe->opcode = IORING_OP_RECV;
+            sqe->addr = (uintptr_t)op->buf;
+            sqe->len = op->len;
+            sqe->msg_flags = op->flags;
+            break;
+        case ENGINE_OP_SEND:
+            sqe->opcode = IORING_OP_SEND;
+            sqe->addr = (uintptr_t)op->buf;
+            sqe->len = op->len;
+            sqe->msg_flags = op->flags;
+            break;
+        case ENGINE_OP_ACCEPT:
+            op->addrlen = sizeof(op->addr);
+            sqe->opcode = IORING_OP_ACCEPT;
+            sqe->addr = (uintptr_t)&op->addr;
+            sqe->addr2 = (uintptr_t)&op->addrlen;
+            break;
+    }
+
+    op->state = ENGINE_OP_RUNNING;
+    ring_advance(ring);
+    return 0;
+}
+
+/*
+    Queue a poll for the fd of the operation. The kernel fails the
+    operations on non blocking fds (sockets with a timeout) with EAGAIN
+    instead of waiting, they are retried when the fd is ready.
+*/
+static int
+ring_queue_poll(struct engine_ring* ring, struct engine_op* op)
+{
+    struct io_uring_sqe* sqe = ring_get_sqe(ring);
+    if(!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_POLL_ADD;
+    sqe->fd = op->fd;
+    sqe->poll_events = op->type == ENGINE_OP_SEND ? POLLOUT : POLLIN;
+    sqe->user_data = (uintptr_t)op;
+
+    op->state = ENGINE_OP_POLLING;
+    ring_advance(ring);
+    return 0;
+}
+
+/* Queue the cancellation of an operation, its completion is ignored */
+static int
+ring_queue_cancel(struct engine_ring* ring, struct engine_op* op)
+{
+    struct io_uring_sqe* sqe = ring_get_sqe(ring);
+    if(!sqe)
+        return -1;
+
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->fd = -1;
+    sqe->addr = (uintptr_t)op;
+    sqe->user_data = 0;
+
+    ring_advance(ring);
+    return 0;
+}
+
+/* Add the operation to the list of the ones owned by the kernel */
+static void
+engine_active_link(engine_object* self, struct engine_op* op)
+{
+    op->prev = NULL;
+    op->next = self->active;
+    if(self->active)
+        self->active->prev = op;
+    self->active = op;
+}
+
+static void
+engine_active_unlink(engine_object* self, struct engine_op* op)
+{
+    if(op->prev)
+        op->prev->next = op->next;
+    else
+        self->active = op->next;
+    if(op->next)
+        op->next->prev = op->prev;
+}
+
+static void
+engine_active_complete(engine_object* self, struct engine_op* op, ssize_t result)
+{
+    op->result = result;
+    engine_active_unlink(self, op);
+    engine_done_push(self, op);
+}
+
+/* Move the completed operations to the done list, the lock must be held */
+static void
+ring_harvest(engine_object* self)
+{
+    struct engine_ring* ring = &self->ring;
+    unsigned int head = *ring->cq_head;
+    unsigned int tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+
+    while(head != tail) {
+        struct io_uring_cqe* cqe = &ring->cqes[head & ring->cq_mask];
+        struct engine_op* op = (struct engine_op*)(uintptr_t)cqe->user_data;
+        int res = cqe->res;
+
+        /* Release the entry before queueing retries, which may flush the ring */
+        __atomic_store_n(ring->cq_head, ++head, __ATOMIC_RELEASE);
+
+        if(!op)
+            continue;
+
+        if(op->state == ENGINE_OP_POLLING) {
+            if(res < 0 || self->closed)
+                engine_active_complete(self, op, res < 0 ? res : -ECANCELED);
+            else if(ring_queue_op(ring, op) < 0)
+                engine_active_complete(self, op, -errno);
+        } else if(res == -EAGAIN && !self->closed) {
+            if(ring_queue_poll(ring, op) < 0)
+                engine_active_complete(self, op, -EAGAIN);
+        } else {
+            engine_active_complete(self, op, res);
+        }
+
+        tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    }
+}
+
+#endif /* ENGINE_HAVE_IO_URING */
+
+/*
+    Thread backend: each thread runs the operations of its sockets with the
+    non blocking calls of the stack and waits in a single poll for all the
+    sockets not ready. The threads never take the GIL.
+*/
+
+/*
+    Accept without blocking: ioth_accept has no flags, so a blocking listener
+    is made non blocking for the call. Otherwise, with several accepts on the
+    same listener, the ones woken up by a connection taken by another would
+    block the thread. The accepted socket is left blocking as the listener.
+*/
+static ssize_t
+engine_accept_nonblock(struct engine_op* op)
+{
+    int flags = ioth_fcntl(op->fd, F_GETFL, 0);
+    if(flags == -1)
+        return -1;
+
+    int blocking = !(flags & O_NONBLOCK);
+    if(blocking && ioth_fcntl(op->fd, F_SETFL, flags | O_NONBLOCK) == -1)
+        return -1;
+
+    op->addrlen = sizeof(op->addr);
+    int fd = ioth_accept(op->fd, (struct sockaddr*)&op->addr, &op->addrlen);
+
+    if(blocking) {
+        int saved_errno = errno;
+        ioth_fcntl(op->fd, F_SETFL, flags);
+        if(fd >= 0) {
+            int fd_flags = ioth_fcntl(fd, F_GETFL, 0);
+            if(fd_flags != -1 && (fd_flags & O_NONBLOCK))
+                ioth_fcntl(fd, F_SETFL, fd_flags & ~O_NONBLOCK);
+        }
+        errno = saved_errno;
+    }
+    return fd;
+}
+
+/* Try the operation, returns 0 if it would block, 1 if done */
+static int
+engine_try_op(struct engine_op* op)
+{
+    for(;;) {
+        ssize_t res = 0;
+        switch(op->type) {
+            case ENGINE_OP_RECV:
+                res = ioth_recv(op->fd, op->buf, op->len, op->flags | MSG_DONTWAIT);
+                break;
+            case ENGINE_OP_SEND:
+                res = ioth_send(op->fd, op->buf, op->len, op->flags | MSG_DONTWAIT);
+                break;
+            case ENGINE_OP_ACCEPT:
+                res = engine_accept_nonblock(op);
+                break;
+        }
+
+        if(res >= 0) {
+            op->result = res;
+            return 1;
+        }
+        if(errno == EINTR)
+            continue;
+        if(errno == EAGAIN || errno == EWOULDBLOCK)
+            return 0;
+
+        op->result = -errno;
+        return 1;
+    }
+}
+
+/* Complete the operations of the list, the lock must be held */
+static void
+engine_done_push_list(engine_object* self, struct engine_op* ops, ssize_t result)
+{
+    while(ops) {
+        struct engine_op* next = ops->next;
+        if(result)
+            ops->result = result;
+        engine_done_push(self, ops);
+        ops = next;
+    }
+}
+
+static void*
+engine_thread(void* arg)
+{
+    struct engine_worker* w = arg;
+    engine_object* self = w->engine;
+    /* Operations taken by the thread and waiting for their socket */
+    struct engine_op* pending = NULL;
+    struct pollfd* pfds = w->pfds;
+
+    pthread_mutex_lock(&self->lock);
+    while(!self->stopping) {
+        /* New operations are tried right away */
+        struct engine_op** tailp = &pending;
+        while(*tailp)
+            tailp = &(*tailp)->next;
+        for(struct engine_op* op = w->incoming_head; op; op = op->next)
+            op->state = ENGINE_OP_RUNNING;
+        *tailp = w->incoming_head;
+        w->incoming_head = w->incoming_tail = NULL;
+        pthread_mutex_unlock(&self->lock);
+
+        /* Each completion is reported as soon as its operation is done,
+           the ones that would block go back to polling */
+        for(struct engine_op** opp = &pending; *opp;) {
+            struct engine_op* op = *opp;
+            if(op->state == ENGINE_OP_RUNNING && engine_try_op(op)) {
+                *opp = op->next;
+                pthread_mutex_lock(&self->lock);
+                engine_done_push(self, op);
+                eventfd_signal(self->event_fd);
+                pthread_mutex_unlock(&self->lock);
+                continue;
+            }
+            op->state = ENGINE_OP_POLLING;
+            opp = &op->next;
+        }
+
+        /* The operations in flight are at most the capacity of the engine */
+        pfds[0].fd = w->wake_fd;
+        pfds[0].events = POLLIN;
+        size_t npfds = 1;
+        for(struct engine_op* op = pending; op; op = op->next, npfds++) {
+            pfds[npfds].fd = op->fd;
+            pfds[npfds].events = op->type == ENGINE_OP_SEND ? POLLOUT : POLLIN;
+            pfds[npfds].revents = 0;
+        }
+
+        pthread_mutex_lock(&self->lock);
+        if(self->stopping || w->incoming_head)
+            continue;
+        w->sleeping = 1;
+        pthread_mutex_unlock(&self->lock);
+
+        if(poll(pfds, npfds, -1) > 0) {
+            if(pfds[0].revents)
+                eventfd_drain(w->wake_fd);
+
+            /* Errors and hangups are reported by the operation itself */
+            size_t i = 1;
+            for(struct engine_op* op = pending; op; op = op->next, i++) {
+                if(pfds[i].revents)
+                    op->state = ENGINE_OP_RUNNING;
+            }
+        }
+
+        pthread_mutex_lock(&self->lock);
+        w->sleeping = 0;
+    }
+
+    /* Cancel the operations left */
+    engine_done_push_list(self, pending, -ECANCELED);
+    engine_done_push_list(self, w->incoming_head, -ECANCELED);
+    w->incoming_head = w->incoming_tail = NULL;
+    eventfd_signal(self->event_fd);
+    pthread_mutex_unlock(&self->lock);
+
+    return NULL;
+}
+
+/* Queue the operation to the thread of its socket, the lock must be held */
+static void
+engine_worker_queue(engine_object* self, struct engine_op* op)
+{
+    struct engine_worker* w = &self->workers[op->fd % self->nworkers];
+
+    op->next = NULL;
+    if(w->incoming_tail)
+        w->incoming_tail->next = op;
+    else
+        w->incoming_head = op;
+    w->incoming_tail = op;
+
+    if(w->sleeping) {
+        w->sleeping = 0;
+        eventfd_signal(w->wake_fd);
+    }
+}
+
+/* Stop and join the threads, their operations are cancelled */
+static void
+engine_stop_threads(engine_object* self)
+{
+    pthread_mutex_lock(&self->lock);
+    self->stopping = 1;
+    for(int i = 0; i < self->nworkers; i++) {
+        if(self->workers[i].wake_fd != -1)
+            eventfd_signal(self->workers[i].wake_fd);
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    for(int i = 0; i < self->nworkers; i++) {
+        struct engine_worker* w = &self->workers[i];
+        if(w->started)
+            pthread_join(w->thread, NULL);
+        if(w->wake_fd != -1)
+            close(w->wake_fd);
+        free(w->pfds);
+    }
+
+    free(self->workers);
+    self->workers = NULL;
+    self->nworkers = 0;
+}
+
+/* Start the threads, returns -1 with errno set on error */
+static int
+engine_start_threads(engine_object* self, int nworkers)
+{
+    int err = 0;
+
+    self->workers = calloc(nworkers, sizeof(struct engine_worker));
+    if(!self->workers)
+        return -1;
+
+    self->nworkers = nworkers;
+
+    for(int i = 0; i < nworkers; i++) {
+        struct engine_worker* w = &self->workers[i];
+
+        w->engine = self;
+        w->pfds = malloc((self->capacity + 1) * sizeof(struct pollfd));
+        w->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+        if(!w->pfds || w->wake_fd < 0) {
+            err = w->pfds ? errno : ENOMEM;
+            break;
+        }
+
+        err = thread_start_nosignals(&w->thread, engine_thread, w);
+        if(err)
+            break;
+        w->started = 1;
+    }
+
+    if(err) {
+        engine_stop_threads(self);
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+    Collect the completed operations: queue the pending submissions and
+    move the completions to the done list. Called without the GIL.
+*/
+static void
+engine_collect(engine_object* self)
+{
+#ifdef ENGINE_HAVE_IO_URING
+    if(self->backend == ENGINE_BACKEND_IO_URING) {
+        ring_flush(&self->ring);
+        ring_harvest(self);
+        /* Submit the retries queued by ring_harvest */
+        ring_flush(&self->ring);
+    }
+#else
+    (void)self;
+#endif
+}
+
+/*
+    Stop the engine and release the operations not reaped. The operations
+    still owned by the kernel are cancelled and waited for, so that their
+    buffers are not released while in use. Returns -1 with errno EBUSY if
+    the kernel did not give them all back in time, the engine then keeps
+    them and close can be called again.
+*/
+static int
+engine_close_internal(engine_object* self)
+{
+    struct engine_op* ops = NULL;
+    unsigned int count;
+    int busy = 0;
+
+    /* Nothing left to release once closed, unless a previous close gave up */
+    if(self->closed && !self->active)
+        return 0;
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->lock);
+    self->closed = 1;
+
+#ifdef ENGINE_HAVE_IO_URING
+    if(self->backend == ENGINE_BACKEND_IO_URING && self->ring.fd != -1) {
+        for(struct engine_op* op = self->active; op; op = op->next)
+            ring_queue_cancel(&self->ring, op);
+        ring_flush(&self->ring);
+
+        for(int i = 0; self->active && i < ENGINE_CLOSE_ROUNDS; i++) {
+            pthread_mutex_unlock(&self->lock);
+            struct pollfd pfd = {.fd = self->event_fd, .events = POLLIN};
+            poll(&pfd, 1, 10);
+            eventfd_drain(self->event_fd);
+            pthread_mutex_lock(&self->lock);
+            engine_collect(self);
+        }
+
+        if(self->active)
+            busy = 1;
+        else
+            ring_fini(&self->ring);
+    }
+#endif
+
+    pthread_mutex_unlock(&self->lock);
+
+    /* The threads give back all their operations before exiting */
+    if(self->backend == ENGINE_BACKEND_THREADS && self->workers)
+        engine_stop_threads(self);
+
+    pthread_mutex_lock(&self->lock);
+    ops = engine_done_take(self, &count);
+    self->inflight -= count;
+    pthread_mutex_unlock(&self->lock);
+    Py_END_ALLOW_THREADS
+
+    engine_op_free_list(ops);
+
+    if(busy) {
+        errno = EBUSY;
+        return -1;
+    }
+
+    if(self->event_fd != -1) {
+        close(self->event_fd);
+        self->event_fd = -1;
+    }
+    return 0;
+}
+
+static int
+engine_check_open(engine_object* self)
+{
+    if(!self->stack) {
+        PyErr_SetString(PyExc_Exception, "Uninitialized engine");
+        return 0;
+    }
+    if(self->closed) {
+        PyErr_SetString(PyExc_ValueError, "Engine is closed");
+        return 0;
+    }
+    return 1;
+}
+
+/* Check that sock is a socket of the stack of the engine */
+static socket_object*
+engine_check_socket(engine_object* self, PyObject* sock)
+{
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return NULL;
+
+    if(!PyObject_TypeCheck(sock, st->socket_type)) {
+        PyErr_SetString(PyExc_TypeError, "sock must be a socket of the stack");
+        return NULL;
+    }
+
+    socket_object* s = (socket_object*)sock;
+    if(s->stack != self->stack) {
+        PyErr_SetString(PyExc_ValueError, "the socket belongs to another stack");
+        return NULL;
+    }
+    return s;
+}
+
+/* Queue the operation and return its id, the operation is freed on error */
+static PyObject*
+engine_submit_op(engine_object* self, struct engine_op* op)
+{
+    int res = 0;
+    uint64_t id;
+
+    pthread_mutex_lock(&self->lock);
+    if(self->closed) {
+        pthread_mutex_unlock(&self->lock);
+        engine_op_free(op);
+        PyErr_SetString(PyExc_ValueError, "Engine is closed");
+        return NULL;
+    }
+    if(self->inflight >= self->capacity) {
+        pthread_mutex_unlock(&self->lock);
+        engine_op_free(op);
+        PyErr_SetString(PyExc_BlockingIOError, "too many operations in flight, reap them first");
+        return NULL;
+    }
+
+    id = op->id = self->next_id++;
+
+#ifdef ENGINE_HAVE_IO_URING
+    if(self->backend == ENGINE_BACKEND_IO_URING) {
+        res = ring_queue_op(&self->ring, op);
+        if(res == 0)
+            engine_active_link(self, op);
+    }
+#endif
+    if(self->backend == ENGINE_BACKEND_THREADS)
+        engine_worker_queue(self, op);
+
+    if(res == 0)
+        self->inflight++;
+    pthread_mutex_unlock(&self->lock);
+
+    if(res < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        engine_op_free(op);
+        return NULL;
+    }
+
+    return PyLong_FromUnsignedLongLong(id);
+}
+
+PyDoc_STRVAR(engine_submit_recv_doc, "submit_recv(sock, bufsize, flags=0) -> id\n\
+\n\
+Queue the reception of up to bufsize bytes from the socket and return\n\
+the id of the operation. The data is returned by reap.");
+
+static PyObject*
+engine_submit_recv(engine_object* self, PyObject* args, PyObject* kwargs)
+{
+    static char* kwnames[] = {"sock", "bufsize", "flags", NULL};
+    PyObject* sock;
+    Py_ssize_t size;
+    int flags = 0;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "On|i:submit_recv", kwnames, &sock, &size, &flags))
+        return NULL;
+
+    if(!engine_check_open(self))
+        return NULL;
+
+    socket_object* s = engine_check_socket(self, sock);
+    if(!s)
+        return NULL;
+
+    if(size < 0) {
+        PyErr_SetString(PyExc_ValueError, "negative buffersize in submit_recv");
+        return NULL;
+    }
+
+    struct engine_op* op = engine_op_new(ENGINE_OP_RECV, s, flags);
+    if(!op)
+        return NULL;
+
+    /* The data is received in place, the bytes object is shrunk on completion */
+    op->data = PyBytes_FromStringAndSize(NULL, size);
+    if(!op->data) {
+        engine_op_free(op);
+        return NULL;
+    }
+    op->buf = PyBytes_AS_STRING(op->data);
+    op->len = size;
+
+    return engine_submit_op(self, op);
+}
+
+PyDoc_STRVAR(engine_submit_send_doc, "submit_send(sock, data, flags=0) -> id\n\
+\n\
+Queue a send of data on the socket and return the id of the operation.\n\
+The buffer of data is held, not copied, until the operation is reaped.\n\
+As for send, the number of bytes sent returned by reap may be lower than\n\
+the length of data.");
+
+static PyObject*
+engine_submit_send(engine_object* self, PyObject* args, PyObject* kwargs)
+{
+    static char* kwnames[] = {"sock", "data", "flags", NULL};
+    PyObject* sock;
+    Py_buffer view;
+    int flags = 0;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "Oy*|i:submit_send", kwnames, &sock, &view, &flags))
+        return NULL;
+
+    socket_object* s = NULL;
+    struct engine_op* op = NULL;
+    if(engine_check_open(self) && (s = engine_check_socket(self, sock)))
+        op = engine_op_new(ENGINE_OP_SEND, s, flags);
+
+    if(!op) {
+        PyBuffer_Release(&view);
+        return NULL;
+    }
+
+    op->view = view;
+    op->buf = view.buf;
+    op->len = view.len;
+
+    return engine_submit_op(self, op);
+}
+
+PyDoc_STRVAR(engine_submit_accept_doc, "submit_accept(sock) -> id\n\
+\n\
+Queue the acceptance of a connection on the listening socket and return\n\
+the id of the operation. The new socket and the address of the peer are\n\
+returned by reap.");
+
+static PyObject*
+engine_submit_accept(engine_object* self, PyObject* sock)
+{
+    if(!engine_check_open(self))
+        return NULL;
+
+    socket_object* s = engine_check_socket(self, sock);
+    if(!s)
+        return NULL;
+
+    struct engine_op* op = engine_op_new(ENGINE_OP_ACCEPT, s, 0);
+    if(!op)
+        return NULL;
+
+    return engine_submit_op(self, op);
+}
+
+PyDoc_STRVAR(engine_submit_doc, "submit() -> int\n\
+\n\
+Pass the queued operations to the kernel without waiting for reap and\n\
+return their number. The thread backend starts the operations right away\n\
+and always returns 0.");
+
+static PyObject*
+engine_submit(engine_object* self, PyObject* Py_UNUSED(ignored))
+{
+    unsigned int count = 0;
+    int res = 0;
+
+    if(!engine_check_open(self))
+        return NULL;
+
+#ifdef ENGINE_HAVE_IO_URING
+    if(self->backend == ENGINE_BACKEND_IO_URING) {
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&self->lock);
+        count = self->ring.sq_pending;
+        res = ring_flush(&self->ring);
+        count -= self->ring.sq_pending;
+        pthread_mutex_unlock(&self->lock);
+        Py_END_ALLOW_THREADS
+    }
+#endif
+
+    if(res < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    return PyLong_FromUnsignedLong(count);
+}
+
+/* Build the Completion of an operation, the result is moved out of op */
+static PyObject*
+engine_make_completion(iothpy_state* st, struct engine_op* op)
+{
+    PyObject* result = NULL;
+    PyObject* error = NULL;
+
+    if(op->result < 0) {
+        int err = (int)-op->result;
+        error = PyObject_CallFunction(PyExc_OSError, "is", err, strerror(err));
+    } else {
+        socket_object* s = (socket_object*)op->socket;
+        PyObject* sock;
+        PyObject* addr;
+
+        switch(op->type) {
+            case ENGINE_OP_RECV:
+                if((size_t)op->result != op->len && _PyBytes_Resize(&op->data, op->result) < 0)
+                    break;
+                result = op->data;
+                op->data = NULL;
+                break;
+
+            case ENGINE_OP_SEND:
+                result = PyLong_FromSsize_t(op->result);
+                break;
+
+            case ENGINE_OP_ACCEPT:
+                /* Same type as the listening socket, as accept does */
+                sock = PyObject_CallFunction((PyObject*)Py_TYPE(s), "Oiiii", s->stack,
+                                             s->family, s->type, s->proto, (int)op->result);
+                if(!sock) {
+                    ioth_close((int)op->result);
+                    PyObject *type, *value, *tb;
+                    PyErr_Fetch(&type, &value, &tb);
+                    PyErr_NormalizeException(&type, &value, &tb);
+                    if(tb)
+                        PyException_SetTraceback(value, tb);
+                    Py_XDECREF(type);
+                    Py_XDECREF(tb);
+                    error = value;
+                    break;
+                }
+
+                addr = make_sockaddr((struct sockaddr*)&op->addr, op->addrlen);
+                if(addr)
+                    result = PyTuple_Pack(2, sock, addr);
+                Py_DECREF(sock);
+                Py_XDECREF(addr);
+                break;
+        }
+    }
+
+    if(!result && !error)
+        return NULL;
+
+    PyObject* item = PyStructSequence_New(st->completion_type);
+    if(!item) {
+        Py_XDECREF(result);
+        Py_XDECREF(error);
+        return NULL;
+    }
+
+    if(!result) {
+        Py_INCREF(Py_None);
+        result = Py_None;
+    }
+    if(!error) {
+        Py_INCREF(Py_None);
+        error = Py_None;
+    }
+    Py_INCREF(op->socket);
+
+    PyStructSequence_SET_ITEM(item, 0, PyLong_FromUnsignedLongLong(op->id));
+    PyStructSequence_SET_ITEM(item, 1, PyUnicode_FromString(engine_op_names[op->type]));
+    PyStructSequence_SET_ITEM(item, 2, op->socket);
+    PyStructSequence_SET_ITEM(item, 3, result);
+    PyStructSequence_SET_ITEM(item, 4, error);
+
+    if(PyErr_Occurred()) {
+        Py_DECREF(item);
+        return NULL;
+    }
+    return item;
+}
+
+PyDoc_STRVAR(engine_reap_doc, "reap(min_complete=0, timeout=None) -> list of Completion\n\
+\n\
+Return the operations completed since the last call as Completion tuples\n\
+(id, op, socket, result, error), waiting until at least min_complete\n\
+of them completed or timeout seconds elapsed, forever if timeout is None.\n\
+All the waiting and the collection of the completions are done in a\n\
+single release of the GIL.");
+
+static PyObject*
+engine_reap(engine_object* self, PyObject* args, PyObject* kwargs)
+{
+    static char* kwnames[] = {"min_complete", "timeout", NULL};
+    unsigned int min_complete = 0;
+    PyObject* timeout_obj = Py_None;
+    _PyTime_t timeout = -1;
+    _PyTime_t deadline = 0;
+    struct engine_op* ops;
+    unsigned int count;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|IO:reap", kwnames, &min_complete, &timeout_obj))
+        return NULL;
+
+    if(!engine_check_open(self))
+        return NULL;
+
+    if(socket_parse_timeout(&timeout, timeout_obj) < 0)
+        return NULL;
+
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return NULL;
+
+    if(timeout >= 0)
+        deadline = _PyTime_GetMonotonicClock() + timeout;
+
+    Py_BEGIN_ALLOW_THREADS
+    for(;;) {
+        /* Drained before collecting, completions after this wake up poll */
+        eventfd_drain(self->event_fd);
+
+        pthread_mutex_lock(&self->lock);
+        engine_collect(self);
+        /* Operations not submitted will never complete */
+        if(self->done_count >= min_complete || self->done_count >= self->inflight)
+            break;
+        pthread_mutex_unlock(&self->lock);
+
+        int ms = -1;
+        if(timeout >= 0) {
+            _PyTime_t remaining = deadline - _PyTime_GetMonotonicClock();
+            if(remaining <= 0) {
+                pthread_mutex_lock(&self->lock);
+                break;
+            }
+            ms = (int)_PyTime_AsMilliseconds(remaining, _PyTime_ROUND_CEILING);
+        }
+
+        struct pollfd pfd = {.fd = self->event_fd, .events = POLLIN};
+        poll(&pfd, 1, ms);
+    }
+    ops = engine_done_take(self, &count);
+    self->inflight -= count;
+    pthread_mutex_unlock(&self->lock);
+    Py_END_ALLOW_THREADS
+
+    PyObject* list = PyList_New(count);
+    Py_ssize_t i = 0;
+    for(struct engine_op* op = ops; op; op = op->next, i++) {
+        if(!list)
+            continue;
+
+        PyObject* item = engine_make_completion(st, op);
+        if(!item) {
+            Py_CLEAR(list);
+            continue;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+
+    engine_op_free_list(ops);
+    return list;
+}
+
+PyDoc_STRVAR(engine_fileno_doc, "fileno() -> integer\n\
+\n\
+Return a file descriptor readable when operations completed. It can be\n\
+passed to select, poll or asyncio add_reader, reap resets it.");
+
+static PyObject*
+engine_fileno(engine_object* self, PyObject* Py_UNUSED(ignored))
+{
+    return PyLong_FromLong(self->event_fd);
+}
+
+PyDoc_STRVAR(engine_close_doc, "close()\n\
+\n\
+Cancel the operations in flight and stop the engine. The completions\n\
+not yet reaped are discarded. OSError with errno EBUSY is raised if the\n\
+kernel did not give back the cancelled operations within a second, close\n\
+can be called again to wait for them.");
+
+static PyObject*
+engine_close(engine_object* self, PyObject* Py_UNUSED(ignored))
+{
+    if(engine_close_internal(self) < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef engine_methods[] = {
+    {"submit_recv", (PyCFunction)engine_submit_recv, METH_VARARGS | METH_KEYWORDS, engine_submit_recv_doc},
+    {"submit_send", (PyCFunction)engine_submit_send, METH_VARARGS | METH_KEYWORDS, engine_submit_send_doc},
+    {"submit_accept", (PyCFunction)engine_submit_accept, METH_O, engine_submit_accept_doc},
+    {"submit", (PyCFunction)engine_submit, METH_NOARGS, engine_submit_doc},
+    {"reap", (PyCFunction)engine_reap, METH_VARARGS | METH_KEYWORDS, engine_reap_doc},
+    {"fileno", (PyCFunction)engine_fileno, METH_NOARGS, engine_fileno_doc},
+    {"close", (PyCFunction)engine_close, METH_NOARGS, engine_close_doc},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyObject*
+engine_get_backend(engine_object* self, void* Py_UNUSED(closure))
+{
+    if(!self->stack)
+        Py_RETURN_NONE;
+    return PyUnicode_FromString(self->backend == ENGINE_BACKEND_IO_URING ? "io_uring" : "threads");
+}
+
+static PyObject*
+engine_get_closed(engine_object* self, void* Py_UNUSED(closure))
+{
+    return PyBool_FromLong(self->closed);
+}
+
+static PyObject*
+engine_get_inflight(engine_object* self, void* Py_UNUSED(closure))
+{
+    unsigned int inflight;
+
+    pthread_mutex_lock(&self->lock);
+    inflight = self->inflight;
+    pthread_mutex_unlock(&self->lock);
+
+    return PyLong_FromUnsignedLong(inflight);
+}
+
+static PyGetSetDef engine_getsetlist[] = {
+    {"backend", (getter)engine_get_backend, NULL, "io_uring or threads", NULL},
+    {"closed", (getter)engine_get_closed, NULL, "True if the engine is closed", NULL},
+    {"inflight", (getter)engine_get_inflight, NULL, "number of operations submitted and not yet reaped", NULL},
+    {NULL} /* sentinel */
+};
+
+static PyMemberDef engine_memberlist[] = {
+    {"capacity", T_UINT, offsetof(engine_object, capacity), READONLY, "maximum number of operations in flight"},
+    {"stack", T_OBJECT_EX, offsetof(engine_object, stack), READONLY, "the stack of the engine"},
+    {0},
+};
+
+static int
+engine_initobj(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    engine_object* e = (engine_object*)self;
+    static char* kwnames[] = {"stack", "entries", "threads", "backend", NULL};
+    stack_object* stack;
+    unsigned int entries = ENGINE_DEFAULT_ENTRIES;
+    int nthreads = ENGINE_DEFAULT_THREADS;
+    const char* backend = NULL;
+
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return -1;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O!|Iiz:Engine", kwnames, st->stack_type,
+                                    &stack, &entries, &nthreads, &backend))
+        return -1;
+
+    if(e->stack) {
+        PyErr_SetString(PyExc_RuntimeError, "Engine already initialized");
+        return -1;
+    }
+    if(!stack->stack) {
+        PyErr_SetString(PyExc_ValueError, "Stack is closed");
+        return -1;
+    }
+    if(entries < 1 || entries > ENGINE_MAX_ENTRIES) {
+        PyErr_Format(PyExc_ValueError, "entries must be between 1 and %d", ENGINE_MAX_ENTRIES);
+        return -1;
+    }
+    if(nthreads < 1) {
+        PyErr_SetString(PyExc_ValueError, "threads must be at least 1");
+        return -1;
+    }
+
+    int use_io_uring;
+    if(!backend) {
+        use_io_uring = (stack->caps & IOTHPY_CAP_KERNEL_FD) != 0;
+    } else if(strcmp(backend, "io_uring") == 0) {
+        if(!(stack->caps & IOTHPY_CAP_KERNEL_FD)) {
+            PyErr_SetString(PyExc_ValueError, "io_uring needs a stack with kernel file descriptors");
+            return -1;
+        }
+        use_io_uring = 1;
+    } else if(strcmp(backend, "threads") == 0) {
+        use_io_uring = 0;
+    } else {
+        PyErr_Format(PyExc_ValueError, "unknown backend %s", backend);
+        return -1;
+    }
+
+    e->event_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(e->event_fd < 0) {
+        e->event_fd = -1;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    int res = -1;
+    Py_BEGIN_ALLOW_THREADS
+#ifdef ENGINE_HAVE_IO_URING
+    if(use_io_uring)
+        res = ring_init(&e->ring, entries, e->event_fd);
+#else
+    errno = EOPNOTSUPP;
+#endif
+    Py_END_ALLOW_THREADS
+
+    e->capacity = entries;
+    if(res == 0) {
+        e->backend = ENGINE_BACKEND_IO_URING;
+    } else if(backend && use_io_uring) {
+        /* io_uring was requested explicitly, no fallback */
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    } else {
+        e->backend = ENGINE_BACKEND_THREADS;
+        if(engine_start_threads(e, nthreads) < 0) {
+            PyErr_SetFromErrno(PyExc_OSError);
+            engine_close_internal(e);
+            return -1;
+        }
+    }
+
+    Py_INCREF(stack);
+    e->stack = (PyObject*)stack;
+
+    return 0;
+}
+
+static PyObject*
+engine_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    PyObject* new = type->tp_alloc(type, 0);
+
+    engine_object* e = (engine_object*)new;
+    if(e != NULL) {
+        e->stack = NULL;
+        e->backend = ENGINE_BACKEND_THREADS;
+        e->event_fd = -1;
+        e->ring.fd = -1;
+        pthread_mutex_init(&e->lock, NULL);
+    }
+
+    return new;
+}
+
+static void
+engine_finalize(engine_object* self)
+{
+    PyObject *error_type, *error_value, *error_traceback;
+    /* Save the current exception, if any. */
+    PyErr_Fetch(&error_type, &error_value, &error_traceback);
+
+    /* The operations the kernel did not give back cannot be freed */
+    if(engine_close_internal(self) < 0 &&
+       PyErr_WarnEx(PyExc_ResourceWarning, "Engine finalized with operations still owned by the kernel", 1) < 0)
+        PyErr_WriteUnraisable((PyObject*)self);
+    Py_CLEAR(self->stack);
+
+    /* Restore the saved exception. */
+    PyErr_Restore(error_type, error_value, error_traceback);
+}
+
+static void
+engine_dealloc(engine_object* self)
+{
+    if(PyObject_CallFinalizerFromDealloc((PyObject*)self) < 0)
+        return;
+
+    pthread_mutex_destroy(&self->lock);
+
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free(self);
+#if PY_VERSION_HEX >= 0x03080000
+    /* Instances of heap types own a reference to their type, released
+       by subtype_dealloc instead before Python 3.8 */
+    Py_DECREF(tp);
+#endif
+}
+
+static PyObject*
+engine_repr(engine_object* self)
+{
+    PyObject* backend = engine_get_backend(self, NULL);
+    if(!backend)
+        return NULL;
+
+    PyObject* repr = PyUnicode_FromFormat("<engine object, backend=%R, inflight=%u%s>",
+                                          backend, self->inflight, self->closed ? ", closed" : "");
+    Py_DECREF(backend);
+    return repr;
+}
+
+PyDoc_STRVAR(engine_doc, "EngineBase(stack, entries=256, threads=4, backend=None)\n\
+\n\
+Completion based I/O on the sockets of a stack, using io_uring for\n\
+stacks with kernel file descriptors and a pool of threads otherwise.");
+
+static PyType_Slot engine_slots[] = {
+    {Py_tp_dealloc, engine_dealloc},
+    {Py_tp_repr, engine_repr},
+    {Py_tp_doc, (void*)engine_doc},
+    {Py_tp_methods, engine_methods},
+    {Py_tp_members, engine_memberlist},
+    {Py_tp_getset, engine_getsetlist},
+    {Py_tp_init, engine_initobj},
+    {Py_tp_new, engine_new},
+    {Py_tp_finalize, engine_finalize},
+    {0, NULL}
+};
+
+static PyType_Spec engine_spec = {
+    "_iothpy.EngineBase",
+    sizeof(engine_object),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    engine_slots
+};
+
+/* Add the engine type and its completion type to the module */
+int
+engine_module_init(PyObject* module)
+{
+    iothpy_state* st = iothpy_state_from_module(module);
+
+    st->engine_type = iothpy_new_type(module, &engine_spec);
+    if(!st->engine_type)
+        return -1;
+
+    Py_INCREF(st->engine_type);
+    if(PyModule_AddObject(module, "EngineBase", (PyObject*)st->engine_type) != 0) {
+        Py_DECREF(st->engine_type);
+        return -1;
+    }
+
+    st->completion_type = PyStructSequence_NewType(&completion_desc);
+    if(!st->completion_type)
+        return -1;
+
+    Py_INCREF(st->completion_type);
+    if(PyModule_AddObject(module, "Completion", (PyObject*)st->completion_type) != 0) {
+        Py_DECREF(st->completion_type);
+        return -1;
+    }
+
+    return 0;
+}
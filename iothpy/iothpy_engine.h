@@ -0,0 +1,97 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <poll.h>
+
+/* Backends of an engine */
+#define ENGINE_BACKEND_IO_URING 0   /* io_uring of the kernel, for stacks with kernel fds */
+#define ENGINE_BACKEND_THREADS  1   /* pool of threads polling the sockets */
+
+struct engine_op;
+struct engine_object;
+
+/* Thread of the thread backend, polling the sockets of its operations */
+struct engine_worker {
+    struct engine_object* engine;
+    pthread_t thread;
+
+    /* Operations submitted and not yet taken by the thread */
+    struct engine_op* incoming_head;
+    struct engine_op* incoming_tail;
+
+    /* Eventfd waking the thread up from poll, written if sleeping is set */
+    int wake_fd;
+    int sleeping;
+
+    /* Room for the wake_fd and one socket for each operation in flight */
+    struct pollfd* pfds;
+    int started;
+};
+
+/* Submission and completion rings mapped from the io_uring fd */
+struct engine_ring {
+    int fd;
+    unsigned int entries;
+
+    void* sq_ptr;
+    size_t sq_size;
+    void* cq_ptr;
+    size_t cq_size;
+    struct io_uring_sqe* sqes;
+    size_t sqes_size;
+
+    unsigned int* sq_head;
+    unsigned int* sq_tail;
+    unsigned int* sq_array;
+    unsigned int sq_mask;
+    /* Entries queued in the submission ring and not yet passed to the kernel */
+    unsigned int sq_pending;
+
+    unsigned int* cq_head;
+    unsigned int* cq_tail;
+    struct io_uring_cqe* cqes;
+    unsigned int cq_mask;
+};
+
+typedef struct engine_object
+{
+    PyObject_HEAD
+    /* Stack of the sockets accepted by the engine */
+    PyObject* stack;
+
+    int backend;
+    int closed;
+
+    /* Maximum number of operations submitted and not yet reaped */
+    unsigned int capacity;
+    /* Operations submitted and not yet reaped */
+    unsigned int inflight;
+    /* Id of the next operation */
+    uint64_t next_id;
+
+    /* Eventfd readable when operations completed, see fileno() */
+    int event_fd;
+
+    /* Protects all the fields below, never held while waiting for the GIL */
+    pthread_mutex_t lock;
+
+    /* Completed operations waiting for reap */
+    struct engine_op* done_head;
+    struct engine_op* done_tail;
+    unsigned int done_count;
+
+    /* io_uring backend: the ring and the operations owned by the kernel */
+    struct engine_ring ring;
+    struct engine_op* active;
+
+    /* Thread backend: the operations of a socket are run by the thread
+       fd % nworkers */
+    struct engine_worker* workers;
+    int nworkers;
+    int stopping;
+} engine_object;
+
+int engine_module_init(PyObject* module);
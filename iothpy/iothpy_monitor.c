@@ -0,0 +1,447 @@
+/* 
+ * This file is part of the iothpy library: python support for ioth.
+ * 
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License 
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_state.h"
+#include "iothpy_monitor.h"
+#include "iothpy_stack.h"
+#include "iothpy_socket.h"
+#include "iothpy_netlink.h"
+
+#include <structmember.h>
+
+#include <stdlib.h>
+#include <errno.h>
+#include <poll.h>
+#include <linux/rtnetlink.h>
+
+#include <ioth.h>
+
+/* Groups subscribed when none are given */
+#define MONITOR_DEFAULT_GROUPS (RTMGRP_LINK | RTMGRP_IPV4_IFADDR | RTMGRP_IPV6_IFADDR | \
+                                RTMGRP_IPV4_ROUTE | RTMGRP_IPV6_ROUTE)
+
+static PyStructSequence_Field netlink_event_fields[] = {
+    {"event", "newlink, dellink, newaddr, deladdr, newroute or delroute"},
+    {"data", "the Link, IfAddr or Route the event refers to"},
+    {NULL}
+};
+
+PyDoc_STRVAR(netlink_event_doc,
+"NetlinkEvent: result entry of Monitor.read\n\
+\n\
+A 2-tuple (event, data) with named fields.");
+
+static PyStructSequence_Desc netlink_event_desc = {
+    "iothpy.NetlinkEvent",
+    netlink_event_doc,
+    netlink_event_fields,
+    2
+};
+
+/* Add the monitor to the list of open monitors of its stack */
+static void
+monitor_track(monitor_object* m)
+{
+    stack_object* stack = (stack_object*)m->stack;
+
+    pthread_mutex_lock(&stack->objects_lock);
+    m->prev_monitor = NULL;
+    m->next_monitor = stack->monitors;
+    if(stack->monitors)
+        stack->monitors->prev_monitor = m;
+    stack->monitors = m;
+    pthread_mutex_unlock(&stack->objects_lock);
+}
+
+/* Remove the monitor from the list of its stack, objects_lock must be held */
+static void
+monitor_unlink(stack_object* stack, monitor_object* m)
+{
+    if(m->prev_monitor)
+        m->prev_monitor->next_monitor = m->next_monitor;
+    else if(stack->monitors == m)
+        stack->monitors = m->next_monitor;
+
+    if(m->next_monitor)
+        m->next_monitor->prev_monitor = m->prev_monitor;
+
+    m->prev_monitor = m->next_monitor = NULL;
+}
+
+/* Remove the monitor from the list of its stack, if it is there */
+static void
+monitor_untrack(monitor_object* m)
+{
+    stack_object* stack = (stack_object*)m->stack;
+    if(!stack)
+        return;
+
+    pthread_mutex_lock(&stack->objects_lock);
+    monitor_unlink(stack, m);
+    pthread_mutex_unlock(&stack->objects_lock);
+}
+
+void
+monitor_close_stack_monitors(stack_object* stack)
+{
+    pthread_mutex_lock(&stack->objects_lock);
+    while(stack->monitors) {
+        monitor_object* m = stack->monitors;
+        int fd = m->fd;
+
+        m->fd = -1;
+        monitor_unlink(stack, m);
+        if(fd != -1)
+            ioth_close(fd);
+    }
+    pthread_mutex_unlock(&stack->objects_lock);
+}
+
+void
+monitor_forget_stack_monitors(stack_object* stack)
+{
+    pthread_mutex_lock(&stack->objects_lock);
+    while(stack->monitors) {
+        monitor_object* m = stack->monitors;
+
+        m->fd = -1;
+        monitor_unlink(stack, m);
+    }
+    pthread_mutex_unlock(&stack->objects_lock);
+}
+
+static PyObject*
+make_event(iothpy_state* st, const struct nl_event* event)
+{
+    const char* name;
+    PyObject* data;
+
+    switch(event->type) {
+        case RTM_NEWLINK:  name = "newlink";  data = stack_make_link(st, &event->link);   break;
+        case RTM_DELLINK:  name = "dellink";  data = stack_make_link(st, &event->link);   break;
+        case RTM_NEWADDR:  name = "newaddr";  data = stack_make_ifaddr(st, &event->addr); break;
+        case RTM_DELADDR:  name = "deladdr";  data = stack_make_ifaddr(st, &event->addr); break;
+        case RTM_NEWROUTE: name = "newroute"; data = stack_make_route(st, &event->route); break;
+        default:           name = "delroute"; data = stack_make_route(st, &event->route); break;
+    }
+    if(!data)
+        return NULL;
+
+    PyObject* item = PyStructSequence_New(st->netlink_event_type);
+    if(!item) {
+        Py_DECREF(data);
+        return NULL;
+    }
+
+    PyStructSequence_SET_ITEM(item, 0, PyUnicode_FromString(name));
+    PyStructSequence_SET_ITEM(item, 1, data);
+
+    if(PyErr_Occurred()) {
+        Py_DECREF(item);
+        return NULL;
+    }
+    return item;
+}
+
+PyDoc_STRVAR(monitor_read_doc, "read(timeout=0.0)\n\
+\n\
+Return the list of the events received, as NetlinkEvent tuples.\n\
+If no event is queued wait up to timeout seconds, forever if timeout is None,\n\
+and return an empty list if nothing arrived in time.\n\
+Raises OSError with errno ENOBUFS if events were lost because they were\n\
+not read fast enough, the state should then be read again.");
+
+static PyObject*
+monitor_read(monitor_object* self, PyObject* args, PyObject* kwargs)
+{
+    static char* kwnames[] = {"timeout", NULL};
+    PyObject* timeout_obj = NULL;
+    _PyTime_t timeout = 0;
+    struct nl_event* events = NULL;
+    size_t count = 0;
+    int res;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:read", kwnames, &timeout_obj))
+        return NULL;
+
+    if(self->fd == -1) {
+        PyErr_SetString(PyExc_ValueError, "Monitor is closed");
+        return NULL;
+    }
+
+    if(timeout_obj && socket_parse_timeout(&timeout, timeout_obj) < 0)
+        return NULL;
+
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    res = nl_read_events(self->fd, &events, &count);
+    if(res == 0 && count == 0 && timeout != 0) {
+        struct pollfd pfd = {.fd = self->fd, .events = POLLIN};
+        int ms = timeout < 0 ? -1 : (int)_PyTime_AsMilliseconds(timeout, _PyTime_ROUND_CEILING);
+
+        res = poll(&pfd, 1, ms);
+        if(res > 0)
+            res = nl_read_events(self->fd, &events, &count);
+        else if(res < 0 && errno == EINTR)
+            res = 0;
+    }
+    Py_END_ALLOW_THREADS
+
+    if(res < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+    PyObject* list = PyList_New(0);
+    for(size_t i = 0; list && i < count; i++) {
+        PyObject* item = make_event(st, &events[i]);
+        if(!item || PyList_Append(list, item) < 0)
+            Py_CLEAR(list);
+        Py_XDECREF(item);
+    }
+
+    free(events);
+    return list;
+}
+
+PyDoc_STRVAR(monitor_fileno_doc, "fileno() -> integer\n\
+\n\
+Return the file descriptor of the netlink socket, readable when events\n\
+are queued. It can be passed to select, poll or asyncio add_reader.");
+
+static PyObject*
+monitor_fileno(monitor_object* self, PyObject* Py_UNUSED(ignored))
+{
+    return PyLong_FromLong(self->fd);
+}
+
+PyDoc_STRVAR(monitor_close_doc, "close()\n\
+\n\
+Close the netlink socket of the monitor.");
+
+static PyObject*
+monitor_close(monitor_object* self, PyObject* Py_UNUSED(ignored))
+{
+    int fd = self->fd;
+
+    self->fd = -1;
+    monitor_untrack(self);
+    if(fd != -1)
+        ioth_close(fd);
+
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef monitor_methods[] = {
+    {"read", (PyCFunction)monitor_read, METH_VARARGS | METH_KEYWORDS, monitor_read_doc},
+    {"fileno", (PyCFunction)monitor_fileno, METH_NOARGS, monitor_fileno_doc},
+    {"close", (PyCFunction)monitor_close, METH_NOARGS, monitor_close_doc},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyObject*
+monitor_get_closed(monitor_object* self, void* Py_UNUSED(closure))
+{
+    return PyBool_FromLong(self->fd == -1);
+}
+
+static PyGetSetDef monitor_getsetlist[] = {
+    {"closed", (getter)monitor_get_closed, NULL, "True if the monitor is closed", NULL},
+    {NULL} /* sentinel */
+};
+
+static PyMemberDef monitor_memberlist[] = {
+    {"groups", T_UINT, offsetof(monitor_object, groups), READONLY, "the subscribed groups (RTMGRP_*)"},
+    {"stack", T_OBJECT_EX, offsetof(monitor_object, stack), READONLY, "the stack of the monitor"},
+    {0},
+};
+
+static int
+monitor_initobj(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    monitor_object* m = (monitor_object*)self;
+    static char* kwnames[] = {"stack", "groups", NULL};
+    stack_object* stack;
+    unsigned int groups = MONITOR_DEFAULT_GROUPS;
+    int fd;
+
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return -1;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "O!|I:Monitor", kwnames, st->stack_type, &stack, &groups))
+        return -1;
+
+    /* Held until the monitor is in the list closed by Stack.close() */
+    struct ioth* ioth_stack = stack_acquire(stack);
+    if(!ioth_stack) {
+        PyErr_SetString(PyExc_ValueError, "Stack is closed");
+        return -1;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+    fd = nl_subscribe(ioth_stack, groups);
+    Py_END_ALLOW_THREADS
+
+    if(fd < 0) {
+        stack_release(stack);
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    /* Close the previous socket if __init__ is called again */
+    if(m->fd != -1) {
+        monitor_untrack(m);
+        ioth_close(m->fd);
+    }
+
+    Py_INCREF(stack);
+    Py_XDECREF(m->stack);
+    m->stack = (PyObject*)stack;
+    m->fd = fd;
+    m->groups = groups;
+    /* Tracked before releasing the stack, Stack.close() closes it */
+    monitor_track(m);
+    stack_release(stack);
+
+    return 0;
+}
+
+static PyObject*
+monitor_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    PyObject* new = type->tp_alloc(type, 0);
+
+    monitor_object* m = (monitor_object*)new;
+    if(m != NULL) {
+        m->stack = NULL;
+        m->fd = -1;
+        m->groups = 0;
+        m->next_monitor = NULL;
+        m->prev_monitor = NULL;
+    }
+
+    return new;
+}
+
+static void
+monitor_finalize(monitor_object* m)
+{
+    PyObject *error_type, *error_value, *error_traceback;
+    /* Save the current exception, if any. */
+    PyErr_Fetch(&error_type, &error_value, &error_traceback);
+
+    /* As for sockets the fd must be closed before the stack is released */
+    monitor_untrack(m);
+    if(m->fd != -1) {
+        ioth_close(m->fd);
+        m->fd = -1;
+    }
+    Py_CLEAR(m->stack);
+
+    /* Restore the saved exception. */
+    PyErr_Restore(error_type, error_value, error_traceback);
+}
+
+static void
+monitor_dealloc(monitor_object* self)
+{
+    if(PyObject_CallFinalizerFromDealloc((PyObject*)self) < 0)
+        return;
+
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free(self);
+#if PY_VERSION_HEX >= 0x03080000
+    /* Instances of heap types own a reference to their type, released
+       by subtype_dealloc instead before Python 3.8 */
+    Py_DECREF(tp);
+#endif
+}
+
+static PyObject*
+monitor_repr(monitor_object* self)
+{
+    return PyUnicode_FromFormat("<monitor object, fd=%d, groups=0x%x>", self->fd, self->groups);
+}
+
+PyDoc_STRVAR(monitor_doc, "MonitorBase(stack, groups)\n\
+\n\
+Netlink socket of a stack subscribed to link, address and route events.");
+
+static PyType_Slot monitor_slots[] = {
+    {Py_tp_dealloc, monitor_dealloc},
+    {Py_tp_repr, monitor_repr},
+    {Py_tp_doc, (void*)monitor_doc},
+    {Py_tp_methods, monitor_methods},
+    {Py_tp_members, monitor_memberlist},
+    {Py_tp_getset, monitor_getsetlist},
+    {Py_tp_init, monitor_initobj},
+    {Py_tp_new, monitor_new},
+    {Py_tp_finalize, monitor_finalize},
+    {0, NULL}
+};
+
+static PyType_Spec monitor_spec = {
+    "_iothpy.MonitorBase",
+    sizeof(monitor_object),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    monitor_slots
+};
+
+/* Add the monitor type, its event type and the group constants to the module */
+int
+monitor_module_init(PyObject* module)
+{
+    iothpy_state* st = iothpy_state_from_module(module);
+
+    st->monitor_type = iothpy_new_type(module, &monitor_spec);
+    if(!st->monitor_type)
+        return -1;
+
+    Py_INCREF(st->monitor_type);
+    if(PyModule_AddObject(module, "MonitorBase", (PyObject*)st->monitor_type) != 0) {
+        Py_DECREF(st->monitor_type);
+        return -1;
+    }
+
+    st->netlink_event_type = PyStructSequence_NewType(&netlink_event_desc);
+    if(!st->netlink_event_type)
+        return -1;
+
+    Py_INCREF(st->netlink_event_type);
+    if(PyModule_AddObject(module, "NetlinkEvent", (PyObject*)st->netlink_event_type) != 0) {
+        Py_DECREF(st->netlink_event_type);
+        return -1;
+    }
+
+    if(PyModule_AddIntConstant(module, "RTMGRP_LINK", RTMGRP_LINK) < 0 ||
+       PyModule_AddIntConstant(module, "RTMGRP_IPV4_IFADDR", RTMGRP_IPV4_IFADDR) < 0 ||
+       PyModule_AddIntConstant(module, "RTMGRP_IPV6_IFADDR", RTMGRP_IPV6_IFADDR) < 0 ||
+       PyModule_AddIntConstant(module, "RTMGRP_IPV4_ROUTE", RTMGRP_IPV4_ROUTE) < 0 ||
+       PyModule_AddIntConstant(module, "RTMGRP_IPV6_ROUTE", RTMGRP_IPV6_ROUTE) < 0)
+        return -1;
+
+    return 0;
+}
@@ -0,0 +1,27 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+typedef struct monitor_object
+{
+    PyObject_HEAD
+    /* Stack on which the netlink socket was opened */
+    PyObject* stack;
+
+    /* Non blocking netlink socket subscribed to the groups, -1 if closed */
+    int fd;
+    unsigned int groups;
+
+    /* Links in the list of open monitors of the stack */
+    struct monitor_object* next_monitor;
+    struct monitor_object* prev_monitor;
+} monitor_object;
+
+int monitor_module_init(PyObject* module);
+
+struct stack_object;
+
+/* Close all the monitors still open on the stack */
+void monitor_close_stack_monitors(struct stack_object* stack);
+
+/* Detach all the monitors of the stack without closing them, after a fork */
+void monitor_forget_stack_monitors(struct stack_object* stack);
@@ -0,0 +1,712 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_netlink.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <net/if.h>
+#include <linux/netlink.h>
+#include <linux/rtnetlink.h>
+
+#define NL_BUFSIZE 32768
+
+/* Operations sent in a single batch, their acks must fit in the receive buffer */
+#define NL_BATCH 64
+
+/* Called for each message of a dump, returns -1 with errno set to stop it */
+typedef int (*nl_dump_cb)(struct nlmsghdr* msg, void* arg);
+
+/* Growable array of fixed size elements filled by the callbacks */
+struct nl_array {
+    void* data;
+    size_t count;
+    size_t capacity;
+    size_t elem_size;
+};
+
+static void*
+nl_array_push(struct nl_array* array)
+{
+    if(array->count == array->capacity) {
+        size_t capacity = array->capacity ? array->capacity * 2 : 16;
+        void* data = realloc(array->data, capacity * array->elem_size);
+        if(!data) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        array->data = data;
+        array->capacity = capacity;
+    }
+
+    void* elem = (char*)array->data + array->count * array->elem_size;
+    memset(elem, 0, array->elem_size);
+    array->count++;
+    return elem;
+}
+
+/*
+    Send the request and call cb for each message of the reply, until the
+    end of a dump or the ack of a request sent with NLM_F_ACK.
+*/
+static int
+nl_request(struct ioth* stack, struct nlmsghdr* req, nl_dump_cb cb, void* arg)
+{
+    static const struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    int fd;
+    int res = -1;
+    int done = 0;
+    char* buf;
+
+    fd = ioth_msocket(stack, AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if(fd < 0)
+        return -1;
+
+    buf = malloc(NL_BUFSIZE);
+    if(!buf) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    if(ioth_sendto(fd, req, req->nlmsg_len, 0, (struct sockaddr*)&kernel, sizeof(kernel)) < 0)
+        goto out;
+
+    while(!done) {
+        ssize_t len = ioth_recv(fd, buf, NL_BUFSIZE, 0);
+        if(len < 0) {
+            if(errno == EINTR)
+                continue;
+            goto out;
+        }
+        if(len == 0) {
+            errno = EPROTO;
+            goto out;
+        }
+
+        struct nlmsghdr* msg;
+        for(msg = (struct nlmsghdr*)buf; NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len)) {
+            if(msg->nlmsg_seq != req->nlmsg_seq)
+                continue;
+
+            if(msg->nlmsg_type == NLMSG_DONE) {
+                done = 1;
+                break;
+            }
+
+            if(msg->nlmsg_type == NLMSG_ERROR) {
+                struct nlmsgerr* err = NLMSG_DATA(msg);
+                if(err->error == 0) {
+                    done = 1;
+                    break;
+                }
+                errno = -err->error;
+                goto out;
+            }
+
+            if(cb(msg, arg) < 0)
+                goto out;
+        }
+    }
+
+    res = 0;
+out:
+    {
+        int saved_errno = errno;
+        free(buf);
+        ioth_close(fd);
+        errno = saved_errno;
+    }
+    return res;
+}
+
+/* Send a dump request and call cb for each message of the reply */
+static int
+nl_dump(struct ioth* stack, int type, int family, nl_dump_cb cb, void* arg)
+{
+    struct {
+        struct nlmsghdr header;
+        struct rtgenmsg msg;
+    } req;
+
+    memset(&req, 0, sizeof(req));
+    req.header.nlmsg_len = NLMSG_LENGTH(sizeof(struct rtgenmsg));
+    req.header.nlmsg_type = type;
+    req.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_DUMP;
+    req.header.nlmsg_seq = 1;
+    req.msg.rtgen_family = family;
+
+    return nl_request(stack, &req.header, cb, arg);
+}
+
+/* Copy the address in the attribute to dst, the size depends on the family */
+static void
+copy_addr(unsigned char* dst, struct rtattr* attr, int family)
+{
+    size_t len = family == AF_INET6 ? 16 : 4;
+    if(RTA_PAYLOAD(attr) >= len)
+        memcpy(dst, RTA_DATA(attr), len);
+}
+
+/* Fill info from a RTM_NEWADDR or RTM_DELADDR message */
+static void
+nl_parse_addr(struct nlmsghdr* msg, struct nl_addr_info* info)
+{
+    struct ifaddrmsg* ifa = NLMSG_DATA(msg);
+
+    info->family = ifa->ifa_family;
+    info->prefixlen = ifa->ifa_prefixlen;
+    info->scope = ifa->ifa_scope;
+    info->ifindex = ifa->ifa_index;
+
+    /* IFA_LOCAL is the address of the interface on point to point links,
+       IFA_ADDRESS is the address of the peer there */
+    int have_local = 0;
+    int len = IFA_PAYLOAD(msg);
+    struct rtattr* attr;
+    for(attr = IFA_RTA(ifa); RTA_OK(attr, len); attr = RTA_NEXT(attr, len)) {
+        if(attr->rta_type == IFA_LOCAL) {
+            copy_addr(info->addr, attr, ifa->ifa_family);
+            have_local = 1;
+        } else if(attr->rta_type == IFA_ADDRESS && !have_local) {
+            copy_addr(info->addr, attr, ifa->ifa_family);
+        }
+    }
+}
+
+struct addr_dump_ctx {
+    struct nl_array array;
+    int family;
+};
+
+static int
+addr_cb(struct nlmsghdr* msg, void* arg)
+{
+    struct addr_dump_ctx* ctx = arg;
+    struct ifaddrmsg* ifa = NLMSG_DATA(msg);
+
+    if(msg->nlmsg_type != RTM_NEWADDR)
+        return 0;
+    if(ctx->family != AF_UNSPEC && ifa->ifa_family != ctx->family)
+        return 0;
+    if(ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)
+        return 0;
+
+    struct nl_addr_info* info = nl_array_push(&ctx->array);
+    if(!info)
+        return -1;
+
+    nl_parse_addr(msg, info);
+    return 0;
+}
+
+int
+nl_get_addrs(struct ioth* stack, int family, struct nl_addr_info** addrs, size_t* count)
+{
+    struct addr_dump_ctx ctx = {
+        .array = {.elem_size = sizeof(struct nl_addr_info)},
+        .family = family,
+    };
+
+    if(nl_dump(stack, RTM_GETADDR, family, addr_cb, &ctx) < 0) {
+        free(ctx.array.data);
+        return -1;
+    }
+
+    *addrs = ctx.array.data;
+    *count = ctx.array.count;
+    return 0;
+}
+
+/* Fill info from a RTM_NEWROUTE or RTM_DELROUTE message */
+static void
+nl_parse_route(struct nlmsghdr* msg, struct nl_route_info* info)
+{
+    struct rtmsg* rtm = NLMSG_DATA(msg);
+
+    info->family = rtm->rtm_family;
+    info->dst_len = rtm->rtm_dst_len;
+    info->table = rtm->rtm_table;
+    info->protocol = rtm->rtm_protocol;
+
+    int len = RTM_PAYLOAD(msg);
+    struct rtattr* attr;
+    for(attr = RTM_RTA(rtm); RTA_OK(attr, len); attr = RTA_NEXT(attr, len)) {
+        switch(attr->rta_type) {
+            case RTA_DST:
+                copy_addr(info->dst, attr, rtm->rtm_family);
+                info->has_dst = 1;
+                break;
+            case RTA_GATEWAY:
+                copy_addr(info->gateway, attr, rtm->rtm_family);
+                info->has_gateway = 1;
+                break;
+            case RTA_OIF:
+                info->ifindex = *(unsigned int*)RTA_DATA(attr);
+                break;
+            case RTA_PRIORITY:
+                info->priority = *(unsigned int*)RTA_DATA(attr);
+                break;
+            case RTA_TABLE:
+                info->table = *(unsigned int*)RTA_DATA(attr);
+                break;
+        }
+    }
+}
+
+struct route_dump_ctx {
+    struct nl_array array;
+    int family;
+};
+
+static int
+route_cb(struct nlmsghdr* msg, void* arg)
+{
+    struct route_dump_ctx* ctx = arg;
+    struct rtmsg* rtm = NLMSG_DATA(msg);
+
+    if(msg->nlmsg_type != RTM_NEWROUTE)
+        return 0;
+    if(ctx->family != AF_UNSPEC && rtm->rtm_family != ctx->family)
+        return 0;
+    if(rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6)
+        return 0;
+
+    struct nl_route_info* info = nl_array_push(&ctx->array);
+    if(!info)
+        return -1;
+
+    nl_parse_route(msg, info);
+    return 0;
+}
+
+int
+nl_get_routes(struct ioth* stack, int family, struct nl_route_info** routes, size_t* count)
+{
+    struct route_dump_ctx ctx = {
+        .array = {.elem_size = sizeof(struct nl_route_info)},
+        .family = family,
+    };
+
+    if(nl_dump(stack, RTM_GETROUTE, family, route_cb, &ctx) < 0) {
+        free(ctx.array.data);
+        return -1;
+    }
+
+    *routes = ctx.array.data;
+    *count = ctx.array.count;
+    return 0;
+}
+
+/* Fill info from a RTM_NEWLINK or RTM_DELLINK message */
+static void
+nl_parse_link(struct nlmsghdr* msg, struct nl_link_info* info)
+{
+    struct ifinfomsg* ifi = NLMSG_DATA(msg);
+
+    info->ifindex = ifi->ifi_index;
+    info->flags = ifi->ifi_flags;
+    info->type = ifi->ifi_type;
+
+    int len = IFLA_PAYLOAD(msg);
+    struct rtattr* attr;
+    for(attr = IFLA_RTA(ifi); RTA_OK(attr, len); attr = RTA_NEXT(attr, len)) {
+        switch(attr->rta_type) {
+            case IFLA_IFNAME:
+            {
+                size_t namelen = RTA_PAYLOAD(attr);
+                if(namelen >= IF_NAMESIZE)
+                    namelen = IF_NAMESIZE - 1;
+                memcpy(info->name, RTA_DATA(attr), namelen);
+                info->name[namelen] = 0;
+            } break;
+            case IFLA_MTU:
+                info->mtu = *(unsigned int*)RTA_DATA(attr);
+                break;
+            case IFLA_ADDRESS:
+                if(RTA_PAYLOAD(attr) <= sizeof(info->addr)) {
+                    info->addr_len = RTA_PAYLOAD(attr);
+                    memcpy(info->addr, RTA_DATA(attr), info->addr_len);
+                }
+                break;
+            case IFLA_STATS64:
+            {
+                /* Older stacks may send a shorter structure */
+                size_t statslen = RTA_PAYLOAD(attr);
+                if(statslen > sizeof(info->stats))
+                    statslen = sizeof(info->stats);
+                memcpy(&info->stats, RTA_DATA(attr), statslen);
+                info->has_stats = 1;
+            } break;
+        }
+    }
+}
+
+static int
+link_cb(struct nlmsghdr* msg, void* arg)
+{
+    struct nl_array* array = arg;
+
+    if(msg->nlmsg_type != RTM_NEWLINK)
+        return 0;
+
+    struct nl_link_info* info = nl_array_push(array);
+    if(!info)
+        return -1;
+
+    nl_parse_link(msg, info);
+    return 0;
+}
+
+int
+nl_get_links(struct ioth* stack, struct nl_link_info** links, size_t* count)
+{
+    struct nl_array array = {.elem_size = sizeof(struct nl_link_info)};
+
+    if(nl_dump(stack, RTM_GETLINK, AF_UNSPEC, link_cb, &array) < 0) {
+        free(array.data);
+        return -1;
+    }
+
+    *links = array.data;
+    *count = array.count;
+    return 0;
+}
+
+int
+nl_get_link(struct ioth* stack, unsigned int ifindex, struct nl_link_info* link)
+{
+    struct {
+        struct nlmsghdr header;
+        struct ifinfomsg msg;
+    } req;
+    struct nl_array array = {.elem_size = sizeof(struct nl_link_info)};
+    int res = -1;
+
+    memset(&req, 0, sizeof(req));
+    req.header.nlmsg_len = NLMSG_LENGTH(sizeof(struct ifinfomsg));
+    req.header.nlmsg_type = RTM_GETLINK;
+    req.header.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    req.header.nlmsg_seq = 1;
+    req.msg.ifi_family = AF_UNSPEC;
+    req.msg.ifi_index = ifindex;
+
+    if(nl_request(stack, &req.header, link_cb, &array) == 0) {
+        if(array.count > 0) {
+            *link = *(struct nl_link_info*)array.data;
+            res = 0;
+        } else {
+            errno = ENODEV;
+        }
+    }
+
+    free(array.data);
+    return res;
+}
+
+int
+nl_subscribe(struct ioth* stack, unsigned int groups)
+{
+    struct sockaddr_nl addr = {.nl_family = AF_NETLINK, .nl_groups = groups};
+    int fd;
+
+    fd = ioth_msocket(stack, AF_NETLINK, SOCK_RAW | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if(fd < 0)
+        return -1;
+
+    if(ioth_bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+        int saved_errno = errno;
+        ioth_close(fd);
+        errno = saved_errno;
+        return -1;
+    }
+
+    return fd;
+}
+
+/* Parse a notification into the next element of the array, skipping unsupported ones */
+static int
+event_cb(struct nlmsghdr* msg, void* arg)
+{
+    struct nl_array* array = arg;
+    struct nl_event* event;
+
+    switch(msg->nlmsg_type) {
+        case RTM_NEWLINK:
+        case RTM_DELLINK:
+            if(!(event = nl_array_push(array)))
+                return -1;
+            nl_parse_link(msg, &event->link);
+            break;
+
+        case RTM_NEWADDR:
+        case RTM_DELADDR:
+        {
+            struct ifaddrmsg* ifa = NLMSG_DATA(msg);
+            if(ifa->ifa_family != AF_INET && ifa->ifa_family != AF_INET6)
+                return 0;
+            if(!(event = nl_array_push(array)))
+                return -1;
+            nl_parse_addr(msg, &event->addr);
+        } break;
+
+        case RTM_NEWROUTE:
+        case RTM_DELROUTE:
+        {
+            struct rtmsg* rtm = NLMSG_DATA(msg);
+            if(rtm->rtm_family != AF_INET && rtm->rtm_family != AF_INET6)
+                return 0;
+            if(!(event = nl_array_push(array)))
+                return -1;
+            nl_parse_route(msg, &event->route);
+        } break;
+
+        default:
+            return 0;
+    }
+
+    event->type = msg->nlmsg_type;
+    return 0;
+}
+
+int
+nl_read_events(int fd, struct nl_event** events, size_t* count)
+{
+    struct nl_array array = {.elem_size = sizeof(struct nl_event)};
+    char* buf;
+
+    buf = malloc(NL_BUFSIZE);
+    if(!buf) {
+        errno = ENOMEM;
+        return -1;
+    }
+
+    for(;;) {
+        ssize_t len = ioth_recv(fd, buf, NL_BUFSIZE, MSG_DONTWAIT);
+        if(len < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno == EAGAIN || errno == EWOULDBLOCK)
+                break;
+            goto fail;
+        }
+        if(len == 0)
+            break;
+
+        struct nlmsghdr* msg;
+        for(msg = (struct nlmsghdr*)buf; NLMSG_OK(msg, len); msg = NLMSG_NEXT(msg, len)) {
+            if(event_cb(msg, &array) < 0)
+                goto fail;
+        }
+    }
+
+    free(buf);
+    *events = array.data;
+    *count = array.count;
+    return 0;
+
+fail:
+    {
+        int saved_errno = errno;
+        free(buf);
+        free(array.data);
+        errno = saved_errno;
+    }
+    return -1;
+}
+
+/* Append an attribute to the message, the buffer must be large enough */
+static void
+nl_add_attr(struct nlmsghdr* msg, unsigned short type, const void* data, size_t len)
+{
+    struct rtattr* attr = (struct rtattr*)((char*)msg + NLMSG_ALIGN(msg->nlmsg_len));
+    attr->rta_type = type;
+    attr->rta_len = RTA_LENGTH(len);
+    memcpy(RTA_DATA(attr), data, len);
+    msg->nlmsg_len = NLMSG_ALIGN(msg->nlmsg_len) + RTA_ALIGN(attr->rta_len);
+}
+
+/* Build the request for op at buf, returns its length */
+static size_t
+nl_build_op(char* buf, const struct nl_op* op, unsigned int seq)
+{
+    struct nlmsghdr* msg = (struct nlmsghdr*)buf;
+    size_t addrlen = op->family == AF_INET6 ? 16 : 4;
+
+    msg->nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+    msg->nlmsg_seq = seq;
+    msg->nlmsg_pid = 0;
+
+    switch(op->type) {
+        case NL_OP_IPADDR_ADD:
+        case NL_OP_IPADDR_DEL:
+        {
+            struct ifaddrmsg* ifa = NLMSG_DATA(msg);
+            msg->nlmsg_len = NLMSG_LENGTH(sizeof(*ifa));
+            if(op->type == NL_OP_IPADDR_ADD) {
+                msg->nlmsg_type = RTM_NEWADDR;
+                msg->nlmsg_flags |= NLM_F_EXCL | NLM_F_CREATE;
+            } else {
+                msg->nlmsg_type = RTM_DELADDR;
+            }
+            memset(ifa, 0, sizeof(*ifa));
+            ifa->ifa_family = op->family;
+            ifa->ifa_prefixlen = op->prefixlen;
+            ifa->ifa_scope = RT_SCOPE_UNIVERSE;
+            ifa->ifa_index = op->ifindex;
+            nl_add_attr(msg, IFA_LOCAL, op->addr, addrlen);
+            nl_add_attr(msg, IFA_ADDRESS, op->addr, addrlen);
+        } break;
+
+        case NL_OP_IPROUTE_ADD:
+        case NL_OP_IPROUTE_DEL:
+        {
+            struct rtmsg* rtm = NLMSG_DATA(msg);
+            msg->nlmsg_len = NLMSG_LENGTH(sizeof(*rtm));
+            if(op->type == NL_OP_IPROUTE_ADD) {
+                msg->nlmsg_type = RTM_NEWROUTE;
+                msg->nlmsg_flags |= NLM_F_EXCL | NLM_F_CREATE;
+            } else {
+                msg->nlmsg_type = RTM_DELROUTE;
+            }
+            memset(rtm, 0, sizeof(*rtm));
+            rtm->rtm_family = op->family;
+            rtm->rtm_dst_len = op->has_dst ? op->prefixlen : 0;
+            rtm->rtm_table = RT_TABLE_MAIN;
+            rtm->rtm_protocol = RTPROT_BOOT;
+            rtm->rtm_scope = RT_SCOPE_UNIVERSE;
+            rtm->rtm_type = RTN_UNICAST;
+            if(op->has_dst)
+                nl_add_attr(msg, RTA_DST, op->addr, addrlen);
+            nl_add_attr(msg, RTA_GATEWAY, op->gateway, addrlen);
+            if(op->ifindex)
+                nl_add_attr(msg, RTA_OIF, &op->ifindex, sizeof(op->ifindex));
+        } break;
+
+        case NL_OP_LINKSETUPDOWN:
+        case NL_OP_LINKSETMTU:
+        {
+            struct ifinfomsg* ifi = NLMSG_DATA(msg);
+            msg->nlmsg_len = NLMSG_LENGTH(sizeof(*ifi));
+            msg->nlmsg_type = RTM_NEWLINK;
+            memset(ifi, 0, sizeof(*ifi));
+            ifi->ifi_family = AF_UNSPEC;
+            ifi->ifi_index = op->ifindex;
+            if(op->type == NL_OP_LINKSETUPDOWN) {
+                ifi->ifi_flags = op->value ? IFF_UP : 0;
+                ifi->ifi_change = IFF_UP;
+            } else {
+                nl_add_attr(msg, IFLA_MTU, &op->value, sizeof(op->value));
+            }
+        } break;
+    }
+
+    return NLMSG_ALIGN(msg->nlmsg_len);
+}
+
+/* Largest request built by nl_build_op */
+#define NL_OP_MAXLEN NLMSG_ALIGN(NLMSG_LENGTH(sizeof(struct rtmsg)) + 2 * RTA_SPACE(16) + RTA_SPACE(sizeof(unsigned int)))
+
+int
+nl_apply(struct ioth* stack, struct nl_op* ops, size_t count)
+{
+    static const struct sockaddr_nl kernel = {.nl_family = AF_NETLINK};
+    char* buf = NULL;
+    int fd;
+    int res = -1;
+    size_t start = 0;
+
+    /* -1 marks the operations still waiting for an ack */
+    for(size_t i = 0; i < count; i++)
+        ops[i].error = -1;
+
+    fd = ioth_msocket(stack, AF_NETLINK, SOCK_RAW | SOCK_CLOEXEC, NETLINK_ROUTE);
+    if(fd < 0)
+        goto out;
+
+    buf = malloc(NL_BUFSIZE > NL_BATCH * NL_OP_MAXLEN ? NL_BUFSIZE : NL_BATCH * NL_OP_MAXLEN);
+    if(!buf) {
+        errno = ENOMEM;
+        goto out;
+    }
+
+    while(start < count) {
+        size_t n = count - start < NL_BATCH ? count - start : NL_BATCH;
+        size_t len = 0;
+        size_t pending = n;
+
+        /* The sequence number of each request is its index in ops plus one */
+        for(size_t i = start; i < start + n; i++)
+            len += nl_build_op(buf + len, &ops[i], i + 1);
+
+        if(ioth_sendto(fd, buf, len, 0, (struct sockaddr*)&kernel, sizeof(kernel)) < 0)
+            goto out;
+
+        while(pending > 0) {
+            ssize_t rlen = ioth_recv(fd, buf, NL_BUFSIZE, 0);
+            if(rlen < 0) {
+                if(errno == EINTR)
+                    continue;
+                goto out;
+            }
+            if(rlen == 0) {
+                errno = EPROTO;
+                goto out;
+            }
+
+            struct nlmsghdr* msg;
+            for(msg = (struct nlmsghdr*)buf; NLMSG_OK(msg, rlen); msg = NLMSG_NEXT(msg, rlen)) {
+                if(msg->nlmsg_type != NLMSG_ERROR)
+                    continue;
+                if(msg->nlmsg_seq < start + 1 || msg->nlmsg_seq > start + n)
+                    continue;
+
+                struct nl_op* op = &ops[msg->nlmsg_seq - 1];
+                if(op->error == -1) {
+                    struct nlmsgerr* err = NLMSG_DATA(msg);
+                    op->error = -err->error;
+                    pending--;
+                }
+            }
+        }
+
+        start += n;
+    }
+
+    res = 0;
+out:
+    {
+        int saved_errno = errno;
+        if(res < 0) {
+            for(size_t i = start; i < count; i++)
+                if(ops[i].error == -1)
+                    ops[i].error = saved_errno;
+        }
+        free(buf);
+        if(fd >= 0)
+            ioth_close(fd);
+        errno = saved_errno;
+    }
+    return res;
+}
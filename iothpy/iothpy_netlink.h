@@ -0,0 +1,118 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <net/if.h>
+#include <linux/if_link.h>
+
+#include <ioth.h>
+
+/*
+    Minimal netlink client used to read the state of a stack through
+    netlink dumps (RTM_GETADDR, RTM_GETROUTE, ...) on a NETLINK_ROUTE
+    socket of the stack itself. None of the functions require the GIL.
+*/
+
+struct nl_addr_info {
+    int family;
+    int prefixlen;
+    int scope;
+    unsigned int ifindex;
+    unsigned char addr[16];
+};
+
+struct nl_route_info {
+    int family;
+    int dst_len;
+    int table;
+    int protocol;
+    unsigned int ifindex;
+    unsigned int priority;
+    int has_dst;
+    int has_gateway;
+    unsigned char dst[16];
+    unsigned char gateway[16];
+};
+
+struct nl_link_info {
+    unsigned int ifindex;
+    unsigned int flags;             /* IFF_* */
+    unsigned int mtu;
+    int type;                       /* ARPHRD_* */
+    int addr_len;                   /* 0 if the link has no hardware address */
+    char name[IF_NAMESIZE];
+    unsigned char addr[32];
+    int has_stats;                  /* 0 if the stack does not report IFLA_STATS64 */
+    struct rtnl_link_stats64 stats;
+};
+
+/*
+    Return in *addrs a malloc'd array of the addresses of the stack of the given
+    family (AF_UNSPEC for all) and its length in *count.
+    Returns 0 on success, -1 with errno set on error.
+*/
+int nl_get_addrs(struct ioth* stack, int family, struct nl_addr_info** addrs, size_t* count);
+
+/* Same as nl_get_addrs for the routes of all the routing tables */
+int nl_get_routes(struct ioth* stack, int family, struct nl_route_info** routes, size_t* count);
+
+/* Same as nl_get_addrs for the links of the stack */
+int nl_get_links(struct ioth* stack, struct nl_link_info** links, size_t* count);
+
+/* Read the link with the given index, returns -1 with errno set on error (ENODEV if missing) */
+int nl_get_link(struct ioth* stack, unsigned int ifindex, struct nl_link_info* link);
+
+/* Notification received by a socket opened with nl_subscribe */
+struct nl_event {
+    int type;                       /* RTM_NEWLINK, RTM_DELLINK, RTM_NEWADDR, ... */
+    union {
+        struct nl_link_info link;
+        struct nl_addr_info addr;
+        struct nl_route_info route;
+    };
+};
+
+/*
+    Open a non blocking netlink socket of the stack subscribed to the
+    rtnetlink multicast groups (RTMGRP_* bitmask).
+    Returns the file descriptor, -1 with errno set on error.
+*/
+int nl_subscribe(struct ioth* stack, unsigned int groups);
+
+/*
+    Read all the notifications queued on fd without blocking and return in
+    *events a malloc'd array of the link, address and route events and its
+    length in *count, 0 if nothing was queued.
+    Returns 0 on success, -1 with errno set on error (ENOBUFS if the
+    socket buffer overflowed and events were lost).
+*/
+int nl_read_events(int fd, struct nl_event** events, size_t* count);
+
+/* Operations executed by nl_apply */
+enum nl_op_type {
+    NL_OP_IPADDR_ADD,
+    NL_OP_IPADDR_DEL,
+    NL_OP_IPROUTE_ADD,
+    NL_OP_IPROUTE_DEL,
+    NL_OP_LINKSETUPDOWN,
+    NL_OP_LINKSETMTU,
+};
+
+struct nl_op {
+    enum nl_op_type type;
+    int family;
+    unsigned int ifindex;
+    int prefixlen;                  /* prefix of the address or of the route destination */
+    int has_dst;                    /* 0 for default routes */
+    unsigned char addr[16];         /* address or route destination */
+    unsigned char gateway[16];
+    unsigned int value;             /* up/down flag or mtu */
+    int error;                      /* set by nl_apply: 0 or an errno value */
+};
+
+/*
+    Execute the operations in order, sending them in batches on a single
+    netlink socket and collecting one acknowledgement for each of them.
+    The result of each operation is stored in its error field.
+    Returns 0 if all the batches were exchanged, -1 with errno set otherwise,
+    the operations not executed then have error set to that errno.
+*/
+int nl_apply(struct ioth* stack, struct nl_op* ops, size_t count);
@@ -0,0 +1,281 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_pump.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/eventfd.h>
+
+#include <ioth.h>
+
+#define RECV_PUMP_MAX_SLOTS 65536
+
+/*
+    The thread and the consumer sleep on their eventfd only after setting
+    their waiting flag and checking the ring once more, and each of them
+    signals the other after moving its index if the flag is set. All the
+    accesses to the indexes and the flags are sequentially consistent, so
+    one of the two always sees the move of the other.
+*/
+
+static void*
+recv_pump_thread(void* arg)
+{
+    struct recv_pump* p = arg;
+    int err = 0;
+
+    while(!__atomic_load_n(&p->stopping, __ATOMIC_SEQ_CST)) {
+        unsigned int tail = p->tail;
+        unsigned int head = __atomic_load_n(&p->head, __ATOMIC_SEQ_CST);
+
+        /* Full ring, stop reading and let the stack apply its backpressure */
+        if(tail - head == p->nslots) {
+            p->full++;
+            __atomic_store_n(&p->producer_waiting, 1, __ATOMIC_SEQ_CST);
+            if(__atomic_load_n(&p->head, __ATOMIC_SEQ_CST) == head
+                    && !__atomic_load_n(&p->stopping, __ATOMIC_SEQ_CST)) {
+                struct pollfd pfd = {p->wake_fd, POLLIN, 0};
+                poll(&pfd, 1, -1);
+                eventfd_drain(p->wake_fd);
+            }
+            __atomic_store_n(&p->producer_waiting, 0, __ATOMIC_SEQ_CST);
+            continue;
+        }
+
+        struct recv_pump_slot* slot = &p->slots[tail & (p->nslots - 1)];
+        ssize_t n;
+        if(p->addresses) {
+            slot->addrlen = sizeof(slot->addr);
+            n = ioth_recvfrom(p->fd, slot->data, p->bufsize, MSG_DONTWAIT,
+                              (struct sockaddr*)&slot->addr, &slot->addrlen);
+        } else {
+            slot->addrlen = 0;
+            n = ioth_recv(p->fd, slot->data, p->bufsize, MSG_DONTWAIT);
+        }
+
+        if(n < 0) {
+            if(errno == EINTR)
+                continue;
+            if(errno != EAGAIN && errno != EWOULDBLOCK) {
+                err = errno;
+                break;
+            }
+
+            /* Nothing to read, wait for the socket or for stop */
+            struct pollfd pfds[2] = {
+                {p->fd, POLLIN, 0},
+                {p->wake_fd, POLLIN, 0},
+            };
+            if(poll(pfds, 2, -1) < 0 && errno != EINTR) {
+                err = errno;
+                break;
+            }
+            if(pfds[1].revents)
+                eventfd_drain(p->wake_fd);
+            continue;
+        }
+
+        if(n == 0 && p->stream)
+            break;
+
+        slot->len = n;
+        p->received++;
+        p->bytes += n;
+        __atomic_store_n(&p->tail, tail + 1, __ATOMIC_SEQ_CST);
+        if(__atomic_exchange_n(&p->consumer_waiting, 0, __ATOMIC_SEQ_CST))
+            eventfd_signal(p->data_fd);
+    }
+
+    p->error = err;
+    __atomic_store_n(&p->finished, 1, __ATOMIC_SEQ_CST);
+    eventfd_signal(p->data_fd);
+    return NULL;
+}
+
+static void
+recv_pump_free(struct recv_pump* p)
+{
+    if(p->wake_fd != -1)
+        close(p->wake_fd);
+    if(p->data_fd != -1)
+        close(p->data_fd);
+    free(p->buffer);
+    free(p->slots);
+    free(p);
+}
+
+struct recv_pump*
+recv_pump_start(int fd, unsigned int nslots, size_t bufsize, int stream, int addresses)
+{
+    if(nslots == 0 || nslots > RECV_PUMP_MAX_SLOTS || bufsize == 0
+            || bufsize > SIZE_MAX / RECV_PUMP_MAX_SLOTS) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct recv_pump* p = calloc(1, sizeof(struct recv_pump));
+    if(!p)
+        return NULL;
+
+    unsigned int size = 1;
+    while(size < nslots)
+        size <<= 1;
+
+    p->fd = fd;
+    p->stream = stream;
+    p->addresses = addresses;
+    p->bufsize = bufsize;
+    p->nslots = size;
+    p->pid = getpid();
+    p->refs = 1;
+    p->slots = calloc(size, sizeof(struct recv_pump_slot));
+    p->buffer = malloc(size * bufsize);
+    p->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    p->data_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(!p->slots || !p->buffer || p->wake_fd == -1 || p->data_fd == -1) {
+        int err = (!p->slots || !p->buffer) ? ENOMEM : errno;
+        recv_pump_free(p);
+        errno = err;
+        return NULL;
+    }
+    for(unsigned int i = 0; i < size; i++)
+        p->slots[i].data = p->buffer + (size_t)i * bufsize;
+
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->cond, NULL);
+
+    int err = thread_start_nosignals(&p->thread, recv_pump_thread, p);
+
+    if(err) {
+        pthread_cond_destroy(&p->cond);
+        pthread_mutex_destroy(&p->lock);
+        recv_pump_free(p);
+        errno = err;
+        return NULL;
+    }
+
+    return p;
+}
+
+void
+recv_pump_stop(struct recv_pump* p)
+{
+    if(p->pid != getpid())
+        return;
+
+    __atomic_store_n(&p->stopping, 1, __ATOMIC_SEQ_CST);
+    eventfd_signal(p->wake_fd);
+    pthread_join(p->thread, NULL);
+}
+
+void
+recv_pump_ref(struct recv_pump* p)
+{
+    __atomic_add_fetch(&p->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+recv_pump_release(struct recv_pump* p)
+{
+    if(__atomic_sub_fetch(&p->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    pthread_cond_destroy(&p->cond);
+    pthread_mutex_destroy(&p->lock);
+    recv_pump_free(p);
+}
+
+void
+recv_pump_forget(struct recv_pump* p)
+{
+    /* The locks may have been held by threads of the parent */
+    recv_pump_free(p);
+}
+
+int
+recv_pump_claim(struct recv_pump* p, int wait)
+{
+    pthread_mutex_lock(&p->lock);
+    while(p->busy && wait)
+        pthread_cond_wait(&p->cond, &p->lock);
+
+    int claimed = !p->busy;
+    p->busy = 1;
+    pthread_mutex_unlock(&p->lock);
+    return claimed;
+}
+
+void
+recv_pump_unclaim(struct recv_pump* p)
+{
+    pthread_mutex_lock(&p->lock);
+    p->busy = 0;
+    pthread_cond_signal(&p->cond);
+    pthread_mutex_unlock(&p->lock);
+}
+
+int
+recv_pump_wait(struct recv_pump* p, int timeout)
+{
+    unsigned int head = p->head;
+    unsigned int tail = __atomic_load_n(&p->tail, __ATOMIC_SEQ_CST);
+
+    if(tail == head && timeout != 0 && !__atomic_load_n(&p->finished, __ATOMIC_SEQ_CST)) {
+        __atomic_store_n(&p->consumer_waiting, 1, __ATOMIC_SEQ_CST);
+        tail = __atomic_load_n(&p->tail, __ATOMIC_SEQ_CST);
+        if(tail == head && !__atomic_load_n(&p->finished, __ATOMIC_SEQ_CST)) {
+            struct pollfd pfd = {p->data_fd, POLLIN, 0};
+            int res = poll(&pfd, 1, timeout);
+            if(res < 0) {
+                __atomic_store_n(&p->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+                return -1;
+            }
+            if(res > 0)
+                eventfd_drain(p->data_fd);
+            tail = __atomic_load_n(&p->tail, __ATOMIC_SEQ_CST);
+        }
+        __atomic_store_n(&p->consumer_waiting, 0, __ATOMIC_SEQ_CST);
+    }
+
+    return tail - head;
+}
+
+struct recv_pump_slot*
+recv_pump_slot(struct recv_pump* p, unsigned int i)
+{
+    return &p->slots[(p->head + i) & (p->nslots - 1)];
+}
+
+void
+recv_pump_consume(struct recv_pump* p, unsigned int count)
+{
+    if(count == 0)
+        return;
+
+    __atomic_store_n(&p->head, p->head + count, __ATOMIC_SEQ_CST);
+    if(__atomic_exchange_n(&p->producer_waiting, 0, __ATOMIC_SEQ_CST))
+        eventfd_signal(p->wake_fd);
+}
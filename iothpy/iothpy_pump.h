@@ -0,0 +1,99 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+#include <sys/socket.h>
+
+/*
+    Receive pump: a thread owned by a socket reading it continuously into
+    a bounded ring of buffers, drained in batches by the consumer. The
+    ring has a single producer, the thread, and a single consumer at a
+    time, see recv_pump_claim, so it is handed over without locks.
+    None of the functions require the GIL.
+*/
+
+struct recv_pump_slot {
+    char* data;                     /* bufsize bytes in the buffer of the pump */
+    size_t len;
+    socklen_t addrlen;              /* 0 if the pump does not keep addresses */
+    struct sockaddr_storage addr;
+};
+
+struct recv_pump {
+    int fd;
+    int stream;                     /* a read of 0 bytes is the end of the stream */
+    int addresses;                  /* read with recvfrom and keep the sender */
+    size_t bufsize;
+
+    /* nslots is a power of two, head and tail wrap around */
+    unsigned int nslots;
+    struct recv_pump_slot* slots;
+    char* buffer;
+
+    unsigned int head;              /* next slot of the consumer */
+    unsigned int tail;              /* next slot of the thread */
+
+    /* Eventfd waking the thread up when the ring has room again or on stop,
+       written if producer_waiting is set */
+    int wake_fd;
+    int producer_waiting;
+    /* Eventfd waking the consumer up on new data, written if
+       consumer_waiting is set, and when the thread exits */
+    int data_fd;
+    int consumer_waiting;
+
+    int stopping;
+    int finished;                   /* the thread exited, on error if error is set */
+    int error;
+
+    /* Statistics, written by the thread only */
+    uint64_t received;
+    uint64_t bytes;
+    uint64_t full;                  /* times the thread stopped reading on a full ring */
+
+    pthread_t thread;
+    pid_t pid;                      /* the thread does not survive fork */
+    int refs;
+
+    /* Protect busy, the consumer of the ring */
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    int busy;
+};
+
+/*
+    Start a thread reading fd into a ring of at least nslots buffers of
+    bufsize bytes. The pump starts with a reference owned by the caller.
+    Returns the pump, NULL with errno set on error.
+*/
+struct recv_pump* recv_pump_start(int fd, unsigned int nslots, size_t bufsize, int stream, int addresses);
+
+/* Stop the thread and wait for it, the fd can then be closed. Call once */
+void recv_pump_stop(struct recv_pump* pump);
+
+void recv_pump_ref(struct recv_pump* pump);
+void recv_pump_release(struct recv_pump* pump);
+
+/* Free the pump in the child after a fork, without waiting for the thread */
+void recv_pump_forget(struct recv_pump* pump);
+
+/*
+    Become the consumer of the ring. If wait is 0 returns 0 when another
+    thread is the consumer, otherwise waits for it. Returns 1 on success.
+*/
+int recv_pump_claim(struct recv_pump* pump, int wait);
+void recv_pump_unclaim(struct recv_pump* pump);
+
+/*
+    Return the number of slots ready to be consumed, waiting up to timeout
+    milliseconds (-1 forever) for the first one if the ring is empty and
+    the thread is running. Returns -1 with errno set if poll fails.
+    Must be called by the consumer.
+*/
+int recv_pump_wait(struct recv_pump* pump, int timeout);
+
+/* Return the i-th slot ready to be consumed */
+struct recv_pump_slot* recv_pump_slot(struct recv_pump* pump, unsigned int i);
+
+/* Give the first count slots back to the thread */
+void recv_pump_consume(struct recv_pump* pump, unsigned int count);
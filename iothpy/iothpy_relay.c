@@ -0,0 +1,677 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_state.h"
+#include "iothpy_relay.h"
+#include "iothpy_stack.h"
+#include "iothpy_socket.h"
+#include "utils.h"
+
+#include <structmember.h>
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include <ioth.h>
+
+#define RELAY_DEFAULT_BUFSIZE 65536
+
+/* Reads of a direction in a row before moving to the next pair */
+#define RELAY_MAX_ROUNDS 16
+
+static ssize_t
+relay_recv(struct relay_pair* p, int i, void* buf, size_t len)
+{
+    if(p->kernel[i])
+        return recv(p->fd[i], buf, len, MSG_DONTWAIT);
+    return ioth_recv(p->fd[i], buf, len, MSG_DONTWAIT);
+}
+
+static ssize_t
+relay_send(struct relay_pair* p, int i, const void* buf, size_t len)
+{
+    if(p->kernel[i])
+        return send(p->fd[i], buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+    return ioth_send(p->fd[i], buf, len, MSG_DONTWAIT | MSG_NOSIGNAL);
+}
+
+static int
+relay_shutdown(struct relay_pair* p, int i)
+{
+    if(p->kernel[i])
+        return shutdown(p->fd[i], SHUT_WR);
+    return ioth_shutdown(p->fd[i], SHUT_WR);
+}
+
+static int
+relay_would_block(int err)
+{
+    return err == EAGAIN || err == EWOULDBLOCK || err == EINTR;
+}
+
+/* Move the data read from fd[i] to the other socket, returns 0 or an errno value */
+static int
+relay_pair_move(struct relay_pair* p, int i)
+{
+    int o = 1 - i;
+
+    for(int round = 0; round < RELAY_MAX_ROUNDS; round++) {
+        if(p->len[i] == 0 && !p->eof[i]) {
+            ssize_t n = relay_recv(p, i, p->buf[i], p->bufsize);
+            if(n < 0) {
+                if(relay_would_block(errno))
+                    break;
+                return errno;
+            }
+            if(n == 0)
+                p->eof[i] = 1;
+            p->len[i] = n;
+            p->off[i] = 0;
+        }
+
+        if(p->len[i] == 0)
+            break;
+
+        ssize_t n = relay_send(p, o, p->buf[i] + p->off[i], p->len[i] - p->off[i]);
+        if(n < 0) {
+            if(relay_would_block(errno))
+                break;
+            return errno;
+        }
+        p->off[i] += n;
+        __atomic_store_n(&p->bytes[i], p->bytes[i] + n, __ATOMIC_RELAXED);
+
+        /* Partial write, wait for the other socket */
+        if(p->off[i] < p->len[i])
+            break;
+        p->len[i] = 0;
+    }
+
+    /* Forward the end of the stream once all the data was written */
+    if(p->eof[i] && p->len[i] == 0 && !p->shut[o]) {
+        if(relay_shutdown(p, o) < 0 && errno != ENOTCONN)
+            return errno;
+        p->shut[o] = 1;
+    }
+
+    return 0;
+}
+
+/* Poll events of fd[i] of the pair, -1 if there is nothing to wait for */
+static short
+relay_pair_events(struct relay_pair* p, int i)
+{
+    short events = 0;
+
+    if(!p->eof[i] && p->len[i] == 0)
+        events |= POLLIN;
+    if(p->len[1 - i] > 0)
+        events |= POLLOUT;
+    return events;
+}
+
+static void
+relay_pair_finish(struct relay_pair* p, int error)
+{
+    p->error = error;
+    __atomic_store_n(&p->finished, 1, __ATOMIC_RELEASE);
+    /* The done function may free the pair */
+    if(p->done)
+        p->done(p);
+}
+
+struct relay_pair*
+relay_pair_new(int fd_a, int kernel_a, int fd_b, int kernel_b, size_t bufsize)
+{
+    struct relay_pair* p = calloc(1, sizeof(struct relay_pair));
+    if(!p)
+        return NULL;
+
+    p->fd[0] = fd_a;
+    p->fd[1] = fd_b;
+    p->kernel[0] = kernel_a;
+    p->kernel[1] = kernel_b;
+    p->bufsize = bufsize;
+    p->buf[0] = malloc(bufsize);
+    p->buf[1] = malloc(bufsize);
+    if(!p->buf[0] || !p->buf[1]) {
+        relay_pair_free(p);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    return p;
+}
+
+void
+relay_pair_free(struct relay_pair* p)
+{
+    free(p->buf[0]);
+    free(p->buf[1]);
+    free(p);
+}
+
+static void*
+relay_loop_thread(void* arg)
+{
+    struct relay_loop* loop = arg;
+    struct pollfd* pfds = NULL;
+    size_t pfds_size = 0;
+
+    pthread_mutex_lock(&loop->lock);
+    while(!loop->stopping) {
+        while(loop->incoming) {
+            struct relay_pair* p = loop->incoming;
+            loop->incoming = p->next;
+            p->next = loop->pairs;
+            loop->pairs = p;
+            loop->npairs++;
+        }
+        pthread_mutex_unlock(&loop->lock);
+
+        size_t needed = 1 + 2 * (size_t)loop->npairs;
+        if(needed > pfds_size) {
+            struct pollfd* larger = realloc(pfds, needed * sizeof(struct pollfd));
+            if(larger) {
+                pfds = larger;
+                pfds_size = needed;
+            }
+        }
+
+        /* Without memory for all the pairs the newest ones give up */
+        while(1 + 2 * (size_t)loop->npairs > pfds_size) {
+            struct relay_pair* p = loop->pairs;
+            loop->pairs = p->next;
+            loop->npairs--;
+            relay_pair_finish(p, ENOMEM);
+        }
+
+        pfds[0].fd = loop->wake_fd;
+        pfds[0].events = POLLIN;
+        size_t n = 1;
+        for(struct relay_pair* p = loop->pairs; p; p = p->next) {
+            for(int i = 0; i < 2; i++, n++) {
+                /* A socket with nothing to wait for is left out, its
+                   POLLHUP would wake the loop up again and again */
+                pfds[n].events = relay_pair_events(p, i);
+                pfds[n].fd = pfds[n].events ? p->fd[i] : -1;
+                pfds[n].revents = 0;
+            }
+        }
+
+        poll(pfds, n, -1);
+        if(pfds[0].revents)
+            eventfd_drain(loop->wake_fd);
+
+        n = 1;
+        struct relay_pair** pp = &loop->pairs;
+        while(*pp) {
+            struct relay_pair* p = *pp;
+            int ready = pfds[n].revents || pfds[n + 1].revents;
+            int err = 0;
+            n += 2;
+
+            if(ready) {
+                err = relay_pair_move(p, 0);
+                if(!err)
+                    err = relay_pair_move(p, 1);
+            }
+
+            if(err || (p->shut[0] && p->shut[1])) {
+                *pp = p->next;
+                loop->npairs--;
+                relay_pair_finish(p, err);
+            } else {
+                pp = &p->next;
+            }
+        }
+
+        pthread_mutex_lock(&loop->lock);
+    }
+
+    /* Cancel the pairs left */
+    while(loop->incoming) {
+        struct relay_pair* p = loop->incoming;
+        loop->incoming = p->next;
+        relay_pair_finish(p, ECANCELED);
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    while(loop->pairs) {
+        struct relay_pair* p = loop->pairs;
+        loop->pairs = p->next;
+        relay_pair_finish(p, ECANCELED);
+    }
+    loop->npairs = 0;
+
+    free(pfds);
+    return NULL;
+}
+
+struct relay_loop*
+relay_loop_start(void)
+{
+    struct relay_loop* loop = calloc(1, sizeof(struct relay_loop));
+    if(!loop)
+        return NULL;
+
+    loop->pid = getpid();
+    loop->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(loop->wake_fd == -1) {
+        free(loop);
+        return NULL;
+    }
+    pthread_mutex_init(&loop->lock, NULL);
+
+    int err = thread_start_nosignals(&loop->thread, relay_loop_thread, loop);
+
+    if(err) {
+        pthread_mutex_destroy(&loop->lock);
+        close(loop->wake_fd);
+        free(loop);
+        errno = err;
+        return NULL;
+    }
+
+    return loop;
+}
+
+int
+relay_loop_add(struct relay_loop* loop, struct relay_pair* pair)
+{
+    pthread_mutex_lock(&loop->lock);
+    int stopping = loop->stopping;
+    if(!stopping) {
+        pair->next = loop->incoming;
+        loop->incoming = pair;
+    }
+    pthread_mutex_unlock(&loop->lock);
+
+    if(stopping) {
+        errno = EBADF;
+        return -1;
+    }
+
+    eventfd_signal(loop->wake_fd);
+    return 0;
+}
+
+void
+relay_loop_stop(struct relay_loop* loop)
+{
+    /* In a child after fork the thread is gone, its pairs are leaked */
+    if(loop->pid == getpid()) {
+        pthread_mutex_lock(&loop->lock);
+        loop->stopping = 1;
+        pthread_mutex_unlock(&loop->lock);
+        eventfd_signal(loop->wake_fd);
+
+        pthread_join(loop->thread, NULL);
+        pthread_mutex_destroy(&loop->lock);
+    }
+
+    close(loop->wake_fd);
+    free(loop);
+}
+
+/*
+    Python interface
+*/
+
+/* Get the fd of a relayed socket: a socket of a stack, an object with
+   fileno() or a file descriptor of a kernel socket */
+static int
+relay_get_fd(iothpy_state* st, PyObject* sock, int* fd, int* kernel)
+{
+    if(PyObject_TypeCheck(sock, st->socket_type)) {
+        *fd = get_sock_fd((socket_object*)sock);
+        *kernel = 0;
+    } else {
+        *fd = PyObject_AsFileDescriptor(sock);
+        if(*fd < 0)
+            return -1;
+        *kernel = 1;
+    }
+
+    if(*fd < 0) {
+        errno = EBADF;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return 0;
+}
+
+static void
+relay_object_done(struct relay_pair* pair)
+{
+    relay_object* self = pair->data;
+    eventfd_signal(self->done_fd);
+}
+
+/* Stop the loop of the relay, cancelling it if still running */
+static void
+relay_close_internal(relay_object* self)
+{
+    struct relay_loop* loop = self->loop;
+
+    self->loop = NULL;
+    if(loop) {
+        Py_BEGIN_ALLOW_THREADS
+        relay_loop_stop(loop);
+        Py_END_ALLOW_THREADS
+    }
+}
+
+static int
+relay_is_finished(relay_object* self)
+{
+    return self->pair && __atomic_load_n(&self->pair->finished, __ATOMIC_ACQUIRE);
+}
+
+PyDoc_STRVAR(relay_wait_doc, "wait(timeout=None) -> bool\n\
+\n\
+Wait up to timeout seconds (None for no limit) for the relay to finish,\n\
+return True if it finished.");
+
+static PyObject*
+relay_wait(relay_object* self, PyObject* args, PyObject* kwargs)
+{
+    static char* kwnames[] = {"timeout", NULL};
+    PyObject* timeout_obj = Py_None;
+    _PyTime_t timeout;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:wait", kwnames, &timeout_obj))
+        return NULL;
+    if(socket_parse_timeout(&timeout, timeout_obj) < 0)
+        return NULL;
+
+    _PyTime_t deadline = _PyTime_GetMonotonicClock() + timeout;
+    while(self->done_fd != -1 && !relay_is_finished(self)) {
+        int ms = -1;
+        if(timeout >= 0) {
+            _PyTime_t interval = deadline - _PyTime_GetMonotonicClock();
+            if(interval < 0)
+                break;
+            ms = (int)_PyTime_AsMilliseconds(interval, _PyTime_ROUND_CEILING);
+        }
+
+        struct pollfd pfd = {self->done_fd, POLLIN, 0};
+        int res;
+
+        Py_BEGIN_ALLOW_THREADS
+        res = poll(&pfd, 1, ms);
+        Py_END_ALLOW_THREADS
+
+        if(res < 0) {
+            if(errno != EINTR)
+                return PyErr_SetFromErrno(PyExc_OSError);
+            if(PyErr_CheckSignals())
+                return NULL;
+        }
+        if(res == 0)
+            break;
+    }
+
+    return PyBool_FromLong(relay_is_finished(self));
+}
+
+PyDoc_STRVAR(relay_fileno_doc, "fileno() -> int\n\
+\n\
+Return a file descriptor readable once the relay finished.");
+
+static PyObject*
+relay_fileno(relay_object* self, PyObject* Py_UNUSED(ignored))
+{
+    return PyLong_FromLong(self->done_fd);
+}
+
+PyDoc_STRVAR(relay_close_doc, "close()\n\
+\n\
+Stop the relay, cancelling it if still running. The sockets stay open.");
+
+static PyObject*
+relay_close(relay_object* self, PyObject* Py_UNUSED(ignored))
+{
+    relay_close_internal(self);
+    Py_RETURN_NONE;
+}
+
+static PyMethodDef relay_methods[] = {
+    {"wait", (PyCFunction)relay_wait, METH_VARARGS | METH_KEYWORDS, relay_wait_doc},
+    {"fileno", (PyCFunction)relay_fileno, METH_NOARGS, relay_fileno_doc},
+    {"close", (PyCFunction)relay_close, METH_NOARGS, relay_close_doc},
+    {NULL, NULL} /* sentinel */
+};
+
+static PyObject*
+relay_get_bytes(relay_object* self, void* closure)
+{
+    int i = closure != NULL;
+    if(!self->pair)
+        return PyLong_FromLong(0);
+    return PyLong_FromUnsignedLongLong(__atomic_load_n(&self->pair->bytes[i], __ATOMIC_RELAXED));
+}
+
+static PyObject*
+relay_get_done(relay_object* self, void* Py_UNUSED(closure))
+{
+    return PyBool_FromLong(relay_is_finished(self));
+}
+
+static PyObject*
+relay_get_error(relay_object* self, void* Py_UNUSED(closure))
+{
+    if(!relay_is_finished(self) || self->pair->error == 0)
+        Py_RETURN_NONE;
+
+    int error = self->pair->error;
+    return PyObject_CallFunction(PyExc_OSError, "is", error, strerror(error));
+}
+
+static PyGetSetDef relay_getsetlist[] = {
+    {"bytes_ab", (getter)relay_get_bytes, NULL, "bytes moved from sock_a to sock_b", NULL},
+    {"bytes_ba", (getter)relay_get_bytes, NULL, "bytes moved from sock_b to sock_a", (void*)1},
+    {"done", (getter)relay_get_done, NULL, "True once the relay finished", NULL},
+    {"error", (getter)relay_get_error, NULL, "OSError that ended the relay, None if it ended with both the streams", NULL},
+    {NULL} /* sentinel */
+};
+
+static PyMemberDef relay_memberlist[] = {
+    {"sock_a", T_OBJECT_EX, offsetof(relay_object, sock_a), READONLY, "the first socket of the relay"},
+    {"sock_b", T_OBJECT_EX, offsetof(relay_object, sock_b), READONLY, "the second socket of the relay"},
+    {0},
+};
+
+static int
+relay_initobj(PyObject* self, PyObject* args, PyObject* kwargs)
+{
+    relay_object* r = (relay_object*)self;
+    static char* kwnames[] = {"sock_a", "sock_b", "bufsize", NULL};
+    PyObject* sock_a;
+    PyObject* sock_b;
+    Py_ssize_t bufsize = RELAY_DEFAULT_BUFSIZE;
+    int fd_a, fd_b, kernel_a, kernel_b;
+
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return -1;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|n:Relay", kwnames, &sock_a, &sock_b, &bufsize))
+        return -1;
+
+    if(r->pair) {
+        PyErr_SetString(PyExc_RuntimeError, "Relay already initialized");
+        return -1;
+    }
+    if(bufsize <= 0) {
+        PyErr_SetString(PyExc_ValueError, "bufsize must be positive");
+        return -1;
+    }
+    if(relay_get_fd(st, sock_a, &fd_a, &kernel_a) < 0 || relay_get_fd(st, sock_b, &fd_b, &kernel_b) < 0)
+        return -1;
+
+    r->done_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(r->done_fd < 0) {
+        r->done_fd = -1;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    r->pair = relay_pair_new(fd_a, kernel_a, fd_b, kernel_b, bufsize);
+    if(!r->pair) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    r->pair->done = relay_object_done;
+    r->pair->data = r;
+
+    r->loop = relay_loop_start();
+    if(!r->loop || relay_loop_add(r->loop, r->pair) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    Py_INCREF(sock_a);
+    r->sock_a = sock_a;
+    Py_INCREF(sock_b);
+    r->sock_b = sock_b;
+
+    return 0;
+}
+
+static PyObject*
+relay_new(PyTypeObject* type, PyObject* args, PyObject* kwargs)
+{
+    PyObject* new = type->tp_alloc(type, 0);
+
+    relay_object* r = (relay_object*)new;
+    if(r != NULL) {
+        r->sock_a = NULL;
+        r->sock_b = NULL;
+        r->loop = NULL;
+        r->pair = NULL;
+        r->done_fd = -1;
+    }
+
+    return new;
+}
+
+static void
+relay_finalize(relay_object* self)
+{
+    PyObject *error_type, *error_value, *error_traceback;
+    /* Save the current exception, if any. */
+    PyErr_Fetch(&error_type, &error_value, &error_traceback);
+
+    /* The sockets must outlive the loop using them */
+    relay_close_internal(self);
+    if(self->pair) {
+        relay_pair_free(self->pair);
+        self->pair = NULL;
+    }
+    if(self->done_fd != -1) {
+        close(self->done_fd);
+        self->done_fd = -1;
+    }
+    Py_CLEAR(self->sock_a);
+    Py_CLEAR(self->sock_b);
+
+    /* Restore the saved exception. */
+    PyErr_Restore(error_type, error_value, error_traceback);
+}
+
+static void
+relay_dealloc(relay_object* self)
+{
+    if(PyObject_CallFinalizerFromDealloc((PyObject*)self) < 0)
+        return;
+
+    PyTypeObject* tp = Py_TYPE(self);
+    tp->tp_free(self);
+#if PY_VERSION_HEX >= 0x03080000
+    /* Instances of heap types own a reference to their type, released
+       by subtype_dealloc instead before Python 3.8 */
+    Py_DECREF(tp);
+#endif
+}
+
+static PyObject*
+relay_repr(relay_object* self)
+{
+    unsigned long long ab = 0, ba = 0;
+    if(self->pair) {
+        ab = __atomic_load_n(&self->pair->bytes[0], __ATOMIC_RELAXED);
+        ba = __atomic_load_n(&self->pair->bytes[1], __ATOMIC_RELAXED);
+    }
+
+    return PyUnicode_FromFormat("<relay object, bytes_ab=%llu, bytes_ba=%llu%s>",
+                                ab, ba, relay_is_finished(self) ? ", done" : "");
+}
+
+PyDoc_STRVAR(relay_doc, "RelayBase(sock_a, sock_b, bufsize=65536)\n\
+\n\
+Relay of two connected stream sockets in a thread of its own, see\n\
+iothpy.relay.");
+
+static PyType_Slot relay_slots[] = {
+    {Py_tp_dealloc, relay_dealloc},
+    {Py_tp_repr, relay_repr},
+    {Py_tp_doc, (void*)relay_doc},
+    {Py_tp_methods, relay_methods},
+    {Py_tp_members, relay_memberlist},
+    {Py_tp_getset, relay_getsetlist},
+    {Py_tp_init, relay_initobj},
+    {Py_tp_new, relay_new},
+    {Py_tp_finalize, relay_finalize},
+    {0, NULL}
+};
+
+static PyType_Spec relay_spec = {
+    "_iothpy.RelayBase",
+    sizeof(relay_object),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    relay_slots
+};
+
+/* Add the relay type to the module */
+int
+relay_module_init(PyObject* module)
+{
+    iothpy_state* st = iothpy_state_from_module(module);
+
+    st->relay_type = iothpy_new_type(module, &relay_spec);
+    if(!st->relay_type)
+        return -1;
+
+    Py_INCREF(st->relay_type);
+    if(PyModule_AddObject(module, "RelayBase", (PyObject*)st->relay_type) != 0) {
+        Py_DECREF(st->relay_type);
+        return -1;
+    }
+
+    return 0;
+}
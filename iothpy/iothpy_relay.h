@@ -0,0 +1,99 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+    Relay core: a thread polling pairs of connected stream sockets and
+    copying the bytes read from each socket of a pair to the other one,
+    until both the directions reached the end of the stream. The end of
+    a direction is forwarded with shutdown(SHUT_WR). The sockets can be
+    sockets of a stack or plain kernel sockets. The relay_* functions do
+    not require the GIL.
+*/
+
+struct relay_pair;
+
+/* Called by the thread once the pair finished, with error set */
+typedef void (*relay_done_func)(struct relay_pair* pair);
+
+struct relay_pair {
+    int fd[2];
+    int kernel[2];                  /* use the libc calls instead of the ioth ones */
+
+    /* Data read from fd[i] and not yet written to fd[1 - i] */
+    size_t bufsize;
+    char* buf[2];
+    size_t len[2];
+    size_t off[2];
+
+    int eof[2];                     /* end of stream read from fd[i] */
+    int shut[2];                    /* shutdown(SHUT_WR) sent to fd[i] */
+
+    /* Bytes moved from fd[i] to fd[1 - i], read with atomic loads */
+    uint64_t bytes[2];
+
+    int error;                      /* 0 if both the directions ended, ECANCELED on stop */
+    int finished;                   /* set atomically once done was called */
+
+    relay_done_func done;
+    void* data;                     /* of the owner of the pair */
+
+    struct relay_pair* next;
+};
+
+struct relay_loop {
+    pthread_t thread;
+    pid_t pid;                      /* the thread does not survive fork */
+
+    /* Eventfd waking the thread up for new pairs and on stop */
+    int wake_fd;
+
+    /* Protects incoming and stopping */
+    pthread_mutex_t lock;
+    struct relay_pair* incoming;
+    int stopping;
+
+    /* Owned by the thread */
+    struct relay_pair* pairs;
+    unsigned int npairs;
+};
+
+/* Return a new pair of buffers of bufsize bytes, NULL with errno set on error */
+struct relay_pair* relay_pair_new(int fd_a, int kernel_a, int fd_b, int kernel_b, size_t bufsize);
+void relay_pair_free(struct relay_pair* pair);
+
+/* Start the thread of a new loop, NULL with errno set on error */
+struct relay_loop* relay_loop_start(void);
+
+/*
+    Add a pair to the loop, the loop calls its done function once finished.
+    Returns 0 on success, -1 with errno set to EBADF if the loop is stopped.
+*/
+int relay_loop_add(struct relay_loop* loop, struct relay_pair* pair);
+
+/*
+    Stop the thread and free the loop. The pairs not finished yet finish
+    with ECANCELED and their done functions are called before returning.
+*/
+void relay_loop_stop(struct relay_loop* loop);
+
+/* Relay of two sockets returned by iothpy.relay, with a loop of its own */
+typedef struct relay_object
+{
+    PyObject_HEAD
+    /* Sockets of the pair, kept alive while relayed */
+    PyObject* sock_a;
+    PyObject* sock_b;
+
+    struct relay_loop* loop;
+    struct relay_pair* pair;
+
+    /* Eventfd readable once the relay finished, see fileno() */
+    int done_fd;
+} relay_object;
+
+int relay_module_init(PyObject* module);
@@ -0,0 +1,356 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "iothpy_sendqueue.h"
+#include "utils.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <sys/eventfd.h>
+
+#include <ioth.h>
+
+/* Move the buffer at the head of the queue to the done list, lock held */
+static void
+send_queue_pop(struct send_queue* q)
+{
+    struct send_queue_buf* buf = q->head;
+
+    q->head = buf->next;
+    if(!q->head)
+        q->tail = NULL;
+    q->queued_bytes -= buf->len - buf->sent;
+    q->queued_buffers--;
+
+    buf->next = q->done;
+    q->done = buf;
+}
+
+/* Pause the queue over max_bytes, the ready_fd stops being readable */
+static void
+send_queue_pause(struct send_queue* q)
+{
+    if(!q->paused) {
+        q->paused = 1;
+        q->pauses++;
+        eventfd_drain(q->ready_fd);
+    }
+}
+
+static void*
+send_queue_thread(void* arg)
+{
+    struct send_queue* q = arg;
+    int err = 0;
+
+    pthread_mutex_lock(&q->lock);
+    while(!q->stopping) {
+        struct send_queue_buf* buf = q->head;
+        if(!buf) {
+            pthread_cond_wait(&q->queued, &q->lock);
+            continue;
+        }
+        if(buf->len == 0) {
+            send_queue_pop(q);
+            q->sent_buffers++;
+            continue;
+        }
+
+        /* The buffer stays at the head of the queue while it is sent,
+           only this thread removes it */
+        pthread_mutex_unlock(&q->lock);
+        ssize_t n = ioth_send(q->fd, buf->data + buf->sent, buf->len - buf->sent,
+                              buf->flags | MSG_DONTWAIT | MSG_NOSIGNAL);
+        if(n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+            /* Wait for the peer, or for stop */
+            struct pollfd pfds[2] = {
+                {q->fd, POLLOUT, 0},
+                {q->wake_fd, POLLIN, 0},
+            };
+            if(poll(pfds, 2, -1) < 0 && errno != EINTR)
+                err = errno;
+            if(pfds[1].revents)
+                eventfd_drain(q->wake_fd);
+        } else if(n < 0 && errno != EINTR) {
+            err = errno;
+        }
+        pthread_mutex_lock(&q->lock);
+
+        if(err)
+            break;
+        if(n <= 0)
+            continue;
+
+        buf->sent += n;
+        q->queued_bytes -= n;
+        q->sent_bytes += n;
+        if(buf->sent == buf->len) {
+            send_queue_pop(q);
+            q->sent_buffers++;
+        }
+
+        if(q->paused && q->queued_bytes <= q->low_water) {
+            q->paused = 0;
+            eventfd_signal(q->ready_fd);
+        }
+        pthread_cond_broadcast(&q->progress);
+    }
+
+    /* Wake up everybody waiting for the queue, to see the error */
+    q->error = err;
+    q->finished = 1;
+    if(q->paused) {
+        q->paused = 0;
+        eventfd_signal(q->ready_fd);
+    }
+    pthread_cond_broadcast(&q->progress);
+    pthread_mutex_unlock(&q->lock);
+    return NULL;
+}
+
+static void
+send_queue_free(struct send_queue* q)
+{
+    if(q->ready_fd != -1)
+        close(q->ready_fd);
+    if(q->wake_fd != -1)
+        close(q->wake_fd);
+    free(q);
+}
+
+struct send_queue*
+send_queue_start(int fd, size_t max_bytes, size_t low_water)
+{
+    if(max_bytes == 0 || low_water > max_bytes) {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    struct send_queue* q = calloc(1, sizeof(struct send_queue));
+    if(!q)
+        return NULL;
+
+    q->fd = fd;
+    q->max_bytes = max_bytes;
+    q->low_water = low_water;
+    q->pid = getpid();
+    q->refs = 1;
+    q->ready_fd = eventfd(1, EFD_NONBLOCK | EFD_CLOEXEC);
+    q->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if(q->ready_fd == -1 || q->wake_fd == -1) {
+        int err = errno;
+        send_queue_free(q);
+        errno = err;
+        return NULL;
+    }
+
+    /* The waits of send and flush have deadlines on the monotonic clock */
+    pthread_condattr_t attr;
+    pthread_condattr_init(&attr);
+    pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+    pthread_mutex_init(&q->lock, NULL);
+    pthread_cond_init(&q->queued, NULL);
+    pthread_cond_init(&q->progress, &attr);
+    pthread_condattr_destroy(&attr);
+
+    int err = thread_start_nosignals(&q->thread, send_queue_thread, q);
+
+    if(err) {
+        pthread_cond_destroy(&q->progress);
+        pthread_cond_destroy(&q->queued);
+        pthread_mutex_destroy(&q->lock);
+        send_queue_free(q);
+        errno = err;
+        return NULL;
+    }
+
+    return q;
+}
+
+void
+send_queue_stop(struct send_queue* q)
+{
+    if(q->pid != getpid())
+        return;
+
+    pthread_mutex_lock(&q->lock);
+    q->stopping = 1;
+    pthread_cond_signal(&q->queued);
+    pthread_mutex_unlock(&q->lock);
+    eventfd_signal(q->wake_fd);
+
+    pthread_join(q->thread, NULL);
+
+    pthread_mutex_lock(&q->lock);
+    while(q->head)
+        send_queue_pop(q);
+    pthread_cond_broadcast(&q->progress);
+    pthread_mutex_unlock(&q->lock);
+}
+
+void
+send_queue_ref(struct send_queue* q)
+{
+    __atomic_add_fetch(&q->refs, 1, __ATOMIC_RELAXED);
+}
+
+void
+send_queue_release(struct send_queue* q)
+{
+    if(__atomic_sub_fetch(&q->refs, 1, __ATOMIC_ACQ_REL) != 0)
+        return;
+
+    pthread_cond_destroy(&q->progress);
+    pthread_cond_destroy(&q->queued);
+    pthread_mutex_destroy(&q->lock);
+    send_queue_free(q);
+}
+
+void
+send_queue_forget(struct send_queue* q)
+{
+    /* The locks may have been held by threads of the parent, the buffers
+       and their owners are leaked */
+    send_queue_free(q);
+}
+
+/* Wait on the progress condition until the deadline, lock held */
+static int
+send_queue_wait(struct send_queue* q, const struct timespec* deadline)
+{
+    if(!deadline)
+        return pthread_cond_wait(&q->progress, &q->lock);
+    return pthread_cond_timedwait(&q->progress, &q->lock, deadline);
+}
+
+static struct timespec*
+send_queue_deadline(struct timespec* deadline, int timeout)
+{
+    if(timeout < 0)
+        return NULL;
+
+    clock_gettime(CLOCK_MONOTONIC, deadline);
+    deadline->tv_sec += timeout / 1000;
+    deadline->tv_nsec += (long)(timeout % 1000) * 1000000;
+    if(deadline->tv_nsec >= 1000000000) {
+        deadline->tv_sec++;
+        deadline->tv_nsec -= 1000000000;
+    }
+    return deadline;
+}
+
+/* Return the error of a queue that cannot send anymore, 0 if it can, lock held */
+static int
+send_queue_check(struct send_queue* q)
+{
+    if(q->error)
+        return q->error;
+    if(q->stopping || q->finished)
+        return EBADF;
+    return 0;
+}
+
+int
+send_queue_push(struct send_queue* q, struct send_queue_buf* buf, int timeout)
+{
+    struct timespec ts;
+    struct timespec* deadline = send_queue_deadline(&ts, timeout);
+    int err;
+
+    pthread_mutex_lock(&q->lock);
+    /* A buffer larger than max_bytes is queued alone */
+    while(!(err = send_queue_check(q))
+            && q->queued_bytes > 0 && q->queued_bytes + buf->len > q->max_bytes) {
+        send_queue_pause(q);
+        if(timeout == 0) {
+            err = EAGAIN;
+            break;
+        }
+        if(send_queue_wait(q, deadline) == ETIMEDOUT) {
+            err = ETIMEDOUT;
+            break;
+        }
+    }
+
+    if(!err) {
+        buf->sent = 0;
+        buf->next = NULL;
+        if(q->tail)
+            q->tail->next = buf;
+        else
+            q->head = buf;
+        q->tail = buf;
+        q->queued_bytes += buf->len;
+        q->queued_buffers++;
+
+        if(q->queued_bytes >= q->max_bytes)
+            send_queue_pause(q);
+        pthread_cond_signal(&q->queued);
+    }
+    pthread_mutex_unlock(&q->lock);
+
+    if(err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+int
+send_queue_flush(struct send_queue* q, int timeout)
+{
+    struct timespec ts;
+    struct timespec* deadline = send_queue_deadline(&ts, timeout);
+    int err;
+
+    pthread_mutex_lock(&q->lock);
+    while(!(err = send_queue_check(q)) && q->head) {
+        if(timeout == 0 || send_queue_wait(q, deadline) == ETIMEDOUT) {
+            err = timeout == 0 ? EAGAIN : ETIMEDOUT;
+            break;
+        }
+    }
+    /* A queue stopped once empty has nothing left to flush */
+    if(err == EBADF && !q->head && !q->error)
+        err = 0;
+    pthread_mutex_unlock(&q->lock);
+
+    if(err) {
+        errno = err;
+        return -1;
+    }
+    return 0;
+}
+
+struct send_queue_buf*
+send_queue_take_done(struct send_queue* q)
+{
+    pthread_mutex_lock(&q->lock);
+    struct send_queue_buf* done = q->done;
+    q->done = NULL;
+    pthread_mutex_unlock(&q->lock);
+    return done;
+}
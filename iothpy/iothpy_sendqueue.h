@@ -0,0 +1,99 @@
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <sys/types.h>
+
+/*
+    Send queue: a thread owned by a socket writing in order the buffers
+    queued by send() and sendall(), so that the callers do not wait for
+    the peer. The buffers are not copied, each one carries the object
+    owning its memory, released by the caller once the buffer is handed
+    back by send_queue_take_done. None of the functions require the GIL.
+*/
+
+struct send_queue_buf {
+    const char* data;
+    size_t len;
+    size_t sent;
+    int flags;
+    void* owner;
+    struct send_queue_buf* next;
+};
+
+struct send_queue {
+    int fd;
+
+    /* Queueing waits while max_bytes are queued. Over max_bytes the queue
+       is paused until the thread drains it down to low_water */
+    size_t max_bytes;
+    size_t low_water;
+
+    /* Protects all the fields below */
+    pthread_mutex_t lock;
+    /* Signaled on new buffers and on stop, waited by the thread */
+    pthread_cond_t queued;
+    /* Signaled when the thread sends data or exits, waited by send and flush */
+    pthread_cond_t progress;
+
+    struct send_queue_buf* head;
+    struct send_queue_buf* tail;
+    size_t queued_bytes;
+    unsigned int queued_buffers;
+
+    /* Sent or dropped buffers waiting to be released by the caller */
+    struct send_queue_buf* done;
+
+    /* Eventfd readable while the queue is not paused, see send_queue_fileno */
+    int ready_fd;
+    int paused;
+
+    /* Eventfd waking the thread up from poll on stop */
+    int wake_fd;
+
+    int stopping;
+    int finished;                   /* the thread exited, on error if error is set */
+    int error;
+
+    /* Statistics */
+    uint64_t sent_bytes;
+    uint64_t sent_buffers;
+    uint64_t pauses;
+
+    pthread_t thread;
+    pid_t pid;                      /* the thread does not survive fork */
+    int refs;
+};
+
+/*
+    Start a thread writing the buffers queued to fd. The queue starts
+    with a reference owned by the caller.
+    Returns the queue, NULL with errno set on error.
+*/
+struct send_queue* send_queue_start(int fd, size_t max_bytes, size_t low_water);
+
+/* Stop the thread and wait for it, the buffers still queued are dropped */
+void send_queue_stop(struct send_queue* queue);
+
+void send_queue_ref(struct send_queue* queue);
+void send_queue_release(struct send_queue* queue);
+
+/* Free the queue in the child after a fork, without waiting for the thread */
+void send_queue_forget(struct send_queue* queue);
+
+/*
+    Queue a buffer, waiting up to timeout milliseconds (-1 forever) while
+    the queue is full. Returns 0 on success, -1 with errno set on error:
+    ETIMEDOUT or EAGAIN (timeout 0) if still full, EBADF if stopped, or
+    the error that stopped the thread.
+*/
+int send_queue_push(struct send_queue* queue, struct send_queue_buf* buf, int timeout);
+
+/*
+    Wait up to timeout milliseconds (-1 forever) for the thread to send
+    all the queued buffers. Returns 0 on success, -1 with errno set on
+    error as send_queue_push.
+*/
+int send_queue_flush(struct send_queue* queue, int timeout);
+
+/* Return the list of the buffers sent or dropped, to be released */
+struct send_queue_buf* send_queue_take_done(struct send_queue* queue);
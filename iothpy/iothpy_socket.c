@@ -26,8 +26,11 @@
 */
 
 #include "utils.h"
+#include "iothpy_state.h"
 #include "iothpy_stack.h"
 #include "iothpy_socket.h"
+#include "iothpy_pump.h"
+#include "iothpy_sendqueue.h"
 
 //PyMemberDef
 #include <structmember.h>
@@ -47,7 +50,29 @@
 
 #include <ioth.h>
 
-_PyTime_t defaulttimeout = _PYTIME_FROMSECONDS(-1);
+_PyTime_t
+socket_get_defaulttimeout(iothpy_state* st)
+{
+#ifdef Py_GIL_DISABLED
+    return _Py_atomic_load_int64_relaxed(&st->defaulttimeout);
+#else
+    return st->defaulttimeout;
+#endif
+}
+
+void
+socket_set_defaulttimeout(iothpy_state* st, _PyTime_t timeout)
+{
+#ifdef Py_GIL_DISABLED
+    _Py_atomic_store_int64_relaxed(&st->defaulttimeout, timeout);
+#else
+    st->defaulttimeout = timeout;
+#endif
+}
+
+static void socket_untrack(socket_object* s);
+static void socket_stop_recv_pump(socket_object* s);
+static void socket_stop_send_queue(socket_object* s);
 
 /* 
    Parse a timeout object into a _PyTime_t, raise an exception and return -1 if
@@ -210,7 +235,14 @@ getsockaddrlen(socket_object *s, socklen_t *len_ret)
 #define SOCK_TIMEOUT_ERR EWOULDBLOCK
 #define SOCK_INPROGRESS_ERR EINPROGRESS
 
-PyObject *socket_timeout;
+/* Raise the _iothpy.timeout exception of the module of the socket */
+static void
+set_timeout_error(socket_object* s)
+{
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(s));
+    if(st)
+        PyErr_SetString(st->socket_timeout, "timed out");
+}
 
 /* Poll on a socket object */
 static int
@@ -220,19 +252,20 @@ internal_select(socket_object *s, int writing, _PyTime_t interval, int connect)
     struct pollfd pollfd;
     _PyTime_t ms;
 
-    /* must be called with the GIL held */
+    /* must be called with an attached thread state (the GIL held on the
+       default build) */
     assert(PyGILState_Check());
 
     /* Error condition is for output only */
     assert(!(connect && !writing));
 
     /* Guard against closed socket */
-    if (s->fd == -1)
+    pollfd.fd = get_sock_fd(s);
+    if (pollfd.fd == -1)
         return 0;
 
     /* Prefer poll, if available, since you can poll() any fd
      * which can't be done with select(). */
-    pollfd.fd = s->fd;
     pollfd.events = writing ? POLLOUT : POLLIN;
     if (connect) {
         /* On Windows, the socket becomes writable on connection success,
@@ -284,7 +317,9 @@ sock_call(socket_object *s,
     int deadline_initialized = 0;
     int res;
 
-    /* sock_call() must be called with the GIL held. */
+    /* sock_call() must be called with an attached thread state, the GIL
+       is held on the default build. The socket itself is not locked:
+       its fd and timeout are read atomically, see get_sock_fd. */
     assert(PyGILState_Check());
 
     /* outer loop to retry select() when select() is interrupted by a signal
@@ -340,7 +375,7 @@ sock_call(socket_object *s,
                 if (err)
                     *err = SOCK_TIMEOUT_ERR;
                 else
-                    PyErr_SetString(socket_timeout, "timed out");
+                    set_timeout_error(s);
                 return -1;
             }
 
@@ -377,7 +412,7 @@ sock_call(socket_object *s,
             /* retry sock_func() */
         }
 
-        if (s->sock_timeout > 0
+        if (get_sock_timeout(s) > 0
             && (CHECK_ERRNO(EWOULDBLOCK) || CHECK_ERRNO(EAGAIN))) {
             /* False positive: sock_func() failed with EWOULDBLOCK or EAGAIN.
                For example, select() could indicate a socket is ready for
@@ -410,7 +445,7 @@ sock_bind(PyObject *self, PyObject *args)
 
     int res;
     Py_BEGIN_ALLOW_THREADS
-    res = ioth_bind(s->fd, (struct sockaddr*)&addrbuf, addrlen);
+    res = ioth_bind(get_sock_fd(s), (struct sockaddr*)&addrbuf, addrlen);
     Py_END_ALLOW_THREADS
 
     if(res != 0) {
@@ -444,7 +479,7 @@ sock_listen(PyObject *self, PyObject *args)
 
 
     Py_BEGIN_ALLOW_THREADS
-    res = ioth_listen(s->fd, backlog);
+    res = ioth_listen(get_sock_fd(s), backlog);
     Py_END_ALLOW_THREADS
 
     if(res != 0) {
@@ -464,24 +499,6 @@ sock_listen(PyObject *self, PyObject *args)
     unaccepted connections that the system will allow before refusing new\n\
     connections. If not specified, a default reasonable value is chosen.");
 
-    static PyObject* 
-    new_socket_from_fd(stack_object* stack, int family, int type, int proto, int fd)
-    {
-        PyObject* socket_args = Py_BuildValue("Oiiii", (PyObject*)stack, family, type, proto, fd);
-        if(!socket_args) {
-            return NULL;
-        }
-
-        // Instantiate a socket by calling the constructor of the socket type
-        PyObject* socket = PyObject_CallObject((PyObject*)&socket_type, socket_args);
-
-        // Release arguments
-        Py_DECREF(socket_args);
-
-        return socket;
-    }
-
-
     struct sock_accept_ctx {
         socklen_t* addrlen;
         struct sockaddr* addrbuf;
@@ -495,7 +512,7 @@ sock_listen(PyObject *self, PyObject *args)
         struct sockaddr* paddrbuf = ctx->addrbuf;
         socklen_t *paddrlen = ctx->addrlen;
 
-        ctx->result = ioth_accept(s->fd, paddrbuf, paddrlen);
+        ctx->result = ioth_accept(get_sock_fd(s), paddrbuf, paddrlen);
     }
 
     static PyObject*
@@ -511,7 +528,7 @@ sock_listen(PyObject *self, PyObject *args)
         ctx.addrlen = &addrlen;
         ctx.addrbuf = (struct sockaddr*)&addrbuf;
 
-        if(sock_call(s, 0, sock_accept_impl, &ctx, 0, NULL, s->sock_timeout) < 0) {
+        if(sock_call(s, 0, sock_accept_impl, &ctx, 0, NULL, get_sock_timeout(s)) < 0) {
             return NULL;
         }
 
@@ -563,7 +580,7 @@ sock_listen(PyObject *self, PyObject *args)
     {
         struct sock_recv *ctx = data;
 
-        ctx->result = ioth_recv(s->fd, ctx->cbuf, ctx->len, ctx->flags);
+        ctx->result = ioth_recv(get_sock_fd(s), ctx->cbuf, ctx->len, ctx->flags);
         return ctx->result >= 0;
     }
 
@@ -590,7 +607,7 @@ sock_listen(PyObject *self, PyObject *args)
         ctx.cbuf = cbuf;
         ctx.len = len;
         ctx.flags = flags;
-        if (sock_call(s, 0, sock_recv_impl, &ctx, 0, NULL, s->sock_timeout) < 0)
+        if (sock_call(s, 0, sock_recv_impl, &ctx, 0, NULL, get_sock_timeout(s)) < 0)
             return -1;
 
         return ctx.result;
@@ -716,7 +733,7 @@ sock_listen(PyObject *self, PyObject *args)
 
         memset(ctx->addrbuf, 0, *ctx->addrlen);
 
-        ctx->result = ioth_recvfrom(s->fd, ctx->cbuf, ctx->len, ctx->flags, ctx->addrbuf, ctx->addrlen);
+        ctx->result = ioth_recvfrom(get_sock_fd(s), ctx->cbuf, ctx->len, ctx->flags, ctx->addrbuf, ctx->addrlen);
         return ctx->result >= 0;
     }
 
@@ -749,7 +766,7 @@ sock_listen(PyObject *self, PyObject *args)
         ctx.flags = flags;
         ctx.addrbuf = (struct sockaddr*)&addrbuf;
         ctx.addrlen = &addrlen;
-        if (sock_call(s, 0, sock_recvfrom_impl, &ctx, 0, NULL, s->sock_timeout) < 0)
+        if (sock_call(s, 0, sock_recvfrom_impl, &ctx, 0, NULL, get_sock_timeout(s)) < 0)
             return -1;
 
         *addr = make_sockaddr((struct sockaddr*)&addrbuf, addrlen);
@@ -957,7 +974,7 @@ sock_listen(PyObject *self, PyObject *args)
     {
         struct sock_recvmsg_ctx *ctx = data;
 
-        ctx->result = ioth_recvmsg(s->fd, ctx->msg, ctx->flags);
+        ctx->result = ioth_recvmsg(get_sock_fd(s), ctx->msg, ctx->flags);
         return  (ctx->result >= 0);
     }
 
@@ -1015,7 +1032,7 @@ sock_listen(PyObject *self, PyObject *args)
 
         ctx.msg = &msg;
         ctx.flags = flags;
-        if (sock_call(s, 0, sock_recvmsg_impl, &ctx, 0, NULL, s->sock_timeout) < 0)
+        if (sock_call(s, 0, sock_recvmsg_impl, &ctx, 0, NULL, get_sock_timeout(s)) < 0)
             goto finally;
 
         /* Make list of (level, type, data) tuples from control messages. */
@@ -1266,6 +1283,676 @@ SCM_RIGHTS mechanism.");
 #endif    /* CMSG_LEN */
 
 
+/* Return a new reference to the receive pump of the socket, NULL with an
+   exception set if it has none */
+static struct recv_pump*
+socket_get_recv_pump(socket_object* s)
+{
+    stack_object* stack = (stack_object*)s->stack;
+    struct recv_pump* pump = NULL;
+    struct recv_pump* forked = NULL;
+
+    if(stack) {
+        pthread_mutex_lock(&stack->objects_lock);
+        pump = s->recv_pump;
+        if(pump && pump->pid != getpid()) {
+            /* The thread of the pump did not survive fork */
+            forked = pump;
+            pump = s->recv_pump = NULL;
+        }
+        if(pump)
+            recv_pump_ref(pump);
+        pthread_mutex_unlock(&stack->objects_lock);
+    }
+
+    if(forked)
+        recv_pump_forget(forked);
+    if(!pump)
+        PyErr_SetString(PyExc_ValueError, "the socket has no receive pump");
+    return pump;
+}
+
+/* Detach the receive pump from the socket and stop it, before closing the fd */
+static void
+socket_stop_recv_pump(socket_object* s)
+{
+    stack_object* stack = (stack_object*)s->stack;
+    struct recv_pump* pump;
+
+    if(!stack)
+        return;
+
+    pthread_mutex_lock(&stack->objects_lock);
+    pump = s->recv_pump;
+    s->recv_pump = NULL;
+    pthread_mutex_unlock(&stack->objects_lock);
+
+    if(pump) {
+        recv_pump_stop(pump);
+        recv_pump_release(pump);
+    }
+}
+
+static PyObject*
+sock_enable_recv_pump(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    socket_object* s = (socket_object*)self;
+
+    static char *kwlist[] = {"slots", "bufsize", "addresses", 0};
+
+    int slots = 64;
+    Py_ssize_t bufsize = 16384;
+    int addresses = 0;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|inp:enable_recv_pump", kwlist,
+                                    &slots, &bufsize, &addresses))
+        return NULL;
+
+    if(slots <= 0 || bufsize <= 0) {
+        PyErr_SetString(PyExc_ValueError, "slots and bufsize must be positive");
+        return NULL;
+    }
+
+    int fd = get_sock_fd(s);
+    if(fd == -1) {
+        errno = EBADF;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+    struct recv_pump* pump = recv_pump_start(fd, slots, bufsize, s->type == SOCK_STREAM, addresses);
+    if(!pump) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+    stack_object* stack = (stack_object*)s->stack;
+    struct recv_pump* old;
+
+    pthread_mutex_lock(&stack->objects_lock);
+    old = s->recv_pump;
+    if(!old)
+        s->recv_pump = pump;
+    pthread_mutex_unlock(&stack->objects_lock);
+
+    if(old) {
+        Py_BEGIN_ALLOW_THREADS
+        recv_pump_stop(pump);
+        Py_END_ALLOW_THREADS
+        recv_pump_release(pump);
+        PyErr_SetString(PyExc_ValueError, "the socket already has a receive pump");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(enable_recv_pump_doc,
+"enable_recv_pump(slots=64, bufsize=16384, addresses=False)\n\
+\n\
+Start a thread reading the socket continuously into a ring of slots\n\
+buffers of bufsize bytes, one read for each buffer, to be fetched in\n\
+batches with recv_batch().  When the ring is full the thread stops reading\n\
+until recv_batch() makes room, leaving the data to the flow control of the\n\
+stack.  If addresses is true the thread reads with recvfrom() and keeps the\n\
+address of the sender.  Other reads of the socket compete with the thread.");
+
+static PyObject*
+sock_disable_recv_pump(PyObject* self, PyObject* Py_UNUSED(ignored))
+{
+    socket_object* s = (socket_object*)self;
+
+    Py_BEGIN_ALLOW_THREADS
+    socket_stop_recv_pump(s);
+    Py_END_ALLOW_THREADS
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(disable_recv_pump_doc,
+"disable_recv_pump()\n\
+\n\
+Stop the receive pump of the socket.  The data read by the pump and not\n\
+fetched yet is discarded.");
+
+/* Build the item of recv_batch for a slot, data is a bytes or a memoryview */
+static PyObject*
+make_recv_batch_item(struct recv_pump* pump, struct recv_pump_slot* slot, PyObject* data)
+{
+    if(!data || !pump->addresses)
+        return data;
+
+    PyObject* addr = make_sockaddr((struct sockaddr*)&slot->addr, slot->addrlen);
+    if(!addr) {
+        Py_DECREF(data);
+        return NULL;
+    }
+    return Py_BuildValue("NN", data, addr);
+}
+
+static PyObject*
+sock_recv_batch(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    socket_object* s = (socket_object*)self;
+
+    static char *kwlist[] = {"maxcount", "timeout", "views", 0};
+
+    int maxcount = 0;
+    PyObject* timeout_obj = Py_None;
+    int views = 0;
+    _PyTime_t timeout;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "|iOp:recv_batch", kwlist,
+                                    &maxcount, &timeout_obj, &views))
+        return NULL;
+    if(socket_parse_timeout(&timeout, timeout_obj) < 0)
+        return NULL;
+
+    struct recv_pump* pump = socket_get_recv_pump(s);
+    if(!pump)
+        return NULL;
+
+    /* Only one thread at a time consumes the ring, the others wait here */
+    if(!recv_pump_claim(pump, 0)) {
+        Py_BEGIN_ALLOW_THREADS
+        recv_pump_claim(pump, 1);
+        Py_END_ALLOW_THREADS
+    }
+
+    PyObject* list = NULL;
+    _PyTime_t deadline = _PyTime_GetMonotonicClock() + timeout;
+    int count = recv_pump_wait(pump, 0);
+
+    while(count == 0 && timeout != 0 && !__atomic_load_n(&pump->finished, __ATOMIC_SEQ_CST)) {
+        _PyTime_t interval = -1;
+        if(timeout > 0) {
+            interval = deadline - _PyTime_GetMonotonicClock();
+            if(interval < 0)
+                break;
+        }
+        int ms = (int)_PyTime_AsMilliseconds(interval, _PyTime_ROUND_CEILING);
+
+        Py_BEGIN_ALLOW_THREADS
+        count = recv_pump_wait(pump, interval < 0 ? -1 : ms);
+        Py_END_ALLOW_THREADS
+
+        if(count < 0) {
+            if(errno != EINTR) {
+                PyErr_SetFromErrno(PyExc_OSError);
+                goto finally;
+            }
+            if(PyErr_CheckSignals())
+                goto finally;
+            count = 0;
+        }
+    }
+
+    /* Drained ring of a stopped pump: end of stream or error */
+    if(count == 0 && __atomic_load_n(&pump->finished, __ATOMIC_SEQ_CST)
+            && recv_pump_wait(pump, 0) == 0) {
+        if(pump->error) {
+            errno = pump->error;
+            PyErr_SetFromErrno(PyExc_OSError);
+            goto finally;
+        }
+        if(pump->stream) {
+            struct recv_pump_slot eof = {0};
+            list = Py_BuildValue("[N]", make_recv_batch_item(pump, &eof, PyBytes_FromStringAndSize(NULL, 0)));
+            goto finally;
+        }
+    }
+
+    if(maxcount > 0 && count > maxcount)
+        count = maxcount;
+
+    list = PyList_New(count);
+    if(!list)
+        goto finally;
+
+    /* With views the data of the batch is copied in a single bytes object */
+    PyObject* view = NULL;
+    if(views && count > 0) {
+        Py_ssize_t total = 0;
+        for(int i = 0; i < count; i++)
+            total += recv_pump_slot(pump, i)->len;
+
+        PyObject* buf = PyBytes_FromStringAndSize(NULL, total);
+        if(!buf)
+            goto error;
+
+        char* p = PyBytes_AS_STRING(buf);
+        for(int i = 0; i < count; i++) {
+            struct recv_pump_slot* slot = recv_pump_slot(pump, i);
+            memcpy(p, slot->data, slot->len);
+            p += slot->len;
+        }
+
+        view = PyMemoryView_FromObject(buf);
+        Py_DECREF(buf);
+        if(!view)
+            goto error;
+    }
+
+    Py_ssize_t offset = 0;
+    for(int i = 0; i < count; i++) {
+        struct recv_pump_slot* slot = recv_pump_slot(pump, i);
+        PyObject* data;
+
+        if(view)
+            data = PySequence_GetSlice(view, offset, offset + slot->len);
+        else
+            data = PyBytes_FromStringAndSize(slot->data, slot->len);
+        offset += slot->len;
+
+        PyObject* item = make_recv_batch_item(pump, slot, data);
+        if(!item) {
+            Py_XDECREF(view);
+            goto error;
+        }
+        PyList_SET_ITEM(list, i, item);
+    }
+    Py_XDECREF(view);
+
+    recv_pump_consume(pump, count);
+    goto finally;
+
+error:
+    Py_CLEAR(list);
+finally:
+    recv_pump_unclaim(pump);
+    recv_pump_release(pump);
+    return list;
+}
+
+PyDoc_STRVAR(recv_batch_doc,
+"recv_batch(maxcount=0, timeout=None, views=False) -> list\n\
+\n\
+Return the data read by the receive pump of the socket, see\n\
+enable_recv_pump(), up to maxcount buffers (0 for all of them).  When the\n\
+pump has nothing, wait up to timeout seconds (None for no limit) and return\n\
+an empty list on timeout.  At the end of the stream the list contains an\n\
+empty bytes object, an error of the pump is raised once all the data was\n\
+fetched.  Each item is a bytes object, or a (data, address) tuple if the\n\
+pump keeps the addresses.  If views is true the data is returned as\n\
+memoryviews sharing a single buffer, saving an object for each item.");
+
+static PyObject*
+sock_recv_pump_stats(PyObject* self, PyObject* Py_UNUSED(ignored))
+{
+    socket_object* s = (socket_object*)self;
+
+    struct recv_pump* pump = socket_get_recv_pump(s);
+    if(!pump)
+        return NULL;
+
+    unsigned int queued = __atomic_load_n(&pump->tail, __ATOMIC_RELAXED)
+                        - __atomic_load_n(&pump->head, __ATOMIC_RELAXED);
+    PyObject* stats = Py_BuildValue("{sKsKsKsIsI}",
+        "received", (unsigned long long)__atomic_load_n(&pump->received, __ATOMIC_RELAXED),
+        "bytes", (unsigned long long)__atomic_load_n(&pump->bytes, __ATOMIC_RELAXED),
+        "full", (unsigned long long)__atomic_load_n(&pump->full, __ATOMIC_RELAXED),
+        "queued", queued,
+        "slots", pump->nslots);
+
+    recv_pump_release(pump);
+    return stats;
+}
+
+PyDoc_STRVAR(recv_pump_stats_doc,
+"recv_pump_stats() -> dict\n\
+\n\
+Return the statistics of the receive pump of the socket: the buffers and\n\
+bytes read, the times the thread found the ring full, the buffers queued\n\
+in the ring and its size.");
+
+
+/* Buffer of the send queue, holding the data passed to send or sendall */
+struct socket_send_buf {
+    struct send_queue_buf buf;
+    Py_buffer view;
+};
+
+/* Release the buffers given back by the send queue, with the GIL held */
+static void
+release_send_bufs(struct send_queue_buf* list)
+{
+    while(list) {
+        struct socket_send_buf* sb = list->owner;
+
+        list = list->next;
+        PyBuffer_Release(&sb->view);
+        PyMem_Free(sb);
+    }
+}
+
+/* Return a new reference to the send queue of the socket, NULL if it has none */
+static struct send_queue*
+socket_get_send_queue(socket_object* s)
+{
+    stack_object* stack = (stack_object*)s->stack;
+    struct send_queue* queue = NULL;
+    struct send_queue* forked = NULL;
+
+    if(!stack)
+        return NULL;
+
+    pthread_mutex_lock(&stack->objects_lock);
+    queue = s->send_queue;
+    if(queue && queue->pid != getpid()) {
+        /* The thread of the queue did not survive fork */
+        forked = queue;
+        queue = s->send_queue = NULL;
+    }
+    if(queue)
+        send_queue_ref(queue);
+    pthread_mutex_unlock(&stack->objects_lock);
+
+    if(forked)
+        send_queue_forget(forked);
+    return queue;
+}
+
+/* Detach the send queue from the socket and stop it, dropping the data
+   not sent yet. Must be called with the GIL held */
+static void
+socket_stop_send_queue(socket_object* s)
+{
+    stack_object* stack = (stack_object*)s->stack;
+    struct send_queue* queue;
+
+    if(!stack)
+        return;
+
+    pthread_mutex_lock(&stack->objects_lock);
+    queue = s->send_queue;
+    s->send_queue = NULL;
+    pthread_mutex_unlock(&stack->objects_lock);
+
+    if(queue) {
+        Py_BEGIN_ALLOW_THREADS
+        send_queue_stop(queue);
+        Py_END_ALLOW_THREADS
+        release_send_bufs(send_queue_take_done(queue));
+        send_queue_release(queue);
+    }
+}
+
+/*
+    Wait for the send queue with a function of the queue taking a timeout
+    in milliseconds, until the deadline of the timeout of the socket. The
+    condition variables of the queue are not interrupted by signals, so
+    the waits are done in slices to run the signal handlers.
+    Returns 0 on success, -1 with an exception set on error.
+*/
+#define SEND_QUEUE_WAIT_SLICE 100
+
+static int
+send_queue_call(socket_object* s, struct send_queue* queue, _PyTime_t timeout,
+                int (*func)(struct send_queue*, struct send_queue_buf*, int),
+                struct send_queue_buf* buf)
+{
+    _PyTime_t deadline = _PyTime_GetMonotonicClock() + timeout;
+    int res;
+
+    /* Try once without waiting, the queue is rarely full */
+    res = func(queue, buf, 0);
+    while(res < 0 && errno == EAGAIN && timeout != 0) {
+        int ms = SEND_QUEUE_WAIT_SLICE;
+        if(timeout > 0) {
+            _PyTime_t interval = deadline - _PyTime_GetMonotonicClock();
+            if(interval <= 0) {
+                errno = ETIMEDOUT;
+                break;
+            }
+            if(_PyTime_AsMilliseconds(interval, _PyTime_ROUND_CEILING) < ms)
+                ms = (int)_PyTime_AsMilliseconds(interval, _PyTime_ROUND_CEILING);
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        res = func(queue, buf, ms);
+        Py_END_ALLOW_THREADS
+
+        if(res < 0 && errno == ETIMEDOUT) {
+            if(PyErr_CheckSignals())
+                return -1;
+            errno = EAGAIN;
+        }
+    }
+
+    if(res == 0)
+        return 0;
+    if(errno == ETIMEDOUT)
+        set_timeout_error(s);
+    else
+        PyErr_SetFromErrno(PyExc_OSError);
+    return -1;
+}
+
+static int
+send_queue_push_call(struct send_queue* queue, struct send_queue_buf* buf, int timeout)
+{
+    return send_queue_push(queue, buf, timeout);
+}
+
+static int
+send_queue_flush_call(struct send_queue* queue, struct send_queue_buf* Py_UNUSED(buf), int timeout)
+{
+    return send_queue_flush(queue, timeout);
+}
+
+/*
+    Queue the buffer of send or sendall on the send queue of the socket,
+    taking over the buffer also on error. Waits while the queue is full
+    like a send on the socket with its timeout.
+    Returns 0 on success, -1 with an exception set on error.
+*/
+static int
+sock_queue_send(socket_object* s, struct send_queue* queue, Py_buffer* pbuf, int flags)
+{
+    struct socket_send_buf* sb = PyMem_Malloc(sizeof(struct socket_send_buf));
+    if(!sb) {
+        PyBuffer_Release(pbuf);
+        PyErr_NoMemory();
+        return -1;
+    }
+
+    sb->view = *pbuf;
+    sb->buf.data = pbuf->buf;
+    sb->buf.len = pbuf->len;
+    sb->buf.flags = flags;
+    sb->buf.owner = sb;
+
+    int res = send_queue_call(s, queue, get_sock_timeout(s), send_queue_push_call, &sb->buf);
+    if(res < 0) {
+        PyBuffer_Release(&sb->view);
+        PyMem_Free(sb);
+    }
+
+    /* Release the buffers sent in the meantime */
+    release_send_bufs(send_queue_take_done(queue));
+    return res;
+}
+
+static PyObject*
+sock_enable_send_queue(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    socket_object* s = (socket_object*)self;
+
+    static char *kwlist[] = {"max_bytes", "low_water", 0};
+
+    Py_ssize_t max_bytes;
+    Py_ssize_t low_water = -1;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwds, "n|n:enable_send_queue", kwlist,
+                                    &max_bytes, &low_water))
+        return NULL;
+
+    if(low_water < 0)
+        low_water = max_bytes / 2;
+    if(max_bytes <= 0 || low_water > max_bytes) {
+        PyErr_SetString(PyExc_ValueError, "max_bytes must be positive and not less than low_water");
+        return NULL;
+    }
+
+    int fd = get_sock_fd(s);
+    if(fd == -1) {
+        errno = EBADF;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+    struct send_queue* queue = send_queue_start(fd, max_bytes, low_water);
+    if(!queue) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+    stack_object* stack = (stack_object*)s->stack;
+    struct send_queue* old;
+
+    pthread_mutex_lock(&stack->objects_lock);
+    old = s->send_queue;
+    if(!old)
+        s->send_queue = queue;
+    pthread_mutex_unlock(&stack->objects_lock);
+
+    if(old) {
+        Py_BEGIN_ALLOW_THREADS
+        send_queue_stop(queue);
+        Py_END_ALLOW_THREADS
+        send_queue_release(queue);
+        PyErr_SetString(PyExc_ValueError, "the socket already has a send queue");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(enable_send_queue_doc,
+"enable_send_queue(max_bytes, low_water=max_bytes // 2)\n\
+\n\
+Start a thread sending the data of send() and sendall() in background.\n\
+Both return as soon as the data is queued, waiting like a send on the\n\
+socket only while max_bytes are queued.  The data is not copied, the\n\
+buffers passed must not be modified until sent.  Over max_bytes the queue\n\
+is paused until the thread drains it down to low_water, see\n\
+send_queue_fileno().  Use flush() to wait for the data to be sent, errors\n\
+of the thread are raised by the next send(), sendall() or flush().\n\
+\n\
+The buffers sent are released only by the next send(), sendall(), flush(),\n\
+send_queue_stats() or close() of the socket, as the thread does not take\n\
+the GIL.  Until then the objects passed stay alive and a bytearray cannot\n\
+be resized; call flush() on a socket that stops sending to release them.");
+
+static PyObject*
+sock_disable_send_queue(PyObject* self, PyObject* Py_UNUSED(ignored))
+{
+    socket_stop_send_queue((socket_object*)self);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(disable_send_queue_doc,
+"disable_send_queue()\n\
+\n\
+Stop the send queue of the socket.  The data not sent yet is dropped, call\n\
+flush() first to send it.");
+
+static PyObject*
+sock_flush(PyObject* self, PyObject* args)
+{
+    socket_object* s = (socket_object*)self;
+
+    PyObject* timeout_obj = Py_None;
+    _PyTime_t timeout;
+
+    if(!PyArg_ParseTuple(args, "|O:flush", &timeout_obj))
+        return NULL;
+    if(socket_parse_timeout(&timeout, timeout_obj) < 0)
+        return NULL;
+
+    struct send_queue* queue = socket_get_send_queue(s);
+    if(!queue)
+        Py_RETURN_NONE;
+
+    int res = send_queue_call(s, queue, timeout, send_queue_flush_call, NULL);
+    release_send_bufs(send_queue_take_done(queue));
+    send_queue_release(queue);
+
+    if(res < 0)
+        return NULL;
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(flush_doc,
+"flush(timeout=None)\n\
+\n\
+Wait up to timeout seconds (None for no limit) for the send queue of the\n\
+socket to send all the queued data, see enable_send_queue().  The buffers\n\
+already sent are released also when the timeout expires.");
+
+static PyObject*
+sock_send_queue_fileno(PyObject* self, PyObject* Py_UNUSED(ignored))
+{
+    struct send_queue* queue = socket_get_send_queue((socket_object*)self);
+    if(!queue) {
+        PyErr_SetString(PyExc_ValueError, "the socket has no send queue");
+        return NULL;
+    }
+
+    int fd = queue->ready_fd;
+    send_queue_release(queue);
+    return PyLong_FromLong(fd);
+}
+
+PyDoc_STRVAR(send_queue_fileno_doc,
+"send_queue_fileno() -> integer\n\
+\n\
+Return a file descriptor readable while the send queue of the socket is\n\
+not paused, to wait for it with select() or an event loop.  The queue is\n\
+paused over max_bytes and resumes when drained down to low_water, or\n\
+when the thread stops on an error.");
+
+static PyObject*
+sock_send_queue_stats(PyObject* self, PyObject* Py_UNUSED(ignored))
+{
+    struct send_queue* queue = socket_get_send_queue((socket_object*)self);
+    if(!queue) {
+        PyErr_SetString(PyExc_ValueError, "the socket has no send queue");
+        return NULL;
+    }
+
+    pthread_mutex_lock(&queue->lock);
+    size_t queued_bytes = queue->queued_bytes;
+    unsigned int queued_buffers = queue->queued_buffers;
+    unsigned long long sent_bytes = queue->sent_bytes;
+    unsigned long long sent_buffers = queue->sent_buffers;
+    unsigned long long pauses = queue->pauses;
+    int paused = queue->paused;
+    pthread_mutex_unlock(&queue->lock);
+
+    PyObject* stats = Py_BuildValue("{snsIsKsKsKsOsnsn}",
+        "queued_bytes", (Py_ssize_t)queued_bytes,
+        "queued_buffers", queued_buffers,
+        "sent_bytes", sent_bytes,
+        "sent_buffers", sent_buffers,
+        "pauses", pauses,
+        "paused", paused ? Py_True : Py_False,
+        "max_bytes", (Py_ssize_t)queue->max_bytes,
+        "low_water", (Py_ssize_t)queue->low_water);
+
+    release_send_bufs(send_queue_take_done(queue));
+    send_queue_release(queue);
+    return stats;
+}
+
+PyDoc_STRVAR(send_queue_stats_doc,
+"send_queue_stats() -> dict\n\
+\n\
+Return the statistics of the send queue of the socket: the bytes and\n\
+buffers queued and sent, the times the queue was paused, whether it is\n\
+paused now and its watermarks.");
+
+
 struct sock_send_ctx {
     char *buf;
     Py_ssize_t len;
@@ -1278,7 +1965,7 @@ sock_send_impl(socket_object *s, void *data)
 {
     struct sock_send_ctx *ctx = data;
 
-    ctx->result = ioth_send(s->fd, ctx->buf, ctx->len, ctx->flags);
+    ctx->result = ioth_send(get_sock_fd(s), ctx->buf, ctx->len, ctx->flags);
     return ctx->result >= 0;
 }
 
@@ -1294,11 +1981,20 @@ sock_send(PyObject *self, PyObject *args)
     if (!PyArg_ParseTuple(args, "y*|i:send", &pbuf, &flags))
         return NULL;
 
+    /* With a send queue all the data is taken, see enable_send_queue */
+    struct send_queue* queue = socket_get_send_queue(s);
+    if (queue) {
+        Py_ssize_t len = pbuf.len;
+        int res = sock_queue_send(s, queue, &pbuf, flags);
+        send_queue_release(queue);
+        return res < 0 ? NULL : PyLong_FromSsize_t(len);
+    }
+
     ctx.buf = pbuf.buf;
     ctx.len = pbuf.len;
     ctx.flags = flags;
 
-    if (sock_call(s, 1, sock_send_impl, &ctx, 0, NULL, s->sock_timeout) < 0) {
+    if (sock_call(s, 1, sock_send_impl, &ctx, 0, NULL, get_sock_timeout(s)) < 0) {
         PyBuffer_Release(&pbuf);
         return NULL;
     }
@@ -1312,7 +2008,9 @@ PyDoc_STRVAR(send_doc,
 \n\
 Send a data string to the socket.  For the optional flags\n\
 argument, see the Unix manual.  Return the number of bytes\n\
-sent; this may be less than len(data) if the network is busy.");
+sent; this may be less than len(data) if the network is busy.\n\
+With a send queue all the data is queued and data is held until a later\n\
+call releases it, see enable_send_queue().");
 
 
 
@@ -1326,8 +2024,9 @@ sock_sendall(PyObject *self, PyObject *args)
     int flags = 0;
     Py_buffer pbuf;
     struct sock_send_ctx ctx;
-    int has_timeout = (s->sock_timeout > 0);
-    _PyTime_t interval = s->sock_timeout;
+    _PyTime_t timeout = get_sock_timeout(s);
+    int has_timeout = (timeout > 0);
+    _PyTime_t interval = timeout;
     _PyTime_t deadline = 0;
     int deadline_initialized = 0;
     PyObject *res = NULL;
@@ -1337,6 +2036,15 @@ sock_sendall(PyObject *self, PyObject *args)
     buf = pbuf.buf;
     len = pbuf.len;
 
+    struct send_queue* queue = socket_get_send_queue(s);
+    if (queue) {
+        int res = sock_queue_send(s, queue, &pbuf, flags);
+        send_queue_release(queue);
+        if (res < 0)
+            return NULL;
+        Py_RETURN_NONE;
+    }
+
     do {
         if (has_timeout) {
             if (deadline_initialized) {
@@ -1345,11 +2053,11 @@ sock_sendall(PyObject *self, PyObject *args)
             }
             else {
                 deadline_initialized = 1;
-                deadline = _PyTime_GetMonotonicClock() + s->sock_timeout;
+                deadline = _PyTime_GetMonotonicClock() + timeout;
             }
 
             if (interval <= 0) {
-                PyErr_SetString(socket_timeout, "timed out");
+                set_timeout_error(s);
                 goto done;
             }
         }
@@ -1387,7 +2095,8 @@ PyDoc_STRVAR(sendall_doc,
 Send a data string to the socket.  For the optional flags\n\
 argument, see the Unix manual.  This calls send() repeatedly\n\
 until all data is sent.  If an error occurs, it's impossible\n\
-to tell how much data has been sent.");
+to tell how much data has been sent.  With a send queue the data is\n\
+queued and held as for send(), see enable_send_queue().");
 
 
 #ifdef CMSG_LEN
@@ -1442,7 +2151,7 @@ sock_sendto_impl(socket_object *s, void *data)
 {
     struct sock_sendto_ctx *ctx = data;
 
-    ctx->result = ioth_sendto(s->fd, ctx->buf, ctx->len, ctx->flags, ctx->addrbuf, ctx->addrlen);
+    ctx->result = ioth_sendto(get_sock_fd(s), ctx->buf, ctx->len, ctx->flags, ctx->addrbuf, ctx->addrlen);
     return ctx->result >= 0;
 }
 
@@ -1488,7 +2197,7 @@ sock_sendto(PyObject* self, PyObject *args)
     ctx.flags = flags;
     ctx.addrlen = addrlen;
     ctx.addrbuf = (struct sockaddr*)&addrbuf;
-    if (sock_call(s, 1, sock_sendto_impl, &ctx, 0, NULL, s->sock_timeout) < 0) {
+    if (sock_call(s, 1, sock_sendto_impl, &ctx, 0, NULL, get_sock_timeout(s)) < 0) {
         PyBuffer_Release(&pbuf);
         return NULL;
     }
@@ -1575,7 +2284,7 @@ sock_sendmsg_impl(socket_object *s, void *data)
 {
     struct sock_sendmsg_ctx *ctx = data;
 
-    ctx->result = ioth_sendmsg(s->fd, ctx->msg, ctx->flags);
+    ctx->result = ioth_sendmsg(get_sock_fd(s), ctx->msg, ctx->flags);
     return (ctx->result >= 0);
 }
 
@@ -1736,7 +2445,7 @@ sock_sendmsg(PyObject* self, PyObject *args)
 
     ctx.msg = &msg;
     ctx.flags = flags;
-    if (sock_call(s, 1, sock_sendmsg_impl, &ctx, 0, NULL, s->sock_timeout) < 0)
+    if (sock_call(s, 1, sock_sendmsg_impl, &ctx, 0, NULL, get_sock_timeout(s)) < 0)
         goto finally;
 
     retval = PyLong_FromSsize_t(ctx.result);
@@ -1778,15 +2487,23 @@ static PyObject *
 sock_close(PyObject *self, PyObject *args)
 {
     socket_object* s = (socket_object*)self;
-    if(s->fd != -1)
+
+    /* Take the fd before releasing the GIL so that a concurrent close()
+       or Stack.close() does not close the same fd again */
+    int fd = take_sock_fd(s);
+    if(fd != -1)
     {
         int res;
 
+        socket_stop_send_queue(s);
+
         Py_BEGIN_ALLOW_THREADS
-        res = ioth_close(s->fd);
+        socket_stop_recv_pump(s);
+        res = ioth_close(fd);
         Py_END_ALLOW_THREADS
 
-        s->fd = -1;
+        socket_untrack(s);
+
         if(res < 0 && errno != ECONNRESET) {
             PyErr_SetFromErrno(PyExc_OSError);
             return NULL;
@@ -1810,7 +2527,7 @@ sock_connect_impl(socket_object* s, void* Py_UNUSED(data))
     int err;
     socklen_t size = sizeof err;
 
-    if (getsockopt(s->fd, SOL_SOCKET, SO_ERROR, (void *)&err, &size)) {
+    if (getsockopt(get_sock_fd(s), SOL_SOCKET, SO_ERROR, (void *)&err, &size)) {
         /* getsockopt() failed */
         return 0;
     }
@@ -1832,7 +2549,7 @@ internal_connect(socket_object* s, struct sockaddr *addr, int addrlen,
     int res, err, wait_connect;
 
     Py_BEGIN_ALLOW_THREADS
-    res = ioth_connect(s->fd, addr, addrlen);
+    res = ioth_connect(get_sock_fd(s), addr, addrlen);
     Py_END_ALLOW_THREADS
 
     if (!res) {
@@ -1848,10 +2565,10 @@ internal_connect(socket_object* s, struct sockaddr *addr, int addrlen,
         if (PyErr_CheckSignals())
             return -1;
 
-        wait_connect = (s->sock_timeout != 0);
+        wait_connect = (get_sock_timeout(s) != 0);
     }
     else {
-        wait_connect = (s->sock_timeout > 0 && err == SOCK_INPROGRESS_ERR);
+        wait_connect = (get_sock_timeout(s) > 0 && err == SOCK_INPROGRESS_ERR);
     }
 
     if (!wait_connect) {
@@ -1868,13 +2585,13 @@ internal_connect(socket_object* s, struct sockaddr *addr, int addrlen,
     if (raise) {
         /* socket.connect() raises an exception on error */
         if (sock_call(s, 1, sock_connect_impl, NULL,
-                         1, NULL, s->sock_timeout) < 0)
+                         1, NULL, get_sock_timeout(s)) < 0)
             return -1;
     }
     else {
         /* socket.connect_ex() returns the error code on error */
         if (sock_call(s, 1, sock_connect_impl, NULL,
-                         1, &err, s->sock_timeout) < 0)
+                         1, &err, get_sock_timeout(s)) < 0)
             return err;
     }
     return 0;
@@ -1932,13 +2649,188 @@ PyDoc_STRVAR(connect_ex_doc,
 This is like connect(address), but returns an error code (the errno value)\n\
 instead of raising an exception when an error occurs.");
 
+/* Connect of a socket started by socket_connect_many */
+struct connect_many_target {
+    int fd;
+    struct sockaddr_storage addr;
+    socklen_t addrlen;
+    int blocking;                   /* O_NONBLOCK is cleared again at the end */
+    int pending;
+    int error;
+};
+
+PyObject*
+socket_connect_many(struct iothpy_state* st, PyObject* sockets, PyObject* addresses, _PyTime_t timeout)
+{
+    PyObject* socks = NULL;
+    PyObject* addrs = NULL;
+    PyObject* result = NULL;
+    struct connect_many_target* targets = NULL;
+    struct pollfd* pfds = NULL;
+    unsigned int* polled = NULL;
+    Py_ssize_t n, npending = 0;
+
+    socks = PySequence_Fast(sockets, "sockets must be a sequence");
+    if(!socks)
+        return NULL;
+    addrs = PySequence_Fast(addresses, "addresses must be a sequence");
+    if(!addrs)
+        goto finally;
+
+    n = PySequence_Fast_GET_SIZE(socks);
+    if(PySequence_Fast_GET_SIZE(addrs) != n) {
+        PyErr_SetString(PyExc_ValueError, "sockets and addresses must have the same length");
+        goto finally;
+    }
+
+    targets = PyMem_Calloc(n ? n : 1, sizeof(struct connect_many_target));
+    pfds = PyMem_Calloc(n ? n : 1, sizeof(struct pollfd));
+    polled = PyMem_Calloc(n ? n : 1, sizeof(unsigned int));
+    if(!targets || !pfds || !polled) {
+        PyErr_NoMemory();
+        goto finally;
+    }
+
+    for(Py_ssize_t i = 0; i < n; i++) {
+        PyObject* obj = PySequence_Fast_GET_ITEM(socks, i);
+        struct connect_many_target* t = &targets[i];
+
+        if(!PyObject_TypeCheck(obj, st->socket_type)) {
+            PyErr_Format(PyExc_TypeError, "connect_many(): expected a socket of a stack, not %.500s",
+                         Py_TYPE(obj)->tp_name);
+            goto finally;
+        }
+
+        socket_object* s = (socket_object*)obj;
+        if(!get_sockaddr_from_tuple("connect_many", s, PySequence_Fast_GET_ITEM(addrs, i),
+                                    (struct sockaddr*)&t->addr, &t->addrlen))
+            goto finally;
+
+        t->fd = get_sock_fd(s);
+        t->blocking = get_sock_timeout(s) < 0;
+        if(t->fd == -1)
+            t->error = EBADF;
+    }
+
+    /* Start all the connects without waiting */
+    Py_BEGIN_ALLOW_THREADS
+    for(Py_ssize_t i = 0; i < n; i++) {
+        struct connect_many_target* t = &targets[i];
+        if(t->error)
+            continue;
+
+        int flags = ioth_fcntl(t->fd, F_GETFL, 0);
+        if(flags == -1 || ioth_fcntl(t->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+            t->error = errno;
+            t->blocking = 0;
+            continue;
+        }
+
+        if(ioth_connect(t->fd, (struct sockaddr*)&t->addr, t->addrlen) == 0)
+            continue;
+        if(errno == EINPROGRESS || errno == EINTR) {
+            t->pending = 1;
+            npending++;
+        } else {
+            t->error = errno;
+        }
+    }
+    Py_END_ALLOW_THREADS
+
+    /* Wait for them together */
+    _PyTime_t deadline = _PyTime_GetMonotonicClock() + timeout;
+    while(npending > 0) {
+        int ms = -1;
+        if(timeout >= 0) {
+            _PyTime_t interval = deadline - _PyTime_GetMonotonicClock();
+            if(interval < 0)
+                break;
+            ms = (int)_PyTime_AsMilliseconds(interval, _PyTime_ROUND_CEILING);
+        }
+
+        nfds_t count = 0;
+        for(Py_ssize_t i = 0; i < n; i++) {
+            if(!targets[i].pending)
+                continue;
+            pfds[count].fd = targets[i].fd;
+            pfds[count].events = POLLOUT;
+            pfds[count].revents = 0;
+            polled[count++] = i;
+        }
+
+        int res;
+        Py_BEGIN_ALLOW_THREADS
+        res = poll(pfds, count, ms);
+        for(nfds_t k = 0; res > 0 && k < count; k++) {
+            struct connect_many_target* t = &targets[polled[k]];
+            int err = 0;
+            socklen_t size = sizeof(err);
+
+            if(!pfds[k].revents)
+                continue;
+            if(ioth_getsockopt(t->fd, SOL_SOCKET, SO_ERROR, &err, &size) < 0)
+                err = errno;
+            t->error = err;
+            t->pending = 0;
+            npending--;
+        }
+        Py_END_ALLOW_THREADS
+
+        if(res < 0) {
+            if(errno != EINTR) {
+                PyErr_SetFromErrno(PyExc_OSError);
+                break;
+            }
+            if(PyErr_CheckSignals())
+                break;
+        }
+        if(res == 0)
+            break;
+    }
+
+    /* Give the blocking sockets their mode back */
+    for(Py_ssize_t i = 0; i < n; i++) {
+        struct connect_many_target* t = &targets[i];
+        if(t->pending)
+            t->error = ETIMEDOUT;
+        if(t->blocking && t->fd != -1) {
+            int flags = ioth_fcntl(t->fd, F_GETFL, 0);
+            if(flags != -1)
+                ioth_fcntl(t->fd, F_SETFL, flags & ~O_NONBLOCK);
+        }
+    }
+
+    if(PyErr_Occurred())
+        goto finally;
+
+    result = PyList_New(n);
+    if(!result)
+        goto finally;
+    for(Py_ssize_t i = 0; i < n; i++) {
+        PyObject* err = PyLong_FromLong(targets[i].error);
+        if(!err) {
+            Py_CLEAR(result);
+            goto finally;
+        }
+        PyList_SET_ITEM(result, i, err);
+    }
+
+finally:
+    PyMem_Free(targets);
+    PyMem_Free(pfds);
+    PyMem_Free(polled);
+    Py_XDECREF(addrs);
+    Py_DECREF(socks);
+    return result;
+}
+
 
 
 static PyObject *
 sock_fileno(PyObject *self, PyObject *args)
 {
     socket_object* s = (socket_object*)self;
-    return PyLong_FromLong(s->fd);
+    return PyLong_FromLong(get_sock_fd(s));
 }
 
 PyDoc_STRVAR(fileno_doc,
@@ -1972,7 +2864,7 @@ sock_getsockopt(PyObject *self, PyObject *args)
         int flag = 0;
         socklen_t flagsize = sizeof(flag);
 
-        res = ioth_getsockopt(s->fd, level, optname, (void *)&flag, &flagsize);
+        res = ioth_getsockopt(get_sock_fd(s), level, optname, (void *)&flag, &flagsize);
         if (res < 0) {
             PyErr_SetFromErrno(PyExc_OSError);
             return NULL;
@@ -1985,7 +2877,7 @@ sock_getsockopt(PyObject *self, PyObject *args)
     if (buf == NULL)
         return NULL;
 
-    res = ioth_getsockopt(s->fd, level, optname, (void *)PyBytes_AS_STRING(buf), &buflen);
+    res = ioth_getsockopt(get_sock_fd(s), level, optname, (void *)PyBytes_AS_STRING(buf), &buflen);
     if (res < 0) {
         PyErr_SetFromErrno(PyExc_OSError);
         return NULL;
@@ -2018,7 +2910,7 @@ sock_setsockopt(PyObject* self, PyObject *args)
 
    /* setsockopt(level, opt, flag) */
     if (PyArg_ParseTuple(args, "iii:setsockopt", &level, &optname, &flag)) {
-        res = ioth_setsockopt(s->fd, level, optname, (char*)&flag, sizeof flag);
+        res = ioth_setsockopt(get_sock_fd(s), level, optname, (char*)&flag, sizeof flag);
         goto done;
     }
 
@@ -2028,7 +2920,7 @@ sock_setsockopt(PyObject* self, PyObject *args)
     if (PyArg_ParseTuple(args, "iiO!I:setsockopt",
                          &level, &optname, Py_TYPE(Py_None), &none, &optlen)) {
         assert(sizeof(socklen_t) >= sizeof(unsigned int));
-        res = ioth_setsockopt(s->fd, level, optname, NULL, (socklen_t)optlen);
+        res = ioth_setsockopt(get_sock_fd(s), level, optname, NULL, (socklen_t)optlen);
         goto done;
     }
 
@@ -2037,7 +2929,7 @@ sock_setsockopt(PyObject* self, PyObject *args)
     if (!PyArg_ParseTuple(args, "iiy*:setsockopt", &level, &optname, &optval))
         return NULL;
 
-    res = ioth_setsockopt(s->fd, level, optname, optval.buf, optval.len);
+    res = ioth_setsockopt(get_sock_fd(s), level, optname, optval.buf, optval.len);
     PyBuffer_Release(&optval);
 
 done:
@@ -2064,8 +2956,10 @@ static PyObject *
 sock_detach(PyObject* self, PyObject *Py_UNUSED(ignored))
 {
     socket_object* s = (socket_object*)self;
-    int fd = s->fd;
-    s->fd = -1;
+    int fd = take_sock_fd(s);
+    socket_stop_send_queue(s);
+    socket_stop_recv_pump(s);
+    socket_untrack(s);
     return PyLong_FromLong(fd);
 }
 
@@ -2089,7 +2983,7 @@ sock_shutdown(PyObject *self, PyObject *arg)
         return NULL;
 
     Py_BEGIN_ALLOW_THREADS
-    res = ioth_shutdown(s->fd, how);
+    res = ioth_shutdown(get_sock_fd(s), how);
     Py_END_ALLOW_THREADS
 
     if (res < 0) {
@@ -2116,7 +3010,7 @@ sock_getsockname(PyObject* self, PyObject* args)
 
     int res;
     Py_BEGIN_ALLOW_THREADS
-    res = ioth_getsockname(s->fd, (struct sockaddr*)&addrbuf, &addrlen);
+    res = ioth_getsockname(get_sock_fd(s), (struct sockaddr*)&addrbuf, &addrlen);
     Py_END_ALLOW_THREADS
 
     if(res < 0) {
@@ -2145,7 +3039,7 @@ sock_getpeername(PyObject* self, PyObject* args)
 
     int res;
     Py_BEGIN_ALLOW_THREADS
-    res = ioth_getpeername(s->fd, (struct sockaddr*)&addrbuf, &addrlen);
+    res = ioth_getpeername(get_sock_fd(s), (struct sockaddr*)&addrbuf, &addrlen);
     Py_END_ALLOW_THREADS
 
     if(res < 0) {
@@ -2174,7 +3068,7 @@ internal_setblocking(socket_object* s, int block)
 
     /* Use fcntl instead of ioctl because it's supported by picoxnet */
     Py_BEGIN_ALLOW_THREADS
-    delay_flag = ioth_fcntl(s->fd, F_GETFL, 0);
+    delay_flag = ioth_fcntl(get_sock_fd(s), F_GETFL, 0);
     if (delay_flag == -1)
         goto done;
     if (block)
@@ -2182,7 +3076,7 @@ internal_setblocking(socket_object* s, int block)
     else
         new_delay_flag = delay_flag | O_NONBLOCK;
     if (new_delay_flag != delay_flag)
-        if (ioth_fcntl(s->fd, F_SETFL, new_delay_flag) == -1)
+        if (ioth_fcntl(get_sock_fd(s), F_SETFL, new_delay_flag) == -1)
             goto done;
 
     result = 0;
@@ -2213,7 +3107,7 @@ sock_setblocking(PyObject *self, PyObject *arg)
     if (block == -1 && PyErr_Occurred())
         return NULL;
 
-    s->sock_timeout = _PyTime_FromSeconds(block ? -1 : 0);
+    set_sock_timeout(s, _PyTime_FromSeconds(block ? -1 : 0));
     if (internal_setblocking(s, block) == -1) {
         return NULL;
     }
@@ -2237,7 +3131,7 @@ sock_getblocking(PyObject *self, PyObject *Py_UNUSED(ignored))
 {
     socket_object* s = (socket_object*)self;
 
-    if (s->sock_timeout) {
+    if (get_sock_timeout(s)) {
         Py_RETURN_TRUE;
     }
     else {
@@ -2267,7 +3161,7 @@ sock_settimeout(PyObject *self, PyObject *arg)
     if (socket_parse_timeout(&timeout, arg) < 0)
         return NULL;
 
-    s->sock_timeout = timeout;
+    set_sock_timeout(s, timeout);
 
     int block = timeout < 0;
     /* Blocking mode for a Python socket object means that operations
@@ -2309,11 +3203,12 @@ sock_gettimeout(PyObject *self, PyObject *Py_UNUSED(ignored))
 {
     socket_object* s = (socket_object*)self;
 
-    if (s->sock_timeout < 0) {
+    _PyTime_t timeout = get_sock_timeout(s);
+    if (timeout < 0) {
         Py_RETURN_NONE;
     }
     else {
-        double seconds = _PyTime_AsSecondsDouble(s->sock_timeout);
+        double seconds = _PyTime_AsSecondsDouble(timeout);
         return PyFloat_FromDouble(seconds);
     }
 }
@@ -2341,6 +3236,15 @@ static PyMethodDef socket_methods[] =
     {"send",    sock_send,    METH_VARARGS, send_doc},  
     {"sendall",    sock_sendall,    METH_VARARGS, sendall_doc},  
     {"sendto", sock_sendto, METH_VARARGS, sendto_doc},
+    {"enable_recv_pump", (PyCFunction)sock_enable_recv_pump, METH_VARARGS | METH_KEYWORDS, enable_recv_pump_doc},
+    {"disable_recv_pump", sock_disable_recv_pump, METH_NOARGS, disable_recv_pump_doc},
+    {"recv_batch", (PyCFunction)sock_recv_batch, METH_VARARGS | METH_KEYWORDS, recv_batch_doc},
+    {"recv_pump_stats", sock_recv_pump_stats, METH_NOARGS, recv_pump_stats_doc},
+    {"enable_send_queue", (PyCFunction)sock_enable_send_queue, METH_VARARGS | METH_KEYWORDS, enable_send_queue_doc},
+    {"disable_send_queue", sock_disable_send_queue, METH_NOARGS, disable_send_queue_doc},
+    {"flush", sock_flush, METH_VARARGS, flush_doc},
+    {"send_queue_fileno", sock_send_queue_fileno, METH_NOARGS, send_queue_fileno_doc},
+    {"send_queue_stats", sock_send_queue_stats, METH_NOARGS, send_queue_stats_doc},
 
 #ifdef CMSG_LEN
     {"recvmsg",      sock_recvmsg, METH_VARARGS, recvmsg_doc},
@@ -2374,19 +3278,126 @@ socket_dealloc(socket_object* self)
     
     PyTypeObject* tp = Py_TYPE(self);
     tp->tp_free(self);
+#if PY_VERSION_HEX >= 0x03080000
+    /* Instances of heap types own a reference to their type, released
+       by subtype_dealloc instead before Python 3.8 */
+    Py_DECREF(tp);
+#endif
 }
 
 static PyObject*
 socket_repr(socket_object* self)
 {
     return PyUnicode_FromFormat( "<socket object, fd=%ld, family=%d, type=%d, proto=%d>",
-        self->fd, self->family, self->type, self->proto);
+        get_sock_fd(self), self->family, self->type, self->proto);
+}
+
+/* Add the socket to the list of open sockets of its stack */
+static void
+socket_track(socket_object* s)
+{
+    stack_object* stack = (stack_object*)s->stack;
+
+    pthread_mutex_lock(&stack->objects_lock);
+    s->prev_socket = NULL;
+    s->next_socket = stack->sockets;
+    if(stack->sockets)
+        stack->sockets->prev_socket = s;
+    stack->sockets = s;
+    pthread_mutex_unlock(&stack->objects_lock);
+}
+
+/* Remove the socket from the list of its stack, objects_lock must be held */
+static void
+socket_unlink(stack_object* stack, socket_object* s)
+{
+    if(s->prev_socket)
+        s->prev_socket->next_socket = s->next_socket;
+    else if(stack->sockets == s)
+        stack->sockets = s->next_socket;
+
+    if(s->next_socket)
+        s->next_socket->prev_socket = s->prev_socket;
+
+    s->prev_socket = s->next_socket = NULL;
+}
+
+/* Remove the socket from the list of its stack, if it is there */
+static void
+socket_untrack(socket_object* s)
+{
+    stack_object* stack = (stack_object*)s->stack;
+    if(!stack)
+        return;
+
+    pthread_mutex_lock(&stack->objects_lock);
+    socket_unlink(stack, s);
+    pthread_mutex_unlock(&stack->objects_lock);
+}
+
+void
+socket_close_stack_sockets(stack_object* stack)
+{
+    /* Buffers of the send queues, released once the lock is dropped */
+    struct send_queue_buf* dropped = NULL;
+
+    pthread_mutex_lock(&stack->objects_lock);
+    while(stack->sockets) {
+        socket_object* s = stack->sockets;
+        struct recv_pump* pump = s->recv_pump;
+        struct send_queue* queue = s->send_queue;
+        int fd = take_sock_fd(s);
+
+        s->recv_pump = NULL;
+        s->send_queue = NULL;
+        socket_unlink(stack, s);
+        if(pump) {
+            recv_pump_stop(pump);
+            recv_pump_release(pump);
+        }
+        if(queue) {
+            send_queue_stop(queue);
+            for(struct send_queue_buf* buf = send_queue_take_done(queue); buf; ) {
+                struct send_queue_buf* next = buf->next;
+                buf->next = dropped;
+                dropped = buf;
+                buf = next;
+            }
+            send_queue_release(queue);
+        }
+        if(fd != -1)
+            ioth_close(fd);
+    }
+    pthread_mutex_unlock(&stack->objects_lock);
+
+    release_send_bufs(dropped);
+}
+
+void
+socket_forget_stack_sockets(stack_object* stack)
+{
+    pthread_mutex_lock(&stack->objects_lock);
+    while(stack->sockets) {
+        socket_object* s = stack->sockets;
+
+        set_sock_fd(s, -1);
+        if(s->recv_pump) {
+            recv_pump_forget(s->recv_pump);
+            s->recv_pump = NULL;
+        }
+        if(s->send_queue) {
+            send_queue_forget(s->send_queue);
+            s->send_queue = NULL;
+        }
+        socket_unlink(stack, s);
+    }
+    pthread_mutex_unlock(&stack->objects_lock);
 }
 
 static int
 init_sockobject(socket_object *s, PyObject* stack, int fd, int family, int type, int proto)
 {
-    s->fd = fd;
+    set_sock_fd(s, fd);
     s->family = family;
     s->type = type;
     s->proto = proto;
@@ -2406,46 +3417,54 @@ init_sockobject(socket_object *s, PyObject* stack, int fd, int family, int type,
 
 #ifdef SOCK_NONBLOCK
     if (type & SOCK_NONBLOCK)
-        s->sock_timeout = 0;
+        set_sock_timeout(s, 0);
     else
 #endif
     {
-        s->sock_timeout = defaulttimeout;
-        if (defaulttimeout >= 0) {
+        iothpy_state* st = iothpy_state_from_type(Py_TYPE(s));
+        if (!st)
+            return -1;
+
+        _PyTime_t timeout = socket_get_defaulttimeout(st);
+        set_sock_timeout(s, timeout);
+        if (timeout >= 0) {
             if (internal_setblocking(s, 0) == -1) {
                 return -1;
             }
         }
     }
 
+    /* Reinitializing the object moves it to the new stack */
+    socket_untrack(s);
+    Py_INCREF(stack);
+    Py_XDECREF(s->stack);
     s->stack = stack;
-    Py_INCREF(s->stack);
+    socket_track(s);
 
     return 0;
 }
 
+/* Second half of socket_initobj, once the stack has been resolved */
 static int
-socket_initobj(PyObject* self, PyObject* args, PyObject* kwds)
+socket_initobj_stack(socket_object* s, PyObject* stack, int family, int type, int proto, PyObject* fdobj)
 {
-    socket_object* s = (socket_object*)self;
-
-    PyObject* stack;
-    int family = AF_INET;
-    int type = SOCK_STREAM;
-    int proto = 0;
-
-    PyObject* fdobj = NULL;
     int fd = -1;
+    int res;
 
-    if(!PyArg_ParseTuple(args, "Oiii|O", &stack, &family, &type, &proto, &fdobj))
+    /* Held until the socket is in the list closed by Stack.close() */
+    struct ioth* ioth_stack = stack_acquire((stack_object*)stack);
+    if(ioth_stack == NULL) {
+        PyErr_SetString(PyExc_ValueError, "Stack is closed");
         return -1;
+    }
 
     /* Create a new socket */
     if(fdobj == NULL || fdobj == Py_None)
     {
-        fd = ioth_msocket(((struct stack_object*)stack)->stack, family, type, proto);
+        fd = ioth_msocket(ioth_stack, family, type, proto);
         if(fd == -1)
         {
+            stack_release((stack_object*)stack);
             PyErr_SetFromErrno(PyExc_OSError);
             return -1;
         }
@@ -2454,20 +3473,24 @@ socket_initobj(PyObject* self, PyObject* args, PyObject* kwds)
     else 
     {
         if (PyFloat_Check(fdobj)) {
+            stack_release((stack_object*)stack);
             PyErr_SetString(PyExc_TypeError, "integer argument expected, got float");
             return -1;
         }
 
         fd = PyLong_AsLong(fdobj);
-        if (PyErr_Occurred())
-            return -1;
-        if (fd == -1) {
-            PyErr_SetString(PyExc_ValueError, "invalid file descriptor");
+        if (PyErr_Occurred() || fd == -1) {
+            stack_release((stack_object*)stack);
+            if (!PyErr_Occurred())
+                PyErr_SetString(PyExc_ValueError, "invalid file descriptor");
             return -1;
         }
     }
     
-    if (init_sockobject(s, stack, fd, family, type, proto) == -1) {
+    res = init_sockobject(s, stack, fd, family, type, proto);
+    stack_release((stack_object*)stack);
+
+    if (res == -1) {
         ioth_close(fd);
         return -1;
     }
@@ -2475,6 +3498,42 @@ socket_initobj(PyObject* self, PyObject* args, PyObject* kwds)
     return 0;
 }
 
+static int
+socket_initobj(PyObject* self, PyObject* args, PyObject* kwds)
+{
+    socket_object* s = (socket_object*)self;
+
+    PyObject* stack;
+    int family = AF_INET;
+    int type = SOCK_STREAM;
+    int proto = 0;
+
+    PyObject* fdobj = NULL;
+
+    if(!PyArg_ParseTuple(args, "Oiii|O", &stack, &family, &type, &proto, &fdobj))
+        return -1;
+
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return -1;
+
+    /* Without a stack use the current one, see iothpy.get_stack */
+    if(stack == Py_None) {
+        stack = stack_get_current(st);
+        if(!stack)
+            return -1;
+    } else if(PyObject_TypeCheck(stack, st->stack_type)) {
+        Py_INCREF(stack);
+    } else {
+        PyErr_SetString(PyExc_TypeError, "stack must be of type Stack");
+        return -1;
+    }
+
+    int res = socket_initobj_stack(s, stack, family, type, proto, fdobj);
+    Py_DECREF(stack);
+    return res;
+}
+
 static PyObject*
 socket_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
 {
@@ -2486,6 +3545,10 @@ socket_new(PyTypeObject *type, PyObject *args, PyObject *kwds)
         s->fd = -1;
         s->sock_timeout = _PyTime_FromSeconds(-1);
         s->stack = NULL;
+        s->next_socket = NULL;
+        s->prev_socket = NULL;
+        s->recv_pump = NULL;
+        s->send_queue = NULL;
     }
     
     return new;
@@ -2498,11 +3561,15 @@ socket_finalize(socket_object* s)
     /* Save the current exception, if any. */
     PyErr_Fetch(&error_type, &error_value, &error_traceback);
 
-    Py_XDECREF(s->stack);
-    if (s->fd != -1) {
-        ioth_close(s->fd);
-        s->fd = -1;
-    }
+    /* The fd must be closed while the stack is still alive, dropping the
+       last reference to the stack first deletes it under the open socket */
+    socket_stop_send_queue(s);
+    socket_stop_recv_pump(s);
+    socket_untrack(s);
+    int fd = take_sock_fd(s);
+    if (fd != -1)
+        ioth_close(fd);
+    Py_CLEAR(s->stack);
 
     /* Restore the saved exception. */
     PyErr_Restore(error_type, error_value, error_traceback);
@@ -2521,54 +3588,42 @@ static PyMemberDef socket_memberlist[] = {
 
 PyDoc_STRVAR(socket_doc, "Test documentation for MSocketBase type");
 
-PyTypeObject socket_type = {
-    PyVarObject_HEAD_INIT(0, 0)    /* Must fill in type value later */
-    "_iothpy.MSocketBase",                    /* tp_name */
-    sizeof(socket_object),                      /* tp_basicsize */
-    0,                                          /* tp_itemsize */
-    (destructor)socket_dealloc,                 /* tp_dealloc */
-    0,                                          /* tp_vectorcall_offset */
-    0,                                          /* tp_getattr */
-    0,                                          /* tp_setattr */
-    0,                                          /* tp_as_async */
-    (reprfunc)socket_repr,                      /* tp_repr */
-    0,                                          /* tp_as_number */
-    0,                                          /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
-    0,                                          /* tp_hash */
-    0,                                          /* tp_call */
-    0,                                          /* tp_str */
-    PyObject_GenericGetAttr,                    /* tp_getattro */
-    0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags */
-    socket_doc,                                 /* tp_doc */
-    0,                                          /* tp_traverse */
-    0,                                          /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    0,                                          /* tp_iter */
-    0,                                          /* tp_iternext */
-    socket_methods,                             /* tp_methods */
-    socket_memberlist,                          /* tp_members */
-    0,                                          /* tp_getset */
-    0,                                          /* tp_base */
-    0,                                          /* tp_dict */
-    0,                                          /* tp_descr_get */
-    0,                                          /* tp_descr_set */
-    0,                                          /* tp_dictoffset */
-    socket_initobj,                             /* tp_init */
-    PyType_GenericAlloc,                        /* tp_alloc */
-    socket_new,                                 /* tp_new */
-    PyObject_Del,                               /* tp_free */
-    0,                                          /* tp_is_gc */
-    0,                                          /* tp_bases */
-    0,                                          /* tp_mro */
-    0,                                          /* tp_cache */
-    0,                                          /* tp_subclasses */
-    0,                                          /* tp_weaklist */
-    0,                                          /* tp_del */
-    0,                                          /* tp_version_tag */
-    (destructor)socket_finalize,                /* tp_finalize */
+static PyType_Slot socket_slots[] = {
+    {Py_tp_dealloc, socket_dealloc},
+    {Py_tp_repr, socket_repr},
+    {Py_tp_doc, (void*)socket_doc},
+    {Py_tp_methods, socket_methods},
+    {Py_tp_members, socket_memberlist},
+    {Py_tp_init, socket_initobj},
+    {Py_tp_new, socket_new},
+    {Py_tp_finalize, socket_finalize},
+    {0, NULL}
+};
+
+static PyType_Spec socket_spec = {
+    "_iothpy.MSocketBase",
+    sizeof(socket_object),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    socket_slots
 };
 
+/* Create the socket type of the module and add it as MSocketBase */
+int
+socket_module_init(PyObject* module)
+{
+    iothpy_state* st = iothpy_state_from_module(module);
+
+    st->socket_type = iothpy_new_type(module, &socket_spec);
+    if(!st->socket_type)
+        return -1;
+
+    Py_INCREF(st->socket_type);
+    if(PyModule_AddObject(module, "MSocketBase", (PyObject*)st->socket_type) != 0) {
+        Py_DECREF(st->socket_type);
+        return -1;
+    }
+
+    return 0;
+}
+
@@ -1,6 +1,8 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include "pycompat.h"
+
 typedef struct socket_object 
 {
     PyObject_HEAD
@@ -21,17 +23,108 @@ typedef struct socket_object
     int proto;
 
     _PyTime_t sock_timeout;     /* Operation timeout in seconds */
+
+    /* 
+        Links in the list of open sockets of the stack, used to close
+        all the sockets when the stack is closed.
+    */
+    struct socket_object* next_socket;
+    struct socket_object* prev_socket;
+
+    /* Thread reading the socket in background, see enable_recv_pump.
+       Protected by the objects_lock of the stack */
+    struct recv_pump* recv_pump;
+
+    /* Thread writing the data of send and sendall, see enable_send_queue.
+       Protected by the objects_lock of the stack */
+    struct send_queue* send_queue;
     
 } socket_object;
 
-extern PyTypeObject socket_type;
-extern PyObject *socket_timeout;
-extern _PyTime_t defaulttimeout;
+/*
+    Without the GIL (free-threaded build) the fd and the timeout of a socket
+    can be changed by a thread while others are using the socket, e.g. close()
+    racing with a blocking recv(), so they are accessed atomically.
+*/
+static inline int
+get_sock_fd(socket_object* s)
+{
+#ifdef Py_GIL_DISABLED
+    return _Py_atomic_load_int_relaxed(&s->fd);
+#else
+    return s->fd;
+#endif
+}
+
+static inline void
+set_sock_fd(socket_object* s, int fd)
+{
+#ifdef Py_GIL_DISABLED
+    _Py_atomic_store_int_relaxed(&s->fd, fd);
+#else
+    s->fd = fd;
+#endif
+}
+
+/* Detach the fd from the socket, of concurrent callers only one gets it */
+static inline int
+take_sock_fd(socket_object* s)
+{
+#ifdef Py_GIL_DISABLED
+    return _Py_atomic_exchange_int(&s->fd, -1);
+#else
+    int fd = s->fd;
+    s->fd = -1;
+    return fd;
+#endif
+}
+
+static inline _PyTime_t
+get_sock_timeout(socket_object* s)
+{
+#ifdef Py_GIL_DISABLED
+    return _Py_atomic_load_int64_relaxed(&s->sock_timeout);
+#else
+    return s->sock_timeout;
+#endif
+}
+
+static inline void
+set_sock_timeout(socket_object* s, _PyTime_t timeout)
+{
+#ifdef Py_GIL_DISABLED
+    _Py_atomic_store_int64_relaxed(&s->sock_timeout, timeout);
+#else
+    s->sock_timeout = timeout;
+#endif
+}
+
+struct iothpy_state;
+
+int socket_module_init(PyObject* module);
+
+/* Default timeout of the new sockets of the interpreter, see setdefaulttimeout */
+_PyTime_t socket_get_defaulttimeout(struct iothpy_state* st);
+void socket_set_defaulttimeout(struct iothpy_state* st, _PyTime_t timeout);
 
 int socket_parse_timeout(_PyTime_t *timeout, PyObject *timeout_obj);
 int get_CMSG_LEN(size_t length, size_t *result);
 int get_CMSG_SPACE(size_t length, size_t *result);
 
+/* Close all the sockets still open on the stack */
+void socket_close_stack_sockets(struct stack_object* stack);
+
+/* Detach all the sockets of the stack without closing them, after a fork */
+void socket_forget_stack_sockets(struct stack_object* stack);
+
+/*
+    Connect each socket to its address, starting all the connects at once
+    and waiting up to timeout (-1 for no limit) for all of them together.
+    Returns a list with 0 or the errno value of each socket, ETIMEDOUT for
+    the connects still in progress at the timeout.
+*/
+PyObject* socket_connect_many(struct iothpy_state* st, PyObject* sockets, PyObject* addresses, _PyTime_t timeout);
+
 #if INT_MAX > 0x7fffffff
 #define SOCKLEN_T_LIMIT 0x7fffffff
 #else
@@ -20,8 +20,11 @@
  * along with this program. If not, see <http://www.gnu.org/licenses/>.
  */
 #include "utils.h"
+#include "iothpy_state.h"
 #include "iothpy_stack.h"
 #include "iothpy_socket.h"
+#include "iothpy_monitor.h"
+#include "iothpy_netlink.h"
 
 
 #ifndef _GNU_SOURCE
@@ -48,7 +51,156 @@
 #define NI_MAXHOST 1025
 #define NI_MAXSERV 32
 
-static char* stackName = NULL;
+/* Default parameters of the getnameinfo cache */
+#define NAMEINFO_CACHE_SIZE 1024
+#define NAMEINFO_CACHE_TTL 60.0
+
+#if PY_VERSION_HEX >= 0x030D0000
+#define interpreter_finalizing() Py_IsFinalizing()
+#else
+#define interpreter_finalizing() _Py_IsFinalizing()
+#endif
+
+/* Capabilities of the known ioth plugins, the others get the default ones */
+static const struct {
+    const char* name;
+    unsigned int caps;
+} plugin_caps[] = {
+    {"kernel",   IOTHPY_CAP_IPLINK_ADD | IOTHPY_CAP_KERNEL_FD},
+    {"vdestack", IOTHPY_CAP_KERNEL_FD},
+};
+
+#define DEFAULT_PLUGIN_CAPS IOTHPY_CAP_IPLINK_ADD
+
+static unsigned int
+stack_plugin_caps(const char* name)
+{
+    if(name) {
+        for(size_t i = 0; i < sizeof(plugin_caps) / sizeof(plugin_caps[0]); i++) {
+            if(strcmp(plugin_caps[i].name, name) == 0)
+                return plugin_caps[i].caps;
+        }
+    }
+    return DEFAULT_PLUGIN_CAPS;
+}
+
+/* 
+   Return a copy of the plugin name in a configuration string for ioth_newstackc,
+   given by a "stack=name" item or else by a bare name as first item.
+   Returns NULL if not found.
+*/
+static char*
+stack_config_name(const char* config)
+{
+    const char* item = config;
+    const char* bare = NULL;
+    size_t bare_len = 0;
+    int first = 1;
+
+    while(*item) {
+        size_t len = strcspn(item, ",");
+
+        while(len > 0 && *item == ' ') {
+            item++;
+            len--;
+        }
+
+        const char* eq = memchr(item, '=', len);
+        if(eq && eq - item == 5 && strncmp(item, "stack", 5) == 0)
+            return strndup(eq + 1, len - 6);
+        if(!eq && first && len > 0) {
+            bare = item;
+            bare_len = len;
+        }
+
+        first = 0;
+        item += len;
+        if(*item == ',')
+            item++;
+    }
+
+    return bare ? strndup(bare, bare_len) : NULL;
+}
+
+/* All the stack objects alive */
+static stack_object* all_stacks = NULL;
+static pthread_mutex_t all_stacks_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static void
+stack_link(stack_object* self)
+{
+    pthread_mutex_lock(&all_stacks_lock);
+    self->prev_stack = NULL;
+    self->next_stack = all_stacks;
+    if(all_stacks)
+        all_stacks->prev_stack = self;
+    all_stacks = self;
+    pthread_mutex_unlock(&all_stacks_lock);
+}
+
+static void
+stack_unlink(stack_object* self)
+{
+    pthread_mutex_lock(&all_stacks_lock);
+    if(self->prev_stack)
+        self->prev_stack->next_stack = self->next_stack;
+    else if(all_stacks == self)
+        all_stacks = self->next_stack;
+
+    if(self->next_stack)
+        self->next_stack->prev_stack = self->prev_stack;
+
+    self->prev_stack = self->next_stack = NULL;
+    pthread_mutex_unlock(&all_stacks_lock);
+}
+
+/* Keep the list of the stacks consistent across fork */
+static void
+stack_atfork_prepare(void)
+{
+    pthread_mutex_lock(&all_stacks_lock);
+}
+
+static void
+stack_atfork_parent(void)
+{
+    pthread_mutex_unlock(&all_stacks_lock);
+}
+
+/*
+    Called in the child after a fork. The threads of the plugins do not
+    survive the fork and their state belongs to the parent, so each stack
+    is dropped without deleting it and behaves as closed in the child.
+    Sockets of plugins with kernel file descriptors are plain descriptors
+    shared with the parent and stay usable, e.g. a listening socket in the
+    prefork model, the ones of the other plugins are dropped too.
+*/
+static void
+stack_atfork_child(void)
+{
+    for(stack_object* s = all_stacks; s; s = s->next_stack) {
+        /* The locks may have been held by other threads of the parent */
+        pthread_mutex_init(&s->dns_lock, NULL);
+        pthread_mutex_init(&s->objects_lock, NULL);
+        /* The calls using the stack ran in threads of the parent */
+        pthread_mutex_init(&s->use_lock, NULL);
+        pthread_cond_init(&s->use_cond, NULL);
+        s->users = 0;
+
+        if(!s->stack)
+            continue;
+
+        s->stack = NULL;
+        s->stack_dns = NULL;
+        s->forked = 1;
+
+        if(!(s->caps & IOTHPY_CAP_KERNEL_FD)) {
+            socket_forget_stack_sockets(s);
+            monitor_forget_stack_monitors(s);
+        }
+    }
+    pthread_mutex_init(&all_stacks_lock, NULL);
+}
 
 static void 
 stack_dealloc(stack_object* self)
@@ -57,8 +209,151 @@ stack_dealloc(stack_object* self)
         return;
     }
 
+    stack_unlink(self);
+    pthread_mutex_destroy(&self->dns_lock);
+    pthread_mutex_destroy(&self->objects_lock);
+    pthread_mutex_destroy(&self->use_lock);
+    pthread_cond_destroy(&self->use_cond);
+
     PyTypeObject* tp = Py_TYPE(self);
     tp->tp_free(self);
+#if PY_VERSION_HEX >= 0x03080000
+    /* Instances of heap types own a reference to their type, released
+       by subtype_dealloc instead before Python 3.8 */
+    Py_DECREF(tp);
+#endif
+}
+
+/* Drop the cached links, they are loaded again on the next lookup */
+static void
+stack_links_invalidate(stack_object* self)
+{
+    struct nl_link_info* links;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    links = self->link_cache;
+    self->link_cache = NULL;
+    self->link_cache_count = 0;
+    Py_END_CRITICAL_SECTION();
+
+    free(links);
+}
+
+struct ioth*
+stack_acquire(stack_object* self)
+{
+    struct ioth* stack;
+
+    pthread_mutex_lock(&self->use_lock);
+    stack = self->stack;
+    if(stack)
+        self->users++;
+    pthread_mutex_unlock(&self->use_lock);
+
+    return stack;
+}
+
+void
+stack_release(stack_object* self)
+{
+    pthread_mutex_lock(&self->use_lock);
+    if(--self->users == 0)
+        pthread_cond_broadcast(&self->use_cond);
+    pthread_mutex_unlock(&self->use_lock);
+}
+
+struct ioth*
+stack_pin(stack_object* self)
+{
+    struct ioth* stack;
+
+    pthread_mutex_lock(&self->use_lock);
+    stack = self->stack;
+    if(stack)
+        self->pins++;
+    pthread_mutex_unlock(&self->use_lock);
+
+    return stack;
+}
+
+void
+stack_unpin(stack_object* self)
+{
+    pthread_mutex_lock(&self->use_lock);
+    self->pins--;
+    pthread_mutex_unlock(&self->use_lock);
+}
+
+/* stack_acquire raising the error of the stack methods on a closed stack */
+static struct ioth*
+stack_use(stack_object* self)
+{
+    struct ioth* stack = stack_acquire(self);
+    if(!stack)
+        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
+    return stack;
+}
+
+/* 
+   Close the sockets of the stack, free the dns handle and delete the stack.
+   Returns -1 with errno set if the stack could not be deleted, EBUSY while
+   it is pinned, in that case the stack is left open and usable.
+*/
+static int
+stack_close_internal(stack_object* self)
+{
+    struct ioth* stack;
+    int res;
+
+    /* Mark the stack as closed before releasing the GIL so that no new
+       socket can be created on it while it is being deleted, and only
+       one of concurrent close() calls deletes it */
+    pthread_mutex_lock(&self->use_lock);
+    if(self->pins > 0) {
+        pthread_mutex_unlock(&self->use_lock);
+        errno = EBUSY;
+        return -1;
+    }
+    stack = self->stack;
+    self->stack = NULL;
+    pthread_mutex_unlock(&self->use_lock);
+
+    if(stack) {
+        /* Wait for the calls still using the stack, e.g. a dhcp configuration */
+        Py_BEGIN_ALLOW_THREADS
+        pthread_mutex_lock(&self->use_lock);
+        while(self->users > 0)
+            pthread_cond_wait(&self->use_cond, &self->use_lock);
+        pthread_mutex_unlock(&self->use_lock);
+        Py_END_ALLOW_THREADS
+
+        socket_close_stack_sockets(self);
+        monitor_close_stack_monitors(self);
+
+        Py_BEGIN_ALLOW_THREADS
+        res = ioth_delstack(stack);
+        Py_END_ALLOW_THREADS
+
+        if(res < 0) {
+            int saved_errno = errno;
+            pthread_mutex_lock(&self->use_lock);
+            self->stack = stack;
+            pthread_mutex_unlock(&self->use_lock);
+            errno = saved_errno;
+            return -1;
+        }
+    }
+
+    pthread_mutex_lock(&self->dns_lock);
+    if(self->stack_dns) {
+        iothdns_fini(self->stack_dns);
+        self->stack_dns = NULL;
+    }
+    pthread_mutex_unlock(&self->dns_lock);
+
+    stack_links_invalidate(self);
+
+    return 0;
 }
 
 static void 
@@ -69,18 +364,129 @@ stack_finalize(stack_object* self)
     /* Save the current exception, if any. */
     PyErr_Fetch(&error_type, &error_value, &error_traceback);
 
-    /* Delete the ioth network stack */
-    if(self->stack) {
-        /* This is currently commented because freeing the stack causes a segfault when using picox */
-        /* ioth_delstack(self->stack); */
-        self->stack = NULL;
-    }
+    /* 
+       Delete the ioth network stack. At interpreter shutdown the threads of
+       the plugin may already be gone, the process exit reclaims everything.
+    */
+    if(!interpreter_finalizing())
+        stack_close_internal(self);
+
+    free(self->name);
+    self->name = NULL;
+    free(self->dns_config);
+    self->dns_config = NULL;
+
+    nameinfo_cache_free(self->nameinfo_cache);
+    self->nameinfo_cache = NULL;
+
+    stack_links_invalidate(self);
+
+    free(self->stats_samples);
+    self->stats_samples = NULL;
+    self->stats_samples_count = 0;
 
     /* Restore the saved exception. */
     PyErr_Restore(error_type, error_value, error_traceback);
     
 }
 
+PyDoc_STRVAR(stack_close_doc, "close()\n\
+\n\
+Close all the sockets still open on the stack, free its dns resolver\n\
+and delete the stack. The stack cannot be used after this call.\n\
+Calls still using the stack in other threads are waited for, OSError\n\
+with errno EBUSY is raised while a load balancer uses the stack.\n\
+Closing an already closed stack has no effect.");
+
+static PyObject*
+stack_close(stack_object* self, PyObject* Py_UNUSED(ignored))
+{
+    if(stack_close_internal(self) < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(stack_close_sockets_doc, "close_sockets()\n\
+\n\
+Close all the sockets still open on the stack, leaving the stack\n\
+and its configuration untouched.");
+
+static PyObject*
+stack_close_sockets(stack_object* self, PyObject* Py_UNUSED(ignored))
+{
+    socket_close_stack_sockets(self);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(stack_connect_many_doc, "_connect_many(sockets, addresses, timeout=None) -> list\n\
+\n\
+Connect each socket to the address at the same index, starting all the\n\
+connects at once and waiting up to timeout seconds (None for no limit)\n\
+for all of them together with the GIL released. Returns the list of the\n\
+errno values of the connects, 0 for the sockets connected. Used by\n\
+Stack.connect_many.");
+
+static PyObject*
+stack_connect_many(stack_object* self, PyObject* args, PyObject* kwargs)
+{
+    static char* kwnames[] = {"sockets", "addresses", "timeout", NULL};
+    PyObject* sockets;
+    PyObject* addresses;
+    PyObject* timeout_obj = Py_None;
+    _PyTime_t timeout;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "OO|O:_connect_many", kwnames,
+                                    &sockets, &addresses, &timeout_obj))
+        return NULL;
+    if(socket_parse_timeout(&timeout, timeout_obj) < 0)
+        return NULL;
+
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return NULL;
+
+    return socket_connect_many(st, sockets, addresses, timeout);
+}
+
+static PyObject*
+stack_get_closed(stack_object* self, void* Py_UNUSED(closure))
+{
+    return PyBool_FromLong(self->stack == NULL);
+}
+
+static PyObject*
+stack_get_forked(stack_object* self, void* Py_UNUSED(closure))
+{
+    return PyBool_FromLong(self->forked);
+}
+
+static PyObject*
+stack_get_name(stack_object* self, void* Py_UNUSED(closure))
+{
+    if(!self->name)
+        Py_RETURN_NONE;
+    return PyUnicode_FromString(self->name);
+}
+
+static PyObject*
+stack_get_creation_latency(stack_object* self, void* Py_UNUSED(closure))
+{
+    return PyFloat_FromDouble(_PyTime_AsSecondsDouble(self->creation_latency));
+}
+
+static PyGetSetDef stack_getsetlist[] = {
+    {"closed", (getter)stack_get_closed, NULL, "True if the stack is closed", NULL},
+    {"forked", (getter)stack_get_forked, NULL,
+     "True in a child process for the stacks inherited across fork, they are closed", NULL},
+    {"name", (getter)stack_get_name, NULL, "name of the ioth plugin of the stack", NULL},
+    {"creation_latency", (getter)stack_get_creation_latency, NULL,
+     "time in seconds taken to create the stack and its dns resolver", NULL},
+    {NULL} /* sentinel */
+};
+
 static PyObject* 
 stack_repr(stack_object* self)
 {
@@ -103,31 +509,89 @@ stack_new(PyTypeObject* type, PyObject* args, PyObject *kwargs)
     if(self != NULL) {
         self->stack = NULL;
         self->stack_dns = NULL;
+        self->dns_config = NULL;
+        pthread_mutex_init(&self->dns_lock, NULL);
+        pthread_mutex_init(&self->objects_lock, NULL);
+        pthread_mutex_init(&self->use_lock, NULL);
+        pthread_cond_init(&self->use_cond, NULL);
+        self->users = 0;
+        self->pins = 0;
+        self->sockets = NULL;
+        self->monitors = NULL;
+        self->forked = 0;
+        stack_link(self);
+        self->name = NULL;
+        self->caps = 0;
+        self->creation_latency = 0;
+        self->link_cache_enabled = 0;
+        self->link_cache = NULL;
+        self->link_cache_count = 0;
+        self->stats_samples = NULL;
+        self->stats_samples_count = 0;
+        self->nameinfo_cache = nameinfo_cache_new(NAMEINFO_CACHE_SIZE, NAMEINFO_CACHE_TTL);
+        if(!self->nameinfo_cache) {
+            Py_DECREF(new);
+            return PyErr_NoMemory();
+        }
     }
 
    return new;
 }
 
-static int stack_dns_init(stack_object* self, char* config){
+/* Called without the GIL and with dns_lock held, returns -1 with errno set on error */
+static int stack_dns_init(stack_object* self, struct ioth* stack, const char* config){
+    struct iothdns* dns;
+
     if (config == NULL || IS_PATH(config)){
-        self -> stack_dns = iothdns_init(self->stack, config);
+        dns = iothdns_init(stack, (char*)config);
     } else{
-        self -> stack_dns = iothdns_init_strcfg(self->stack, config);
+        dns = iothdns_init_strcfg(stack, (char*)config);
     }
 
-    if(self->stack_dns == NULL){
-        PyErr_SetFromErrno(PyExc_OSError);
+    if(dns == NULL){
         return -1;
     }
+    __atomic_store_n(&self->stack_dns, dns, __ATOMIC_RELEASE);
     return 0;
 }
 
+/* 
+   Return the dns resolver of the stack, creating it on first use. Most stacks
+   never resolve a name, so the configuration is not read at creation.
+   The caller holds a use of the stack, the resolver is freed by close().
+   Raises an exception and returns NULL on error.
+*/
+static struct iothdns*
+stack_get_dns(stack_object* self, struct ioth* stack)
+{
+    struct iothdns* dns = __atomic_load_n(&self->stack_dns, __ATOMIC_ACQUIRE);
+    int saved_errno = 0;
+
+    if(dns)
+        return dns;
+
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->dns_lock);
+    if(!self->stack_dns && stack_dns_init(self, stack, self->dns_config) < 0)
+        saved_errno = errno;
+    dns = self->stack_dns;
+    pthread_mutex_unlock(&self->dns_lock);
+    Py_END_ALLOW_THREADS
+
+    if(!dns) {
+        errno = saved_errno;
+        PyErr_SetFromErrno(PyExc_OSError);
+    }
+    return dns;
+}
+
 static int
 stack_initobj(PyObject* self, PyObject* args, PyObject* kwargs)
 {
     stack_object* s = (stack_object*)self;
 
     PyObject* vdeurl = NULL;
+    PyObject* vdeurl_items = NULL;
 
     char* config_dns = NULL;
     char* stack_name = NULL;
@@ -136,38 +600,22 @@ stack_initobj(PyObject* self, PyObject* args, PyObject* kwargs)
     const char* single_url_buf[2];
     const char** multi_url_buf = NULL;
 
-    if(!PyArg_ParseTuple(args, "s|Oz", &stack_name, &vdeurl, &config_dns)){
-        PyErr_SetFromErrno(PyExc_OSError);
-        return -1;
-    }
+    struct ioth* stack;
+    int res;
+    int saved_errno;
+    _PyTime_t start;
 
-    
-
-    if(stack_dns_init(s, config_dns) < 0) {
+    if(!PyArg_ParseTuple(args, "s|Oz", &stack_name, &vdeurl, &config_dns)){
         PyErr_SetFromErrno(PyExc_OSError);
         return -1;
     }
 
-    if(vdeurl == Py_None){
-        /*stack interface in configuration string */
-        s->stack = ioth_newstackc(stack_name);
-
-        if(!s->stack) {
-            PyErr_SetFromErrno(PyExc_OSError);
-            return -1;
-        }
-
-        //get stack name
-        char* stackString = strstr(stack_name, "stack=\0");
-        if(stackString){
-            strtok(stackString, "=");
-            stackName = strtok(NULL, "=");
-        }
-    }
-    else{
+    if(vdeurl != NULL && vdeurl != Py_None){
         /* check if vde url is a string or a list of strings */
         if(PyUnicode_Check(vdeurl)){
             single_url_buf[0] = PyUnicode_AsUTF8(vdeurl);
+            if(!single_url_buf[0])
+                return -1;
             single_url_buf[1] = 0;
             urls = single_url_buf;
         } else if(PyBytes_Check(vdeurl)){
@@ -181,108 +629,254 @@ stack_initobj(PyObject* self, PyObject* args, PyObject* kwargs)
                 return -1;
             }
 
+            /* 
+               Take a snapshot of the list, its strings must stay alive while
+               the stack is created without the GIL even if the list changes
+            */
+            vdeurl_items = PyList_AsTuple(vdeurl);
+            if(!vdeurl_items)
+                return -1;
+
             /* Allocate enough space for each string plus the null sentinel */
-            Py_ssize_t len = PyList_Size(vdeurl);
+            Py_ssize_t len = PyTuple_GET_SIZE(vdeurl_items);
             multi_url_buf = malloc(sizeof(char*) * (len + 1));
+            if(!multi_url_buf) {
+                Py_DECREF(vdeurl_items);
+                PyErr_NoMemory();
+                return -1;
+            }
             for(Py_ssize_t i = 0; i < len; i++)
             {
-                PyObject* string = PyList_GetItem(vdeurl, i);
-                if(!PyUnicode_Check(string)) {
-                    PyErr_SetString(PyExc_ValueError, argument_error);
+                PyObject* string = PyTuple_GET_ITEM(vdeurl_items, i);
+                const char* url = PyUnicode_Check(string) ? PyUnicode_AsUTF8(string) : NULL;
+                if(!url) {
+                    if(!PyErr_Occurred())
+                        PyErr_SetString(PyExc_ValueError, argument_error);
+                    free(multi_url_buf);
+                    Py_DECREF(vdeurl_items);
                     return -1;
                 }
-                const char* url = PyUnicode_AsUTF8(string);
                 multi_url_buf[i] = url;
             }
             multi_url_buf[len] = 0;
             urls = multi_url_buf;
         }
+    }
+
+    free(s->name);
+    s->name = urls ? strdup(stack_name) : stack_config_name(stack_name);
+    free(s->dns_config);
+    s->dns_config = config_dns ? strdup(config_dns) : NULL;
+
+    /* Starting the plugin can be slow */
+    start = _PyTime_GetMonotonicClock();
+    Py_BEGIN_ALLOW_THREADS
+    if(urls)
+        stack = ioth_newstackv(stack_name, urls);
+    else
+        /*stack interface in configuration string */
+        stack = ioth_newstackc(stack_name);
+    res = stack ? 0 : -1;
+    saved_errno = errno;
+    Py_END_ALLOW_THREADS
+    s->creation_latency = _PyTime_GetMonotonicClock() - start;
+
+    pthread_mutex_lock(&s->use_lock);
+    s->stack = stack;
+    pthread_mutex_unlock(&s->use_lock);
+
+    free(multi_url_buf);
+    Py_XDECREF(vdeurl_items);
+
+    if(res < 0) {
+        errno = saved_errno;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    s->caps = stack_plugin_caps(s->name);
+
+    return 0;
+}
+
+
+/* Copy the link with the given name, or index if name is NULL, returns 1 if found */
+static int
+links_find(const struct nl_link_info* links, size_t count, const char* name,
+           unsigned int index, struct nl_link_info* out)
+{
+    for(size_t i = 0; i < count; i++) {
+        if(name ? strcmp(links[i].name, name) == 0 : links[i].ifindex == index) {
+            *out = links[i];
+            return 1;
+        }
+    }
+    return 0;
+}
 
+/*
+    Return in *links a malloc'd array of the links of the stack, a copy of
+    the cached table when the cache is enabled, loading it if needed.
+    Returns -1 and raises OSError on error.
+*/
+static int
+stack_get_links(stack_object* self, struct nl_link_info** links, size_t* count)
+{
+    int res = 1;
+
+    /* The table is copied, another thread may drop the cache meanwhile */
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if(self->link_cache_enabled && self->link_cache) {
+        *count = self->link_cache_count;
+        *links = malloc((*count ? *count : 1) * sizeof(**links));
+        if(*links) {
+            memcpy(*links, self->link_cache, *count * sizeof(**links));
+            res = 0;
+        } else {
+            res = -1;
+        }
+    }
+    Py_END_CRITICAL_SECTION();
 
-        s->stack = ioth_newstackv(stack_name, urls);
-        free(multi_url_buf);
-        stackName = stack_name;
+    if(res == 0)
+        return 0;
+    if(res < 0) {
+        PyErr_NoMemory();
+        return -1;
     }
 
-    if(!s->stack) {
+    struct ioth* stack = stack_use(self);
+    if(!stack)
+        return -1;
+
+    Py_BEGIN_ALLOW_THREADS
+    res = nl_get_links(stack, links, count);
+    Py_END_ALLOW_THREADS
+    stack_release(self);
+
+    if(res < 0) {
         PyErr_SetFromErrno(PyExc_OSError);
         return -1;
     }
 
-    
+    /* Cache a copy of the fresh table, skipped if there is no memory for it */
+    struct nl_link_info* cache = NULL;
+    if(self->link_cache_enabled) {
+        cache = malloc((*count ? *count : 1) * sizeof(*cache));
+        if(cache)
+            memcpy(cache, *links, *count * sizeof(*cache));
+    }
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if(cache && self->link_cache_enabled) {
+        struct nl_link_info* old = self->link_cache;
+        self->link_cache = cache;
+        self->link_cache_count = *count;
+        cache = old;
+    }
+    Py_END_CRITICAL_SECTION();
 
+    free(cache);
     return 0;
 }
 
+/*
+    Find the link with the given name, or with the given index if name is NULL.
+    Returns 1 and copies the link to *out if found, 0 if not found and -1 on error.
+    A miss in the cache is checked again on a fresh table, the link could have
+    been added without going through this stack object.
+*/
+static int
+stack_find_link(stack_object* self, const char* name, unsigned int index, struct nl_link_info* out)
+{
+    struct nl_link_info* links;
+    size_t count;
+    int found = 0;
+
+    Py_BEGIN_CRITICAL_SECTION(self);
+    if(self->link_cache_enabled && self->link_cache)
+        found = links_find(self->link_cache, self->link_cache_count, name, index, out);
+    Py_END_CRITICAL_SECTION();
+
+    if(found)
+        return 1;
+
+    stack_links_invalidate(self);
+    if(stack_get_links(self, &links, &count) < 0)
+        return -1;
+
+    found = links_find(links, count, name, index, out);
+    free(links);
+    return found;
+}
 
 PyDoc_STRVAR(if_nameindex_doc, "if_nameindex()\n\
 \n\
 Returns a list of network interface information (index, name) tuples.");
 
 static PyObject*
-stack_if_nameindex(stack_object* self)
+stack_if_nameindex(stack_object* self, PyObject* Py_UNUSED(ignored))
 {
-    /* nlinline missing support for if_nameindex */
-#if 1
-    PyErr_SetNone(PyExc_NotImplementedError);
-    return NULL;
-#else
     if(!self->stack) 
     {
         PyErr_SetString(PyExc_Exception, "Uninitialized stack");
         return NULL;
     }
 
-    PyObject* list = PyList_New(0);
-    if(!list) 
-        return NULL;
-
-
-    struct ioth_if_nameindex *ni = ioth_if_nameindex(self->stack);
-    if(!ni) {
-        Py_DECREF(list);
-        PyErr_SetString(PyExc_Exception, "Unable to retrieve interfaces");
+    struct nl_link_info* links;
+    size_t count;
+    if(stack_get_links(self, &links, &count) < 0)
         return NULL;
-    }
 
-    for (int i = 0; ni[i].if_index != 0 && i < INT_MAX; i++)
-    {
+    PyObject* list = PyList_New(0);
+    for(size_t i = 0; list && i < count; i++) {
         PyObject *ni_tuple = Py_BuildValue("IO&", 
-            ni[i].if_index, PyUnicode_DecodeFSDefault, ni[i].if_name);
-        if(!ni_tuple || PyList_Append(list, ni_tuple) == -1) {
-            Py_XDECREF(ni_tuple);
-            Py_DECREF(list);
-            ioth_if_freenameindex(self->stack, ni);
-            return NULL;
-        }
-        Py_DECREF(ni_tuple);
+            links[i].ifindex, PyUnicode_DecodeFSDefault, links[i].name);
+        if(!ni_tuple || PyList_Append(list, ni_tuple) == -1)
+            Py_CLEAR(list);
+        Py_XDECREF(ni_tuple);
     }
 
-    ioth_if_freenameindex(self->stack, ni);
+    free(links);
 
     return list;
-#endif
 }
 
 
 PyDoc_STRVAR(if_nametoindex_doc, "if_nametoindex(if_name)\n\
 \n\
-Returns the interface index corresponding to the interface name if_name.");
+Returns the interface index corresponding to the interface name if_name.\n\
+The lookup uses the interface table when enabled by set_ifindex_cache.");
 
 static PyObject*
 stack_if_nametoindex(stack_object* self, PyObject* args)
 {
-    if(!self->stack) 
-    {
-        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
+    PyObject* oname;
+    if(!PyArg_ParseTuple(args, "O&:if_nametoindex", PyUnicode_FSConverter, &oname))
         return NULL;
+
+    if(self->link_cache_enabled) {
+        struct nl_link_info link;
+        int found = stack_find_link(self, PyBytes_AS_STRING(oname), 0, &link);
+        Py_DECREF(oname);
+
+        if(found < 0)
+            return NULL;
+        if(!found) {
+            PyErr_SetString(PyExc_Exception, "no interface with this name");
+            return NULL;
+        }
+        return PyLong_FromUnsignedLong(link.ifindex);
     }
 
-    PyObject* oname;
-    if(!PyArg_ParseTuple(args, "O&:if_nametoindex", PyUnicode_FSConverter, &oname))
+    struct ioth* stack = stack_use(self);
+    if(!stack) {
+        Py_DECREF(oname);
         return NULL;
+    }
 
-    unsigned long index = ioth_if_nametoindex(self->stack, PyBytes_AS_STRING(oname));
+    unsigned long index = ioth_if_nametoindex(stack, PyBytes_AS_STRING(oname));
+    stack_release(self);
     Py_DECREF(oname);
 
     // TODO: nlinline returns -1 on error instead of 0 (not in line with the man pages)
@@ -302,11 +896,6 @@ Returns the interface name corresponding to the interface index if_index.");
 static PyObject*
 stack_if_indextoname(stack_object* self, PyObject* arg)
 {
-    /* nlinline missing support for if_indextoname */
-#if 1
-    PyErr_SetNone(PyExc_NotImplementedError);
-    return NULL;
-#else
     if(!self->stack) 
     {
         PyErr_SetString(PyExc_Exception, "Uninitialized stack");
@@ -316,37 +905,62 @@ stack_if_indextoname(stack_object* self, PyObject* arg)
     unsigned long index = PyLong_AsUnsignedLong(arg);
     if(PyErr_Occurred())
         return NULL;
-    
-    char name[IF_NAMESIZE + 1];
-    if(ioth_indextoname(self->stack, index, name) == NULL)
-    {
+
+    struct nl_link_info link;
+    int found = stack_find_link(self, NULL, index, &link);
+    if(found < 0)
+        return NULL;
+    if(!found) {
         PyErr_SetString(PyExc_Exception, "no interface with this index");
         return NULL;
     }
 
-    return PyUnicode_DecodeFSDefault(name);
-#endif
+    return PyUnicode_DecodeFSDefault(link.name);
 }
 
-
-PyDoc_STRVAR(linksetupdown_doc, "linksetupdown(index, up_down)\n\
+PyDoc_STRVAR(set_ifindex_cache_doc, "set_ifindex_cache(enabled=True)\n\
 \n\
-Turn the interface at the specified index up (updown == True) or down (updown == False)");
+Enable or disable the cache of the interface table used by if_nametoindex,\n\
+if_indextoname and if_nameindex. The table is loaded with a single netlink\n\
+dump and dropped by the calls of this object that add, remove or configure\n\
+links (iplink_add, iplink_add_vde, iplink_del, ioth_config). Changes made\n\
+by other means are noticed only when a lookup misses.");
 
 static PyObject*
-stack_linksetupdown(stack_object* self, PyObject* args)
+stack_set_ifindex_cache(stack_object* self, PyObject* args, PyObject* kwargs)
 {
-    if(!self->stack) 
-    {
-        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
+    static char* kwnames[] = {"enabled", NULL};
+    int enabled = 1;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|p:set_ifindex_cache", kwnames, &enabled))
         return NULL;
-    }
 
+    Py_BEGIN_CRITICAL_SECTION(self);
+    self->link_cache_enabled = enabled;
+    Py_END_CRITICAL_SECTION();
+    stack_links_invalidate(self);
+
+    Py_RETURN_NONE;
+}
+
+
+PyDoc_STRVAR(linksetupdown_doc, "linksetupdown(index, up_down)\n\
+\n\
+Turn the interface at the specified index up (updown == True) or down (updown == False)");
+
+static PyObject*
+stack_linksetupdown(stack_object* self, PyObject* args)
+{
     int index, updown;
     if(!PyArg_ParseTuple(args, "ip", &index, &updown))
         return NULL;
 
-    int res = ioth_linksetupdown(self->stack, index, updown);
+    struct ioth* stack = stack_use(self);
+    if(!stack)
+        return NULL;
+
+    int res = ioth_linksetupdown(stack, index, updown);
+    stack_release(self);
 
     if(res == -1) {
         PyErr_SetString(PyExc_Exception, "no interface with this name");
@@ -395,12 +1009,12 @@ parse_iproute_args(PyObject* args, PyObject* kwargs, int* out_family, char* out_
 
     static char* kwnames[] = { 
         "", "", /* 2 required positional arguments */
-        "dst_addr", "dst_prefix", "ifindex"
+        "dst_addr", "dst_prefix", "ifindex", NULL
     };
 
 
     /* Parse arguments */
-    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "is|sii", kwnames, &family, &gw_str, 
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "is|zii", kwnames, &family, &gw_str, 
                                     &dst_str,  &dst_prefix, &if_index)) {
         return 0;
     }
@@ -412,14 +1026,14 @@ parse_iproute_args(PyObject* args, PyObject* kwargs, int* out_family, char* out_
     }
 
     /* Convert string address to bytes */
-    if(inet_pton(family, gw_str, out_gw_buf) < 0) {
+    if(inet_pton(family, gw_str, out_gw_buf) <= 0) {
         PyErr_SetString(PyExc_ValueError, "invalid gw_addr address string");
         return 0;
     }
 
     if(dst_str) {
         /* Convert string address to bytes */
-        if(inet_pton(family, gw_str, *out_dst_bufp) < 0) {
+        if(inet_pton(family, dst_str, *out_dst_bufp) <= 0) {
             PyErr_SetString(PyExc_ValueError, "invalid dst_addr address string");
             return 0;
         }
@@ -444,12 +1058,6 @@ If gw_addr is an IPv6 link local address, ifindex must be specified");
 static PyObject*
 stack_iproute_add(stack_object* self, PyObject* args, PyObject* kwargs)
 {
-    if(!self->stack) 
-    {
-        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
-        return NULL;
-    }
-
     int family;
     char gw_buf[sizeof(struct in6_addr)];
     char dst_buf[sizeof(struct in6_addr)];
@@ -460,7 +1068,14 @@ stack_iproute_add(stack_object* self, PyObject* args, PyObject* kwargs)
     if(!parse_iproute_args(args, kwargs, &family, gw_buf, &dst_bufp, &dst_prefix, &if_index))
         return NULL;
 
-    if(ioth_iproute_add(self->stack, family, dst_buf, dst_prefix, gw_buf, if_index) < 0) {
+    struct ioth* stack = stack_use(self);
+    if(!stack)
+        return NULL;
+
+    int res = ioth_iproute_add(stack, family, dst_bufp, dst_prefix, gw_buf, if_index);
+    stack_release(self);
+
+    if(res < 0) {
         PyErr_SetString(PyExc_Exception, "failed to add ip route");
         return NULL;       
     }
@@ -477,13 +1092,6 @@ If gw_addr is an IPv6 link local address, ifindex must be specified");
 static PyObject*
 stack_iproute_del(stack_object* self, PyObject* args, PyObject* kwargs)
 {
-    if(!self->stack) 
-    {
-        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
-        return NULL;
-    }
-
-
     int family;
     char gw_buf[sizeof(struct in6_addr)];
     char dst_buf[sizeof(struct in6_addr)];
@@ -494,7 +1102,14 @@ stack_iproute_del(stack_object* self, PyObject* args, PyObject* kwargs)
     if(!parse_iproute_args(args, kwargs, &family, gw_buf, &dst_bufp, &dst_prefix, &if_index))
         return NULL;
 
-    if(ioth_iproute_del(self->stack, family, dst_buf, dst_prefix, gw_buf, if_index) < 0) {
+    struct ioth* stack = stack_use(self);
+    if(!stack)
+        return NULL;
+
+    int res = ioth_iproute_del(stack, family, dst_bufp, dst_prefix, gw_buf, if_index);
+    stack_release(self);
+
+    if(res < 0) {
         PyErr_SetString(PyExc_Exception, "failed to del ip route");
         return NULL;       
     }
@@ -526,7 +1141,7 @@ parse_ipaddr_args(PyObject* args, int* out_af, char* out_addr, int* out_prefix_l
     }
 
     /* Convert string address to bytes */
-    if(inet_pton(af, addr_str, out_addr) < 0) {
+    if(inet_pton(af, addr_str, out_addr) <= 0) {
         PyErr_SetString(PyExc_ValueError, "invalid address string");
         return 0;
     }
@@ -548,19 +1163,20 @@ stack_ipaddr_add(stack_object* self, PyObject* args)
     int prefix_len;
     int if_index;
 
-    if(!self->stack) 
-    {
-        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
-        return NULL;
-    }
-
     /* Parse arguments */
     char buf[sizeof(struct in6_addr)];
     if(!parse_ipaddr_args(args, &af, buf, &prefix_len, &if_index)) {
         return NULL;
     }
 
-    if(ioth_ipaddr_add(self->stack, af, buf, prefix_len, if_index) < 0) {
+    struct ioth* stack = stack_use(self);
+    if(!stack)
+        return NULL;
+
+    int res = ioth_ipaddr_add(stack, af, buf, prefix_len, if_index);
+    stack_release(self);
+
+    if(res < 0) {
         PyErr_SetString(PyExc_Exception, "failed to add ip address to interface");
         return NULL;
     }
@@ -581,19 +1197,20 @@ stack_ipaddr_del(stack_object *self, PyObject *args){
     int prefix_len;
     int if_index;
 
-    if(!self->stack) 
-    {
-        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
-        return NULL;
-    }
-
     /* Parse arguments */
     char buf[sizeof(struct in6_addr)];
     if(!parse_ipaddr_args(args, &af, buf, &prefix_len, &if_index)) {
         return NULL;
     }
 
-    if(ioth_ipaddr_del(self->stack, af, buf, prefix_len, if_index) < 0) {
+    struct ioth* stack = stack_use(self);
+    if(!stack)
+        return NULL;
+
+    int res = ioth_ipaddr_del(stack, af, buf, prefix_len, if_index);
+    stack_release(self);
+
+    if(res < 0) {
         PyErr_SetString(PyExc_Exception, "failed to delete ip address from interface");
         return NULL;
     }
@@ -601,6 +1218,150 @@ stack_ipaddr_del(stack_object *self, PyObject *args){
     Py_RETURN_NONE;
 }
 
+/* Names of the operations accepted by apply, in the order of enum nl_op_type */
+static const char* const apply_op_names[] = {
+    "ipaddr_add", "ipaddr_del", "iproute_add", "iproute_del", "linksetupdown", "linksetmtu",
+};
+
+/*
+    Parse an operation of apply into op.
+    Returns 0 and raises an exception if the operation is invalid.
+*/
+static int
+parse_apply_op(PyObject* item, struct nl_op* op)
+{
+    if(!PyTuple_Check(item) || PyTuple_GET_SIZE(item) < 1 || !PyUnicode_Check(PyTuple_GET_ITEM(item, 0))) {
+        PyErr_SetString(PyExc_TypeError, "operations must be tuples (name, *args)");
+        return 0;
+    }
+
+    const char* name = PyUnicode_AsUTF8(PyTuple_GET_ITEM(item, 0));
+    if(!name)
+        return 0;
+
+    int type = -1;
+    for(int i = 0; i < (int)(sizeof(apply_op_names) / sizeof(apply_op_names[0])); i++) {
+        if(strcmp(name, apply_op_names[i]) == 0) {
+            type = i;
+            break;
+        }
+    }
+    if(type < 0) {
+        PyErr_Format(PyExc_ValueError, "unknown operation '%s'", name);
+        return 0;
+    }
+
+    PyObject* args = PyTuple_GetSlice(item, 1, PyTuple_GET_SIZE(item));
+    if(!args)
+        return 0;
+
+    int ok = 0;
+    memset(op, 0, sizeof(*op));
+    op->type = type;
+
+    switch(op->type) {
+        case NL_OP_IPADDR_ADD:
+        case NL_OP_IPADDR_DEL:
+        {
+            int if_index;
+            ok = parse_ipaddr_args(args, &op->family, (char*)op->addr, &op->prefixlen, &if_index);
+            op->ifindex = if_index;
+        } break;
+
+        case NL_OP_IPROUTE_ADD:
+        case NL_OP_IPROUTE_DEL:
+        {
+            char* dst_bufp = (char*)op->addr;
+            int if_index;
+            ok = parse_iproute_args(args, NULL, &op->family, (char*)op->gateway, &dst_bufp,
+                                    &op->prefixlen, &if_index);
+            op->has_dst = dst_bufp != NULL;
+            op->ifindex = if_index;
+        } break;
+
+        case NL_OP_LINKSETUPDOWN:
+        case NL_OP_LINKSETMTU:
+        {
+            int if_index, value;
+            ok = PyArg_ParseTuple(args, op->type == NL_OP_LINKSETUPDOWN ? "ip" : "ii", &if_index, &value);
+            if(ok && op->type == NL_OP_LINKSETMTU && value <= 0) {
+                PyErr_SetString(PyExc_ValueError, "mtu must be a positive integer");
+                ok = 0;
+            }
+            op->ifindex = if_index;
+            op->value = value;
+        } break;
+    }
+
+    Py_DECREF(args);
+    return ok;
+}
+
+PyDoc_STRVAR(apply_doc, "apply(ops)\n\
+\n\
+Apply a list of configuration operations in a single transaction.\n\
+Each operation is a tuple (name, *args) where name is one of ipaddr_add,\n\
+ipaddr_del, iproute_add, iproute_del, linksetupdown and linksetmtu and args\n\
+are the positional arguments of the method with the same name.\n\
+\n\
+All the operations are validated before any of them is executed, then they\n\
+are sent in order on a single netlink socket without holding the GIL.\n\
+Returns a list with the result of each operation: 0 on success or the errno\n\
+value reported for it. Operations are not rolled back on failure.");
+
+static PyObject*
+stack_apply(stack_object* self, PyObject* ops_arg)
+{
+    PyObject* ops_seq = PySequence_Fast(ops_arg, "ops must be a sequence");
+    if(!ops_seq)
+        return NULL;
+
+    Py_ssize_t count = PySequence_Fast_GET_SIZE(ops_seq);
+    struct nl_op* ops = PyMem_New(struct nl_op, count > 0 ? count : 1);
+    if(!ops) {
+        Py_DECREF(ops_seq);
+        return PyErr_NoMemory();
+    }
+
+    /* Validate everything before touching the stack */
+    for(Py_ssize_t i = 0; i < count; i++) {
+        if(!parse_apply_op(PySequence_Fast_GET_ITEM(ops_seq, i), &ops[i])) {
+            PyMem_Free(ops);
+            Py_DECREF(ops_seq);
+            return NULL;
+        }
+    }
+    Py_DECREF(ops_seq);
+
+    if(count > 0) {
+        struct ioth* stack = stack_use(self);
+        if(!stack) {
+            PyMem_Free(ops);
+            return NULL;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        nl_apply(stack, ops, count);
+        Py_END_ALLOW_THREADS
+        stack_release(self);
+    }
+
+    PyObject* result = PyList_New(count);
+    if(result) {
+        for(Py_ssize_t i = 0; i < count; i++) {
+            PyObject* error = PyLong_FromLong(ops[i].error);
+            if(!error) {
+                Py_CLEAR(result);
+                break;
+            }
+            PyList_SET_ITEM(result, i, error);
+        }
+    }
+
+    PyMem_Free(ops);
+    return result;
+}
+
 PyDoc_STRVAR(iplink_add_doc, "iplink_add(ifindex, type, data, ifname)\n\
 \n\
 This function adds a new link of type type,  named  ifname.  The\n\
@@ -623,14 +1384,8 @@ stack_iplink_add(stack_object *self, PyObject *args){
     int newifindex;
     struct nl_iplink_data* ifd = NULL;
 
-    if(!self->stack) 
-    {
-        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
-        return NULL;
-    }
-
-    if(strcmp(stackName, "vdestack") == 0){
-        PyErr_SetString(PyExc_Exception, "Operation not supported by vdestack");
+    if(!(self->caps & IOTHPY_CAP_IPLINK_ADD)){
+        PyErr_Format(PyExc_Exception, "Operation not supported by %s", self->name);
         return NULL;
     }
 
@@ -670,7 +1425,17 @@ stack_iplink_add(stack_object *self, PyObject *args){
         return NULL;
     }
 
-    if((newifindex = ioth_iplink_add(self->stack, ifname, ifindex, type, ifd,  nifd)) < 0) {
+    struct ioth* stack = stack_use(self);
+    if(!stack) {
+        free(ifd);
+        return NULL;
+    }
+
+    stack_links_invalidate(self);
+    newifindex = ioth_iplink_add(stack, ifname, ifindex, type, ifd,  nifd);
+    stack_release(self);
+
+    if(newifindex < 0) {
         PyErr_SetString(PyExc_Exception, "failed to add link");
         return NULL;
     }
@@ -697,14 +1462,8 @@ stack_iplink_add_vde(stack_object *self, PyObject *args){
     char* vnl = NULL;
     int newifindex;
 
-    if(!self->stack) 
-    {
-        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
-        return NULL;
-    }
-
-    if(strcmp(stackName, "vdestack") == 0){
-        PyErr_SetString(PyExc_Exception, "Operation not supported by vdestack");
+    if(!(self->caps & IOTHPY_CAP_IPLINK_ADD)){
+        PyErr_Format(PyExc_Exception, "Operation not supported by %s", self->name);
         return NULL;
     }
 
@@ -713,7 +1472,15 @@ stack_iplink_add_vde(stack_object *self, PyObject *args){
         return NULL;
     }
 
-    if((newifindex = ioth_iplink_add(self->stack, ifname, ifindex, "vde", nl_iplink_strdata(IFLA_VDE_VNL, vnl))) < 0) {
+    struct ioth* stack = stack_use(self);
+    if(!stack)
+        return NULL;
+
+    stack_links_invalidate(self);
+    newifindex = ioth_iplink_add(stack, ifname, ifindex, "vde", nl_iplink_strdata(IFLA_VDE_VNL, vnl));
+    stack_release(self);
+
+    if(newifindex < 0) {
         PyErr_SetString(PyExc_Exception, "failed to add link");
         return NULL;
     }
@@ -738,12 +1505,6 @@ stack_iplink_del(stack_object *self, PyObject *args, PyObject *kwargs){
 
     PyObject *empty = PyTuple_New(0);
 
-    if(!self->stack) 
-    {
-        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
-        goto out;
-    }    
-
     if(empty == NULL){
         PyErr_SetString(PyExc_Exception, "failed to remove link");
         goto out;
@@ -758,8 +1519,16 @@ stack_iplink_del(stack_object *self, PyObject *args, PyObject *kwargs){
         goto out;
     }
 
+    struct ioth* stack = stack_use(self);
+    if(!stack)
+        goto out;
+
     int ret = 0;
-    if((ret = ioth_iplink_del(self->stack, ifname, ifindex))<0){
+    stack_links_invalidate(self);
+    ret = ioth_iplink_del(stack, ifname, ifindex);
+    stack_release(self);
+
+    if(ret < 0){
         PyErr_SetString(PyExc_Exception, "failed to remove link");
         goto out;
     }
@@ -778,13 +1547,6 @@ static PyObject*
 stack_linkgetaddr(stack_object *self, PyObject *args) {
     int ifindex;
 
-    if(!self->stack) 
-    {
-        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
-        return NULL;
-    }
-
-
     /* Parse arguments */
     if(!PyArg_ParseTuple(args, "i", &ifindex)) {
         return NULL;
@@ -794,8 +1556,17 @@ stack_linkgetaddr(stack_object *self, PyObject *args) {
     if (buf == NULL)
         return NULL;
 
-    int ret = 0;
-    if((ret = ioth_linkgetaddr(self->stack, ifindex, (void *)PyBytes_AS_STRING(buf))) < 0){
+    struct ioth* stack = stack_use(self);
+    if(!stack) {
+        Py_DECREF(buf);
+        return NULL;
+    }
+
+    int ret = ioth_linkgetaddr(stack, ifindex, (void *)PyBytes_AS_STRING(buf));
+    stack_release(self);
+
+    if(ret < 0){
+        Py_DECREF(buf);
         PyErr_SetString(PyExc_Exception, "failed to get MAC address");
         return NULL;
     }
@@ -812,60 +1583,666 @@ stack_linksetaddr(stack_object *self, PyObject *args) {
     int ifindex;
     Py_buffer addr;
 
+    /* Parse arguments */
+    if(!PyArg_ParseTuple(args, "iy*", &ifindex, &addr)) {
+        return NULL;
+    }
+
+    if(addr.len != 6) {
+        PyErr_SetString(PyExc_ValueError, "MAC address must be of 6 bytes");
+        PyBuffer_Release(&addr);
+        return NULL;
+    }
+
+    struct ioth* stack = stack_use(self);
+    if(!stack) {
+        PyBuffer_Release(&addr);
+        return NULL;
+    }
+
+    int ret = ioth_linksetaddr(stack, ifindex, addr.buf);
+    stack_release(self);
+    PyBuffer_Release(&addr);
+
+    if(ret < 0) {
+        PyErr_SetString(PyExc_Exception, "failed to set MAC address");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+
+PyDoc_STRVAR(linksetmtu_doc," linksetmtu(ifindex, mtu)\n\
+Set the MTU of the interface ifindex, mtu must be a positive integer");
+
+static PyObject*
+stack_linksetmtu(stack_object *self, PyObject *args) {
+    int ifindex;
+    int mtu;
+
+    /* Parse arguments */
+    if(!PyArg_ParseTuple(args, "ii", &ifindex, &mtu)) {
+        return NULL;
+    }
+
+    struct ioth* stack = stack_use(self);
+    if(!stack)
+        return NULL;
+
+    int ret = ioth_linksetmtu(stack, ifindex, mtu);
+    stack_release(self);
+
+    if(ret < 0) {
+        PyErr_SetString(PyExc_Exception, "failed to set MAC address");
+        return NULL;
+    }
+
+    Py_RETURN_NONE;
+}
+
+/* Counters of struct rtnl_link_stats64 exposed by LinkStats, in field order */
+static const size_t link_stats_offsets[] = {
+    offsetof(struct rtnl_link_stats64, rx_packets),
+    offsetof(struct rtnl_link_stats64, tx_packets),
+    offsetof(struct rtnl_link_stats64, rx_bytes),
+    offsetof(struct rtnl_link_stats64, tx_bytes),
+    offsetof(struct rtnl_link_stats64, rx_errors),
+    offsetof(struct rtnl_link_stats64, tx_errors),
+    offsetof(struct rtnl_link_stats64, rx_dropped),
+    offsetof(struct rtnl_link_stats64, tx_dropped),
+    offsetof(struct rtnl_link_stats64, multicast),
+    offsetof(struct rtnl_link_stats64, collisions),
+};
+
+#define LINK_STATS_COUNTERS (sizeof(link_stats_offsets) / sizeof(link_stats_offsets[0]))
+
+static PyStructSequence_Field linkstats_fields[] = {
+    {"rx_packets", "packets received"},
+    {"tx_packets", "packets transmitted"},
+    {"rx_bytes", "bytes received"},
+    {"tx_bytes", "bytes transmitted"},
+    {"rx_errors", "bad packets received"},
+    {"tx_errors", "packet transmit problems"},
+    {"rx_dropped", "packets received and dropped by the stack"},
+    {"tx_dropped", "packets dropped on transmit"},
+    {"multicast", "multicast packets received"},
+    {"collisions", "collisions on transmit"},
+    {"interval", "seconds since the previous sample for link_stats_delta, None otherwise"},
+    {NULL}
+};
+
+PyDoc_STRVAR(linkstats_doc,
+"LinkStats: result entry of Stack.link_stats and Stack.link_stats_delta\n\
+\n\
+A 10-tuple of traffic counters (rx_packets, tx_packets, rx_bytes, tx_bytes,\n\
+rx_errors, tx_errors, rx_dropped, tx_dropped, multicast, collisions)\n\
+with named fields, plus the interval attribute.");
+
+static PyStructSequence_Desc linkstats_desc = {
+    "iothpy.LinkStats",
+    linkstats_doc,
+    linkstats_fields,
+    LINK_STATS_COUNTERS
+};
+
+
+/* Sample of the counters of a link kept for link_stats_delta */
+struct link_stats_sample {
+    unsigned int ifindex;
+    _PyTime_t time;
+    struct rtnl_link_stats64 stats;
+};
+
+static inline uint64_t
+link_stats_counter(const struct rtnl_link_stats64* stats, size_t i)
+{
+    return *(const uint64_t*)((const char*)stats + link_stats_offsets[i]);
+}
+
+/*
+    Build a LinkStats from the counters of stats, minus the ones of prev
+    if not NULL. A counter lower than in prev was reset and is reported as is.
+*/
+static PyObject*
+make_link_stats(iothpy_state* st, const struct rtnl_link_stats64* stats, const struct link_stats_sample* prev, _PyTime_t now)
+{
+    PyObject* item = PyStructSequence_New(st->linkstats_type);
+    if(!item)
+        return NULL;
+
+    for(size_t i = 0; i < LINK_STATS_COUNTERS; i++) {
+        uint64_t value = link_stats_counter(stats, i);
+        if(prev) {
+            uint64_t old = link_stats_counter(&prev->stats, i);
+            if(value >= old)
+                value -= old;
+        }
+        PyStructSequence_SET_ITEM(item, i, PyLong_FromUnsignedLongLong(value));
+    }
+
+    PyObject* interval;
+    if(prev) {
+        interval = PyFloat_FromDouble(_PyTime_AsSecondsDouble(now - prev->time));
+    } else {
+        Py_INCREF(Py_None);
+        interval = Py_None;
+    }
+    PyStructSequence_SET_ITEM(item, LINK_STATS_COUNTERS, interval);
+
+    if(PyErr_Occurred()) {
+        Py_DECREF(item);
+        return NULL;
+    }
+    return item;
+}
+
+/*
+    Read the links for link_stats, all of them if ifindex is None.
+    Returns -1 and raises an exception on error.
+*/
+static int
+stack_read_link_stats(stack_object* self, PyObject* ifindex_obj, struct nl_link_info** links, size_t* count)
+{
+    struct ioth* stack;
+    int res;
+
+    if(ifindex_obj == Py_None) {
+        if(!(stack = stack_use(self)))
+            return -1;
+
+        Py_BEGIN_ALLOW_THREADS
+        res = nl_get_links(stack, links, count);
+        Py_END_ALLOW_THREADS
+        stack_release(self);
+    } else {
+        unsigned long ifindex = PyLong_AsUnsignedLong(ifindex_obj);
+        if(PyErr_Occurred())
+            return -1;
+
+        *links = malloc(sizeof(**links));
+        if(!*links) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        *count = 1;
+
+        if(!(stack = stack_use(self))) {
+            free(*links);
+            return -1;
+        }
+
+        Py_BEGIN_ALLOW_THREADS
+        res = nl_get_link(stack, ifindex, *links);
+        Py_END_ALLOW_THREADS
+        stack_release(self);
+
+        if(res < 0) {
+            int saved_errno = errno;
+            free(*links);
+            errno = saved_errno;
+        } else if(!(*links)->has_stats) {
+            free(*links);
+            PyErr_SetString(PyExc_OSError, "the stack does not report link statistics");
+            return -1;
+        }
+    }
+
+    if(res < 0) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+    return 0;
+}
+
+PyDoc_STRVAR(link_stats_doc, "link_stats(ifindex=None)\n\
+\n\
+Return the traffic counters of the interface ifindex as a LinkStats tuple,\n\
+or a dict {ifindex: LinkStats} with the counters of all the interfaces\n\
+when ifindex is None. Interfaces without counters are left out.");
+
+static PyObject*
+stack_link_stats(stack_object* self, PyObject* args, PyObject* kwargs)
+{
+    static char* kwnames[] = {"ifindex", NULL};
+    PyObject* ifindex_obj = Py_None;
+    struct nl_link_info* links;
+    size_t count;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:link_stats", kwnames, &ifindex_obj))
+        return NULL;
+
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return NULL;
+
+    if(stack_read_link_stats(self, ifindex_obj, &links, &count) < 0)
+        return NULL;
+
+    PyObject* result;
+    if(ifindex_obj != Py_None) {
+        result = make_link_stats(st, &links[0].stats, NULL, 0);
+    } else {
+        result = PyDict_New();
+        for(size_t i = 0; result && i < count; i++) {
+            if(!links[i].has_stats)
+                continue;
+
+            PyObject* key = PyLong_FromUnsignedLong(links[i].ifindex);
+            PyObject* value = make_link_stats(st, &links[i].stats, NULL, 0);
+            if(!key || !value || PyDict_SetItem(result, key, value) < 0)
+                Py_CLEAR(result);
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+        }
+    }
+
+    free(links);
+    return result;
+}
+
+/*
+    Build the result of link_stats_delta from the new counters and replace
+    the samples of the links read, single is set if only one was requested.
+    Called in a critical section of the stack object.
+*/
+static PyObject*
+stack_stats_delta(iothpy_state* st, stack_object* self, int single, const struct nl_link_info* links, size_t count, _PyTime_t now)
+{
+    /* The new samples replace all the old ones when reading every link */
+    size_t new_count = single ? self->stats_samples_count + 1 : count;
+    struct link_stats_sample* samples = malloc((new_count ? new_count : 1) * sizeof(*samples));
+    if(!samples)
+        return PyErr_NoMemory();
+
+    size_t nsamples = 0;
+    if(single) {
+        for(size_t j = 0; j < self->stats_samples_count; j++) {
+            if(self->stats_samples[j].ifindex != links[0].ifindex)
+                samples[nsamples++] = self->stats_samples[j];
+        }
+    }
+
+    PyObject* result = single ? NULL : PyDict_New();
+    for(size_t i = 0; i < count; i++) {
+        if(!links[i].has_stats)
+            continue;
+
+        struct link_stats_sample* prev = NULL;
+        for(size_t j = 0; j < self->stats_samples_count; j++) {
+            if(self->stats_samples[j].ifindex == links[i].ifindex) {
+                prev = &self->stats_samples[j];
+                break;
+            }
+        }
+
+        PyObject* value;
+        if(prev) {
+            value = make_link_stats(st, &links[i].stats, prev, now);
+        } else {
+            Py_INCREF(Py_None);
+            value = Py_None;
+        }
+
+        if(single) {
+            result = value;
+        } else if(result) {
+            PyObject* key = PyLong_FromUnsignedLong(links[i].ifindex);
+            if(!key || !value || PyDict_SetItem(result, key, value) < 0)
+                Py_CLEAR(result);
+            Py_XDECREF(key);
+            Py_XDECREF(value);
+        }
+
+        samples[nsamples].ifindex = links[i].ifindex;
+        samples[nsamples].time = now;
+        samples[nsamples].stats = links[i].stats;
+        nsamples++;
+    }
+
+    /* Keep the old samples if the result could not be built */
+    if(!result) {
+        free(samples);
+        return NULL;
+    }
+
+    free(self->stats_samples);
+    self->stats_samples = samples;
+    self->stats_samples_count = nsamples;
+
+    return result;
+}
+
+PyDoc_STRVAR(link_stats_delta_doc, "link_stats_delta(ifindex=None)\n\
+\n\
+Same as link_stats, but return the increase of each counter since the\n\
+previous call for the same interface, with the elapsed seconds in the\n\
+interval attribute, so that rates are delta.rx_bytes / delta.interval.\n\
+The first call for an interface returns None for it.");
+
+static PyObject*
+stack_link_stats_delta(stack_object* self, PyObject* args, PyObject* kwargs)
+{
+    static char* kwnames[] = {"ifindex", NULL};
+    PyObject* ifindex_obj = Py_None;
+    struct nl_link_info* links;
+    size_t count;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|O:link_stats_delta", kwnames, &ifindex_obj))
+        return NULL;
+
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return NULL;
+
+    if(stack_read_link_stats(self, ifindex_obj, &links, &count) < 0)
+        return NULL;
+
+    _PyTime_t now = _PyTime_GetMonotonicClock();
+
+    PyObject* result;
+    Py_BEGIN_CRITICAL_SECTION(self);
+    result = stack_stats_delta(st, self, ifindex_obj != Py_None, links, count, now);
+    Py_END_CRITICAL_SECTION();
+
+    free(links);
+    return result;
+}
+
+static PyStructSequence_Field ifaddr_fields[] = {
+    {"family", "address family"},
+    {"address", "the address as a string"},
+    {"prefixlen", "length of the network prefix"},
+    {"ifindex", "index of the interface"},
+    {"scope", "scope of the address (RT_SCOPE_*)"},
+    {NULL}
+};
+
+PyDoc_STRVAR(ifaddr_doc,
+"IfAddr: result entry of Stack.addresses\n\
+\n\
+A 5-tuple (family, address, prefixlen, ifindex, scope) with named fields.");
+
+static PyStructSequence_Desc ifaddr_desc = {
+    "iothpy.IfAddr",
+    ifaddr_doc,
+    ifaddr_fields,
+    5
+};
+
+
+static PyStructSequence_Field route_fields[] = {
+    {"family", "address family"},
+    {"dst", "destination network, None for the default route"},
+    {"dst_len", "length of the destination prefix"},
+    {"gateway", "address of the gateway, None for directly connected networks"},
+    {"ifindex", "index of the output interface, 0 if not set"},
+    {"table", "routing table (RT_TABLE_*)"},
+    {"priority", "metric of the route"},
+    {"protocol", "origin of the route (RTPROT_*)"},
+    {NULL}
+};
+
+PyDoc_STRVAR(route_doc,
+"Route: result entry of Stack.routes\n\
+\n\
+A 8-tuple (family, dst, dst_len, gateway, ifindex, table, priority, protocol)\n\
+with named fields.");
+
+static PyStructSequence_Desc route_desc = {
+    "iothpy.Route",
+    route_doc,
+    route_fields,
+    8
+};
+
+
+static PyStructSequence_Field link_fields[] = {
+    {"ifindex", "index of the interface"},
+    {"name", "name of the interface"},
+    {"flags", "interface flags (IFF_*)"},
+    {"mtu", "maximum transmission unit"},
+    {"address", "hardware address as bytes, None if the link has none"},
+    {"type", "link type (ARPHRD_*)"},
+    {NULL}
+};
+
+PyDoc_STRVAR(link_doc,
+"Link: result entry of Stack.links\n\
+\n\
+A 6-tuple (ifindex, name, flags, mtu, address, type) with named fields.");
+
+static PyStructSequence_Desc link_desc = {
+    "iothpy.Link",
+    link_doc,
+    link_fields,
+    6
+};
+
+
+/* Return the string representation of a binary address, or None if not present */
+static PyObject*
+make_addr_str(int family, const unsigned char* addr, int present)
+{
+    char buf[INET6_ADDRSTRLEN];
+
+    if(!present)
+        Py_RETURN_NONE;
+
+    if(!inet_ntop(family, addr, buf, sizeof(buf))) {
+        PyErr_SetFromErrno(PyExc_OSError);
+        return NULL;
+    }
+    return PyUnicode_FromString(buf);
+}
+
+PyObject*
+stack_make_ifaddr(iothpy_state* st, const struct nl_addr_info* a)
+{
+    PyObject* item = PyStructSequence_New(st->ifaddr_type);
+    if(!item)
+        return NULL;
+
+    PyObject* address = make_addr_str(a->family, a->addr, 1);
+    PyStructSequence_SET_ITEM(item, 0, PyLong_FromLong(a->family));
+    PyStructSequence_SET_ITEM(item, 1, address);
+    PyStructSequence_SET_ITEM(item, 2, PyLong_FromLong(a->prefixlen));
+    PyStructSequence_SET_ITEM(item, 3, PyLong_FromUnsignedLong(a->ifindex));
+    PyStructSequence_SET_ITEM(item, 4, PyLong_FromLong(a->scope));
+
+    if(PyErr_Occurred()) {
+        Py_DECREF(item);
+        return NULL;
+    }
+    return item;
+}
+
+PyObject*
+stack_make_route(iothpy_state* st, const struct nl_route_info* r)
+{
+    PyObject* item = PyStructSequence_New(st->route_type);
+    if(!item)
+        return NULL;
+
+    PyObject* dst = make_addr_str(r->family, r->dst, r->has_dst);
+    PyObject* gateway = make_addr_str(r->family, r->gateway, r->has_gateway);
+    PyStructSequence_SET_ITEM(item, 0, PyLong_FromLong(r->family));
+    PyStructSequence_SET_ITEM(item, 1, dst);
+    PyStructSequence_SET_ITEM(item, 2, PyLong_FromLong(r->dst_len));
+    PyStructSequence_SET_ITEM(item, 3, gateway);
+    PyStructSequence_SET_ITEM(item, 4, PyLong_FromUnsignedLong(r->ifindex));
+    PyStructSequence_SET_ITEM(item, 5, PyLong_FromLong(r->table));
+    PyStructSequence_SET_ITEM(item, 6, PyLong_FromUnsignedLong(r->priority));
+    PyStructSequence_SET_ITEM(item, 7, PyLong_FromLong(r->protocol));
+
+    if(PyErr_Occurred()) {
+        Py_DECREF(item);
+        return NULL;
+    }
+    return item;
+}
+
+PyObject*
+stack_make_link(iothpy_state* st, const struct nl_link_info* l)
+{
+    PyObject* item = PyStructSequence_New(st->link_type);
+    if(!item)
+        return NULL;
+
+    PyObject* address;
+    if(l->addr_len > 0) {
+        address = PyBytes_FromStringAndSize((const char*)l->addr, l->addr_len);
+    } else {
+        Py_INCREF(Py_None);
+        address = Py_None;
+    }
+    PyStructSequence_SET_ITEM(item, 0, PyLong_FromUnsignedLong(l->ifindex));
+    PyStructSequence_SET_ITEM(item, 1, PyUnicode_DecodeFSDefault(l->name));
+    PyStructSequence_SET_ITEM(item, 2, PyLong_FromUnsignedLong(l->flags));
+    PyStructSequence_SET_ITEM(item, 3, PyLong_FromUnsignedLong(l->mtu));
+    PyStructSequence_SET_ITEM(item, 4, address);
+    PyStructSequence_SET_ITEM(item, 5, PyLong_FromLong(l->type));
+
+    if(PyErr_Occurred()) {
+        Py_DECREF(item);
+        return NULL;
+    }
+    return item;
+}
+
+PyDoc_STRVAR(addresses_doc, "addresses(family=AF_UNSPEC, ifindex=0)\n\
+\n\
+Return the list of the IP addresses of the stack as IfAddr tuples\n\
+(family, address, prefixlen, ifindex, scope), read with a netlink dump.\n\
+The result can be restricted to an address family and to an interface.");
+
+static PyObject*
+stack_addresses(stack_object* self, PyObject* args, PyObject* kwargs)
+{
+    static char* kwlist[] = {"family", "ifindex", NULL};
+    int family = AF_UNSPEC;
+    unsigned int ifindex = 0;
+    struct nl_addr_info* addrs = NULL;
+    size_t count = 0;
+    int res;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|iI:addresses", kwlist, &family, &ifindex))
+        return NULL;
+
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return NULL;
+
+    struct ioth* stack = stack_use(self);
+    if(!stack)
+        return NULL;
+
+    Py_BEGIN_ALLOW_THREADS
+    res = nl_get_addrs(stack, family, &addrs, &count);
+    Py_END_ALLOW_THREADS
+    stack_release(self);
+
+    if(res < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    PyObject* list = PyList_New(0);
+    for(size_t i = 0; list && i < count; i++) {
+        struct nl_addr_info* a = &addrs[i];
+        if(ifindex != 0 && a->ifindex != ifindex)
+            continue;
+
+        PyObject* item = stack_make_ifaddr(st, a);
+        if(!item || PyList_Append(list, item) < 0)
+            Py_CLEAR(list);
+        Py_XDECREF(item);
+    }
+
+    free(addrs);
+    return list;
+}
+
+PyDoc_STRVAR(routes_doc, "routes(family=AF_UNSPEC)\n\
+\n\
+Return the list of the routes of the stack, from all the routing tables,\n\
+as Route tuples (family, dst, dst_len, gateway, ifindex, table, priority,\n\
+protocol), read with a netlink dump. dst is None for default routes.");
+
+static PyObject*
+stack_routes(stack_object* self, PyObject* args, PyObject* kwargs)
+{
+    static char* kwlist[] = {"family", NULL};
+    int family = AF_UNSPEC;
+    struct nl_route_info* routes = NULL;
+    size_t count = 0;
+    int res;
 
-    if(!self->stack) 
-    {
-        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|i:routes", kwlist, &family))
         return NULL;
-    }
 
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return NULL;
 
-    /* Parse arguments */
-    if(!PyArg_ParseTuple(args, "iy*", &ifindex, &addr)) {
+    struct ioth* stack = stack_use(self);
+    if(!stack)
         return NULL;
-    }
 
-    if(addr.len != 6) {
-        PyErr_SetString(PyExc_ValueError, "MAC address must be of 6 bytes");
-    }
+    Py_BEGIN_ALLOW_THREADS
+    res = nl_get_routes(stack, family, &routes, &count);
+    Py_END_ALLOW_THREADS
+    stack_release(self);
 
-    int ret = 0;
-    if((ret = ioth_linksetaddr(self->stack, ifindex, addr.buf) < 0)) {
-        PyErr_SetString(PyExc_Exception, "failed to set MAC address");
-        return NULL;
+    if(res < 0)
+        return PyErr_SetFromErrno(PyExc_OSError);
+
+    PyObject* list = PyList_New(0);
+    for(size_t i = 0; list && i < count; i++) {
+        PyObject* item = stack_make_route(st, &routes[i]);
+        if(!item || PyList_Append(list, item) < 0)
+            Py_CLEAR(list);
+        Py_XDECREF(item);
     }
 
-    Py_RETURN_NONE;
+    free(routes);
+    return list;
 }
 
-
-PyDoc_STRVAR(linksetmtu_doc," linksetmtu(ifindex, mtu)\n\
-Set the MTU of the interface ifindex, mtu must be a positive integer");
+PyDoc_STRVAR(links_doc, "links()\n\
+\n\
+Return the list of the links of the stack as Link tuples\n\
+(ifindex, name, flags, mtu, address, type), read with a netlink dump.\n\
+The interface table of set_ifindex_cache is refreshed as well.");
 
 static PyObject*
-stack_linksetmtu(stack_object *self, PyObject *args) {
-    int ifindex;
-    int mtu;
+stack_links(stack_object* self, PyObject* Py_UNUSED(ignored))
+{
+    struct nl_link_info* links = NULL;
+    size_t count = 0;
 
-    if(!self->stack) 
+    if(!self->stack)
     {
-        PyErr_SetString(PyExc_Exception, "uninitialized stack");
+        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
         return NULL;
     }
 
-
-    /* Parse arguments */
-    if(!PyArg_ParseTuple(args, "ii", &ifindex, &mtu)) {
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
         return NULL;
-    }
 
-    int ret = 0;
-    if((ret = ioth_linksetmtu(self->stack, ifindex, mtu) < 0)) {
-        PyErr_SetString(PyExc_Exception, "failed to set MAC address");
+    stack_links_invalidate(self);
+    if(stack_get_links(self, &links, &count) < 0)
         return NULL;
+
+    PyObject* list = PyList_New(0);
+    for(size_t i = 0; list && i < count; i++) {
+        PyObject* item = stack_make_link(st, &links[i]);
+        if(!item || PyList_Append(list, item) < 0)
+            Py_CLEAR(list);
+        Py_XDECREF(item);
     }
 
-    Py_RETURN_NONE;
+    free(links);
+    return list;
 }
 
 PyDoc_STRVAR(ioth_config_doc, "ioth_config(config)\n\
@@ -899,19 +2276,25 @@ stack_ioth_config(stack_object *self, PyObject *args)
 {
     char* config;
 
-    if(!self->stack) 
-    {
-        PyErr_SetString(PyExc_Exception, "uninitialized stack");
-        return NULL;
-    }
-
     /* Parse arguments */
     if(!PyArg_ParseTuple(args, "s", &config)){
         return NULL;
     }
 
-    int res = 0;
-    if(res = ioth_config(self->stack, config) < 0){
+    struct ioth* stack = stack_use(self);
+    if(!stack)
+        return NULL;
+
+    stack_links_invalidate(self);
+
+    /* dhcp and router discovery can take seconds, let other threads run */
+    int res;
+    Py_BEGIN_ALLOW_THREADS
+    res = ioth_config(stack, config);
+    Py_END_ALLOW_THREADS
+    stack_release(self);
+
+    if(res < 0){
         PyErr_SetString(PyExc_Exception, "error in configuration. Check config options");
         return NULL;
     }
@@ -936,7 +2319,13 @@ stack_ioth_resolvconf(stack_object *self, PyObject *args)
         return NULL;
     }
 
-    resolvConf = ioth_resolvconf(self->stack, config);
+    struct ioth* stack = stack_use(self);
+    if(!stack)
+        return NULL;
+
+    errno = 0;
+    resolvConf = ioth_resolvconf(stack, config);
+    stack_release(self);
 
     if (resolvConf == NULL){
         /* check for an error */
@@ -959,25 +2348,49 @@ written in same syntax of resolv.conf.");
 static PyObject*
 stack_dns_upgrade(stack_object* self, PyObject* args){
     char* config = NULL;
+    int res = 0;
+    int saved_errno = 0;
+    int created = 0;
 
-    if(self->stack_dns == NULL){
-        PyErr_SetString(PyExc_Exception, "Uninitialized dns");
+    if(!PyArg_ParseTuple(args, "s", &config))
         return NULL;
-    }
 
-    if(!PyArg_ParseTuple(args, "s", &config))
+    struct ioth* stack = stack_use(self);
+    if(!stack)
         return NULL;
-    
-    if(IS_PATH(config)){
-        if(iothdns_update(self->stack_dns, config) < 0){
-            PyErr_SetFromErrno(PyExc_SyntaxError);
-            return NULL;
-        }
-    } else {
-        if(iothdns_update_strcfg(self->stack_dns, config) < 0){
+
+    /* If the resolver was never used create it directly with the new configuration */
+    Py_BEGIN_ALLOW_THREADS
+    pthread_mutex_lock(&self->dns_lock);
+    if(!self->stack_dns) {
+        res = stack_dns_init(self, stack, config);
+        saved_errno = errno;
+        created = 1;
+    }
+    pthread_mutex_unlock(&self->dns_lock);
+    Py_END_ALLOW_THREADS
+
+    if(created) {
+        stack_release(self);
+        if(res < 0) {
+            errno = saved_errno;
             PyErr_SetFromErrno(PyExc_SyntaxError);
             return NULL;
         }
+        Py_RETURN_NONE;
+    }
+    
+    if(IS_PATH(config))
+        res = iothdns_update(self->stack_dns, config);
+    else
+        res = iothdns_update_strcfg(self->stack_dns, config);
+    saved_errno = errno;
+    stack_release(self);
+
+    if(res < 0) {
+        errno = saved_errno;
+        PyErr_SetFromErrno(PyExc_SyntaxError);
+        return NULL;
     }
     Py_RETURN_NONE;
 }
@@ -988,16 +2401,153 @@ host is a domain name, a string representation of an IPv4/v6 address or None.\n\
 port is a string service name such as 'http', a numeric port number or None.\n\
 The family, type and proto arguments can be optionally specified in order to\n\
 narrow the list of addresses returned.\n\
-The function returns a list of 5-tuples with the following structure:\n\
+The function returns a list of AddrInfo 5-tuples with the following structure:\n\
+\n\
+(family, type, proto, canonname, sockaddr)\n\
+\n\
+family and type are socket.AddressFamily and socket.SocketKind members when\n\
+known, sockaddr can be passed directly to connect. Raises socket.gaierror\n\
+if the name cannot be resolved.");
+
+/* 
+    Load the objects borrowed from the built-in socket module into the
+    module state on first use. The enum value maps are used to convert
+    family and type without calling into python code for every address.
+*/
+static int
+load_socket_module_objects(iothpy_state* st)
+{
+    PyObject* socket_module;
+    PyObject* enum_type;
+
+    if(st->gaierror)
+        return 0;
+
+    socket_module = PyImport_ImportModule("socket");
+    if(!socket_module)
+        return -1;
+
+    enum_type = PyObject_GetAttrString(socket_module, "AddressFamily");
+    if(!enum_type)
+        goto error;
+    st->family_map = PyObject_GetAttrString(enum_type, "_value2member_map_");
+    Py_DECREF(enum_type);
+    if(!st->family_map)
+        goto error;
+
+    enum_type = PyObject_GetAttrString(socket_module, "SocketKind");
+    if(!enum_type)
+        goto error;
+    st->socktype_map = PyObject_GetAttrString(enum_type, "_value2member_map_");
+    Py_DECREF(enum_type);
+    if(!st->socktype_map)
+        goto error;
+
+    st->gaierror = PyObject_GetAttrString(socket_module, "gaierror");
+    if(!st->gaierror)
+        goto error;
+
+    Py_DECREF(socket_module);
+    return 0;
+
+error:
+    Py_CLEAR(st->family_map);
+    Py_CLEAR(st->socktype_map);
+    Py_DECREF(socket_module);
+    return -1;
+}
+
+/* Raise socket.gaierror for a resolver error code, always returns NULL */
+static PyObject*
+set_gaierror(iothpy_state* st, int error)
+{
+    if(load_socket_module_objects(st) < 0)
+        return NULL;
+
+    PyObject* v = Py_BuildValue("(is)", error, iothdns_gai_strerror(error));
+    if(v) {
+        PyErr_SetObject(st->gaierror, v);
+        Py_DECREF(v);
+    }
+    return NULL;
+}
+
+/* Return the enum member of map with the given value, or a plain int if unknown */
+static PyObject*
+intenum_from_map(PyObject* map, int value)
+{
+    PyObject* key = PyLong_FromLong(value);
+    if(!key)
+        return NULL;
+
+    PyObject* member = PyDict_GetItemWithError(map, key);
+    if(member) {
+        Py_DECREF(key);
+        Py_INCREF(member);
+        return member;
+    }
+    if(PyErr_Occurred()) {
+        Py_DECREF(key);
+        return NULL;
+    }
+    return key;
+}
+
+static PyStructSequence_Field addrinfo_fields[] = {
+    {"family", "address family"},
+    {"type", "socket type"},
+    {"proto", "protocol number"},
+    {"canonname", "canonical name of the host"},
+    {"sockaddr", "socket address, suitable for connect and bind"},
+    {NULL}
+};
+
+PyDoc_STRVAR(addrinfo_doc,
+"AddrInfo: result entry of Stack.getaddrinfo\n\
 \n\
-(family, type, proto, canonname, sockaddr)");
+A 5-tuple (family, type, proto, canonname, sockaddr) with named fields.");
+
+static PyStructSequence_Desc addrinfo_desc = {
+    "iothpy.AddrInfo",
+    addrinfo_doc,
+    addrinfo_fields,
+    5
+};
+
+/* Build an AddrInfo object from a single addrinfo entry */
+static PyObject*
+make_addrinfo(iothpy_state* st, struct addrinfo* res)
+{
+    PyObject* item = PyStructSequence_New(st->addrinfo_type);
+    if(!item)
+        return NULL;
+
+    PyObject* family = intenum_from_map(st->family_map, res->ai_family);
+    PyObject* socktype = intenum_from_map(st->socktype_map, res->ai_socktype);
+    PyObject* proto = PyLong_FromLong(res->ai_protocol);
+    PyObject* canonname = PyUnicode_FromString(res->ai_canonname ? res->ai_canonname : "");
+    PyObject* addr = make_sockaddr(res->ai_addr, res->ai_addrlen);
+
+    /* PyStructSequence_SET_ITEM steals the references */
+    PyStructSequence_SET_ITEM(item, 0, family);
+    PyStructSequence_SET_ITEM(item, 1, socktype);
+    PyStructSequence_SET_ITEM(item, 2, proto);
+    PyStructSequence_SET_ITEM(item, 3, canonname);
+    PyStructSequence_SET_ITEM(item, 4, addr);
+
+    if(!family || !socktype || !proto || !canonname || !addr) {
+        Py_DECREF(item);
+        return NULL;
+    }
 
+    return item;
+}
 
 static PyObject* dns_getaddrinfo(stack_object* self, PyObject* args, PyObject* kwargs){
     static char* kwnames[] = {"host", "port", "family", "type", "proto", "flags", 0};
     struct addrinfo hints, *res;
     struct addrinfo *resList = NULL;
-    char *hoststr, *portstr;
+    const char *hoststr, *portstr;
     PyObject* portObj;
     PyObject* portObjStr = NULL;
     PyObject* all = NULL;
@@ -1005,11 +2555,6 @@ static PyObject* dns_getaddrinfo(stack_object* self, PyObject* args, PyObject* k
     int family, socktype, protocol, flags;
     int error;
 
-    if(self->stack == NULL){
-        PyErr_SetString(PyExc_Exception, "Uninitialized stack");
-        return NULL;
-    }
-
     socktype = protocol = flags = 0;
     family = AF_UNSPEC;
 
@@ -1017,6 +2562,10 @@ static PyObject* dns_getaddrinfo(stack_object* self, PyObject* args, PyObject* k
         &family, &socktype, &protocol, &flags))
         return NULL;
 
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st || load_socket_module_objects(st) < 0)
+        return NULL;
+
     if(PyLong_CheckExact(portObj)){
         portObjStr = PyObject_Str(portObj);
         if(portObjStr == NULL) return NULL;
@@ -1032,51 +2581,63 @@ static PyObject* dns_getaddrinfo(stack_object* self, PyObject* args, PyObject* k
         return NULL;
     }
 
-    
-
     memset(&hints, 0, sizeof(hints));
     hints.ai_family = family;
     hints.ai_socktype = socktype;
     hints.ai_protocol = protocol;
     hints.ai_flags = flags;
-    
-    error = iothdns_getaddrinfo(self->stack_dns, hoststr, portstr, &hints, &resList);
-
-    if(error){
-        resList = NULL;
-        return Py_BuildValue("is", error, iothdns_gai_strerror(error));
-    }
-
-    all = PyList_New(0);
-    if(all == NULL) return NULL;
-    for(res = resList; res; res= res -> ai_next){
-        PyObject* single;
-        PyObject* addr = make_sockaddr(res->ai_addr, res->ai_addrlen);
-        if(addr == NULL) return NULL;
-        single = Py_BuildValue("iiisO", res->ai_family,
-            res->ai_socktype, res->ai_protocol,
-            res->ai_canonname ? res->ai_canonname : "",
-            addr);
-        Py_XDECREF(addr);
-        if(single == NULL) return NULL;
-        if(PyList_Append(all, single)){
-            Py_XDECREF(single);
-            return NULL;
+
+    struct ioth* stack = stack_use(self);
+    if(!stack) {
+        Py_XDECREF(portObjStr);
+        return NULL;
+    }
+
+    struct iothdns* dns = stack_get_dns(self, stack);
+    if(!dns) {
+        stack_release(self);
+        Py_XDECREF(portObjStr);
+        return NULL;
+    }
+
+    error = iothdns_getaddrinfo(dns, hoststr, portstr, &hints, &resList);
+    stack_release(self);
+    Py_XDECREF(portObjStr);
+
+    if(error)
+        return set_gaierror(st, error);
+
+    /* Build the whole result in a single pass over the list */
+    Py_ssize_t count = 0;
+    for(res = resList; res; res = res->ai_next)
+        count++;
+
+    all = PyList_New(count);
+    if(all == NULL)
+        goto out;
+
+    Py_ssize_t i = 0;
+    for(res = resList; res; res = res->ai_next, i++){
+        PyObject* single = make_addrinfo(st, res);
+        if(single == NULL){
+            Py_CLEAR(all);
+            goto out;
         }
-        Py_XDECREF(single);
+        PyList_SET_ITEM(all, i, single);
     }
-    if(resList) iothdns_freeaddrinfo(resList);
+
+out:
+    iothdns_freeaddrinfo(resList);
     return all;
 }
 
 PyDoc_STRVAR(dns_getnameinfo_doc, "getnameinfo(sockaddr, flags) --> (host, port)\n\
 \n\
-Get host and port for a sockaddr.);");
-
-static PyObject* dns_getnameinfo(PyObject* self, PyObject *args){
-
-    stack_object* s = (socket_object*) self;
+Get host and port for a sockaddr. The host of sockaddr must be a numeric\n\
+IPv4 or IPv6 address. Results are kept in a per stack cache, see\n\
+set_nameinfo_cache. Raises socket.gaierror if the lookup fails.");
 
+static PyObject* dns_getnameinfo(stack_object* self, PyObject *args){
     PyObject * sockaddr = (PyObject *)NULL;
     int flags;
     const char *hostptr;
@@ -1084,8 +2645,8 @@ static PyObject* dns_getnameinfo(PyObject* self, PyObject *args){
     unsigned int flowinfo, scope_id;
     int error;
     char hbuf[NI_MAXHOST], pbuf[NI_MAXSERV];
-    struct addrinfo hints, *res = NULL;
-    PyObject *name, *ret;
+    struct sockaddr_storage addrbuf;
+    socklen_t addrlen;
 
     flags = flowinfo = scope_id = 0;
     if(!PyArg_ParseTuple(args,"Oi:getnameinfo", &sockaddr, &flags))
@@ -1100,74 +2661,130 @@ static PyObject* dns_getnameinfo(PyObject* self, PyObject *args){
                           &hostptr, &port, &flowinfo, &scope_id))
         return NULL;
 
+    iothpy_state* st = iothpy_state_from_type(Py_TYPE(self));
+    if(!st)
+        return NULL;
+
     if (flowinfo > 0xfffff) {
         PyErr_SetString(PyExc_OverflowError, "getnameinfo(): flowinfo must be 0-1048575.");
         return NULL;
     }
 
-    PyOS_snprintf(pbuf, sizeof(pbuf), "%d", port);
-    memset(&hints, 0, sizeof(hints));
-    hints.ai_family = AF_UNSPEC;
-    hints.ai_socktype = SOCK_DGRAM; 
-    hints.ai_flags = AI_NUMERICHOST;
-
-    error = iothdns_getaddrinfo(s->stack_dns, hostptr, pbuf, &hints, &res);
-
-    if(error){
-        res = NULL;
-        return Py_BuildValue("is", error, iothdns_gai_strerror(error));
+    if (port < 0 || port > 0xffff) {
+        PyErr_SetString(PyExc_OverflowError, "getnameinfo(): port must be 0-65535.");
+        return NULL;
     }
 
-    if(res->ai_next){
-        PyErr_SetString(PyExc_OSError, "sockaddr resolved to multiple addresses");
-        iothdns_freeaddrinfo(res);
-        return (PyObject*) NULL;
+    /* Build the sockaddr directly from the numeric address */
+    memset(&addrbuf, 0, sizeof(addrbuf));
+    struct sockaddr_in* sin = (struct sockaddr_in*)&addrbuf;
+    struct sockaddr_in6* sin6 = (struct sockaddr_in6*)&addrbuf;
+    if(inet_pton(AF_INET, hostptr, &sin->sin_addr) == 1) {
+        if (PyTuple_GET_SIZE(sockaddr) != 2) {
+            PyErr_SetString(PyExc_OSError, "IPv4 sockaddr must be 2 tuple");
+            return NULL;
+        }
+        sin->sin_family = AF_INET;
+        sin->sin_port = htons(port);
+        addrlen = sizeof(*sin);
+    } else if(inet_pton(AF_INET6, hostptr, &sin6->sin6_addr) == 1) {
+        sin6->sin6_family = AF_INET6;
+        sin6->sin6_port = htons(port);
+        sin6->sin6_flowinfo = htonl(flowinfo);
+        sin6->sin6_scope_id = scope_id;
+        addrlen = sizeof(*sin6);
+    } else {
+        return set_gaierror(st, EAI_NONAME);
     }
 
-    switch (res->ai_family){
-        case AF_INET:{
-            if (PyTuple_GET_SIZE(sockaddr) != 2) {
-                PyErr_SetString(PyExc_OSError, "IPv4 sockaddr must be 2 tuple");
-                iothdns_freeaddrinfo(res);
-                return (PyObject*) NULL;
-            }
-            break;
-        }
+    if(!nameinfo_cache_lookup(self->nameinfo_cache, (struct sockaddr*)&addrbuf, flags,
+                              hbuf, sizeof(hbuf), pbuf, sizeof(pbuf))) {
+        struct ioth* stack = stack_use(self);
+        if(!stack)
+            return NULL;
 
-        case AF_INET6: {
-            struct sockaddr_in6 *sin6;
-            sin6 = (struct sockaddr_in6 *)res->ai_addr;
-            sin6->sin6_flowinfo = htonl(flowinfo);
-            sin6->sin6_scope_id = scope_id;
-            break;
+        struct iothdns* dns = stack_get_dns(self, stack);
+        if(!dns) {
+            stack_release(self);
+            return NULL;
         }
-    }
 
-    error = iothdns_getnameinfo(s->stack_dns, res->ai_addr, (socklen_t) res->ai_addrlen,
-                        hbuf, sizeof(hbuf), pbuf, sizeof(pbuf), flags );
+        Py_BEGIN_ALLOW_THREADS
+        error = iothdns_getnameinfo(dns, (struct sockaddr*)&addrbuf, addrlen,
+                                    hbuf, sizeof(hbuf), pbuf, sizeof(pbuf), flags);
+        if(!error)
+            nameinfo_cache_insert(self->nameinfo_cache, (struct sockaddr*)&addrbuf, flags, hbuf, pbuf);
+        Py_END_ALLOW_THREADS
+        stack_release(self);
 
-    if(error){
-        iothdns_freeaddrinfo(res);
-        return Py_BuildValue("is", error, iothdns_gai_strerror(error));
+        if(error)
+            return set_gaierror(st, error);
     }
 
-    name = PyUnicode_FromString(hbuf);
-    if(name == NULL){
-        iothdns_freeaddrinfo(res);
+    return Py_BuildValue("ss", hbuf, pbuf);
+}
+
+PyDoc_STRVAR(set_nameinfo_cache_doc, "set_nameinfo_cache(maxsize=1024, ttl=60.0)\n\
+\n\
+Configure the cache of getnameinfo results of this stack.\n\
+At most maxsize results are kept, each one for ttl seconds, the least\n\
+recently used results are evicted first. maxsize == 0 disables the cache.");
+
+static PyObject*
+stack_set_nameinfo_cache(stack_object* self, PyObject* args, PyObject* kwargs)
+{
+    static char* kwnames[] = {"maxsize", "ttl", NULL};
+    Py_ssize_t maxsize = NAMEINFO_CACHE_SIZE;
+    double ttl = NAMEINFO_CACHE_TTL;
+
+    if(!PyArg_ParseTupleAndKeywords(args, kwargs, "|nd:set_nameinfo_cache", kwnames, &maxsize, &ttl))
+        return NULL;
+
+    if(maxsize < 0 || ttl < 0) {
+        PyErr_SetString(PyExc_ValueError, "maxsize and ttl must not be negative");
         return NULL;
     }
 
-    ret = Py_BuildValue("Ns", name, pbuf);
-    iothdns_freeaddrinfo(res);
-    return ret;
+    nameinfo_cache_configure(self->nameinfo_cache, (size_t)maxsize, ttl);
+    Py_RETURN_NONE;
+}
+
+PyDoc_STRVAR(nameinfo_cache_info_doc, "nameinfo_cache_info() -> (hits, misses, maxsize, currsize, ttl)\n\
+\n\
+Return the statistics of the getnameinfo cache.");
+
+static PyObject*
+stack_nameinfo_cache_info(stack_object* self, PyObject* Py_UNUSED(ignored))
+{
+    struct nameinfo_cache_stats stats;
+    nameinfo_cache_get_stats(self->nameinfo_cache, &stats);
+
+    return Py_BuildValue("KKnnd", (unsigned long long)stats.hits, (unsigned long long)stats.misses,
+                         (Py_ssize_t)stats.maxsize, (Py_ssize_t)stats.size, stats.ttl);
+}
+
+PyDoc_STRVAR(nameinfo_cache_clear_doc, "nameinfo_cache_clear()\n\
+\n\
+Remove all the results from the getnameinfo cache.");
+
+static PyObject*
+stack_nameinfo_cache_clear(stack_object* self, PyObject* Py_UNUSED(ignored))
+{
+    nameinfo_cache_clear(self->nameinfo_cache);
+    Py_RETURN_NONE;
 }
 
 
 static PyMethodDef stack_methods[] = {
+    {"close", (PyCFunction)stack_close, METH_NOARGS, stack_close_doc},
+    {"close_sockets", (PyCFunction)stack_close_sockets, METH_NOARGS, stack_close_sockets_doc},
+    {"_connect_many", (PyCFunction)stack_connect_many, METH_VARARGS | METH_KEYWORDS, stack_connect_many_doc},
+
     /* Listing network interfaces */
     {"if_nameindex", (PyCFunction)stack_if_nameindex, METH_NOARGS, if_nameindex_doc},
     {"if_nametoindex", (PyCFunction)stack_if_nametoindex, METH_VARARGS, if_nametoindex_doc},
     {"if_indextoname", (PyCFunction)stack_if_indextoname, METH_O, if_indextoname_doc},
+    {"set_ifindex_cache", (PyCFunction)stack_set_ifindex_cache, METH_VARARGS | METH_KEYWORDS, set_ifindex_cache_doc},
 
     /* Network interface configuration */
     {"linksetupdown", (PyCFunction)stack_linksetupdown, METH_VARARGS, linksetupdown_doc},
@@ -1178,14 +2795,22 @@ static PyMethodDef stack_methods[] = {
     {"linkgetaddr", (PyCFunction)stack_linkgetaddr, METH_VARARGS, linkgetaddr_doc},
     {"_linksetaddr", (PyCFunction)stack_linksetaddr, METH_VARARGS, linksetaddr_doc},
     {"linksetmtu",  (PyCFunction)stack_linksetmtu,  METH_VARARGS, linksetmtu_doc},
+    {"apply",       (PyCFunction)stack_apply,       METH_O,       apply_doc},
 
     {"ipaddr_add", (PyCFunction)stack_ipaddr_add, METH_VARARGS, ipaddr_add_doc},
     {"ipaddr_del", (PyCFunction)stack_ipaddr_del, METH_VARARGS, ipaddr_del_doc},
     {"iproute_add", (PyCFunction)stack_iproute_add, METH_VARARGS | METH_KEYWORDS, iproute_add_doc},
     {"iproute_del", (PyCFunction)stack_iproute_del, METH_VARARGS | METH_KEYWORDS, iproute_del_doc},
 
+    /* Network configuration state */
+    {"addresses", (PyCFunction)stack_addresses, METH_VARARGS | METH_KEYWORDS, addresses_doc},
+    {"routes", (PyCFunction)stack_routes, METH_VARARGS | METH_KEYWORDS, routes_doc},
+    {"links", (PyCFunction)stack_links, METH_NOARGS, links_doc},
+    {"link_stats", (PyCFunction)stack_link_stats, METH_VARARGS | METH_KEYWORDS, link_stats_doc},
+    {"link_stats_delta", (PyCFunction)stack_link_stats_delta, METH_VARARGS | METH_KEYWORDS, link_stats_delta_doc},
+
     /* Iothconf */
-    {"ioth_config", (PyCFunction)stack_ioth_config, METH_VARARGS, ioth_config_doc},
+    {"_ioth_config", (PyCFunction)stack_ioth_config, METH_VARARGS, ioth_config_doc},
     {"ioth_resolvconf", (PyCFunction)stack_ioth_resolvconf, METH_VARARGS, ioth_resolvconf_doc},
 
     /* Iothdns */
@@ -1196,6 +2821,9 @@ static PyMethodDef stack_methods[] = {
     /* queries */
     {"getaddrinfo", (PyCFunctionWithKeywords)dns_getaddrinfo, METH_VARARGS | METH_KEYWORDS, dns_getaddrinfo_doc},
     {"getnameinfo", (PyCFunction)dns_getnameinfo, METH_VARARGS, dns_getnameinfo_doc},
+    {"set_nameinfo_cache", (PyCFunction)stack_set_nameinfo_cache, METH_VARARGS | METH_KEYWORDS, set_nameinfo_cache_doc},
+    {"nameinfo_cache_info", (PyCFunction)stack_nameinfo_cache_info, METH_NOARGS, nameinfo_cache_info_doc},
+    {"nameinfo_cache_clear", (PyCFunction)stack_nameinfo_cache_clear, METH_NOARGS, nameinfo_cache_clear_doc},
 
     {NULL, NULL} /* sentinel */
 };
@@ -1206,54 +2834,197 @@ PyDoc_STRVAR(stack_doc,
 This class is used internally as a base type for the Stack class\n\
 ");
 
-PyTypeObject stack_type = {
-  PyVarObject_HEAD_INIT(0, 0)                 /* Must fill in type value later */
-    "_iothpy.StackBase",                             /* tp_name */
-    sizeof(stack_object),                       /* tp_basicsize */
-    0,                                          /* tp_itemsize */
-    (destructor)stack_dealloc,                  /* tp_dealloc */
-    0,                                          /* tp_vectorcall_offset */
-    0,                                          /* tp_getattr */
-    0,                                          /* tp_setattr */
-    0,                                          /* tp_as_async */
-    (reprfunc)stack_repr,                       /* tp_repr */
-    0,                                          /* tp_as_number */
-    0,                                          /* tp_as_sequence */
-    0,                                          /* tp_as_mapping */
-    0,                                          /* tp_hash */
-    0,                                          /* tp_call */
-    (reprfunc)stack_str,                        /* tp_str */
-    PyObject_GenericGetAttr,                    /* tp_getattro */
-    0,                                          /* tp_setattro */
-    0,                                          /* tp_as_buffer */
-    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,   /* tp_flags */
-    stack_doc,                                  /* tp_doc */
-    0,                                          /* tp_traverse */
-    0,                                          /* tp_clear */
-    0,                                          /* tp_richcompare */
-    0,                                          /* tp_weaklistoffset */
-    0,                                          /* tp_iter */
-    0,                                          /* tp_iternext */
-    stack_methods,                              /* tp_methods */
-    0,                                          /* tp_members */
-    0,                                          /* tp_getset */
-    0,                                          /* tp_base */
-    0,                                          /* tp_dict */
-    0,                                          /* tp_descr_get */
-    0,                                          /* tp_descr_set */
-    0,                                          /* tp_dictoffset */
-    stack_initobj,                              /* tp_init */
-    PyType_GenericAlloc,                        /* tp_alloc */
-    stack_new,                                  /* tp_new */
-    PyObject_Del,                               /* tp_free */
-    0,                                          /* tp_is_gc */
-    0,                                          /* tp_bases */
-    0,                                          /* tp_mro */
-    0,                                          /* tp_cache */
-    0,                                          /* tp_subclasses */
-    0,                                          /* tp_weaklist */
-    0,                                          /* tp_del */
-    0,                                          /* tp_version_tag */
-    (destructor)stack_finalize,                 /* tp_finalize */
+static PyType_Slot stack_slots[] = {
+    {Py_tp_dealloc, stack_dealloc},
+    {Py_tp_repr, stack_repr},
+    {Py_tp_str, stack_str},
+    {Py_tp_doc, (void*)stack_doc},
+    {Py_tp_methods, stack_methods},
+    {Py_tp_getset, stack_getsetlist},
+    {Py_tp_init, stack_initobj},
+    {Py_tp_new, stack_new},
+    {Py_tp_finalize, stack_finalize},
+    {0, NULL}
+};
+
+static PyType_Spec stack_spec = {
+    "_iothpy.StackBase",
+    sizeof(stack_object),
+    0,
+    Py_TPFLAGS_DEFAULT | Py_TPFLAGS_BASETYPE,
+    stack_slots
 };
 
+/*
+    Stack used by the sockets created without one, looked up in order in the
+    current_stack context variable, in the thread state dict and in the
+    interpreter default, all kept in the module state.
+*/
+PyObject*
+stack_get_current(iothpy_state* st)
+{
+    PyObject* stack = NULL;
+
+    if(PyContextVar_Get(st->current_stack_var, NULL, &stack) < 0)
+        return NULL;
+    if(stack && stack != Py_None) {
+        /* The variable is public, anything can be stored in it */
+        if(!PyObject_TypeCheck(stack, st->stack_type)) {
+            Py_DECREF(stack);
+            PyErr_SetString(PyExc_TypeError, "current_stack must be set to a Stack or None");
+            return NULL;
+        }
+        return stack;
+    }
+    Py_XDECREF(stack);
+
+    PyObject* tdict = PyThreadState_GetDict();
+    if(tdict) {
+        stack = PyDict_GetItemWithError(tdict, st->thread_stack_key);
+        if(stack) {
+            Py_INCREF(stack);
+            return stack;
+        }
+        if(PyErr_Occurred())
+            return NULL;
+    }
+
+    pthread_mutex_lock(&st->default_stack_lock);
+    stack = st->default_stack;
+    Py_XINCREF(stack);
+    pthread_mutex_unlock(&st->default_stack_lock);
+    if(stack)
+        return stack;
+
+    PyErr_SetString(PyExc_RuntimeError, "no current stack, see help(\"iothpy.set_default_stack\")");
+    return NULL;
+}
+
+/* Check that stack is a Stack or None, raising TypeError otherwise */
+static int
+check_stack_or_none(iothpy_state* st, PyObject* stack)
+{
+    if(stack != Py_None && !PyObject_TypeCheck(stack, st->stack_type)) {
+        PyErr_SetString(PyExc_TypeError, "stack must be of type Stack or None");
+        return 0;
+    }
+    return 1;
+}
+
+int
+stack_set_default(iothpy_state* st, PyObject* stack)
+{
+    if(!check_stack_or_none(st, stack))
+        return -1;
+
+    if(stack == Py_None)
+        stack = NULL;
+    else
+        Py_INCREF(stack);
+
+    pthread_mutex_lock(&st->default_stack_lock);
+    PyObject* old = st->default_stack;
+    st->default_stack = stack;
+    pthread_mutex_unlock(&st->default_stack_lock);
+
+    Py_XDECREF(old);
+    return 0;
+}
+
+int
+stack_set_thread(iothpy_state* st, PyObject* stack)
+{
+    if(!check_stack_or_none(st, stack))
+        return -1;
+
+    PyObject* tdict = PyThreadState_GetDict();
+    if(!tdict) {
+        PyErr_SetString(PyExc_RuntimeError, "no thread state dict");
+        return -1;
+    }
+
+    if(stack != Py_None)
+        return PyDict_SetItem(tdict, st->thread_stack_key, stack);
+
+    if(PyDict_DelItem(tdict, st->thread_stack_key) < 0) {
+        if(!PyErr_ExceptionMatches(PyExc_KeyError))
+            return -1;
+        PyErr_Clear();
+    }
+    return 0;
+}
+
+static pthread_once_t atfork_once = PTHREAD_ONCE_INIT;
+static int atfork_error = 0;
+
+static void
+stack_atfork_register(void)
+{
+    atfork_error = pthread_atfork(stack_atfork_prepare, stack_atfork_parent, stack_atfork_child);
+}
+
+/* Create a struct sequence type and add it to the module */
+static PyTypeObject*
+add_struct_seq(PyObject* module, const char* name, PyStructSequence_Desc* desc)
+{
+    PyTypeObject* type = PyStructSequence_NewType(desc);
+    if(!type)
+        return NULL;
+
+    Py_INCREF(type);
+    if(PyModule_AddObject(module, name, (PyObject*)type) != 0) {
+        Py_DECREF(type);
+        Py_DECREF(type);
+        return NULL;
+    }
+
+    return type;
+}
+
+/* Initialize the types defined in this file and add them to the module state */
+int
+stack_module_init(PyObject* module)
+{
+    iothpy_state* st = iothpy_state_from_module(module);
+
+    /* The handlers walk the stacks of all the interpreters, register them once */
+    pthread_once(&atfork_once, stack_atfork_register);
+    if(atfork_error) {
+        errno = atfork_error;
+        PyErr_SetFromErrno(PyExc_OSError);
+        return -1;
+    }
+
+    st->stack_type = iothpy_new_type(module, &stack_spec);
+    if(!st->stack_type)
+        return -1;
+
+    Py_INCREF(st->stack_type);
+    if(PyModule_AddObject(module, "StackBase", (PyObject*)st->stack_type) != 0) {
+        Py_DECREF(st->stack_type);
+        return -1;
+    }
+
+    if(!(st->addrinfo_type = add_struct_seq(module, "AddrInfo", &addrinfo_desc)) ||
+       !(st->ifaddr_type = add_struct_seq(module, "IfAddr", &ifaddr_desc)) ||
+       !(st->route_type = add_struct_seq(module, "Route", &route_desc)) ||
+       !(st->linkstats_type = add_struct_seq(module, "LinkStats", &linkstats_desc)) ||
+       !(st->link_type = add_struct_seq(module, "Link", &link_desc)))
+        return -1;
+
+    st->current_stack_var = PyContextVar_New("iothpy.current_stack", NULL);
+    if(!st->current_stack_var)
+        return -1;
+
+    Py_INCREF(st->current_stack_var);
+    if(PyModule_AddObject(module, "current_stack", st->current_stack_var) != 0) {
+        Py_DECREF(st->current_stack_var);
+        return -1;
+    }
+
+    st->thread_stack_key = PyUnicode_InternFromString("iothpy.thread_stack");
+    if(!st->thread_stack_key)
+        return -1;
+
+    return 0;
+}
@@ -1,14 +1,118 @@
 #define PY_SSIZE_T_CLEAN
 #include <Python.h>
 
+#include <pthread.h>
+
 #include <ioth.h>
 #include <iothconf.h>
 #include <iothdns.h>
 
+#include "nameinfo_cache.h"
+#include "pycompat.h"
+
+struct nl_link_info;
+struct nl_addr_info;
+struct nl_route_info;
+struct link_stats_sample;
+
+/* Capabilities of the ioth plugin of a stack */
+#define IOTHPY_CAP_IPLINK_ADD   (1 << 0)    /* new links can be added with ioth_iplink_add */
+#define IOTHPY_CAP_KERNEL_FD    (1 << 1)    /* socket fds are kernel file descriptors */
+
 typedef struct stack_object {
     PyObject_HEAD
     struct ioth* stack;
+
+    /* Dns resolver, created on first use by stack_get_dns */
     struct iothdns* stack_dns;
+    /* Path or contents of the resolver configuration, NULL for the default */
+    char* dns_config;
+    pthread_mutex_t dns_lock;
+
+    /* Name of the ioth plugin, NULL if it could not be determined */
+    char* name;
+    /* Bitmap of IOTHPY_CAP_* flags of the plugin */
+    unsigned int caps;
+
+    /* Time taken by stack_initobj to create the stack */
+    _PyTime_t creation_latency;
+
+    /* Cache of reverse lookups done by getnameinfo */
+    struct nameinfo_cache* nameinfo_cache;
+
+    /* Links of the stack used by the name/index lookups when the cache is
+       enabled, NULL until loaded and dropped by the calls changing the links.
+       The link cache and the samples below are changed in critical sections
+       of the stack object. */
+    int link_cache_enabled;
+    struct nl_link_info* link_cache;
+    size_t link_cache_count;
+
+    /* Counters returned by the last link_stats_delta call, one per link */
+    struct link_stats_sample* stats_samples;
+    size_t stats_samples_count;
+
+    /* Open sockets created on this stack */
+    struct socket_object* sockets;
+
+    /* Open netlink monitors created on this stack */
+    struct monitor_object* monitors;
+
+    /* Protects the lists of sockets and monitors, never held while waiting
+       for the GIL */
+    pthread_mutex_t objects_lock;
+
+    /* Calls using the stack without the GIL, or from native threads, see
+       stack_acquire. close() waits for users to drop to zero and fails with
+       EBUSY while pins is not zero. */
+    pthread_mutex_t use_lock;
+    pthread_cond_t use_cond;
+    unsigned int users;
+    unsigned int pins;
+
+    /* Set in the child of a fork, the stack was dropped and is closed there */
+    int forked;
+
+    /* Links in the list of all the stack objects, walked after a fork */
+    struct stack_object* next_stack;
+    struct stack_object* prev_stack;
 } stack_object;
 
-extern PyTypeObject stack_type;
+struct iothpy_state;
+
+int stack_module_init(PyObject* module);
+
+/*
+    Return a new reference to the stack used by the sockets created without
+    one: the value of the current_stack context variable if set, otherwise
+    the stack of the thread or the interpreter default stack.
+    Raises RuntimeError and returns NULL if none is set, TypeError if the
+    context variable holds something else than a Stack.
+*/
+PyObject* stack_get_current(struct iothpy_state* st);
+
+/*
+    Take a use of the ioth stack of a stack object: close() waits for the
+    uses to be released with stack_release before deleting the stack, so
+    the pointer returned stays valid until then, with or without the GIL.
+    Returns NULL if the stack is closed, without raising.
+*/
+struct ioth* stack_acquire(stack_object* self);
+void stack_release(stack_object* self);
+
+/*
+    As stack_acquire, for native components keeping the stack for their
+    whole life (e.g. a load balancer): close() fails with EBUSY until the
+    stack is released with stack_unpin.
+*/
+struct ioth* stack_pin(stack_object* self);
+void stack_unpin(stack_object* self);
+
+/* Set the interpreter default stack and the stack of the calling thread, None to unset */
+int stack_set_default(struct iothpy_state* st, PyObject* stack);
+int stack_set_thread(struct iothpy_state* st, PyObject* stack);
+
+/* Build the Link, IfAddr and Route tuples returned by the stack methods */
+PyObject* stack_make_link(struct iothpy_state* st, const struct nl_link_info* l);
+PyObject* stack_make_ifaddr(struct iothpy_state* st, const struct nl_addr_info* a);
+PyObject* stack_make_route(struct iothpy_state* st, const struct nl_route_info* r);
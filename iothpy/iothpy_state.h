@@ -0,0 +1,61 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include <pthread.h>
+
+#include "pycompat.h"
+
+/*
+    State of the _iothpy module, one for each interpreter that imports it,
+    so that sub-interpreters (with their own GIL since Python 3.12) have
+    their own types, exceptions, default timeout and current stack.
+*/
+typedef struct iothpy_state {
+    /* Base types of the Stack, MSocket and Monitor python classes */
+    PyTypeObject* stack_type;
+    PyTypeObject* socket_type;
+    PyTypeObject* monitor_type;
+    PyTypeObject* engine_type;
+    PyTypeObject* relay_type;
+    PyTypeObject* balancer_type;
+    PyTypeObject* dispatcher_type;
+
+    /* Struct sequence types of the results */
+    PyTypeObject* addrinfo_type;
+    PyTypeObject* ifaddr_type;
+    PyTypeObject* route_type;
+    PyTypeObject* link_type;
+    PyTypeObject* linkstats_type;
+    PyTypeObject* netlink_event_type;
+    PyTypeObject* completion_type;
+
+    /* _iothpy.timeout exception */
+    PyObject* socket_timeout;
+
+    /* Default timeout of the new sockets, see socket_get_defaulttimeout */
+    _PyTime_t defaulttimeout;
+
+    /* Stack used by the sockets created without one, see stack_get_current */
+    PyObject* current_stack_var;
+    PyObject* thread_stack_key;
+    PyObject* default_stack;
+    pthread_mutex_t default_stack_lock;
+
+    /* Objects borrowed from the socket module, loaded on first use */
+    PyObject* family_map;
+    PyObject* socktype_map;
+    PyObject* gaierror;
+} iothpy_state;
+
+/*
+    Return the state of the module that created type or the first of its
+    bases defined by this module, e.g. Py_TYPE(self) of a Stack subclass.
+    Raises TypeError and returns NULL if there is none.
+*/
+iothpy_state* iothpy_state_from_type(PyTypeObject* type);
+
+/* Return the state of the _iothpy module object */
+iothpy_state* iothpy_state_from_module(PyObject* module);
+
+/* Create a type of the module from its spec */
+PyTypeObject* iothpy_new_type(PyObject* module, PyType_Spec* spec);
@@ -0,0 +1,274 @@
+#
+# This file is part of the iothpy library: python support for ioth.
+#
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+"""
+ListenerGroup class
+
+This module defines the ListenerGroup class returned by
+Stack.listen_reuseport, N listening sockets bound to the same address
+with SO_REUSEPORT, one for each worker thread, so that the stack spreads
+the incoming connections among them and each worker waits on its own
+socket. On stacks without SO_REUSEPORT the workers share one listener
+and take turns waiting on it in arrival order, so each connection wakes
+up only the worker whose turn it is instead of all of them.
+
+Example:
+
+def echo(conn, addr):
+    while data := conn.recv(4096):
+        conn.sendall(data)
+
+with stack.listen_reuseport(("", 5000), 4) as group:
+    group.serve(echo)
+    ...
+    print(group.stats()["workers"])
+"""
+
+import collections
+import errno
+import socket
+import threading
+import time
+
+from . import _iothpy
+
+# Counters kept for each worker, summed up by ListenerGroup.stats
+STATS_FIELDS = ("accepted", "handled", "errors")
+
+# Seconds between two checks of close() by the workers waiting to accept
+_POLL_INTERVAL = 0.25
+
+class _AcceptTurns:
+    """Turns of the workers sharing one listener, given in arrival order
+
+    Only the worker holding the turn waits on the listener, release()
+    hands the turn to the next worker waiting, waking up that one only.
+    """
+
+    def __init__(self):
+        self._lock = threading.Lock()
+        self._waiters = collections.deque()
+        self._busy = False
+
+    def acquire(self, timeout=None):
+        with self._lock:
+            if not self._busy:
+                self._busy = True
+                return True
+            gate = threading.Lock()
+            gate.acquire()
+            self._waiters.append(gate)
+
+        if gate.acquire(timeout=-1 if timeout is None else timeout):
+            return True
+
+        with self._lock:
+            try:
+                self._waiters.remove(gate)
+                return False
+            except ValueError:
+                # The turn was handed over while timing out
+                return True
+
+    def release(self):
+        with self._lock:
+            if self._waiters:
+                self._waiters.popleft().release()
+            else:
+                self._busy = False
+
+class ListenerGroup:
+    """Listening sockets of a stack shared by worker threads
+
+    This class is only used internally, the user should create groups
+    with Stack.listen_reuseport().
+
+    Worker i accepts with accept(i), or serve(handler) starts the n
+    workers. The reuseport attribute tells whether each worker has its
+    own socket. stats() reports the connections accepted by each worker.
+    Closing the group stops the workers and closes the listeners.
+    """
+
+    def __init__(self, stack, address, n, backlog=128):
+        if n < 1:
+            raise ValueError("n must be at least 1")
+
+        host, port = address[0], address[1]
+        family = socket.AF_INET6 if ":" in host else socket.AF_INET
+
+        self.n = n
+        self.sockets = []
+        self.reuseport = n > 1
+        self._closed = False
+        self._turns = _AcceptTurns()
+        self._threads = []
+        self._lock = threading.Lock()
+        self._counters = [dict.fromkeys(STATS_FIELDS, 0) for _ in range(n)]
+
+        try:
+            for i in range(n if self.reuseport else 1):
+                sock = stack.socket(family, socket.SOCK_STREAM)
+                self.sockets.append(sock)
+                sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+                if self.reuseport:
+                    try:
+                        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEPORT, 1)
+                        sock.bind((host, port))
+                    except OSError as e:
+                        # Stack without SO_REUSEPORT: setsockopt fails, or the
+                        # port is not shared once the first socket is bound
+                        if i > 0 and e.errno != errno.EADDRINUSE:
+                            raise
+                        if i == 0 and e.errno not in (errno.ENOPROTOOPT, errno.EINVAL,
+                                                      errno.EOPNOTSUPP):
+                            raise
+                        self._close_sockets()
+                        self.reuseport = False
+                        self._listen_single(stack, family, (host, port), backlog)
+                        break
+                else:
+                    sock.bind((host, port))
+                sock.listen(backlog)
+                sock.settimeout(_POLL_INTERVAL)
+                # The next sockets take the port given to the first one
+                port = sock.getsockname()[1]
+        except BaseException:
+            self._close_sockets()
+            raise
+
+    def _listen_single(self, stack, family, address, backlog):
+        sock = stack.socket(family, socket.SOCK_STREAM)
+        self.sockets.append(sock)
+        sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+        sock.bind(address)
+        sock.listen(backlog)
+        sock.settimeout(_POLL_INTERVAL)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def getsockname(self):
+        """Return the address the listeners are bound to"""
+        return self.sockets[0].getsockname()
+
+    def accept(self, worker, timeout=None):
+        """Accept a connection as the worker at index worker
+
+        Waits up to timeout seconds (None for no limit), raising
+        iothpy.timeout if no connection arrived, and OSError(EBADF) once
+        the group is closed. Returns (conn, address) as socket.accept().
+        """
+        if not 0 <= worker < self.n:
+            raise IndexError("worker index out of range")
+        if self._closed:
+            raise OSError(errno.EBADF, "listener group closed")
+
+        deadline = None if timeout is None else time.monotonic() + timeout
+        if self.reuseport:
+            conn, addr = self._accept_on(self.sockets[worker], deadline)
+        else:
+            if not self._turns.acquire(timeout):
+                raise _iothpy.timeout("timed out")
+            try:
+                conn, addr = self._accept_on(self.sockets[0], deadline)
+            finally:
+                self._turns.release()
+
+        self._count(worker, "accepted")
+        return conn, addr
+
+    def _accept_on(self, sock, deadline):
+        while True:
+            if self._closed:
+                raise OSError(errno.EBADF, "listener group closed")
+            if deadline is not None and time.monotonic() >= deadline:
+                raise _iothpy.timeout("timed out")
+            try:
+                return sock.accept()
+            except _iothpy.timeout:
+                continue
+
+    def _count(self, worker, field):
+        with self._lock:
+            self._counters[worker][field] += 1
+
+    def _serve_worker(self, worker, handler):
+        while True:
+            try:
+                conn, addr = self.accept(worker)
+            except OSError:
+                if self._closed:
+                    return
+                # Persistent failures such as EMFILE: count them and
+                # back off instead of spinning on the listener
+                self._count(worker, "errors")
+                time.sleep(_POLL_INTERVAL)
+                continue
+
+            try:
+                handler(conn, addr)
+                self._count(worker, "handled")
+            except Exception:
+                self._count(worker, "errors")
+            finally:
+                conn.close()
+
+    def serve(self, handler):
+        """Start the n worker threads, each one calling handler(conn, addr)
+        for the connections it accepts, conn is closed when it returns"""
+        if self._threads:
+            raise RuntimeError("ListenerGroup already serving")
+        for worker in range(self.n):
+            t = threading.Thread(target=self._serve_worker, args=(worker, handler),
+                                 name="iothpy-listener-%d" % worker, daemon=True)
+            t.start()
+            self._threads.append(t)
+
+    def stats(self):
+        """Return the counters of the workers
+
+        The result is a dict with "reuseport", "workers", a list with the
+        accepted, handled and errors (failed accepts and exceptions raised
+        by the handler) counters of each worker, and "total", the sum of all of them.
+        """
+        with self._lock:
+            workers = [dict(c) for c in self._counters]
+        total = {field: sum(w[field] for w in workers) for field in STATS_FIELDS}
+        return {"reuseport": self.reuseport, "workers": workers, "total": total}
+
+    def _close_sockets(self):
+        for sock in self.sockets:
+            sock.close()
+        self.sockets = []
+
+    def close(self, timeout=None):
+        """Stop the workers, waiting for them to finish the connection
+        they are handling, and close the listeners"""
+        self._closed = True
+        for t in self._threads:
+            t.join(timeout)
+        self._threads = []
+        self._close_sockets()
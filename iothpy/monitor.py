@@ -0,0 +1,97 @@
+#
+# This file is part of the iothpy library: python support for ioth.
+#
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+"""
+Monitor class
+
+This module defines the Monitor class returned by Stack.subscribe, a
+netlink socket of the stack that receives the link, address and route
+changes as they happen.
+
+Example:
+
+with stack.subscribe() as mon:
+    while True:
+        for event, data in mon.read(timeout=None):
+            print(event, data)
+
+With asyncio:
+
+async for event, data in mon:
+    ...
+"""
+
+from . import _iothpy
+
+class Monitor(_iothpy.MonitorBase):
+    """Netlink event monitor of a stack
+
+    This class is only used internally, the user should create monitors
+    with Stack.subscribe().
+
+    Parameters
+    ----------
+    stack : Stack
+        Stack to monitor.
+
+    groups : int
+        Bitmask of the RTMGRP_* groups to subscribe, links, IPv4 and
+        IPv6 addresses and routes if missing.
+    """
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    async def aread(self):
+        """Wait in the running asyncio loop for events and return them
+
+        Same as read(timeout=None) without blocking the loop.
+        """
+        import asyncio
+
+        events = self.read()
+        if events:
+            return events
+
+        loop = asyncio.get_running_loop()
+        fd = self.fileno()
+        while not events:
+            ready = loop.create_future()
+            loop.add_reader(fd, ready.set_result, None)
+            try:
+                await ready
+            finally:
+                loop.remove_reader(fd)
+            events = self.read()
+        return events
+
+    def __aiter__(self):
+        return self._aiter()
+
+    async def _aiter(self):
+        while True:
+            for event in await self.aread():
+                yield event
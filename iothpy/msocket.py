@@ -56,7 +56,8 @@ class MSocket(_iothpy.MSocketBase):
     __slots__ = ["__weakref__", "_io_refs", "_closed"]
 
     def __init__(self, stack, family=-1, type=-1, proto=-1, fileno=None):
-        if not isinstance(stack, iothpy.stack.Stack):
+        # None selects the current stack, see help("iothpy.get_stack")
+        if stack is not None and not isinstance(stack, iothpy.stack.Stack):
             raise TypeError("stack must be of type Stack")
 
         if fileno is None:
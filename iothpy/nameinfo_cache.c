@@ -0,0 +1,385 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "nameinfo_cache.h"
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <netinet/in.h>
+
+/* Fixed size key built from the fields of the sockaddr that identify it */
+struct nameinfo_key {
+    int family;
+    int flags;
+    uint32_t scope_id;
+    uint16_t port;
+    unsigned char addr[16];
+};
+
+struct nameinfo_entry {
+    struct nameinfo_key key;
+    uint32_t hash;
+    int64_t inserted;
+    char* host;
+    char* serv;
+
+    /* Collision chain of the hash bucket */
+    struct nameinfo_entry* hnext;
+
+    /* LRU list, most recently used first */
+    struct nameinfo_entry* prev;
+    struct nameinfo_entry* next;
+};
+
+struct nameinfo_cache {
+    pthread_mutex_t lock;
+
+    struct nameinfo_entry** buckets;
+    size_t nbuckets;
+
+    struct nameinfo_entry* head;
+    struct nameinfo_entry* tail;
+
+    size_t size;
+    size_t maxsize;
+    int64_t ttl;
+
+    uint64_t hits;
+    uint64_t misses;
+};
+
+#define NS_PER_SEC 1000000000LL
+
+/* Initial number of buckets, doubled when the entries outnumber them */
+#define NAMEINFO_MIN_BUCKETS 16
+
+static int64_t
+monotonic_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * NS_PER_SEC + ts.tv_nsec;
+}
+
+/* Fill key from addr, returns 0 for unsupported address families */
+static int
+make_key(struct nameinfo_key* key, const struct sockaddr* addr, int flags)
+{
+    memset(key, 0, sizeof(*key));
+    key->family = addr->sa_family;
+    key->flags = flags;
+
+    switch(addr->sa_family) {
+        case AF_INET:
+        {
+            const struct sockaddr_in* a = (const struct sockaddr_in*)addr;
+            key->port = a->sin_port;
+            memcpy(key->addr, &a->sin_addr, sizeof(a->sin_addr));
+        } break;
+
+        case AF_INET6:
+        {
+            const struct sockaddr_in6* a = (const struct sockaddr_in6*)addr;
+            key->port = a->sin6_port;
+            key->scope_id = a->sin6_scope_id;
+            memcpy(key->addr, &a->sin6_addr, sizeof(a->sin6_addr));
+        } break;
+
+        default:
+            return 0;
+    }
+
+    return 1;
+}
+
+/* FNV-1a hash of the key */
+static uint32_t
+hash_key(const struct nameinfo_key* key)
+{
+    const unsigned char* p = (const unsigned char*)key;
+    uint32_t h = 2166136261u;
+    for(size_t i = 0; i < sizeof(*key); i++) {
+        h ^= p[i];
+        h *= 16777619u;
+    }
+    return h;
+}
+
+static void
+lru_unlink(struct nameinfo_cache* cache, struct nameinfo_entry* e)
+{
+    if(e->prev)
+        e->prev->next = e->next;
+    else
+        cache->head = e->next;
+
+    if(e->next)
+        e->next->prev = e->prev;
+    else
+        cache->tail = e->prev;
+
+    e->prev = e->next = NULL;
+}
+
+static void
+lru_push_front(struct nameinfo_cache* cache, struct nameinfo_entry* e)
+{
+    e->prev = NULL;
+    e->next = cache->head;
+    if(cache->head)
+        cache->head->prev = e;
+    cache->head = e;
+    if(!cache->tail)
+        cache->tail = e;
+}
+
+static struct nameinfo_entry**
+bucket_of(struct nameinfo_cache* cache, uint32_t hash)
+{
+    return &cache->buckets[hash % cache->nbuckets];
+}
+
+/* Unlink the entry from its bucket and from the LRU list and free it */
+static void
+remove_entry(struct nameinfo_cache* cache, struct nameinfo_entry* e)
+{
+    struct nameinfo_entry** p = bucket_of(cache, e->hash);
+    while(*p != e)
+        p = &(*p)->hnext;
+    *p = e->hnext;
+
+    lru_unlink(cache, e);
+    free(e->host);
+    free(e->serv);
+    free(e);
+    cache->size--;
+}
+
+static struct nameinfo_entry*
+find_entry(struct nameinfo_cache* cache, const struct nameinfo_key* key, uint32_t hash)
+{
+    struct nameinfo_entry* e;
+    for(e = *bucket_of(cache, hash); e; e = e->hnext) {
+        if(e->hash == hash && memcmp(&e->key, key, sizeof(*key)) == 0)
+            return e;
+    }
+    return NULL;
+}
+
+/*
+    Double the buckets when there are more entries than buckets, keeping the
+    load factor below 1 whatever maxsize is. On allocation failure the chains
+    just get longer.
+*/
+static void
+maybe_grow(struct nameinfo_cache* cache)
+{
+    if(cache->size <= cache->nbuckets)
+        return;
+
+    size_t nbuckets = cache->nbuckets * 2;
+    struct nameinfo_entry** buckets = calloc(nbuckets, sizeof(*buckets));
+    if(!buckets)
+        return;
+
+    for(size_t i = 0; i < cache->nbuckets; i++) {
+        struct nameinfo_entry* e = cache->buckets[i];
+        while(e) {
+            struct nameinfo_entry* next = e->hnext;
+            struct nameinfo_entry** bucket = &buckets[e->hash % nbuckets];
+            e->hnext = *bucket;
+            *bucket = e;
+            e = next;
+        }
+    }
+
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->nbuckets = nbuckets;
+}
+
+static void
+evict_to(struct nameinfo_cache* cache, size_t maxsize)
+{
+    while(cache->size > maxsize && cache->tail)
+        remove_entry(cache, cache->tail);
+}
+
+struct nameinfo_cache*
+nameinfo_cache_new(size_t maxsize, double ttl)
+{
+    struct nameinfo_cache* cache = calloc(1, sizeof(*cache));
+    if(!cache)
+        return NULL;
+
+    /* The buckets grow with the entries, see maybe_grow */
+    cache->nbuckets = NAMEINFO_MIN_BUCKETS;
+    cache->buckets = calloc(cache->nbuckets, sizeof(*cache->buckets));
+    if(!cache->buckets) {
+        free(cache);
+        return NULL;
+    }
+
+    pthread_mutex_init(&cache->lock, NULL);
+    cache->maxsize = maxsize;
+    cache->ttl = (int64_t)(ttl * NS_PER_SEC);
+    return cache;
+}
+
+void
+nameinfo_cache_free(struct nameinfo_cache* cache)
+{
+    if(!cache)
+        return;
+
+    nameinfo_cache_clear(cache);
+    pthread_mutex_destroy(&cache->lock);
+    free(cache->buckets);
+    free(cache);
+}
+
+void
+nameinfo_cache_configure(struct nameinfo_cache* cache, size_t maxsize, double ttl)
+{
+    pthread_mutex_lock(&cache->lock);
+    cache->maxsize = maxsize;
+    cache->ttl = (int64_t)(ttl * NS_PER_SEC);
+    evict_to(cache, maxsize);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+nameinfo_cache_clear(struct nameinfo_cache* cache)
+{
+    pthread_mutex_lock(&cache->lock);
+    evict_to(cache, 0);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+int
+nameinfo_cache_lookup(struct nameinfo_cache* cache, const struct sockaddr* addr, int flags,
+                      char* host, size_t hostlen, char* serv, size_t servlen)
+{
+    struct nameinfo_key key;
+    int hit = 0;
+
+    if(!make_key(&key, addr, flags))
+        return 0;
+    uint32_t hash = hash_key(&key);
+
+    pthread_mutex_lock(&cache->lock);
+    struct nameinfo_entry* e = find_entry(cache, &key, hash);
+    if(e && monotonic_ns() - e->inserted >= cache->ttl) {
+        remove_entry(cache, e);
+        e = NULL;
+    }
+
+    if(e) {
+        lru_unlink(cache, e);
+        lru_push_front(cache, e);
+
+        strncpy(host, e->host, hostlen - 1);
+        host[hostlen - 1] = '\0';
+        strncpy(serv, e->serv, servlen - 1);
+        serv[servlen - 1] = '\0';
+
+        cache->hits++;
+        hit = 1;
+    } else {
+        cache->misses++;
+    }
+    pthread_mutex_unlock(&cache->lock);
+
+    return hit;
+}
+
+void
+nameinfo_cache_insert(struct nameinfo_cache* cache, const struct sockaddr* addr, int flags,
+                      const char* host, const char* serv)
+{
+    struct nameinfo_key key;
+
+    if(!make_key(&key, addr, flags))
+        return;
+    uint32_t hash = hash_key(&key);
+
+    char* host_copy = strdup(host);
+    char* serv_copy = strdup(serv);
+    if(!host_copy || !serv_copy) {
+        free(host_copy);
+        free(serv_copy);
+        return;
+    }
+
+    pthread_mutex_lock(&cache->lock);
+    if(cache->maxsize == 0 || cache->ttl <= 0) {
+        pthread_mutex_unlock(&cache->lock);
+        free(host_copy);
+        free(serv_copy);
+        return;
+    }
+
+    struct nameinfo_entry* e = find_entry(cache, &key, hash);
+    if(e) {
+        /* Another thread resolved the same address, refresh it */
+        free(e->host);
+        free(e->serv);
+        lru_unlink(cache, e);
+    } else {
+        e = calloc(1, sizeof(*e));
+        if(!e) {
+            pthread_mutex_unlock(&cache->lock);
+            free(host_copy);
+            free(serv_copy);
+            return;
+        }
+        e->key = key;
+        e->hash = hash;
+
+        struct nameinfo_entry** bucket = bucket_of(cache, hash);
+        e->hnext = *bucket;
+        *bucket = e;
+        cache->size++;
+    }
+
+    e->host = host_copy;
+    e->serv = serv_copy;
+    e->inserted = monotonic_ns();
+    lru_push_front(cache, e);
+
+    evict_to(cache, cache->maxsize);
+    maybe_grow(cache);
+    pthread_mutex_unlock(&cache->lock);
+}
+
+void
+nameinfo_cache_get_stats(struct nameinfo_cache* cache, struct nameinfo_cache_stats* stats)
+{
+    pthread_mutex_lock(&cache->lock);
+    stats->hits = cache->hits;
+    stats->misses = cache->misses;
+    stats->size = cache->size;
+    stats->maxsize = cache->maxsize;
+    stats->ttl = (double)cache->ttl / NS_PER_SEC;
+    pthread_mutex_unlock(&cache->lock);
+}
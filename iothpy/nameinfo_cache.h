@@ -0,0 +1,42 @@
+#include <stdint.h>
+#include <sys/socket.h>
+
+/*
+    Bounded LRU cache of getnameinfo results keyed by (sockaddr, flags).
+    Entries expire after a fixed ttl. All the functions are thread safe and
+    do not require the GIL, so they can be used around blocking lookups.
+*/
+struct nameinfo_cache;
+
+struct nameinfo_cache_stats {
+    uint64_t hits;
+    uint64_t misses;
+    size_t size;
+    size_t maxsize;
+    double ttl;
+};
+
+/* Create a new cache holding at most maxsize entries for ttl seconds */
+struct nameinfo_cache* nameinfo_cache_new(size_t maxsize, double ttl);
+
+/* Free the cache and all its entries */
+void nameinfo_cache_free(struct nameinfo_cache* cache);
+
+/* Change the size and ttl of the cache, evicting entries if needed */
+void nameinfo_cache_configure(struct nameinfo_cache* cache, size_t maxsize, double ttl);
+
+/* Remove all the entries */
+void nameinfo_cache_clear(struct nameinfo_cache* cache);
+
+/*
+    Copy host and serv of a valid entry for addr and flags into the buffers.
+    Returns 1 on hit and 0 on miss.
+*/
+int nameinfo_cache_lookup(struct nameinfo_cache* cache, const struct sockaddr* addr, int flags,
+                          char* host, size_t hostlen, char* serv, size_t servlen);
+
+/* Insert or refresh the entry for addr and flags */
+void nameinfo_cache_insert(struct nameinfo_cache* cache, const struct sockaddr* addr, int flags,
+                           const char* host, const char* serv);
+
+void nameinfo_cache_get_stats(struct nameinfo_cache* cache, struct nameinfo_cache_stats* stats);
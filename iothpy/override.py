@@ -31,7 +31,7 @@ from iothpy.msocket import MSocket
 from iothpy.stack import Stack
 import iothpy._iothpy as _iothpy
 
-def override_socket_module(stack):
+def override_socket_module(stack=None):
     """Override built-in socket module so that it creates sockets on the specified stack
 
     Parameters:
@@ -39,22 +39,39 @@ def override_socket_module(stack):
     stack : Stack
        on success all the socket created using the built-in socket module will now 
        be created on this stack instead of using the default kernel stack
+
+    The stack is looked up on each socket creation with iothpy.get_stack():
+    the stack set in the iothpy.current_stack context variable or with
+    iothpy.set_thread_stack takes precedence, and stack, if not None,
+    becomes the process default with iothpy.set_default_stack. This way
+    each thread or asyncio task can open sockets on a different stack.
+    getaddrinfo, and so create_connection, resolve names with the same stack.
     """
 
-    if not isinstance(stack, Stack):
+    if stack is not None and not isinstance(stack, Stack):
         raise TypeError("stack must be of type Stack")
 
     import socket as socket_module
 
-    # Create a new class that subclasses MSocket fixing the stack parameter
-    # to provide an interface identical to the built-in socket class
+    if stack is not None:
+        _iothpy.set_default_stack(stack)
+
+    # Create a new class that subclasses MSocket leaving the choice of the
+    # stack to the c module to provide an interface identical to the
+    # built-in socket class
     class socket(MSocket):
         def __init__(self, family=-1, type=-1, proto=-1, fileno=None):
-           MSocket.__init__(self, stack, family, type, proto, fileno)
+           MSocket.__init__(self, None, family, type, proto, fileno)
+
+    def getaddrinfo(host, port, family=0, type=0, proto=0, flags=0):
+        return _iothpy.get_stack().getaddrinfo(host, port, family, type, proto, flags)
 
     # Override the socket class
     socket_module.__dict__["socket"] = socket
 
+    # Override name resolution, also used by create_connection
+    socket_module.__dict__["getaddrinfo"] = getaddrinfo
+
     # Override defaulttimmeout functions
     socket_module.__dict__["getdefaulttimeout"] = _iothpy.getdefaulttimeout
     socket_module.__dict__["setdefaulttimeout"] = _iothpy.setdefaulttimeout
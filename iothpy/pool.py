@@ -0,0 +1,258 @@
+#
+# This file is part of the iothpy library: python support for ioth.
+#
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""
+StackPool class
+
+This module defines the StackPool class, a pool of stacks created and
+configured in the background so that they can be handed out without
+waiting for the plugin to start or for dhcp to complete. Returned stacks
+are reset to the configuration they had when created and reused.
+
+Example:
+
+pool = iothpy.StackPool(4, "vdestack", "vde:///tmp/mysw", config="eth,dhcp")
+
+with pool.stack() as stack:
+    s = stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+    ...
+
+pool.close()
+"""
+
+import collections
+import contextlib
+import threading
+import time
+
+from iothpy.stack import Stack
+
+# Flag of the links and table of the routes restored by the reset
+_IFF_UP = 0x1
+_RT_TABLE_MAIN = 254
+
+def _state(stack):
+    """Return the configuration of stack restored when it is recycled
+
+    It is made of the up flag and mtu of each link, the addresses and the
+    routes through a gateway of the main table, as arguments of iproute_add.
+    """
+    links = {l.ifindex: (l.flags & _IFF_UP, l.mtu) for l in stack.links()}
+    addresses = {(a.family, a.address, a.prefixlen, a.ifindex) for a in stack.addresses()}
+    routes = {(r.family, r.gateway, r.dst, r.dst_len, r.ifindex)
+              for r in stack.routes()
+              if r.table == _RT_TABLE_MAIN and r.gateway is not None}
+    return links, addresses, routes
+
+class StackPool:
+    """Pool of pre-created and pre-configured stacks
+
+    Parameters
+    ----------
+    size : int
+        Number of ready stacks kept in the pool.
+
+    stack, vdeurl, config_dns :
+        Arguments used to create each stack, see help("iothpy.Stack").
+
+    config : str
+        Optional ioth_config string applied to each new stack.
+
+    setup : callable
+        Optional function called with each new stack, after config,
+        to complete its configuration.
+    """
+
+    def __init__(self, size, stack, vdeurl=None, config_dns=None, config=None, setup=None):
+        if size < 1:
+            raise ValueError("size must be at least 1")
+
+        self._size = size
+        self._args = (stack, vdeurl, config_dns)
+        self._dns = config_dns if config_dns is not None else "/etc/resolv.conf"
+        self._config = config
+        self._setup = setup
+
+        self._ready = collections.deque()
+        self._cond = threading.Condition()
+        self._closed = False
+        self._error = None
+
+        self._filler = threading.Thread(target=self._fill, name="iothpy-stackpool", daemon=True)
+        self._filler.start()
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def _new_stack(self):
+        stack = Stack(*self._args)
+        try:
+            if self._config is not None:
+                stack.ioth_config(self._config)
+            if self._setup is not None:
+                self._setup(stack)
+            # The configuration restored by _reset when it is released
+            stack._pool_template = (self, _state(stack))
+        except BaseException:
+            stack.close()
+            raise
+        return stack
+
+    def _reset(self, stack):
+        """Restore the configuration a stack had when it was created
+
+        Closes the sockets, deletes the addresses and the routes added
+        since then, adds back the ones removed, restores the links state
+        and the dns configuration. Returns False if the stack cannot be
+        brought back to the template, e.g. if links were added or removed.
+        """
+        pool, template = getattr(stack, "_pool_template", (None, None))
+        if pool is not self or stack.closed:
+            return False
+
+        stack.close_sockets()
+        links, addresses, routes = _state(stack)
+        t_links, t_addresses, t_routes = template
+        if links.keys() != t_links.keys():
+            return False
+
+        ops = [("iproute_del",) + r for r in routes - t_routes]
+        ops += [("ipaddr_del",) + a for a in addresses - t_addresses]
+        for ifindex, (up, mtu) in t_links.items():
+            if links[ifindex][1] != mtu:
+                ops.append(("linksetmtu", ifindex, mtu))
+            if links[ifindex][0] != up:
+                ops.append(("linksetupdown", ifindex, 1 if up else 0))
+        ops += [("ipaddr_add",) + a for a in t_addresses - addresses]
+        ops += [("iproute_add",) + r for r in t_routes - routes]
+
+        if any(stack.apply(ops)) or _state(stack) != template:
+            return False
+
+        stack.iothdns_update(self._dns)
+        stack.nameinfo_cache_clear()
+        return True
+
+    def _fill(self):
+        while True:
+            with self._cond:
+                while not self._closed and len(self._ready) >= self._size:
+                    self._cond.wait()
+                if self._closed:
+                    return
+
+            try:
+                stack = self._new_stack()
+            except Exception as e:
+                # Report the error to the waiting consumers and retry later
+                with self._cond:
+                    self._error = e
+                    self._cond.notify_all()
+                time.sleep(1)
+                continue
+
+            with self._cond:
+                closed = self._closed
+                full = len(self._ready) >= self._size
+                if not closed and not full:
+                    self._error = None
+                    self._ready.append(stack)
+                    self._cond.notify_all()
+
+            if closed or full:
+                stack.close()
+                if closed:
+                    return
+
+    def acquire(self, timeout=None):
+        """Take a ready stack from the pool
+
+        Waits up to timeout seconds (forever if None) for a stack to be
+        ready and raises TimeoutError if none is available in time.
+        If creating stacks is failing, the last error is raised instead.
+        """
+        with self._cond:
+            if not self._cond.wait_for(lambda: self._closed or self._ready or self._error, timeout):
+                raise TimeoutError("no stack available in the pool")
+            if self._closed:
+                raise ValueError("StackPool is closed")
+            if not self._ready:
+                raise self._error
+
+            stack = self._ready.popleft()
+            self._cond.notify_all()
+            return stack
+
+    def release(self, stack):
+        """Give a stack back to the pool
+
+        The stack is reset to the configuration it had when it was created
+        (see _reset) and made ready again. It is closed instead when the
+        reset fails, when the pool is closed or already full, or when the
+        stack does not come from this pool.
+        """
+        try:
+            recycled = self._reset(stack)
+        except Exception:
+            recycled = False
+
+        if recycled:
+            with self._cond:
+                recycled = not self._closed and len(self._ready) < self._size
+                if recycled:
+                    self._ready.append(stack)
+                    self._cond.notify_all()
+
+        if not recycled:
+            stack.close()
+
+    @contextlib.contextmanager
+    def stack(self, timeout=None):
+        """Context manager that acquires a stack and releases it on exit"""
+        stack = self.acquire(timeout)
+        try:
+            yield stack
+        finally:
+            self.release(stack)
+
+    def close(self):
+        """Stop the background thread and close all the ready stacks
+
+        Stacks currently acquired are closed when they are released.
+        """
+        with self._cond:
+            self._closed = True
+            ready = list(self._ready)
+            self._ready.clear()
+            self._cond.notify_all()
+
+        self._filler.join()
+        for stack in ready:
+            stack.close()
+
+    @property
+    def ready(self):
+        """Number of stacks ready to be acquired"""
+        return len(self._ready)
@@ -0,0 +1,181 @@
+#
+# This file is part of the iothpy library: python support for ioth.
+#
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+
+"""
+Native proxying of stream sockets
+
+This module defines relay, copying the bytes between two connected
+sockets both ways in a thread of its own with the GIL released, e.g.
+to forward ports between the host network and a stack or between two
+stacks. The sockets can be sockets of a stack or kernel sockets.
+
+LoadBalancer accepts the connections of a listening socket of a stack
+and relays each one to a backend of a pool, connecting to it on the
+stack of the backend, all in native code.
+
+Example:
+
+host = socket.create_server(("0.0.0.0", 8080))
+while True:
+    conn, addr = host.accept()
+    upstream = stack.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+    upstream.connect(("10.0.0.1", 80))
+    relay = iothpy.relay(conn, upstream)
+    relay.add_done_callback(lambda r, c=conn, u=upstream: (c.close(), u.close()))
+
+listener = front.socket(iothpy.AF_INET, iothpy.SOCK_STREAM)
+listener.bind(("0.0.0.0", 80))
+listener.listen(128)
+lb = iothpy.LoadBalancer(listener, [(back1, ("10.0.1.1", 80)),
+                                    (back2, ("10.0.2.1", 80))], policy="least_conn")
+"""
+
+import ipaddress
+import socket
+
+from . import _iothpy
+
+class Relay(_iothpy.RelayBase):
+    """Relay of two connected stream sockets
+
+    This class is only used internally, the user should start relays
+    with iothpy.relay().
+
+    The end of the stream read from a socket is forwarded to the other
+    one with shutdown(SHUT_WR), the relay finishes once both the
+    directions ended or on the first error. The sockets are not closed
+    by the relay and must not be closed while it runs.
+    """
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def add_done_callback(self, fn):
+        """Call fn(relay) in a new thread once the relay finished"""
+        import threading
+
+        def waiter():
+            self.wait()
+            fn(self)
+        threading.Thread(target=waiter, daemon=True).start()
+
+    def __await__(self):
+        """Wait in the running asyncio loop for the relay to finish"""
+        import asyncio
+
+        if self.done:
+            return self
+        loop = asyncio.get_running_loop()
+        fd = self.fileno()
+        ready = loop.create_future()
+        loop.add_reader(fd, ready.set_result, None)
+        try:
+            yield from ready.__await__()
+        finally:
+            loop.remove_reader(fd)
+        return self
+
+def relay(sock_a, sock_b, bufsize=65536):
+    """Relay two connected stream sockets both ways in native code
+
+    Parameters
+    ----------
+    sock_a, sock_b : MSocket, socket.socket or int
+        Sockets of a stack, kernel sockets or their file descriptors.
+
+    bufsize : int
+        Size of the buffer of each direction.
+
+    Returns a Relay with the byte counters (bytes_ab, bytes_ba) and the
+    state of the relay (done, error), wait() and fileno() to wait for it
+    and close() to cancel it. Dropping the Relay cancels the relay.
+    """
+    return Relay(sock_a, sock_b, bufsize)
+
+class LoadBalancer(_iothpy.LoadBalancerBase):
+    """L4 load balancer of the connections of a listening socket
+
+    Parameters
+    ----------
+    listener : MSocket
+        Listening stream socket of a stack. The balancer puts it in
+        non-blocking mode while running.
+
+    backends : sequence of (Stack, address)
+        The pool of backends, each one connected on its own stack. The
+        host of an address is resolved by the stack of the backend if it
+        is not a numeric address.
+
+    policy : str
+        "round_robin", "least_conn" (fewest active connections) or
+        "hash" (consistent hash of the client address, a client keeps
+        its backend while the backend is up).
+
+    bufsize : int
+        Size of the buffer of each direction of a connection.
+
+    connect_timeout : float
+        Seconds to connect to a backend before trying the next one.
+
+    max_fails, fail_timeout : int, float
+        A backend failing max_fails connects in a row is skipped for
+        fail_timeout seconds, then tried again. 0 never skips it.
+
+    threads : int
+        Number of relay loops sharing the connections.
+
+    The listener must stay open while the balancer runs, closing the
+    stack of the listener or of a backend raises OSError (EBUSY) until
+    the balancer is closed. close() stops it and closes the connections being balanced. stats()
+    returns the counters of the balancer and the health and counters of
+    each backend, set_backend() takes a backend out of the pool and
+    back.
+    """
+
+    def __init__(self, listener, backends, policy="round_robin", bufsize=16384,
+                 connect_timeout=5.0, max_fails=1, fail_timeout=10.0, threads=1):
+        backends = [(stack, _numeric_address(stack, address)) for stack, address in backends]
+        super().__init__(listener, backends, policy, bufsize, connect_timeout,
+                         max_fails, fail_timeout, threads)
+
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+def _numeric_address(stack, address):
+    """Resolve the host of a backend address on its stack"""
+    host, port = address[0], address[1]
+    try:
+        ipaddress.ip_address(host)
+        return address
+    except ValueError:
+        pass
+
+    infos = stack.getaddrinfo(host, port, 0, socket.SOCK_STREAM)
+    if not infos:
+        raise OSError("cannot resolve backend host {0}".format(host))
+    return infos[0].sockaddr
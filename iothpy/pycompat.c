@@ -0,0 +1,115 @@
+/*
+ * This file is part of the iothpy library: python support for ioth.
+ *
+ * Copyright (c) 2020-2024   Dario Mylonopoulos
+ *                           Lorenzo Liso
+ *                           Francesco Testa
+ * Virtualsquare team.
+ *
+ * This library is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU Lesser General Public
+ * License as published by the Free Software Foundation; either
+ * version 2.1 of the License, or any later version.
+ *
+ * This library is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+ * Lesser General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program. If not, see <http://www.gnu.org/licenses/>.
+ */
+#include "pycompat.h"
+
+#if PY_VERSION_HEX >= 0x030D0000
+
+#include <math.h>
+
+#define NS_PER_SEC 1000000000
+#define NS_PER_MS 1000000
+
+PyTime_t
+iothpy_time_monotonic(void)
+{
+    PyTime_t t;
+    if(PyTime_MonotonicRaw(&t) < 0)
+        return 0;
+    return t;
+}
+
+/* Round the quotient q of a division with remainder r towards the mode */
+static PyTime_t
+round_quotient(PyTime_t q, PyTime_t r, int round)
+{
+    if(r == 0)
+        return q;
+
+    switch(round) {
+    case _PyTime_ROUND_FLOOR:
+        return r < 0 ? q - 1 : q;
+    case _PyTime_ROUND_CEILING:
+        return r > 0 ? q + 1 : q;
+    default: /* _PyTime_ROUND_UP */
+        return r > 0 ? q + 1 : q - 1;
+    }
+}
+
+PyTime_t
+iothpy_time_as_milliseconds(PyTime_t t, int round)
+{
+    return round_quotient(t / NS_PER_MS, t % NS_PER_MS, round);
+}
+
+static void
+time_overflow(void)
+{
+    PyErr_SetString(PyExc_OverflowError, "timestamp too large to convert to C PyTime_t");
+}
+
+int
+iothpy_time_from_seconds_object(PyTime_t* t, PyObject* obj, int round)
+{
+    if(PyFloat_Check(obj)) {
+        double d = PyFloat_AsDouble(obj);
+        if(isnan(d)) {
+            PyErr_SetString(PyExc_ValueError, "Invalid value NaN (not a number)");
+            return -1;
+        }
+
+        d *= NS_PER_SEC;
+        switch(round) {
+        case _PyTime_ROUND_FLOOR:
+            d = floor(d);
+            break;
+        case _PyTime_ROUND_CEILING:
+            d = ceil(d);
+            break;
+        default: /* _PyTime_ROUND_UP */
+            d = d >= 0 ? ceil(d) : floor(d);
+            break;
+        }
+
+        if(!((double)PyTime_MIN <= d && d < -(double)PyTime_MIN)) {
+            time_overflow();
+            return -1;
+        }
+        *t = (PyTime_t)d;
+        return 0;
+    }
+
+    long long sec = PyLong_AsLongLong(obj);
+    if(sec == -1 && PyErr_Occurred()) {
+        if(PyErr_ExceptionMatches(PyExc_OverflowError))
+            time_overflow();
+        return -1;
+    }
+
+    if(sec > PyTime_MAX / NS_PER_SEC || sec < PyTime_MIN / NS_PER_SEC) {
+        time_overflow();
+        return -1;
+    }
+    *t = (PyTime_t)sec * NS_PER_SEC;
+    return 0;
+}
+
+#endif
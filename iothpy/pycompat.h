@@ -0,0 +1,47 @@
+#include <Python.h>
+
+/*
+    Compatibility with the Python versions supported by the extension.
+
+    The _PyTime API used by the socket code became internal in Python 3.13:
+    it is mapped on the public PyTime API and on the helpers in pycompat.c,
+    which keep the same semantics (nanoseconds, rounding modes, errors).
+    Only macros and declarations here, the header can be included twice.
+*/
+#if PY_VERSION_HEX >= 0x030D0000
+
+#define _PyTime_t PyTime_t
+
+#define _PyTime_ROUND_FLOOR 0
+#define _PyTime_ROUND_CEILING 1
+#define _PyTime_ROUND_UP 3
+#define _PyTime_ROUND_TIMEOUT _PyTime_ROUND_UP
+
+#define _PYTIME_FROMSECONDS(seconds) ((PyTime_t)(seconds) * 1000000000)
+#define _PyTime_FromSeconds(seconds) _PYTIME_FROMSECONDS(seconds)
+#define _PyTime_AsSecondsDouble PyTime_AsSecondsDouble
+#define _PyTime_GetMonotonicClock iothpy_time_monotonic
+#define _PyTime_AsMilliseconds iothpy_time_as_milliseconds
+#define _PyTime_FromSecondsObject iothpy_time_from_seconds_object
+
+#define _PyLong_AsInt PyLong_AsInt
+
+/* Monotonic clock, does not need an attached thread state, 0 on error */
+PyTime_t iothpy_time_monotonic(void);
+
+/* Convert t to milliseconds with the given _PyTime_ROUND_* mode */
+PyTime_t iothpy_time_as_milliseconds(PyTime_t t, int round);
+
+/* Convert an int or float number of seconds, raise and return -1 on error */
+int iothpy_time_from_seconds_object(PyTime_t* t, PyObject* obj, int round);
+
+#endif
+
+/*
+    Critical sections protect the state of an object from concurrent threads
+    on the free-threaded build, before Python 3.13 the GIL is enough.
+*/
+#if PY_VERSION_HEX < 0x030D0000
+#define Py_BEGIN_CRITICAL_SECTION(op) {
+#define Py_END_CRITICAL_SECTION() }
+#endif
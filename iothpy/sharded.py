@@ -0,0 +1,342 @@
+#
+# This file is part of the iothpy library: python support for ioth.
+#
+# Copyright (c) 2020-2024   Dario Mylonopoulos
+#                           Lorenzo Liso
+#                           Francesco Testa
+# Virtualsquare team.
+#
+# This library is free software; you can redistribute it and/or
+# modify it under the terms of the GNU Lesser General Public
+# License as published by the Free Software Foundation; either
+# version 2.1 of the License, or any later version.
+#
+# This library is distributed in the hope that it will be useful,
+# but WITHOUT ANY WARRANTY; without even the implied warranty of
+# MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the GNU
+# Lesser General Public License for more details.
+#
+# You should have received a copy of the GNU General Public License
+# along with this program. If not, see <http://www.gnu.org/licenses/>.
+#
+
+
+"""
+ShardedServer class
+
+This module defines the ShardedServer class, a server made of N stacks
+(shards), each one running in its own worker process or thread with its
+own address on the same vde network, all running the same handler.
+Clients, or a load balancer in front of them, spread the load among the
+shard addresses, so a service can scale with the number of cores.
+
+Example:
+
+def echo(conn, addr):
+    with conn:
+        while data := conn.recv(4096):
+            conn.sendall(data)
+
+server = iothpy.ShardedServer(4, echo, "vdestack", "vxvde://234.0.0.1",
+                              config="eth,ip=10.0.0.{shard_num}/24",
+                              address=("", 5000))
+server.start()
+...
+print(server.stats()["total"])
+server.stop()
+
+Sharing one address among the shards with ECMP-style distribution is
+not supported: on a vde network every shard is a distinct host with its
+own MAC address, and with the same IP address on all of them the peers
+would reach only the last one that answered an ARP request.
+"""
+
+import queue
+import socket
+import threading
+import time
+
+from . import _iothpy
+from .stack import Stack
+
+# Counters kept for each shard, summed up by ShardedServer.stats
+STATS_FIELDS = ("accepted", "active", "handled", "errors",
+                "rx_packets", "tx_packets", "rx_bytes", "tx_bytes")
+
+# Seconds between two checks of the stop request by the workers
+_POLL_INTERVAL = 0.25
+
+# Type of the loopback links, their counters are not reported
+_ARPHRD_LOOPBACK = 772
+
+def _shard_value(spec, shard):
+    """Value of a per-shard argument for the given shard
+
+    spec can be a callable taking the shard index, a list with one item
+    for each shard or a string formatted with shard (0 based) and
+    shard_num (1 based).
+    """
+    if spec is None:
+        return None
+    if callable(spec):
+        return spec(shard)
+    if isinstance(spec, list):
+        return spec[shard]
+    return spec.format(shard=shard, shard_num=shard + 1)
+
+class _ShardStats:
+    """View of the counters of a shard in the shared array"""
+
+    def __init__(self, counters, shard):
+        self._counters = counters
+        self._base = shard * len(STATS_FIELDS)
+        self._lock = threading.Lock()
+
+    def add(self, field, value=1):
+        i = self._base + STATS_FIELDS.index(field)
+        with self._lock:
+            self._counters[i] += value
+
+    def set(self, field, value):
+        self._counters[self._base + STATS_FIELDS.index(field)] = value
+
+def _update_link_stats(stack, stats, loopback):
+    totals = dict.fromkeys(("rx_packets", "tx_packets", "rx_bytes", "tx_bytes"), 0)
+    for ifindex, counters in stack.link_stats().items():
+        if ifindex in loopback:
+            continue
+        for field in totals:
+            totals[field] += getattr(counters, field)
+    for field, value in totals.items():
+        stats.set(field, value)
+
+def _serve_connection(handler, conn, addr, stats):
+    try:
+        handler(conn, addr)
+        stats.add("handled")
+    except Exception:
+        stats.add("errors")
+    finally:
+        conn.close()
+        stats.add("active", -1)
+
+def _run_shard(shard, params, counters, ready, stop):
+    """Body of a worker: create the stack of the shard and serve until stopped"""
+    (handler, stack_name, vdeurl, config_dns, config, address,
+     sock_type, backlog, setup) = params
+    stats = _ShardStats(counters, shard)
+
+    try:
+        stack = Stack(stack_name, _shard_value(vdeurl, shard), config_dns)
+    except BaseException as e:
+        ready.put((shard, e))
+        return
+
+    with stack:
+        try:
+            config = _shard_value(config, shard)
+            if config is not None:
+                stack.ioth_config(config)
+            if setup is not None:
+                setup(stack, shard)
+
+            host, port = address
+            host = _shard_value(host, shard)
+            family = socket.AF_INET6 if ":" in host else socket.AF_INET
+            sock = stack.socket(family, sock_type)
+            sock.setsockopt(socket.SOL_SOCKET, socket.SO_REUSEADDR, 1)
+            sock.bind((host, port))
+            if sock_type == socket.SOCK_STREAM:
+                sock.listen(backlog)
+            sock.settimeout(_POLL_INTERVAL)
+
+            loopback = {l.ifindex for l in stack.links() if l.type == _ARPHRD_LOOPBACK}
+        except BaseException as e:
+            ready.put((shard, e))
+            return
+
+        ready.put((shard, None))
+
+        next_update = 0
+        while not stop.is_set():
+            now = time.monotonic()
+            if now >= next_update:
+                try:
+                    _update_link_stats(stack, stats, loopback)
+                except OSError:
+                    pass
+                next_update = now + 1
+
+            try:
+                if sock_type == socket.SOCK_STREAM:
+                    conn, addr = sock.accept()
+                else:
+                    data, addr = sock.recvfrom(65535)
+            except _iothpy.timeout:
+                continue
+            except OSError:
+                # Persistent failures such as EMFILE: count them and back
+                # off instead of ending the shard or spinning on the socket
+                stats.add("errors")
+                stop.wait(_POLL_INTERVAL)
+                continue
+
+            stats.add("accepted")
+            if sock_type == socket.SOCK_STREAM:
+                stats.add("active")
+                threading.Thread(target=_serve_connection, args=(handler, conn, addr, stats),
+                                 daemon=True).start()
+            else:
+                try:
+                    handler(sock, data, addr)
+                    stats.add("handled")
+                except Exception:
+                    stats.add("errors")
+
+class ShardedServer:
+    """Server running the same handler on several stacks
+
+    Parameters
+    ----------
+    shards : int
+        Number of stacks, usually the number of cores.
+
+    handler : callable
+        For SOCK_STREAM servers handler(conn, addr) is called in a new
+        thread for each connection, conn is closed when it returns.
+        For SOCK_DGRAM servers handler(sock, data, addr) is called for
+        each datagram received on the socket sock of the shard.
+        With process workers it must be picklable unless the "fork"
+        start method is used.
+
+    stack, vdeurl, config_dns :
+        Arguments used to create the stack of each shard, see help("iothpy.Stack").
+        vdeurl can be given per shard, as described for config.
+
+    config : str, list or callable
+        ioth_config string of each shard, usually with a distinct address.
+        A string is formatted with {shard} (0 based) and {shard_num} (1 based),
+        a list has one item per shard, a callable is called with the shard index.
+
+    address : tuple
+        (host, port) the shards bind to, host can be given per shard
+        as described for config. Default ("", 0) needs a port.
+
+    type : int
+        SOCK_STREAM (default) or SOCK_DGRAM.
+
+    backlog : int
+        listen backlog of SOCK_STREAM servers.
+
+    workers : str
+        "process" (default) runs each shard in its own process and scales
+        with the cores, "thread" runs them in threads of this process.
+
+    setup : callable
+        Optional setup(stack, shard) called in the worker after config.
+
+    mp_context :
+        multiprocessing context used for process workers, the default
+        one if None.
+    """
+
+    def __init__(self, shards, handler, stack, vdeurl=None, config_dns=None, config=None,
+                 address=("", 0), type=socket.SOCK_STREAM, backlog=128, workers="process",
+                 setup=None, mp_context=None):
+        if shards < 1:
+            raise ValueError("shards must be at least 1")
+        if workers not in ("process", "thread"):
+            raise ValueError("workers must be 'process' or 'thread'")
+        if type not in (socket.SOCK_STREAM, socket.SOCK_DGRAM):
+            raise ValueError("type must be SOCK_STREAM or SOCK_DGRAM")
+
+        self._shards = shards
+        self._params = (handler, stack, vdeurl, config_dns, config, address, type, backlog, setup)
+        self._workers_kind = workers
+        self._mp_context = mp_context
+        self._workers = []
+        self._counters = None
+        self._stop = None
+
+    def __enter__(self):
+        self.start()
+        return self
+
+    def __exit__(self, *args):
+        self.stop()
+
+    def start(self):
+        """Start the shards and wait until all of them are serving
+
+        If a shard fails to start, the others are stopped and its
+        error is raised.
+        """
+        if self._workers:
+            raise RuntimeError("ShardedServer already started")
+
+        size = self._shards * len(STATS_FIELDS)
+        if self._workers_kind == "process":
+            import multiprocessing
+            ctx = self._mp_context or multiprocessing.get_context()
+            self._counters = ctx.RawArray("q", size)
+            self._stop = ctx.Event()
+            ready = ctx.Queue()
+            worker = ctx.Process
+        else:
+            self._counters = [0] * size
+            self._stop = threading.Event()
+            ready = queue.Queue()
+            worker = threading.Thread
+
+        for shard in range(self._shards):
+            w = worker(target=_run_shard, name="iothpy-shard-%d" % shard, daemon=True,
+                       args=(shard, self._params, self._counters, ready, self._stop))
+            w.start()
+            self._workers.append(w)
+
+        error = None
+        for _ in range(self._shards):
+            shard, e = ready.get()
+            if e is not None and error is None:
+                error = e
+
+        if error is not None:
+            self.stop()
+            raise error
+
+    def stop(self, timeout=None):
+        """Stop the shards and wait for their workers to exit
+
+        Connections still being handled in SOCK_STREAM servers are
+        closed together with the stacks.
+        """
+        if self._stop is not None:
+            self._stop.set()
+        for w in self._workers:
+            w.join(timeout)
+        self._workers = []
+
+    def serve_forever(self):
+        """Start the shards if needed and wait until stop is called from another thread"""
+        if not self._workers:
+            self.start()
+        self._stop.wait()
+
+    def stats(self):
+        """Return the counters of the shards
+
+        The result is a dict with "shards", a list with a dict of counters
+        for each shard, and "total", a dict with the sum of all of them.
+        The counters are accepted (connections or datagrams), active
+        (connections being handled), handled, errors (failed accepts or
+        receives and exceptions raised by the handler) and the link counters rx/tx_packets and rx/tx_bytes of
+        the stack, updated every second.
+        """
+        if self._counters is None:
+            return {"shards": [], "total": dict.fromkeys(STATS_FIELDS, 0)}
+
+        n = len(STATS_FIELDS)
+        shards = [dict(zip(STATS_FIELDS, self._counters[i * n:(i + 1) * n]))
+                  for i in range(self._shards)]
+        total = {field: sum(s[field] for s in shards) for field in STATS_FIELDS}
+        return {"shards": shards, "total": total}
@@ -27,6 +27,9 @@ To configure the stack you can use the following functions
 
 Get interface index:
     if_nametoindex
+    if_indextoname
+    if_nameindex
+    set_ifindex_cache
 
 Link configuration:
     linksetupdown
@@ -42,27 +45,53 @@ IP configuration:
     iproute_add
     iproute_del
 
+Many link and IP operations can be applied at once with:
+    apply
+
 Or you can use a single method:
-    iothconfig
+    ioth_config
+
+Configuration state:
+    links
+    addresses
+    routes
+
+Traffic counters:
+    link_stats
+    link_stats_delta
+
+Configuration events:
+    subscribe
+
+Completion based I/O:
+    engine
 
 To configure dns, you can use:
     iothdns_update
 
 Other methods:
+    connect_many
+    listen_reuseport
     getaddrinfo
     getnameinfo
+    set_nameinfo_cache
     socket
+    close
+    close_sockets
+    create_many (classmethod)
+
+A stack can be used as a context manager, it is closed on exit
+together with all the sockets still open on it.
+
+Stacks are not inherited across fork: in the child process the stacks
+created by the parent are closed (their forked attribute is True) and
+each child must create its own, see help("iothpy.prefork"). Sockets of
+the kernel plugin are plain file descriptors and stay usable.
 """
 
 #Import iothpy c module
 from . import _iothpy
 
-#Import msocket for the MSocket class
-from . import msocket
-
-#Import function and classes to get getaddrinfo like built-in
-from socket import _intenum_converter, AddressFamily, SocketKind, gaierror
-
 class Stack(_iothpy.StackBase):
     """Stack class that represents a ioth networking stack
     
@@ -84,57 +113,177 @@ class Stack(_iothpy.StackBase):
         # Pass all arguments to the base class constructor
        _iothpy.StackBase.__init__(self, stack, vdeurl, config_dns)
 
+    def __enter__(self):
+        return self
+
+    def __exit__(self, *args):
+        self.close()
+
+    def close(self):
+        """Close all the sockets still open on the stack and delete it
+
+        A revalidation of ioth_config(config, cache) still running in the
+        background is waited for first, see help(_iothpy.StackBase.close).
+        """
+        revalidation = getattr(self, "_revalidation", None)
+        if revalidation is not None:
+            import threading
+            if revalidation is not threading.current_thread():
+                revalidation.join()
+        _iothpy.StackBase.close(self)
+
+    @classmethod
+    def create_many(cls, specs, workers=None):
+        """Create many stacks in parallel and return them in order
+
+        Each item of specs describes a stack with the arguments of the
+        constructor: a string (the stack name or configuration), a tuple
+        of positional arguments or a dict of keyword arguments.
+        Stacks are created on a pool of at most workers threads, the time
+        taken by each one is reported by its creation_latency attribute.
+        If any creation fails, the stacks already created are closed and
+        the first error is raised.
+        """
+        import concurrent.futures
+
+        def create(spec):
+            if isinstance(spec, dict):
+                return cls(**spec)
+            if isinstance(spec, tuple):
+                return cls(*spec)
+            return cls(spec)
+
+        specs = list(specs)
+        with concurrent.futures.ThreadPoolExecutor(workers) as executor:
+            futures = [executor.submit(create, spec) for spec in specs]
+            concurrent.futures.wait(futures)
+
+        stacks = [f.result() for f in futures if f.exception() is None]
+        if len(stacks) != len(futures):
+            for stack in stacks:
+                stack.close()
+            raise next(f.exception() for f in futures if f.exception() is not None)
+        return stacks
+
     def socket(self, family=-1, type=-1, proto=-1, fileno=None):
         """Create and return a new socket on this stack
 
         This method takes the same parameters as the builtin socket.socket() function.
         Stack.socket(family=AF_INET, type=SOCK_STREAM, proto=0, fileno=None)
         """
+        #Import msocket only when needed, it pulls in the socket module
+        from . import msocket
         return msocket.MSocket(self, family, type, proto, fileno)
 
+    def listen_reuseport(self, address, n, backlog=128):
+        """Return a ListenerGroup of n listeners bound to address
 
-    def linksetaddr(self, ifindex, addr):
-        """Set the MAC address of the interface ifindex");
+        Each listener is bound with SO_REUSEPORT and belongs to one of n
+        worker threads, the stack spreading the connections among them.
+        On stacks without SO_REUSEPORT the workers share one listener,
+        waking up one at a time. See help("iothpy.listeners.ListenerGroup").
+        """
+        from . import listeners
+        return listeners.ListenerGroup(self, address, n, backlog)
 
-        ifindex must be an integer index, addr must be valid macaddr as a string or bytes object.
-        E.g. "80:00:42:0e:e7:3a" or b'\\x80\\x00\\x42\\x0e\\xe7\\x3a'
+    def connect_many(self, targets, timeout=None):
+        """Open stream connections to many addresses in parallel
+
+        targets is a sequence of (family, address) pairs. The connects
+        are all started at once and waited for together with the GIL
+        released, up to timeout seconds overall (None for no limit), so
+        that connecting to N addresses takes about one round trip.
+        Returns a list with, for each target in order, the connected
+        MSocket or the OSError of the target, iothpy.timeout if it was
+        still connecting at the timeout. The sockets of the failed
+        targets are closed.
         """
-        if isinstance(addr, str):
-            addr = addr.replace(":", "")
-            addr = bytearray.fromhex(addr)
+        import errno, os, socket
 
-        self._linksetaddr(ifindex, addr)
+        results = []
+        sockets = []
+        addresses = []
+        indexes = []
+        for family, address in targets:
+            try:
+                sock = self.socket(family, socket.SOCK_STREAM)
+            except OSError as e:
+                results.append(e)
+                continue
+            indexes.append(len(results))
+            results.append(sock)
+            sockets.append(sock)
+            addresses.append(address)
+
+        try:
+            errors = self._connect_many(sockets, addresses, timeout)
+        except BaseException:
+            for sock in sockets:
+                sock.close()
+            raise
+
+        for index, sock, error in zip(indexes, sockets, errors):
+            if error == 0:
+                continue
+            sock.close()
+            if error == errno.ETIMEDOUT:
+                results[index] = _iothpy.timeout(error, "timed out")
+            else:
+                results[index] = OSError(error, os.strerror(error))
+        return results
+
+
+    def subscribe(self, groups=None):
+        """Return a Monitor receiving the link, address and route events of the stack
 
-    def getaddrinfo(self, *args, **kwargs):
-        """Returns all the addresses info of host and port take as parameters.
-        
-        This method takes the same parameters as the builtin socket.getaddrinfo().
+        groups is a bitmask of RTMGRP_LINK, RTMGRP_IPV4_IFADDR, RTMGRP_IPV6_IFADDR,
+        RTMGRP_IPV4_ROUTE and RTMGRP_IPV6_ROUTE, all of them if None.
+        See help("iothpy.monitor.Monitor").
         """
+        from . import monitor
+        if groups is None:
+            return monitor.Monitor(self)
+        return monitor.Monitor(self, groups)
 
-        res = _iothpy.StackBase.getaddrinfo(self, *args,**kwargs)
+    def engine(self, entries=256, threads=4, backend=None):
+        """Return an Engine to run socket operations of the stack in batches
 
-        if(not isinstance(res, list)):
-            raise gaierror(res[1])
-        
-        else:
-            addrlist = []
+        Up to entries operations can be in flight. backend is "io_uring",
+        available if the sockets of the stack are kernel file descriptors,
+        or "threads" to run them on a pool of threads, chosen from the
+        stack if None. See help("iothpy.engine.Engine").
+        """
+        from . import engine
+        return engine.Engine(self, entries, threads, backend)
 
-            for res in _iothpy.StackBase.getaddrinfo(self, *args,**kwargs):
-                af, socktype, proto, canonname, sa = res
-                addrlist.append((_intenum_converter(af, AddressFamily),
-                                _intenum_converter(socktype, SocketKind),
-                                proto, canonname, sa))
-            return addrlist
+    def ioth_config(self, config, cache=None):
+        """Configure the stack using the config string
 
-    def getnameinfo(self, *args):
-        """Returns the host and port of sockaddr.
+        See help("iothpy.StackBase._ioth_config") for the options supported.
 
-        This method takes the same parameters as the builtin socket.getnameinfo().
+        If cache is the path of a file, the resulting configuration (MAC
+        address, addresses, default gateways and dns servers) is saved there.
+        When the file already holds the configuration for the same config
+        string, it is applied statically right away and ioth_config runs
+        in the background to revalidate it, removing the stale entries if
+        the lease changed. In cache mode a concurrent.futures.Future is
+        returned, its result is True if the configuration was changed by
+        the revalidation. close() waits for the revalidation to finish.
         """
+        if cache is None:
+            return self._ioth_config(config)
 
-        res = _iothpy.StackBase.getnameinfo(self, *args)
+        from . import confcache
+        return confcache.configure(self, config, cache)
 
-        if(isinstance(res[0], int)):
-            raise gaierror(res[1])
+    def linksetaddr(self, ifindex, addr):
+        """Set the MAC address of the interface ifindex");
 
-        return res
\ No newline at end of file
+        ifindex must be an integer index, addr must be valid macaddr as a string or bytes object.
+        E.g. "80:00:42:0e:e7:3a" or b'\\x80\\x00\\x42\\x0e\\xe7\\x3a'
+        """
+        if isinstance(addr, str):
+            addr = addr.replace(":", "")
+            addr = bytearray.fromhex(addr)
+
+        self._linksetaddr(ifindex, addr)
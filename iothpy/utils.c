@@ -87,4 +87,52 @@ PyObject * make_ipv6_addr(struct sockaddr_in6 *addr)
         return NULL;
     }
     return PyUnicode_FromString(buf);
-}
\ No newline at end of file
+}
+void
+eventfd_signal(int fd)
+{
+    uint64_t one = 1;
+    ssize_t res = write(fd, &one, sizeof(one));
+    (void)res;
+}
+
+void
+eventfd_drain(int fd)
+{
+    uint64_t value;
+    ssize_t res = read(fd, &value, sizeof(value));
+    (void)res;
+}
+
+int
+thread_start_nosignals(pthread_t* thread, void* (*start)(void*), void* arg)
+{
+    sigset_t all, old;
+    int err;
+
+    sigfillset(&all);
+    pthread_sigmask(SIG_BLOCK, &all, &old);
+    err = pthread_create(thread, NULL, start, arg);
+    pthread_sigmask(SIG_SETMASK, &old, NULL);
+
+    return err;
+}
+
+uint64_t
+hash_bytes(const void* data, size_t len, uint64_t seed)
+{
+    const unsigned char* p = data;
+    uint64_t h = 0xcbf29ce484222325ULL ^ seed;
+
+    for(size_t i = 0; i < len; i++) {
+        h ^= p[i];
+        h *= 0x100000001b3ULL;
+    }
+
+    h ^= h >> 30;
+    h *= 0xbf58476d1ce4e5b9ULL;
+    h ^= h >> 27;
+    h *= 0x94d049bb133111ebULL;
+    h ^= h >> 31;
+    return h;
+}
@@ -12,6 +12,7 @@
 #include <poll.h>
 #include <netinet/in.h>
 #include <pthread.h>
+#include <signal.h>
 #include <arpa/inet.h>
 
 /* Utility to create a tuple representing the given sockaddr suitable
@@ -22,4 +23,16 @@ PyObject* make_sockaddr(struct sockaddr *addr, size_t addrlen);
 PyObject* make_ipv4_addr(struct sockaddr_in *addr);
 
 /* Convert IPv6 sockaddr to a Python str. */
-PyObject* make_ipv6_addr(struct sockaddr_in6 *addr);
\ No newline at end of file
+PyObject* make_ipv6_addr(struct sockaddr_in6 *addr);
+/* Wake up the waiters of a non blocking eventfd, and reset it */
+void eventfd_signal(int fd);
+void eventfd_drain(int fd);
+
+/*
+   Start a thread with all the signals blocked, they are handled by the
+   threads of the interpreter. Returns 0 or an error number as pthread_create.
+*/
+int thread_start_nosignals(pthread_t* thread, void* (*start)(void*), void* arg);
+
+/* 64 bits hash of a short key: FNV-1a mixed by the splitmix64 finalizer */
+uint64_t hash_bytes(const void* data, size_t len, uint64_t seed);
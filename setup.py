@@ -39,7 +39,7 @@ setup (
        long_description_content_type="text/markdown",
        packages = ["iothpy"],
        classifiers = ["Operating System :: POSIX :: Linux"],
-       python_requires='>=3.6',
+       python_requires='>=3.8',
 
        #skbuild options
        cmake_args= [],